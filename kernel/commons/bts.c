@@ -11,6 +11,7 @@
 
 // Include Files
 #include "bts.h"
+#include "cpu_trace.h"
 
 //
 // Global Variables
@@ -20,6 +21,21 @@ char bts_state_lock[MAX_LOCK_LEN];
 char bts_state_head[MAX_LIST_LEN];
 // Head of bts state list
 
+u32 pebs_format;
+// PEBS record format of the cpu, 0 if PEBS is not usable
+
+u32 pebs_record_size;
+// Size of one PEBS record written by the cpu
+
+u32 pebs_counter_index;
+// General purpose counter used for PEBS, the last one with a counter reset
+
+u64 pebs_counter_mask;
+// Mask of the general purpose counter width
+
+u32 pebs_ll_enable;
+// Whether load latency has its own PEBS_ENABLE bit (perfmon v4 and older)
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : get_bts
@@ -41,9 +57,14 @@ void get_bts(struct bts_state *state)
     dbgctlmsr &= ~state->config.bts_config;
     xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
 
+    // PEBS must stop before its debug store area goes away
+    if (state->config.pebs_event)
+        get_pebs(state);
+
     // Reset BTS debug store buffer pointer
     xwrmsr(MSR_IA32_DS_AREA, NULL);
 
+    state->loaded = FALSE;
     xrelease_lock(bts_state_lock, irql_flag);
 }
 
@@ -71,6 +92,11 @@ void put_bts(struct bts_state *state)
     dbgctlmsr |= state->config.bts_config;
     xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
 
+    // Enable PEBS, sharing the debug store area
+    if (state->config.pebs_event)
+        put_pebs(state);
+
+    state->loaded = TRUE;
     xrelease_lock(bts_state_lock, irql_flag);
 }
 
@@ -104,12 +130,84 @@ void flush_bts(void)
     dbgctlmsr &= ~bts_bits;
     xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
 
+    // Stop the PEBS counter
+    if (pebs_format)
+        get_pebs(NULL);
+
     // Reset BTS debug store buffer pointer
     xwrmsr(MSR_IA32_DS_AREA, NULL);
 
     xrelease_core(irql_flag);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_pebs
+// Description  : Stop the PEBS counter on the current cpu and save its count
+//                into the BTS state. The counter is programmed directly, so
+//                it is not coordinated with other users of the PMU.
+//
+// Inputs       : state - the BTS state, NULL to only stop the counter
+// Outputs      : void
+
+void get_pebs(struct bts_state *state)
+{
+    u64 msr;
+
+    xrdmsr(MSR_CORE_PERF_GLOBAL_CTRL, &msr);
+    msr &= ~(1ULL << pebs_counter_index);
+    xwrmsr(MSR_CORE_PERF_GLOBAL_CTRL, msr);
+
+    xrdmsr(MSR_IA32_PEBS_ENABLE, &msr);
+    msr &= ~((1ULL << pebs_counter_index) | (1ULL << (pebs_counter_index + 32)));
+    xwrmsr(MSR_IA32_PEBS_ENABLE, msr);
+
+    xwrmsr(MSR_P6_EVNTSEL0 + pebs_counter_index, 0);
+    if (state)
+        xrdmsr(MSR_P6_PERFCTR0 + pebs_counter_index, &state->pebs_counter);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_pebs
+// Description  : Program the PEBS counter of the BTS state on the current cpu
+//                and start it. Caller should have loaded the debug store area
+//                of the state.
+//
+// Inputs       : state - the BTS state
+// Outputs      : void
+
+void put_pebs(struct bts_state *state)
+{
+    u64 msr, evntsel;
+
+    // Only user mode events of the traced thread are counted
+    evntsel = (state->config.pebs_event & 0xffff) | EVNTSEL_USR | EVNTSEL_EN;
+    if (pebs_format >= 4)
+    {
+        // Adaptive PEBS only records the basic group unless asked for more
+        evntsel |= EVNTSEL_ADAPTIVE;
+        xwrmsr(MSR_PEBS_DATA_CFG, PEBS_DATA_CFG_MEMINFO);
+    }
+
+    if (state->config.pebs_latency)
+        xwrmsr(MSR_PEBS_LD_LAT_THRESHOLD, state->config.pebs_latency);
+
+    // Counter writes only take the low 32 bits, sign extended
+    xwrmsr(MSR_P6_PERFCTR0 + pebs_counter_index, state->pebs_counter);
+    xwrmsr(MSR_P6_EVNTSEL0 + pebs_counter_index, evntsel);
+
+    xrdmsr(MSR_IA32_PEBS_ENABLE, &msr);
+    msr |= 1ULL << pebs_counter_index;
+    if (state->config.pebs_latency && pebs_ll_enable)
+        msr |= 1ULL << (pebs_counter_index + 32);
+    xwrmsr(MSR_IA32_PEBS_ENABLE, msr);
+
+    xrdmsr(MSR_CORE_PERF_GLOBAL_CTRL, &msr);
+    msr |= 1ULL << pebs_counter_index;
+    xwrmsr(MSR_CORE_PERF_GLOBAL_CTRL, msr);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : enable_bts
@@ -122,6 +220,15 @@ s32 enable_bts(struct bts_ioctl_request *request)
 {
     struct bts_state *state;
 
+    if (cpu_trace_enabled)
+    {
+        xprintdbg("LIBIHT-COM: BTS per task trace conflicts with CPU trace\n");
+        return -1;
+    }
+
+    if (request->bts_config.scope == LIBIHT_SCOPE_PROCESS)
+        return enable_bts_process(request);
+
     state = find_bts_state(request->bts_config.pid);
     if (state)
     {
@@ -141,26 +248,27 @@ s32 enable_bts(struct bts_ioctl_request *request)
     state->parent = NULL;
     state->config.pid = request->bts_config.pid ?
                 request->bts_config.pid : xgetcurrent_pid();
+    state->config.scope = LIBIHT_SCOPE_THREAD;
     state->config.bts_config = request->bts_config.bts_config ?
                 request->bts_config.bts_config : DEFAULT_BTS_CONFIG;
     state->config.bts_buffer_size = request->bts_config.bts_buffer_size ?
                 request->bts_config.bts_buffer_size : DEFAULT_BTS_BUFFER_SIZE;
 
     // Setup fields for BTS debug store area
-    state->ds_area->bts_buffer_base = (u64)xmalloc(state->config.bts_buffer_size);
-    state->ds_area->bts_index = state->ds_area->bts_buffer_base;
-    state->ds_area->bts_absolute_maximum =
-            state->ds_area->bts_buffer_base +
-            state->config.bts_buffer_size + 1;
-    // Not yet support state->ds_area->bts_interrupt_threshold
-
-    // Print BTS debug store area info
-    xprintdbg("LIBIHT-COM: BTS ds_area pointer: %llx, bts_buffer_base: %llx, "
-                "bts_index: %llx, bts_absolute_maximum: %llx.\n",
-                (u64)state->ds_area, state->ds_area->bts_buffer_base,
-                state->ds_area->bts_index,
-                state->ds_area->bts_absolute_maximum);
+    if (setup_bts_buffer(state))
+    {
+        xprintdbg("LIBIHT-COM: Allocate BTS buffer failed.\n");
+        xfree(state->ds_area);
+        xfree(state);
+        return -1;
+    }
 
+    if (config_pebs_state(state, &request->bts_config))
+    {
+        xprintdbg("LIBIHT-COM: Setup PEBS failed.\n");
+        free_bts_state(state);
+        return -1;
+    }
 
     insert_bts_state(state);
     // If the requesting process is the current process, trace it right away
@@ -169,6 +277,145 @@ s32 enable_bts(struct bts_ioctl_request *request)
     return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_bts_process
+// Description  : Enable the BTS for every thread of the requested process
+//                (thread group). Each thread gets its own BTS state and
+//                buffer, and threads created later join the trace through
+//                `bts_newproc_handler`.
+//
+// Inputs       : request - the BTS ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 enable_bts_process(struct bts_ioctl_request *request)
+{
+    struct bts_state *state;
+    u32 *tids, tgid, tid_cnt, max_cnt, i;
+
+    tgid = request->bts_config.pid ?
+                request->bts_config.pid : xgetcurrent_tgid();
+    if (find_bts_proc_state(tgid))
+    {
+        xprintdbg("LIBIHT-COM: BTS already enabled for process %d.\n", tgid);
+        return -1;
+    }
+
+    // Collect the thread ids, retry with a larger array if it is too small
+    max_cnt = MAX_PROC_THREADS;
+    while (TRUE)
+    {
+        tids = xmalloc(max_cnt * sizeof(u32));
+        if (tids == NULL)
+            return -1;
+
+        tid_cnt = xget_thread_ids(tgid, tids, max_cnt);
+        if (tid_cnt <= max_cnt)
+            break;
+
+        xfree(tids);
+        max_cnt = tid_cnt << 1;
+    }
+
+    if (tid_cnt == 0)
+    {
+        xprintdbg("LIBIHT-COM: No threads found for process %d.\n", tgid);
+        xfree(tids);
+        return -1;
+    }
+
+    for (i = 0; i < tid_cnt; i++)
+    {
+        // Threads traced on their own keep their existing state
+        if (find_bts_state(tids[i]))
+            continue;
+
+        state = create_bts_state();
+        if (state == NULL)
+            goto fail;
+
+        state->parent = NULL;
+        state->tgid = tgid;
+        state->config.pid = tids[i];
+        state->config.scope = LIBIHT_SCOPE_PROCESS;
+        state->config.bts_config = request->bts_config.bts_config ?
+                    request->bts_config.bts_config : DEFAULT_BTS_CONFIG;
+        state->config.bts_buffer_size = request->bts_config.bts_buffer_size ?
+                    request->bts_config.bts_buffer_size : DEFAULT_BTS_BUFFER_SIZE;
+        if (setup_bts_buffer(state))
+        {
+            xfree(state->ds_area);
+            xfree(state);
+            goto fail;
+        }
+
+        if (config_pebs_state(state, &request->bts_config))
+        {
+            free_bts_state(state);
+            goto fail;
+        }
+
+        insert_bts_state(state);
+
+        // If the thread is the current one, trace it right away
+        if (state->config.pid == xgetcurrent_pid())
+            put_bts(state);
+    }
+
+    xfree(tids);
+    return 0;
+
+fail:
+    xprintdbg("LIBIHT-COM: Create BTS state failed.\n");
+    xfree(tids);
+    remove_bts_proc_states(tgid);
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : attach_bts_state
+// Description  : Enable the BTS for a single threaded process or a thread with
+//                a BTS state and buffer allocated beforehand, so it can be
+//                called in atomic context. The buffer size of the state must
+//                match the request, and PEBS is not supported. The state is
+//                freed on failure.
+//
+// Inputs       : state - the preallocated BTS state
+//                request - the BTS ioctl request, its pid must be nonzero
+// Outputs      : 0 if successful, -1 if failure
+
+s32 attach_bts_state(struct bts_state *state, struct bts_ioctl_request *request)
+{
+    u32 pid = request->bts_config.pid;
+    u64 buffer_size;
+
+    buffer_size = request->bts_config.bts_buffer_size ?
+                request->bts_config.bts_buffer_size : DEFAULT_BTS_BUFFER_SIZE;
+    if (cpu_trace_enabled || find_bts_state(pid) ||
+        state->config.bts_buffer_size != buffer_size ||
+        request->bts_config.pebs_event)
+    {
+        xprintdbg("LIBIHT-COM: Attach BTS to pid %d refused.\n", pid);
+        free_bts_state(state);
+        return -1;
+    }
+
+    state->parent = NULL;
+    state->tgid = pid;
+    state->config.pid = pid;
+    state->config.scope = request->bts_config.scope == LIBIHT_SCOPE_PROCESS ?
+                            LIBIHT_SCOPE_PROCESS : LIBIHT_SCOPE_THREAD;
+    state->config.bts_config = request->bts_config.bts_config ?
+                request->bts_config.bts_config : DEFAULT_BTS_CONFIG;
+    insert_bts_state(state);
+
+    // If the thread is the current one, trace it right away
+    if (pid == xgetcurrent_pid())
+        put_bts(state);
+    return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : disable_bts
@@ -181,6 +428,19 @@ s32 disable_bts(struct bts_ioctl_request *request)
 {
     struct bts_state *state;
 
+    if (request->bts_config.scope == LIBIHT_SCOPE_PROCESS)
+    {
+        if (find_bts_proc_state(request->bts_config.pid) == NULL)
+        {
+            xprintdbg("LIBIHT-COM: BTS not enabled for process %d.\n",
+                        request->bts_config.pid);
+            return -1;
+        }
+
+        remove_bts_proc_states(request->bts_config.pid);
+        return 0;
+    }
+
     state = find_bts_state(request->bts_config.pid);
     if (state == NULL)
     {
@@ -189,200 +449,1010 @@ s32 disable_bts(struct bts_ioctl_request *request)
         return -1;
     }
 
-    if (state->config.pid == xgetcurrent_pid())
-        get_bts(state);
-    remove_bts_state(state);
+    if (state->config.pid == xgetcurrent_pid())
+        get_bts(state);
+    remove_bts_state(state);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_bts
+// Description  : Dump the BTS records for a given process in request.
+//
+// Inputs       : request - the BTS ioctl request
+// Outputs      : 0 if successful (number of threads dumped for process scope
+//                requests), -1 if failure
+
+s32 dump_bts(struct bts_ioctl_request *request)
+{
+    if (request->bts_config.scope == LIBIHT_SCOPE_PROCESS)
+        return dump_bts_process(request);
+
+    // The thread may have exited since
+    if (dump_bts_threads(request, FALSE) <= 0)
+    {
+        xprintdbg("LIBIHT-COM: BTS dump failed for pid %d.\n",
+                    request->bts_config.pid);
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_bts_process
+// Description  : Dump the BTS records of every traced thread of the process
+//                in request. Each thread is dumped into its own `bts_data` of
+//                the request buffer array, tagged with the thread id.
+//
+// Inputs       : request - the BTS ioctl request
+// Outputs      : number of threads dumped, -1 if failure
+
+s32 dump_bts_process(struct bts_ioctl_request *request)
+{
+    if (find_bts_proc_state(request->bts_config.pid) == NULL)
+    {
+        xprintdbg("LIBIHT-COM: BTS not enabled for process %d.\n",
+                    request->bts_config.pid);
+        return -1;
+    }
+
+    return dump_bts_threads(request, TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_bts_threads
+// Description  : Dump the BTS records of the requested thread, or of every
+//                traced thread of the requested process. A reference is
+//                taken on each state under the `bts_state_lock`, and the
+//                states are dumped once the lock is released, since the
+//                copies to userspace may fault and sleep.
+//
+// Inputs       : request - the BTS ioctl request
+//                process - TRUE for the process scope, FALSE for one thread
+// Outputs      : number of threads dumped, -1 if failure
+
+s32 dump_bts_threads(struct bts_ioctl_request *request, u32 process)
+{
+    s32 ret = 0;
+    struct bts_state *curr_state, **states;
+    char irql_flag[MAX_IRQL_LEN];
+    void *curr_list;
+    u32 state_cnt, max_states, limit, i;
+    u64 offset;
+
+    // A thread scope request has a single buffer
+    limit = process ? (request->buffer ? request->buffer_count : ~0U) : 1;
+
+    // Collect the states, retry with a larger array if it is too small
+    max_states = process ? MAX_PROC_THREADS : 1;
+    while (TRUE)
+    {
+        states = xmalloc(max_states * sizeof(struct bts_state *));
+        if (states == NULL)
+            return -1;
+        state_cnt = 0;
+
+        xacquire_lock(bts_state_lock, irql_flag);
+
+        // offsetof(st, m) macro implementation of stddef.h
+        offset = (u64)(&((struct bts_state *)0)->list);
+        curr_list = xlist_next(bts_state_head);
+        while (curr_list != NULL && curr_list != bts_state_head &&
+                state_cnt < limit)
+        {
+            curr_state = (struct bts_state *)((u64)curr_list - offset);
+            curr_list = xlist_next(curr_list);
+            if (process ? (curr_state->config.scope != LIBIHT_SCOPE_PROCESS ||
+                            curr_state->tgid != request->bts_config.pid) :
+                            curr_state->config.pid != request->bts_config.pid)
+                continue;
+
+            if (state_cnt < max_states)
+            {
+                curr_state->refs++;
+                states[state_cnt] = curr_state;
+            }
+            state_cnt++;
+        }
+
+        xrelease_lock(bts_state_lock, irql_flag);
+
+        if (state_cnt <= max_states)
+            break;
+
+        for (i = 0; i < max_states; i++)
+            release_bts_state(states[i]);
+        xfree(states);
+        max_states = state_cnt << 1;
+    }
+
+    for (i = 0; i < state_cnt; i++)
+    {
+        if (ret == 0 && dump_bts_state(states[i],
+                            request->buffer ? request->buffer + i : NULL))
+            ret = -1;
+        release_bts_state(states[i]);
+    }
+
+    xfree(states);
+    return ret ? ret : (s32)state_cnt;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_bts_state
+// Description  : Dump the BTS records of one BTS state, and copy them to the
+//                userspace buffer if provided. The records are staged in a
+//                kernel buffer under the `bts_state_lock`, and copied to
+//                userspace once it is released. Caller should hold a
+//                reference on the state, but not the lock.
+//
+// Inputs       : state - the BTS state
+//                buffer - the userspace BTS data buffer (may be NULL)
+// Outputs      : 0 if successful, -1 if failure
+
+s32 dump_bts_state(struct bts_state *state, struct bts_data *buffer)
+{
+    s32 ret = 0;
+    u64 i, bts_offset, buffer_size;
+    u32 tid;
+    struct bts_record *stage = NULL, *record;
+    struct ds_area stage_area;
+    char irql_flag[MAX_IRQL_LEN];
+
+    // Stage the buffer, retry if a config request resized it meanwhile
+    while (TRUE)
+    {
+        xacquire_lock(bts_state_lock, irql_flag);
+        buffer_size = state->config.bts_buffer_size;
+        xrelease_lock(bts_state_lock, irql_flag);
+
+        stage = xvmalloc(buffer_size);
+        if (stage == NULL)
+            return -1;
+
+        xacquire_lock(bts_state_lock, irql_flag);
+        if (buffer_size == state->config.bts_buffer_size)
+            break;
+        xrelease_lock(bts_state_lock, irql_flag);
+        xvfree(stage);
+    }
+
+    xmemcpy(stage, (void *)state->ds_area->bts_buffer_base, buffer_size);
+    bts_offset = state->ds_area->bts_index - state->ds_area->bts_buffer_base;
+    tid = state->config.pid;
+    xrelease_lock(bts_state_lock, irql_flag);
+
+    xmemset(&stage_area, 0, sizeof(stage_area));
+    stage_area.bts_buffer_base = (u64)stage;
+    stage_area.bts_index = (u64)stage + bts_offset;
+
+    // Dump some BTS buffer records
+    xprintdbg("LIBIHT-COM: BTS buffer base: 0x%llx, index: 0x%llx. offset: 0x%llx\n",
+                stage_area.bts_buffer_base, stage_area.bts_index,
+                bts_offset / sizeof(struct bts_record));
+    for (i = 0; i < buffer_size / sizeof(struct bts_record); i++)
+    {
+        record = stage + i;
+        xprintdbg("LIBIHT-COM: BTS record ptr: 0x%llx.\n", (u64)record);
+        xprintdbg("LIBIHT-COM: BTS record %d: from %llx to %llx.\n",
+                    i, record->from, record->to);
+    }
+
+    // Dump the BTS data to userspace buffer
+    // TODO: Try best to support mmap share between user and kernel space
+    if (buffer)
+        ret = copy_bts_to_user(&stage_area, buffer_size, tid, buffer);
+
+    xvfree(stage);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : copy_bts_to_user
+// Description  : Copy a BTS buffer to a userspace BTS data buffer. With a
+//                record count set by the caller, the userspace buffer must hold
+//                the whole BTS buffer, only the valid records are copied and
+//                their number is returned in the record count.
+//
+// Inputs       : ds_area - the debug store area of the BTS buffer
+//                buffer_size - the BTS buffer size
+//                tid - the thread id of the records
+//                buffer - the userspace BTS data buffer
+// Outputs      : 0 if successful, -1 if failure
+
+s32 copy_bts_to_user(struct ds_area *ds_area, u64 buffer_size, u32 tid,
+                        struct bts_data *buffer)
+{
+    u64 bytes_left, bts_offset, total, valid, copy;
+    struct bts_record *records;
+    struct bts_data req_buf;
+
+    // Get a copy of data from userspace buffer
+    bytes_left = xcopy_from_user(&req_buf, buffer, sizeof(struct bts_data));
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy BTS data from user failed.\n");
+        return -1;
+    }
+
+    records = (struct bts_record *)ds_area->bts_buffer_base;
+    total = buffer_size / sizeof(struct bts_record);
+    bts_offset = (ds_area->bts_index - ds_area->bts_buffer_base) /
+                    sizeof(struct bts_record);
+
+    // The buffer is zeroed on setup, a record past the index means it wrapped
+    valid = (bts_offset < total && records[bts_offset].from) ?
+                total : bts_offset;
+
+    // Without a record count, the whole buffer is copied as before
+    copy = total;
+    if (req_buf.record_count)
+    {
+        if (req_buf.record_count < total)
+        {
+            xprintdbg("LIBIHT-COM: BTS data buffer too small, %lld records "
+                        "needed.\n", total);
+            return -1;
+        }
+        copy = valid;
+        req_buf.record_count = (u32)valid;
+    }
+
+    // Dump data to userspace buffer ptr
+    // Not yet support ds_area->bts_interrupt_threshold
+    req_buf.bts_index = req_buf.bts_buffer_base + bts_offset;
+    req_buf.tid = tid;
+    if (req_buf.bts_buffer_base && copy)
+    {
+        bytes_left = xcopy_to_user(req_buf.bts_buffer_base, records,
+                                    copy * sizeof(struct bts_record));
+        if (bytes_left)
+        {
+            xprintdbg("LIBIHT-COM: Copy to user failed.\n");
+            return -1;
+        }
+    }
+
+    // Copy updated data back to userspace buffer
+    bytes_left = xcopy_to_user(buffer, &req_buf, sizeof(struct bts_data));
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy to user failed.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_pebs
+// Description  : Drain the PEBS records of the thread in request, or of every
+//                traced thread of the process for process scope requests,
+//                into the PEBS records buffer of the request. At most
+//                MAX_PEBS_DUMP_RECORDS records are moved per request. They
+//                are staged in a kernel buffer under the `bts_state_lock`
+//                and copied to userspace after it is released, so they are
+//                lost if the copy fails.
+//
+// Inputs       : request - the BTS ioctl request
+// Outputs      : number of records copied, -1 if failure
+
+s32 dump_pebs(struct bts_ioctl_request *request)
+{
+    s32 cnt = 0, ret;
+    struct bts_state *curr_state;
+    struct pebs_record *stage;
+    char irql_flag[MAX_IRQL_LEN];
+    void *curr_list;
+    u32 process, found = FALSE, max_cnt;
+    u64 offset;
+
+    max_cnt = request->pebs_count < MAX_PEBS_DUMP_RECORDS ?
+                request->pebs_count : MAX_PEBS_DUMP_RECORDS;
+    if (request->pebs == NULL || max_cnt == 0)
+        return 0;
+
+    stage = xmalloc(max_cnt * sizeof(struct pebs_record));
+    if (stage == NULL)
+        return -1;
+
+    process = request->bts_config.scope == LIBIHT_SCOPE_PROCESS;
+
+    xacquire_lock(bts_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct bts_state *)0)->list);
+    curr_list = xlist_next(bts_state_head);
+    while (curr_list != NULL && curr_list != bts_state_head)
+    {
+        curr_state = (struct bts_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (process ? (curr_state->config.scope != LIBIHT_SCOPE_PROCESS ||
+                        curr_state->tgid != request->bts_config.pid) :
+                        curr_state->config.pid != request->bts_config.pid)
+            continue;
+
+        found = TRUE;
+        ret = dump_pebs_state(curr_state, stage + cnt, max_cnt - cnt);
+        cnt += ret;
+        if (!process)
+            break;
+    }
+
+    xrelease_lock(bts_state_lock, irql_flag);
+
+    if (!found)
+    {
+        xprintdbg("LIBIHT-COM: BTS not enabled for %s %d.\n",
+                    process ? "process" : "pid", request->bts_config.pid);
+        cnt = -1;
+    }
+    else if (cnt &&
+                xcopy_to_user(request->pebs, stage,
+                                cnt * sizeof(struct pebs_record)))
+    {
+        xprintdbg("LIBIHT-COM: Copy to user failed.\n");
+        cnt = -1;
+    }
+
+    xfree(stage);
+    return cnt;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_pebs_state
+// Description  : Move the PEBS records of one BTS state to a kernel buffer in
+//                the normalized record format, and remove them from the PEBS
+//                buffer. The PEBS buffer is not circular, the cpu stops
+//                writing records once it is full. The records of a thread
+//                running on another cpu are left until it is switched out,
+//                and the counter of the current thread is stopped while its
+//                buffer is compacted. Caller should hold the `bts_state_lock`.
+//
+// Inputs       : state - the BTS state
+//                records - the kernel PEBS records buffer
+//                record_count - number of records of the buffer
+// Outputs      : number of records moved
+
+s32 dump_pebs_state(struct bts_state *state, struct pebs_record *records,
+                    u32 record_count)
+{
+    struct pebs_record_legacy *legacy;
+    struct pebs_record_adaptive *adaptive;
+    struct pebs_record *record;
+    u64 base, total, cnt, i;
+    u32 is_current;
+
+    base = state->ds_area->pebs_buffer_base;
+    if (state->config.pebs_event == 0 || base == 0 || record_count == 0)
+        return 0;
+
+    is_current = state->config.pid == xgetcurrent_pid();
+    if (state->loaded && !is_current)
+    {
+        xprintdbg("LIBIHT-COM: PEBS of pid %d running, not dumped.\n",
+                    state->config.pid);
+        return 0;
+    }
+
+    // The lock keeps the current thread on this cpu
+    if (state->loaded && !state->paused)
+        get_pebs(state);
+
+    total = (state->ds_area->pebs_index - base) / pebs_record_size;
+    cnt = total < record_count ? total : record_count;
+    xprintdbg("LIBIHT-COM: PEBS buffer base: 0x%llx, records: %lld.\n",
+                base, total);
+
+    for (i = 0; i < cnt; i++)
+    {
+        record = &records[i];
+        xmemset(record, 0, sizeof(struct pebs_record));
+        record->tid = state->config.pid;
+        if (pebs_format >= 4)
+        {
+            adaptive = (struct pebs_record_adaptive *)
+                            (base + i * pebs_record_size);
+            record->ip = adaptive->ip;
+            record->data_addr = adaptive->address;
+            record->latency = adaptive->latency & 0xFFFFFFFF;
+            record->data_source = adaptive->aux;
+            record->tsc = adaptive->tsc;
+        }
+        else
+        {
+            // Before format 2 only the next instruction is known
+            legacy = (struct pebs_record_legacy *)(base + i * pebs_record_size);
+            record->ip = pebs_format >= 2 ? legacy->real_ip : legacy->ip;
+            record->data_addr = legacy->dla;
+            record->latency = legacy->lat;
+            record->data_source = legacy->dse;
+            record->tsc = pebs_format >= 3 ? legacy->tsc : 0;
+        }
+    }
+
+    // Move the records left behind to the front of the buffer
+    for (i = 0; i < total - cnt; i++)
+        xmemcpy((void *)(base + i * pebs_record_size),
+                (void *)(base + (cnt + i) * pebs_record_size),
+                pebs_record_size);
+    state->ds_area->pebs_index = base + (total - cnt) * pebs_record_size;
+
+    if (state->loaded && !state->paused)
+        put_pebs(state);
+
+    return (s32)cnt;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_bts_paused
+// Description  : Pause or resume the BTS for the given process id. The BTS
+//                state and buffer stay allocated, only the trace bits of a
+//                running thread are flipped, and paused threads are skipped
+//                by the context switch handler.
+//
+// Inputs       : request - the BTS ioctl request
+//                paused - TRUE to pause, FALSE to resume
+// Outputs      : 0 if successful, -1 if failure
+
+s32 set_bts_paused(struct bts_ioctl_request *request, u32 paused)
+{
+    struct bts_state *state, *curr_state;
+    char irql_flag[MAX_IRQL_LEN];
+    void *curr_list;
+    u64 offset;
+
+    if (request->bts_config.scope == LIBIHT_SCOPE_PROCESS)
+    {
+        if (find_bts_proc_state(request->bts_config.pid) == NULL)
+        {
+            xprintdbg("LIBIHT-COM: BTS not enabled for process %d.\n",
+                        request->bts_config.pid);
+            return -1;
+        }
+
+        xacquire_lock(bts_state_lock, irql_flag);
+
+        // offsetof(st, m) macro implementation of stddef.h
+        offset = (u64)(&((struct bts_state *)0)->list);
+        curr_list = xlist_next(bts_state_head);
+        while (curr_list != NULL && curr_list != bts_state_head)
+        {
+            curr_state = (struct bts_state *)((u64)curr_list - offset);
+            curr_list = xlist_next(curr_list);
+            if (curr_state->config.scope == LIBIHT_SCOPE_PROCESS &&
+                curr_state->tgid == request->bts_config.pid)
+            {
+                curr_state->user_paused = paused;
+                curr_state->paused = curr_state->user_paused ||
+                                        curr_state->gate_paused;
+            }
+        }
+
+        xrelease_lock(bts_state_lock, irql_flag);
+
+        // Apply right away if the caller is one of the traced threads
+        state = find_bts_state(xgetcurrent_pid());
+        if (state && state->config.scope == LIBIHT_SCOPE_PROCESS &&
+            state->tgid == request->bts_config.pid)
+            sync_bts_paused(state);
+        return 0;
+    }
+
+    state = find_bts_state(request->bts_config.pid);
+    if (state == NULL)
+    {
+        xprintdbg("LIBIHT-COM: BTS not enabled for pid %d.\n",
+                    request->bts_config.pid);
+        return -1;
+    }
+
+    pause_bts_state(state, BTS_PAUSE_USER, paused);
+    sync_bts_paused(state);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pause_bts_state
+// Description  : Set a pause source of a BTS state. The state is paused while
+//                either the user (ioctl or window) or the trace gate pauses
+//                it, so one never overrides the other.
+//
+// Inputs       : state - the BTS state
+//                source - BTS_PAUSE_USER or BTS_PAUSE_GATE
+//                paused - TRUE to pause, FALSE to resume
+// Outputs      : void
+
+void pause_bts_state(struct bts_state *state, u32 source, u32 paused)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(bts_state_lock, irql_flag);
+    if (source == BTS_PAUSE_GATE)
+        state->gate_paused = paused;
+    else
+        state->user_paused = paused;
+    state->paused = state->user_paused || state->gate_paused;
+    xrelease_lock(bts_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : own_bts_state
+// Description  : Hand a BTS state over to a kernel owner, such as the
+//                trace window or the exec rule that enabled it. An owned
+//                state is freed when its thread exits or its owner is
+//                deleted, while a state enabled by the user stays until it
+//                is disabled.
+//
+// Inputs       : state - the BTS state
+//                owner - BTS_OWNER_WINDOW or BTS_OWNER_EXEC_RULE
+//                owner_id - the window or exec rule id
+// Outputs      : void
+
+void own_bts_state(struct bts_state *state, u32 owner, u32 owner_id)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(bts_state_lock, irql_flag);
+    state->owner = owner;
+    state->owner_id = owner_id;
+    xrelease_lock(bts_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sync_bts_paused
+// Description  : Apply the paused flag of a BTS state to the current cpu if
+//                the state belongs to the current thread. While the debug
+//                store area of the state is still loaded, only the DEBUGCTL
+//                bits are flipped.
+//
+// Inputs       : state - the BTS state
+// Outputs      : void
+
+void sync_bts_paused(struct bts_state *state)
+{
+    u64 dbgctlmsr;
+
+    if (state->config.pid != xgetcurrent_pid())
+        return;
+
+    if (!state->loaded)
+    {
+        // Unloaded since the pause, load it again on resume
+        if (!state->paused)
+            put_bts(state);
+        return;
+    }
+
+    xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
+    if (state->paused)
+        dbgctlmsr &= ~state->config.bts_config;
+    else
+        dbgctlmsr |= state->config.bts_config;
+    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
+
+    if (state->config.pebs_event)
+    {
+        if (state->paused)
+            get_pebs(state);
+        else
+            put_pebs(state);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : config_bts
+// Description  : Configure the BTS trace bits and BTS buffer size for a given
+//                process in request.
+//
+// Inputs       : request - the BTS ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 config_bts(struct bts_ioctl_request *request)
+{
+    s32 ret = 0;
+    struct bts_state *state;
+    u32 *tids, tid_cnt, max_cnt, i;
+
+    if (request->bts_config.scope == LIBIHT_SCOPE_PROCESS)
+    {
+        if (find_bts_proc_state(request->bts_config.pid) == NULL)
+        {
+            xprintdbg("LIBIHT-COM: BTS not enabled for process %d.\n",
+                        request->bts_config.pid);
+            return -1;
+        }
+
+        // Resizing may sleep, so walk the threads instead of the locked list
+        max_cnt = MAX_PROC_THREADS;
+        while (TRUE)
+        {
+            tids = xmalloc(max_cnt * sizeof(u32));
+            if (tids == NULL)
+                return -1;
+
+            tid_cnt = xget_thread_ids(request->bts_config.pid, tids, max_cnt);
+            if (tid_cnt <= max_cnt)
+                break;
+
+            xfree(tids);
+            max_cnt = tid_cnt << 1;
+        }
+
+        for (i = 0; i < tid_cnt; i++)
+        {
+            state = find_bts_state(tids[i]);
+            if (state == NULL ||
+                state->config.scope != LIBIHT_SCOPE_PROCESS ||
+                state->tgid != request->bts_config.pid)
+                continue;
+
+            if (config_bts_state(state, &request->bts_config))
+                ret = -1;
+        }
+
+        xfree(tids);
+        return ret;
+    }
+
+    state = find_bts_state(request->bts_config.pid);
+    if (state == NULL)
+    {
+        xprintdbg("LIBIHT-COM: BTS not enabled for pid %d.\n",
+                    request->bts_config.pid);
+        return -1;
+    }
+
+    return config_bts_state(state, &request->bts_config);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : config_bts_state
+// Description  : Apply the BTS trace bits and BTS buffer size to one BTS
+//                state.
+//
+// Inputs       : state - the BTS state
+//                config - the requested BTS configuration
+// Outputs      : 0 if successful, -1 if failure
+
+s32 config_bts_state(struct bts_state *state, struct bts_config *config)
+{
+    s32 ret = 0;
+    u32 is_current;
+    u64 buffer_base, old_buffer_base;
+    char irql_flag[MAX_IRQL_LEN];
+
+    // If the current process is the target process, we need to
+    // disable and re-enable BTS to apply the new configuration
+    is_current = state->config.pid == xgetcurrent_pid();
+    if (is_current && state->loaded)
+        get_bts(state);
+
+    state->config.bts_config = config->bts_config;
+    if (config->bts_buffer_size != state->config.bts_buffer_size &&
+        config->bts_buffer_size != 0)
+    {
+        // Reconfigure BTS debug store area, keep the old one on failure
+        buffer_base = (u64)xmalloc(config->bts_buffer_size);
+        if (buffer_base == 0)
+        {
+            xprintdbg("LIBIHT-COM: Allocate BTS buffer failed.\n");
+            ret = -1;
+        }
+        else
+        {
+            xmemset((void *)buffer_base, 0, config->bts_buffer_size);
+
+            // Swap under the lock, so a dump never stages a freed buffer
+            xacquire_lock(bts_state_lock, irql_flag);
+            old_buffer_base = state->ds_area->bts_buffer_base;
+            state->config.bts_buffer_size = config->bts_buffer_size;
+            state->ds_area->bts_buffer_base = buffer_base;
+            state->ds_area->bts_index = buffer_base;
+            state->ds_area->bts_absolute_maximum =
+                    buffer_base + config->bts_buffer_size + 1;
+            xrelease_lock(bts_state_lock, irql_flag);
+            xfree((void *)old_buffer_base);
+        }
+    }
+
+    // A zero PEBS event turns PEBS off and releases its buffer
+    if (config_pebs_state(state, config))
+    {
+        xprintdbg("LIBIHT-COM: Configure PEBS failed.\n");
+        ret = -1;
+    }
+
+    if (is_current && !state->paused)
+        put_bts(state);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : create_bts_state
+// Description  : Create a new BTS state.
+//
+// Inputs       : void
+// Outputs      : The new BTS state
+
+struct bts_state *create_bts_state(void)
+{
+    struct bts_state *state;
+
+    state = xmalloc(sizeof(struct bts_state));
+    if (state == NULL)
+        return NULL;
+    xmemset(state, 0, sizeof(struct bts_state));
+    state->refs = 1;
+
+    state->ds_area = xmalloc(sizeof(struct ds_area));
+    if (state->ds_area == NULL)
+    {
+        xfree(state);
+        return NULL;
+    }
+    xmemset(state->ds_area, 0, sizeof(struct ds_area));
+
+    return state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : setup_bts_buffer
+// Description  : Allocate a zeroed BTS buffer of the configured size and point
+//                the debug store area of the BTS state to it.
+//
+// Inputs       : state - the BTS state
+// Outputs      : 0 if successful, -1 if failure
+
+s32 setup_bts_buffer(struct bts_state *state)
+{
+    u64 buffer_base;
+
+    buffer_base = (u64)xmalloc(state->config.bts_buffer_size);
+    if (buffer_base == 0)
+        return -1;
+    xmemset((void *)buffer_base, 0, state->config.bts_buffer_size);
+
+    state->ds_area->bts_buffer_base = buffer_base;
+    state->ds_area->bts_index = buffer_base;
+    state->ds_area->bts_absolute_maximum =
+            buffer_base + state->config.bts_buffer_size + 1;
+    // Not yet support state->ds_area->bts_interrupt_threshold
+
+    // Print BTS debug store area info
+    xprintdbg("LIBIHT-COM: BTS ds_area pointer: %llx, bts_buffer_base: %llx, "
+                "bts_index: %llx, bts_absolute_maximum: %llx.\n",
+                (u64)state->ds_area, state->ds_area->bts_buffer_base,
+                state->ds_area->bts_index,
+                state->ds_area->bts_absolute_maximum);
+
     return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : dump_bts
-// Description  : Dump the BTS records for a given process in request.
+// Function     : config_pebs_state
+// Description  : Apply the PEBS event of the requested configuration to a BTS
+//                state and point the PEBS part of its debug store area to a
+//                zeroed PEBS buffer. The buffer is kept if its size does not
+//                change. No PEBS interrupt is used, so the threshold is put
+//                past the end of the buffer. Caller should ensure the state
+//                is not loaded.
 //
-// Inputs       : request - the BTS ioctl request
+// Inputs       : state - the BTS state
+//                config - the requested BTS configuration
 // Outputs      : 0 if successful, -1 if failure
 
-s32 dump_bts(struct bts_ioctl_request *request)
+s32 config_pebs_state(struct bts_state *state, struct bts_config *config)
 {
-    u64 i, bytes_left, bts_offset;
-    struct bts_state *state;
-    struct bts_record *record;
-    struct bts_data req_buf;
-    char irql_flag[MAX_IRQL_LEN];
+    struct ds_area *ds_area = state->ds_area;
+    u64 buffer_base, buffer_size, period, records;
 
-    state = find_bts_state(request->bts_config.pid);
-    if (state == NULL)
+    if (config->pebs_event == 0)
     {
-        xprintdbg("LIBIHT-COM: BTS not enabled for pid %d.\n",
-                    request->bts_config.pid);
-        return -1;
+        if (ds_area->pebs_buffer_base)
+            xfree((void *)ds_area->pebs_buffer_base);
+        ds_area->pebs_buffer_base = 0;
+        ds_area->pebs_index = 0;
+        ds_area->pebs_absolute_maximum = 0;
+        ds_area->pebs_interrupt_threshold = 0;
+        state->config.pebs_event = 0;
+        return 0;
     }
 
-    // Dump some BTS buffer records
-    xacquire_lock(bts_state_lock, irql_flag);
-
-    bts_offset = (state->ds_area->bts_index -
-                    state->ds_area->bts_buffer_base) /
-                    sizeof(struct bts_record);
-    xprintdbg("LIBIHT-COM: BTS buffer base: 0x%llx, index: 0x%llx. offset: 0x%llx\n",
-                state->ds_area->bts_buffer_base,
-                state->ds_area->bts_index,
-                bts_offset);
-    for (i = 0; i < state->config.bts_buffer_size / sizeof(struct bts_record); i++)
+    if (pebs_format == 0)
     {
-        record = (struct bts_record*)state->ds_area->bts_buffer_base + i;
-        xprintdbg("LIBIHT-COM: BTS record ptr: 0x%llx.\n", (u64)record);
-        xprintdbg("LIBIHT-COM: BTS record %d: from %llx to %llx.\n",
-                    i, record->from, record->to);
+        xprintdbg("LIBIHT-COM: PEBS is not supported or available.\n");
+        return -1;
     }
 
-    // Dump the BTS data to userspace buffer
-    // TODO: Try best to support mmap share between user and kernel space
-    if (request->buffer)
+    period = config->pebs_period ? config->pebs_period : DEFAULT_PEBS_PERIOD;
+    if (period < MIN_PEBS_PERIOD || period > MAX_PEBS_PERIOD)
     {
-        // Get a copy of data from userspace buffer
-        bytes_left = xcopy_from_user(&req_buf, request->buffer,
-                                    sizeof(struct bts_data));
-        if (bytes_left)
-        {
-            xprintdbg("LIBIHT-COM: Copy BTS data from user failed.\n");
-            xrelease_lock(bts_state_lock, irql_flag);
-            return -1;
-        }
+        xprintdbg("LIBIHT-COM: Invalid PEBS period %lld.\n", period);
+        return -1;
+    }
 
-        // Dump data to userspace buffer ptr
-        // Not yet support state->ds_area->bts_interrupt_threshold
-        req_buf.bts_index = req_buf.bts_buffer_base + bts_offset;
-        if (req_buf.bts_buffer_base)
-        {
-            bytes_left = xcopy_to_user(req_buf.bts_buffer_base,
-                                        (void *)state->ds_area->bts_buffer_base,
-                                        state->config.bts_buffer_size);
-            if (bytes_left)
-            {
-                xprintdbg("LIBIHT-COM: Copy to user failed.\n");
-                xrelease_lock(bts_state_lock, irql_flag);
-                return -1;
-            }
-        }
+    buffer_size = config->pebs_buffer_size ?
+                config->pebs_buffer_size : DEFAULT_PEBS_BUFFER_SIZE;
+    records = buffer_size / pebs_record_size;
+    if (records == 0)
+        return -1;
 
-        // Copy updated data back to userspace buffer
-        bytes_left = xcopy_to_user(request->buffer, &req_buf,
-                                    sizeof(struct bts_data));
-        if (bytes_left)
-        {
-            xprintdbg("LIBIHT-COM: Copy to user failed.\n");
-            xrelease_lock(bts_state_lock, irql_flag);
+    if (ds_area->pebs_buffer_base == 0 ||
+        buffer_size != state->config.pebs_buffer_size)
+    {
+        buffer_base = (u64)xmalloc(buffer_size);
+        if (buffer_base == 0)
             return -1;
-        }
+        xmemset((void *)buffer_base, 0, buffer_size);
+
+        if (ds_area->pebs_buffer_base)
+            xfree((void *)ds_area->pebs_buffer_base);
+        ds_area->pebs_buffer_base = buffer_base;
+        ds_area->pebs_index = buffer_base;
+        ds_area->pebs_absolute_maximum =
+                buffer_base + records * pebs_record_size;
+        ds_area->pebs_interrupt_threshold =
+                ds_area->pebs_absolute_maximum + pebs_record_size;
     }
 
-    xrelease_lock(bts_state_lock, irql_flag);
+    state->config.pebs_event = config->pebs_event;
+    state->config.pebs_period = period;
+    state->config.pebs_buffer_size = buffer_size;
+    state->config.pebs_latency = config->pebs_latency;
+
+    // The counter counts up from -period, and is reloaded after each record
+    ds_area->pebs_counter_reset[pebs_counter_index] =
+            (0 - period) & pebs_counter_mask;
+    state->pebs_counter = ds_area->pebs_counter_reset[pebs_counter_index];
 
     return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : config_bts
-// Description  : Configure the BTS trace bits and BTS buffer size for a given
-//                process in request.
+// Function     : free_bts_state
+// Description  : Free a BTS state, its debug store area and its BTS and PEBS
+//                buffers. The state should not be in the list.
 //
-// Inputs       : request - the BTS ioctl request
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : state - the BTS state
+// Outputs      : void
 
-s32 config_bts(struct bts_ioctl_request *request)
+void free_bts_state(struct bts_state *state)
 {
-    struct bts_state *state;
+    if (state->ds_area->pebs_buffer_base)
+        xfree((void *)state->ds_area->pebs_buffer_base);
+    if (state->ds_area->bts_buffer_base)
+        xfree((void *)state->ds_area->bts_buffer_base);
+    xfree(state->ds_area);
+    xfree(state);
+}
 
-    state = find_bts_state(request->bts_config.pid);
-    if (state == NULL)
-    {
-        xprintdbg("LIBIHT-COM: BTS not enabled for pid %d.\n",
-                    request->bts_config.pid);
-        return -1;
-    }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_bts_state
+// Description  : Drop a reference to a BTS state. The state and its buffers
+//                are freed with the last reference, so a state can be removed
+//                while a dump still copies it. References are taken with the
+//                `bts_state_lock` held.
+//
+// Inputs       : state - the BTS state
+// Outputs      : void
 
-    state->config.bts_config = request->bts_config.bts_config;
-    // If the current process is the target process, we need to
-    // disable and re-enable BTS to apply the new configuration
-    if (xgetcurrent_pid() == request->bts_config.pid)
-    {
-        // TODO: check if it works
-        get_bts(state);
+void release_bts_state(struct bts_state *state)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    u32 refs;
 
-        if (request->bts_config.bts_buffer_size != state->config.bts_buffer_size &&
-            request->bts_config.bts_buffer_size != 0)
-        {
-            state->config.bts_buffer_size = request->bts_config.bts_buffer_size;
+    xacquire_lock(bts_state_lock, irql_flag);
+    refs = --state->refs;
+    xrelease_lock(bts_state_lock, irql_flag);
 
-            // Reconfigure BTS debug store area
-            xfree((void *)state->ds_area->bts_buffer_base);
-            state->ds_area->bts_buffer_base = (u64)xmalloc(request->bts_config.bts_buffer_size);
-            state->ds_area->bts_index = state->ds_area->bts_buffer_base;
-            state->ds_area->bts_absolute_maximum =
-                    state->ds_area->bts_buffer_base +
-                    request->bts_config.bts_buffer_size + 1;
-        }
+    if (refs == 0)
+        free_bts_state(state);
+}
 
-        put_bts(state);
-    }
-    else
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_bts_state
+// Description  : Find a BTS state by pid.
+//
+// Inputs       : pid - the pid of the target process
+// Outputs      : The BTS state
+
+struct bts_state *find_bts_state(u32 pid)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct bts_state *curr_state, *ret_state = NULL;
+    void *curr_list;
+    u64 offset;
+
+    xacquire_lock(bts_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct bts_state *)0)->list);
+    curr_list = xlist_next(bts_state_head);
+    while (curr_list != NULL && curr_list != bts_state_head)
     {
-        if (request->bts_config.bts_buffer_size != state->config.bts_buffer_size &&
-            request->bts_config.bts_buffer_size != 0)
+        curr_state = (struct bts_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (curr_state->config.pid == pid)
         {
-            state->config.bts_buffer_size = request->bts_config.bts_buffer_size;
-
-            // Reconfigure BTS debug store area
-            xfree((void *)state->ds_area->bts_buffer_base);
-            state->ds_area->bts_buffer_base = (u64)xmalloc(request->bts_config.bts_buffer_size);
-            state->ds_area->bts_index = 0;
-            state->ds_area->bts_absolute_maximum =
-                    state->ds_area->bts_buffer_base +
-                    request->bts_config.bts_buffer_size + 1;
+            ret_state = curr_state;
+            break;
         }
-
     }
 
-    return 0;
+    xrelease_lock(bts_state_lock, irql_flag);
+
+    return ret_state;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : create_bts_state
-// Description  : Create a new BTS state.
+// Function     : find_bts_proc_state
+// Description  : Find any process scope BTS state of a thread group.
 //
-// Inputs       : void
-// Outputs      : The new BTS state
+// Inputs       : tgid - the thread group id (user process pid)
+// Outputs      : The BTS state
 
-struct bts_state *create_bts_state(void)
+struct bts_state *find_bts_proc_state(u32 tgid)
 {
-    struct bts_state *state;
+    char irql_flag[MAX_IRQL_LEN];
+    struct bts_state *curr_state, *ret_state = NULL;
+    void *curr_list;
+    u64 offset;
 
-    state = xmalloc(sizeof(struct bts_state));
-    if (state == NULL)
-        return NULL;
-    state->ds_area = xmalloc(sizeof(struct ds_area));
-    if (state->ds_area == NULL)
+    xacquire_lock(bts_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct bts_state *)0)->list);
+    curr_list = xlist_next(bts_state_head);
+    while (curr_list != NULL && curr_list != bts_state_head)
     {
-        xfree(state);
-        return NULL;
+        curr_state = (struct bts_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (tgid != 0 && curr_state->config.scope == LIBIHT_SCOPE_PROCESS &&
+            curr_state->tgid == tgid)
+        {
+            ret_state = curr_state;
+            break;
+        }
     }
 
-    return state;
+    xrelease_lock(bts_state_lock, irql_flag);
+
+    return ret_state;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : find_bts_state
-// Description  : Find a BTS state by pid.
+// Function     : find_bts_owned_state
+// Description  : Find any BTS state of a kernel owner.
 //
-// Inputs       : pid - the pid of the target process
-// Outputs      : The BTS state
+// Inputs       : owner - BTS_OWNER_WINDOW or BTS_OWNER_EXEC_RULE
+//                owner_id - the window or exec rule id
+// Outputs      : struct bts_state* - the BTS state, NULL if not found
 
-struct bts_state *find_bts_state(u32 pid)
+struct bts_state *find_bts_owned_state(u32 owner, u32 owner_id)
 {
     char irql_flag[MAX_IRQL_LEN];
     struct bts_state *curr_state, *ret_state = NULL;
@@ -398,7 +1468,7 @@ struct bts_state *find_bts_state(u32 pid)
     {
         curr_state = (struct bts_state *)((u64)curr_list - offset);
         curr_list = xlist_next(curr_list);
-        if (curr_state->config.pid == pid)
+        if (curr_state->owner == owner && curr_state->owner_id == owner_id)
         {
             ret_state = curr_state;
             break;
@@ -451,10 +1521,51 @@ void remove_bts_state(struct bts_state *old_state)
     xprintdbg("LIBIHT-COM: Remove BTS state for pid %d.\n",
                 old_state->config.pid);
     xlist_del(&old_state->list);
-    xfree((void *)old_state->ds_area->bts_buffer_base);
-    xfree(old_state->ds_area);
-    xfree(old_state);
     xrelease_lock(bts_state_lock, irql_flag);
+
+    // A dump may still hold the state
+    release_bts_state(old_state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_bts_proc_states
+// Description  : Remove all process scope BTS states of a thread group.
+//
+// Inputs       : tgid - the thread group id (user process pid)
+// Outputs      : void
+
+void remove_bts_proc_states(u32 tgid)
+{
+    struct bts_state *state;
+
+    while ((state = find_bts_proc_state(tgid)) != NULL)
+    {
+        if (state->config.pid == xgetcurrent_pid())
+            get_bts(state);
+        remove_bts_state(state);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_bts_owned_states
+// Description  : Remove all BTS states of a kernel owner from the list.
+//
+// Inputs       : owner - BTS_OWNER_WINDOW or BTS_OWNER_EXEC_RULE
+//                owner_id - the window or exec rule id
+// Outputs      : void
+
+void remove_bts_owned_states(u32 owner, u32 owner_id)
+{
+    struct bts_state *state;
+
+    while ((state = find_bts_owned_state(owner, owner_id)) != NULL)
+    {
+        if (state->config.pid == xgetcurrent_pid())
+            get_bts(state);
+        remove_bts_state(state);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -485,9 +1596,8 @@ void free_bts_state_list(void)
                     curr_state->config.pid);
 
         xlist_del(curr_state->list);
-        xfree((void *)curr_state->ds_area->bts_buffer_base);
-        xfree(curr_state->ds_area);
-        xfree(curr_state);
+        if (--curr_state->refs == 0)
+            free_bts_state(curr_state);
     }
 
     xrelease_lock(bts_state_lock, irql_flag);
@@ -532,6 +1642,24 @@ s32 bts_ioctl_handler(struct xioctl_request *request)
         ret = config_bts(&request->body.bts);
         break;
 
+    case LIBIHT_IOCTL_PAUSE_BTS:
+        xprintdbg("LIBIHT-COM: Pause BTS for pid %d.\n",
+                    request->body.bts.bts_config.pid);
+        ret = set_bts_paused(&request->body.bts, TRUE);
+        break;
+
+    case LIBIHT_IOCTL_RESUME_BTS:
+        xprintdbg("LIBIHT-COM: Resume BTS for pid %d.\n",
+                    request->body.bts.bts_config.pid);
+        ret = set_bts_paused(&request->body.bts, FALSE);
+        break;
+
+    case LIBIHT_IOCTL_DUMP_PEBS:
+        xprintdbg("LIBIHT-COM: Dump PEBS for pid %d.\n",
+                    request->body.bts.bts_config.pid);
+        ret = dump_pebs(&request->body.bts);
+        break;
+
     default:
         xprintdbg("LIBIHT-COM: Invalid BTS ioctl command.\n");
         ret = -1;
@@ -557,14 +1685,15 @@ void bts_cswitch_handler(u32 prev_pid, u32 next_pid)
     prev_state = find_bts_state(prev_pid);
     next_state = find_bts_state(next_pid);
 
-    if (prev_state)
+    // A paused state is unloaded once on its first switch out, then skipped
+    if (prev_state && prev_state->loaded)
     {
         xprintdbg("LIBIHT-COM: BTS context switch from pid %d on core %d\n",
             prev_state->config.pid, xcoreid());
         get_bts(prev_state);
     }
 
-    if (next_state)
+    if (next_state && !next_state->paused)
     {
         xprintdbg("LIBIHT-COM: BTS context switch to pid %d on core %d\n",
                 next_state->config.pid, xcoreid());
@@ -572,33 +1701,91 @@ void bts_cswitch_handler(u32 prev_pid, u32 next_pid)
     }
 }
 
-void bts_newproc_handler(u32 parent_pid, u32 child_pid)
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_newproc_handler
+// Description  : The new process handler for the BTS. A new thread of a
+//                process traced in process scope joins the process trace,
+//                otherwise the child inherits the trace of its parent.
+//
+// Inputs       : parent_pid - the pid of the parent process
+//                child_pid - the pid of the child process
+//                child_tgid - the thread group id of the child process
+// Outputs      : void
+
+void bts_newproc_handler(u32 parent_pid, u32 child_pid, u32 child_tgid)
 {
-    struct bts_state *parent_state, *child_state;
-    // char irql_flag[MAX_IRQL_LEN];
+    struct bts_state *parent_state = NULL, *child_state;
 
-    parent_state = find_bts_state(parent_pid);
+    if (child_pid != child_tgid)
+        parent_state = find_bts_proc_state(child_tgid);
+    if (parent_state == NULL)
+        parent_state = find_bts_state(parent_pid);
     if (parent_state == NULL)
         return;
 
     xprintdbg("LIBIHT-COM: BTS new process %d parent pid %d\n",
-            child_pid, parent_pid);
+            child_pid, parent_state->config.pid);
     child_state = create_bts_state();
     if (child_state == NULL)
         return;
 
     child_state->parent = parent_state;
+    child_state->tgid = child_tgid;
     child_state->config.pid = child_pid;
+    child_state->config.scope = parent_state->config.scope;
     child_state->config.bts_config = parent_state->config.bts_config;
     child_state->config.bts_buffer_size = parent_state->config.bts_buffer_size;
-    // TODO: memcpy or not? overhead? If yes, acquire lock for this operation
+    // The trace gate belongs to the parent thread only
+    child_state->user_paused = parent_state->user_paused;
+    child_state->paused = child_state->user_paused;
+    child_state->owner = parent_state->owner;
+    child_state->owner_id = parent_state->owner_id;
+
+    // The child records into its own buffer, parent records are not copied
+    if (setup_bts_buffer(child_state))
+    {
+        xfree(child_state->ds_area);
+        xfree(child_state);
+        return;
+    }
+    if (config_pebs_state(child_state, &parent_state->config))
+    {
+        free_bts_state(child_state);
+        return;
+    }
     insert_bts_state(child_state);
 
     // If the child process is the current process, trace it right away
-    if (child_pid == xgetcurrent_pid())
+    if (child_pid == xgetcurrent_pid() && !child_state->paused)
         put_bts(child_state);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_exitproc_handler
+// Description  : The process exit handler for the BTS. Threads traced in
+//                process scope or by a kernel owner are detached and their
+//                buffers released when they exit.
+//
+// Inputs       : pid - the pid of the exiting process
+// Outputs      : void
+
+void bts_exitproc_handler(u32 pid)
+{
+    struct bts_state *state;
+
+    state = find_bts_state(pid);
+    if (state == NULL || (state->config.scope != LIBIHT_SCOPE_PROCESS &&
+        state->owner == BTS_OWNER_USER))
+        return;
+
+    xprintdbg("LIBIHT-COM: BTS traced thread %d exit.\n", pid);
+    if (pid == xgetcurrent_pid())
+        get_bts(state);
+    remove_bts_state(state);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : bts_check
@@ -626,6 +1813,71 @@ s32 bts_check(void)
     return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pebs_check
+// Description  : Check if the PEBS is available, and find its record format
+//                and the counter it runs on.
+//
+// Inputs       : void
+// Outputs      : 0 if successful, -1 if failure
+
+s32 pebs_check(void)
+{
+    u32 eax, ebx, ecx, edx, counters;
+    u64 misc_msr, perf_cap;
+
+    // The PEBS record format is only reported by PERF_CAPABILITIES
+    xcpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & (1 << X64_FEATURE_PDCM)))
+        return -1;
+
+    xrdmsr(MSR_IA32_MISC_ENABLE, &misc_msr);
+    if (misc_msr & MSR_IA32_MISC_ENABLE_PEBS_UNAVAIL)
+        return -1;
+
+    xcpuid(0xA, &eax, &ebx, &ecx, &edx);
+    counters = (eax >> 8) & 0xFF;
+    if ((eax & 0xFF) == 0 || counters == 0)
+        return -1;
+
+    xrdmsr(MSR_IA32_PERF_CAPABILITIES, &perf_cap);
+    pebs_format = PERF_CAP_PEBS_FORMAT(perf_cap);
+    switch (pebs_format)
+    {
+    case 0:
+        // Core PEBS has no data address and latency
+        return -1;
+
+    case 1:
+        pebs_record_size = (u32)(u64)(&((struct pebs_record_legacy *)0)->real_ip);
+        break;
+
+    case 2:
+        pebs_record_size = (u32)(u64)(&((struct pebs_record_legacy *)0)->tsc);
+        break;
+
+    case 3:
+        pebs_record_size = sizeof(struct pebs_record_legacy);
+        break;
+
+    default:
+        if (!(perf_cap & PERF_CAP_PEBS_BASELINE))
+            return -1;
+        pebs_record_size = sizeof(struct pebs_record_adaptive);
+        break;
+    }
+
+    pebs_counter_index = (counters > PEBS_MAX_COUNTERS ?
+                            PEBS_MAX_COUNTERS : counters) - 1;
+    pebs_counter_mask = (1ULL << ((eax >> 16) & 0xFF)) - 1;
+    pebs_ll_enable = (eax & 0xFF) < 5;
+
+    xprintdbg("LIBIHT-COM: PEBS format %d, record size %d, counter %d.\n",
+                pebs_format, pebs_record_size, pebs_counter_index);
+    return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : bts_init
@@ -643,6 +1895,13 @@ s32 bts_init(void)
         return -1;
     }
 
+    // PEBS is optional, BTS works without it
+    if (pebs_check())
+    {
+        xprintdbg("LIBIHT-COM: PEBS is not supported or available.\n");
+        pebs_format = 0;
+    }
+
     xprintdbg("LIBIHT-COM: Init BTS related structs.\n");
     xinit_lock(bts_state_lock);
     xinit_list_head(bts_state_head);
@@ -44,6 +44,34 @@ extern "C" {
 #define MSR_IA32_MISC_ENABLE    0x000001a0
 #endif
 
+#ifndef MSR_IA32_PERF_CAPABILITIES
+#define MSR_IA32_PERF_CAPABILITIES  0x00000345
+#endif
+
+#ifndef MSR_IA32_PEBS_ENABLE
+#define MSR_IA32_PEBS_ENABLE    0x000003f1
+#endif
+
+#ifndef MSR_PEBS_DATA_CFG
+#define MSR_PEBS_DATA_CFG       0x000003f2
+#endif
+
+#ifndef MSR_PEBS_LD_LAT_THRESHOLD
+#define MSR_PEBS_LD_LAT_THRESHOLD   0x000003f6
+#endif
+
+#ifndef MSR_P6_EVNTSEL0
+#define MSR_P6_EVNTSEL0         0x00000186
+#endif
+
+#ifndef MSR_P6_PERFCTR0
+#define MSR_P6_PERFCTR0         0x000000c1
+#endif
+
+#ifndef MSR_CORE_PERF_GLOBAL_CTRL
+#define MSR_CORE_PERF_GLOBAL_CTRL   0x0000038f
+#endif
+
 // MSR bit shifts
 #ifndef DEBUGCTLMSR_TR
 #define DEBUGCTLMSR_TR          (1UL <<  6)
@@ -73,6 +101,19 @@ extern "C" {
 #define MSR_IA32_MISC_ENABLE_BTS_UNAVAIL    (1ULL << MSR_IA32_MISC_ENABLE_BTS_UNAVAIL_BIT)
 #endif
 
+#ifndef MSR_IA32_MISC_ENABLE_PEBS_UNAVAIL
+#define MSR_IA32_MISC_ENABLE_PEBS_UNAVAIL   (1ULL << 12)
+#endif
+
+// Perfmon bits used by PEBS
+#define X64_FEATURE_PDCM        15          // CPUID.1 ECX, PERF_CAPABILITIES
+#define PERF_CAP_PEBS_FORMAT(cap)   (((cap) >> 8) & 0xf)
+#define PERF_CAP_PEBS_BASELINE  (1ULL << 14)
+#define EVNTSEL_USR             (1ULL << 16)
+#define EVNTSEL_EN              (1ULL << 22)
+#define EVNTSEL_ADAPTIVE        (1ULL << 34)
+#define PEBS_DATA_CFG_MEMINFO   (1ULL <<  0)
+
 /* CPL-Qualified Branch Trace Store Encodings (Table 18-6 from Intel SDM)
  *
  * TR  BTS  BTS_OFF_OS  BTS_OFF_USR  BTINT  Description
@@ -100,6 +141,30 @@ extern "C" {
 // BTS buffer size 0x200 * 2 = 0x400 = 1024 records
 #define DEFAULT_BTS_BUFFER_SIZE        (0x3000 << 1) 
 
+// PEBS buffer size, 0x10000 / 200 = 327 records of the largest legacy format
+#define DEFAULT_PEBS_BUFFER_SIZE       0x10000
+
+// Most PEBS records moved by one dump request, staged in a kernel buffer
+#define MAX_PEBS_DUMP_RECORDS          0x400
+
+// Default and minimum number of events between two PEBS records. Counters
+// are written through the legacy counter MSRs, which only take 31 bits.
+#define DEFAULT_PEBS_PERIOD            0x10000
+#define MIN_PEBS_PERIOD                0x100
+#define MAX_PEBS_PERIOD                0x7fffffff
+
+// General purpose counters with a PEBS counter reset in the DS area
+#define PEBS_MAX_COUNTERS              8
+
+// Pause sources of a BTS state
+#define BTS_PAUSE_USER                 0
+#define BTS_PAUSE_GATE                 1
+
+// Owners of a BTS state, a state owned by the kernel is freed on thread exit
+#define BTS_OWNER_USER                 0
+#define BTS_OWNER_WINDOW               1
+#define BTS_OWNER_EXEC_RULE            2
+
 //
 // Type definitions
 
@@ -110,10 +175,39 @@ struct ds_area
     u64 bts_index;                  // BTS current index
     u64 bts_absolute_maximum;       // BTS absolute maximum
     u64 bts_interrupt_threshold;    // BTS interrupt threshold
-    u64 pebs_buffer_base;           // PEBS placeholder
-    u64 pebs_index;                 // PEBS placeholder
-    u64 pebs_absolute_maximum;      // PEBS placeholder
-    u64 pebs_interrupt_threshold;   // PEBS placeholder
+    u64 pebs_buffer_base;           // PEBS buffer base
+    u64 pebs_index;                 // PEBS current index
+    u64 pebs_absolute_maximum;      // PEBS absolute maximum
+    u64 pebs_interrupt_threshold;   // PEBS interrupt threshold
+    u64 pebs_counter_reset[PEBS_MAX_COUNTERS]; // PEBS counter reload values
+};
+
+// Define legacy PEBS record (format 1 to 3), general registers are skipped
+struct pebs_record_legacy
+{
+    u64 flags;                      // RFLAGS
+    u64 ip;                         // Instruction after the eventing one
+    u64 regs[16];                   // RAX to R15
+    u64 status;                     // Overflowed counters (format 1+)
+    u64 dla;                        // Data linear address (format 1+)
+    u64 dse;                        // Data source encoding (format 1+)
+    u64 lat;                        // Load latency (format 1+)
+    u64 real_ip;                    // Eventing instruction (format 2+)
+    u64 tsx_tuning;                 // TSX abort information (format 2+)
+    u64 tsc;                        // Timestamp counter (format 3+)
+};
+
+// Define adaptive PEBS record (format 4+) with the memory info group
+struct pebs_record_adaptive
+{
+    u64 format_size;                // Record format, size in bits 63:48
+    u64 ip;                         // Eventing instruction pointer
+    u64 applicable_counters;        // Overflowed counters
+    u64 tsc;                        // Timestamp counter
+    u64 address;                    // Data linear address
+    u64 aux;                        // Data source encoding
+    u64 latency;                    // Load latency
+    u64 tsx_tuning;                 // TSX abort information
 };
 
 // Define BTS state
@@ -123,6 +217,15 @@ struct bts_state
     struct bts_state *parent;           // Parent bts_state
     struct bts_config config;           // BTS configuration
     struct ds_area *ds_area;            // Debug Store area pointer
+    u32 tgid;                           // Thread group id (process scope)
+    u32 paused;                         // Tracing paused, skip save/restore
+    u32 user_paused;                    // Paused by an ioctl or a window
+    u32 gate_paused;                    // Paused by the trace gate
+    u32 owner;                          // BTS_OWNER_* that enabled the state
+    u32 owner_id;                       // Window or exec rule id of the owner
+    u32 refs;                           // References, freed with the last one
+    u32 loaded;                         // DS area loaded on the running cpu
+    u64 pebs_counter;                   // PEBS counter saved on switch out
 };
 
 //
@@ -134,6 +237,9 @@ extern char bts_state_lock[MAX_LOCK_LEN];
 extern char bts_state_head[MAX_LIST_LEN];
 // The head of the bts_state_list.
 
+extern u32 pebs_format;
+// The PEBS record format of the cpu, 0 if PEBS is not usable.
+
 //
 // Function Prototypes
 
@@ -146,30 +252,101 @@ void put_bts(struct bts_state *state);
 void flush_bts(void);
 // Flush the BTS buffer.
 
+void get_pebs(struct bts_state *state);
+// Stop the PEBS counter of a BTS state and save its count
+
+void put_pebs(struct bts_state *state);
+// Program and start the PEBS counter of a BTS state
+
 s32 enable_bts(struct bts_ioctl_request *request);
 // Enable the BTS.
 
+s32 enable_bts_process(struct bts_ioctl_request *request);
+// Enable the BTS for all threads of a given process.
+
+s32 attach_bts_state(struct bts_state *state, struct bts_ioctl_request *request);
+// Enable the BTS with a preallocated state and buffer, without allocating.
+
 s32 disable_bts(struct bts_ioctl_request *request);
 // Disable the BTS.
 
 s32 dump_bts(struct bts_ioctl_request *request);
 // Dump the BTS records.
 
+s32 dump_bts_process(struct bts_ioctl_request *request);
+// Dump the BTS records of all threads of a given process.
+
+s32 dump_bts_threads(struct bts_ioctl_request *request, u32 process);
+// Dump the BTS records of a thread or of all threads of a process.
+
+s32 dump_bts_state(struct bts_state *state, struct bts_data *buffer);
+// Dump the BTS records of a single BTS state through a stage.
+
+s32 copy_bts_to_user(struct ds_area *ds_area, u64 buffer_size, u32 tid,
+                        struct bts_data *buffer);
+// Copy the valid records of a BTS buffer to a userspace BTS data buffer.
+
+s32 dump_pebs(struct bts_ioctl_request *request);
+// Drain the PEBS records of a thread or process
+
+s32 dump_pebs_state(struct bts_state *state, struct pebs_record *records,
+                    u32 record_count);
+// Drain the PEBS records of a single BTS state into a kernel buffer
+
+s32 set_bts_paused(struct bts_ioctl_request *request, u32 paused);
+// Pause or resume the BTS without freeing its state and buffer
+
+void pause_bts_state(struct bts_state *state, u32 source, u32 paused);
+// Set a pause source of a BTS state and update its paused flag
+
+void own_bts_state(struct bts_state *state, u32 owner, u32 owner_id);
+// Hand a BTS state over to a kernel owner
+
+void sync_bts_paused(struct bts_state *state);
+// Apply the paused flag of the current thread BTS state
+
 s32 config_bts(struct bts_ioctl_request *request);
 // Configure the BTS trace bits
 
+s32 config_bts_state(struct bts_state *state, struct bts_config *config);
+// Configure the BTS trace bits of a single BTS state
+
 struct bts_state *create_bts_state(void);
 // Create a new BTS state
 
+s32 setup_bts_buffer(struct bts_state *state);
+// Allocate the BTS buffer of a BTS state
+
+s32 config_pebs_state(struct bts_state *state, struct bts_config *config);
+// Apply the PEBS event and allocate the PEBS buffer of a BTS state
+
+void free_bts_state(struct bts_state *state);
+// Free a BTS state and its buffers
+
+void release_bts_state(struct bts_state *state);
+// Drop a reference to a BTS state taken under the lock
+
 struct bts_state *find_bts_state(u32 pid);
 // Find the BTS state by pid
 
+struct bts_state *find_bts_proc_state(u32 tgid);
+// Find any process scope BTS state by tgid
+
+struct bts_state *find_bts_owned_state(u32 owner, u32 owner_id);
+// Find any BTS state of a kernel owner
+
 void insert_bts_state(struct bts_state *new_state);
 // Insert the BTS state into the list
 
 void remove_bts_state(struct bts_state *old_state);
 // Remove the BTS state from the list
 
+void remove_bts_proc_states(u32 tgid);
+// Remove all process scope BTS states of a thread group
+
+void remove_bts_owned_states(u32 owner, u32 owner_id);
+// Remove all BTS states of a kernel owner
+
 void free_bts_state_list(void);
 // Free the BTS state list
 
@@ -179,12 +356,18 @@ s32 bts_ioctl_handler(struct xioctl_request *request);
 void bts_cswitch_handler(u32 prev_pid, u32 next_pid);
 // The context switch handler for the BTS
 
-void bts_newproc_handler(u32 parent_pid, u32 child_pid);
+void bts_newproc_handler(u32 parent_pid, u32 child_pid, u32 child_tgid);
 // The new process handler for the BTS
 
+void bts_exitproc_handler(u32 pid);
+// The process exit handler for the BTS
+
 s32 bts_check(void);
 // Check if the BTS is available
 
+s32 pebs_check(void);
+// Check if the PEBS is available
+
 s32 bts_init(void);
 // Initialize the BTS
 
@@ -0,0 +1,603 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/cpu_trace.c
+//  Description    : This is the implementation of the CPU scope tracing for
+//                   the libiht library. The LBR and BTS are left running on
+//                   the selected cpus, each cpu owns its BTS buffer and a ring
+//                   of context switch sideband records, which tag the trace
+//                   with the thread running at any given time. An optional
+//                   cgroup filter only keeps the trace running while a task
+//                   of the selected cgroups is on the cpu.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "cpu_trace.h"
+#include "sample.h"
+
+//
+// Global Variables
+
+u32 cpu_trace_enabled;
+// Whether the CPU scope tracing is running.
+
+char cpu_trace_mutex[MAX_MUTEX_LEN];
+// The mutex serializing the CPU scope ioctls and exit, so a dump never
+// drains per cpu states freed by a concurrent disable.
+
+struct cpu_config cpu_trace_config;
+// The configuration of the running CPU scope tracing.
+
+struct cpu_state *cpu_states;
+// The per cpu states, indexed by cpu core id.
+
+u32 cpu_state_count;
+// The number of entries in `cpu_states`.
+
+//
+// Low level per cpu registers access
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_cpu_trace
+// Description  : Start the selected features on the current cpu. Called on
+//                each cpu with interrupts disabled.
+//
+// Inputs       : void
+// Outputs      : void
+
+void start_cpu_trace(void)
+{
+    u32 i, cpu;
+    struct cpu_state *state;
+
+    cpu = xcoreid();
+    if (cpu >= cpu_state_count || !cpu_states[cpu].active)
+        return;
+    state = &cpu_states[cpu];
+
+    if (cpu_trace_config.features & LIBIHT_CPU_LBR)
+    {
+        // Start from a clean LBR stack
+        xwrmsr(MSR_LBR_SELECT, cpu_trace_config.lbr_select);
+        xwrmsr(MSR_LBR_TOS, 0);
+        for (i = 0; i < lbr_capacity; i++)
+        {
+            xwrmsr(MSR_LBR_NHM_FROM + i, 0);
+            xwrmsr(MSR_LBR_NHM_TO + i, 0);
+        }
+    }
+
+    if (cpu_trace_config.features & LIBIHT_CPU_BTS)
+        xwrmsr(MSR_IA32_DS_AREA, (u64)state->ds_area);
+
+    // With a cgroup filter, the switch handler turns the trace on
+    state->tracing = FALSE;
+    if (cpu_trace_config.cgroup_count == 0)
+        set_cpu_trace_bits(state, TRUE);
+
+    xprintdbg("LIBIHT-COM: CPU trace started on cpu core: %d\n", cpu);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stop_cpu_trace
+// Description  : Stop the selected features on the current cpu. Called on
+//                each cpu with interrupts disabled.
+//
+// Inputs       : void
+// Outputs      : void
+
+void stop_cpu_trace(void)
+{
+    u32 cpu;
+
+    cpu = xcoreid();
+    if (cpu >= cpu_state_count || !cpu_states[cpu].active)
+        return;
+
+    set_cpu_trace_bits(&cpu_states[cpu], FALSE);
+
+    if (cpu_trace_config.features & LIBIHT_CPU_LBR)
+        xwrmsr(MSR_LBR_SELECT, 0);
+    if (cpu_trace_config.features & LIBIHT_CPU_BTS)
+        xwrmsr(MSR_IA32_DS_AREA, 0);
+
+    xprintdbg("LIBIHT-COM: CPU trace stopped on cpu core: %d\n", cpu);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cpu_trace_bits
+// Description  : Turn the trace bits of the selected features on or off for
+//                the current cpu. The LBR stack and the BTS buffer are kept.
+//
+// Inputs       : state - the cpu state of the current cpu
+//                on - TRUE to start tracing, FALSE to stop
+// Outputs      : void
+
+void set_cpu_trace_bits(struct cpu_state *state, u32 on)
+{
+    u64 dbgctlmsr, bits = 0;
+
+    if (cpu_trace_config.features & LIBIHT_CPU_LBR)
+        bits |= DEBUGCTLMSR_LBR;
+    if (cpu_trace_config.features & LIBIHT_CPU_BTS)
+        bits |= cpu_trace_config.bts_config;
+
+    xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
+    if (on)
+        dbgctlmsr |= bits;
+    else
+        dbgctlmsr &= ~bits;
+    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
+
+    state->tracing = on;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : snapshot_cpu_lbr
+// Description  : Freeze the LBR of the current cpu, read out the stack and
+//                resume it. The snapshot is tagged with the interrupted
+//                thread.
+//
+// Inputs       : info - the kernel LBR data to fill
+// Outputs      : void
+
+void snapshot_cpu_lbr(void *info)
+{
+    u32 i;
+    u64 dbgctlmsr;
+    struct lbr_data *data = info;
+
+    xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
+    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr & ~DEBUGCTLMSR_LBR);
+
+    xrdmsr(MSR_LBR_TOS, &data->lbr_tos);
+    for (i = 0; i < lbr_capacity; i++)
+    {
+        xrdmsr(MSR_LBR_NHM_FROM + i, &data->entries[i].from);
+        xrdmsr(MSR_LBR_NHM_TO + i, &data->entries[i].to);
+    }
+    data->tid = xgetcurrent_pid();
+
+    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
+}
+
+//
+// CPU scope request handlers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_cpu_trace
+// Description  : Enable the CPU scope tracing on the cpus of the request mask.
+//                Per task tracing must not be running at the same time since
+//                both drive the same registers.
+//
+// Inputs       : request - the cpu ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 enable_cpu_trace(struct cpu_ioctl_request *request)
+{
+    u32 i;
+    struct cpu_state *state;
+
+    if (cpu_trace_enabled)
+    {
+        xprintdbg("LIBIHT-COM: CPU trace already enabled\n");
+        return -1;
+    }
+
+    if (xlist_next(lbr_state_head) != lbr_state_head ||
+        xlist_next(bts_state_head) != bts_state_head)
+    {
+        xprintdbg("LIBIHT-COM: CPU trace conflicts with per task trace\n");
+        return -1;
+    }
+
+    if (sample_enabled)
+    {
+        xprintdbg("LIBIHT-COM: CPU trace conflicts with LBR sampling\n");
+        return -1;
+    }
+
+    if (request->cpu_config.cgroup_count > LIBIHT_CGROUP_MAX)
+    {
+        xprintdbg("LIBIHT-COM: Too many cgroups in CPU trace filter\n");
+        return -1;
+    }
+
+    // Setup config with defaults
+    cpu_trace_config = request->cpu_config;
+    if (cpu_trace_config.features == 0)
+        cpu_trace_config.features = LIBIHT_CPU_LBR;
+    if (cpu_trace_config.lbr_select == 0)
+        cpu_trace_config.lbr_select = LBR_SELECT;
+    if (cpu_trace_config.bts_config == 0)
+        cpu_trace_config.bts_config = DEFAULT_BTS_CONFIG;
+    if (cpu_trace_config.bts_buffer_size == 0)
+        cpu_trace_config.bts_buffer_size = DEFAULT_BTS_BUFFER_SIZE;
+
+    cpu_state_count = xcpu_count();
+    cpu_states = xmalloc(cpu_state_count * sizeof(struct cpu_state));
+    if (cpu_states == NULL)
+    {
+        cpu_state_count = 0;
+        return -1;
+    }
+    xmemset(cpu_states, 0, cpu_state_count * sizeof(struct cpu_state));
+
+    // Allocate per cpu buffers for the selected cpus
+    for (i = 0; i < cpu_state_count; i++)
+    {
+        state = &cpu_states[i];
+        state->cpu = i;
+        if (!cpu_in_mask(i))
+            continue;
+
+        state->active = TRUE;
+        state->sideband = create_ring(sizeof(struct cpu_sideband_record),
+                                        CPU_SIDEBAND_RING_SIZE);
+        if (state->sideband == NULL)
+            goto fail;
+
+        if (!(cpu_trace_config.features & LIBIHT_CPU_BTS))
+            continue;
+
+        state->ds_area = xmalloc(sizeof(struct ds_area));
+        if (state->ds_area == NULL)
+            goto fail;
+        xmemset(state->ds_area, 0, sizeof(struct ds_area));
+
+        state->ds_area->bts_buffer_base =
+                (u64)xmalloc(cpu_trace_config.bts_buffer_size);
+        if (state->ds_area->bts_buffer_base == 0)
+            goto fail;
+        xmemset((void *)state->ds_area->bts_buffer_base, 0,
+                cpu_trace_config.bts_buffer_size);
+        state->ds_area->bts_index = state->ds_area->bts_buffer_base;
+        state->ds_area->bts_absolute_maximum =
+                state->ds_area->bts_buffer_base +
+                cpu_trace_config.bts_buffer_size + 1;
+    }
+
+    cpu_trace_enabled = TRUE;
+    xon_each_cpu(start_cpu_trace);
+    return 0;
+
+fail:
+    xprintdbg("LIBIHT-COM: Allocate CPU trace buffers failed\n");
+    free_cpu_states();
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disable_cpu_trace
+// Description  : Disable the CPU scope tracing and release per cpu buffers.
+//                The stop dispatch waits for every cpu, so no context switch
+//                handler still uses the states when they are freed.
+//
+// Inputs       : request - the cpu ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 disable_cpu_trace(struct cpu_ioctl_request *request)
+{
+    if (!cpu_trace_enabled)
+    {
+        xprintdbg("LIBIHT-COM: CPU trace not enabled\n");
+        return -1;
+    }
+
+    cpu_trace_enabled = FALSE;
+    xon_each_cpu(stop_cpu_trace);
+    free_cpu_states();
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_cpu_trace
+// Description  : Dump the LBR stack, the BTS buffer and the pending sideband
+//                records of one cpu to the userspace buffers provided.
+//
+// Inputs       : request - the cpu ioctl request
+// Outputs      : s32 - number of sideband records copied, -1 on failure
+
+s32 dump_cpu_trace(struct cpu_ioctl_request *request)
+{
+    u64 bytes_left;
+    struct cpu_state *state;
+    struct lbr_data *data;
+    struct lbr_data lbr_buf;
+
+    if (!cpu_trace_enabled || request->cpu >= cpu_state_count ||
+        !cpu_states[request->cpu].active)
+    {
+        xprintdbg("LIBIHT-COM: CPU %d not traced\n", request->cpu);
+        return -1;
+    }
+    state = &cpu_states[request->cpu];
+
+    // Snapshot the LBR stack on the traced cpu
+    if ((cpu_trace_config.features & LIBIHT_CPU_LBR) && request->lbr_buffer)
+    {
+        bytes_left = xcopy_from_user(&lbr_buf, request->lbr_buffer,
+                                        sizeof(struct lbr_data));
+        if (bytes_left)
+        {
+            xprintdbg("LIBIHT-COM: Copy LBR data from user failed\n");
+            return -1;
+        }
+        if (lbr_buf.entry_count)
+        {
+            if (lbr_buf.entry_count < lbr_capacity)
+                return -1;
+            lbr_buf.entry_count = lbr_capacity;
+        }
+
+        data = xmalloc(sizeof(struct lbr_data) +
+                        lbr_capacity * sizeof(struct lbr_stack_entry));
+        if (data == NULL)
+            return -1;
+        data->entries = (struct lbr_stack_entry *)(data + 1);
+        xon_cpu(request->cpu, snapshot_cpu_lbr, data);
+
+        lbr_buf.lbr_tos = data->lbr_tos;
+        lbr_buf.tid = data->tid;
+        bytes_left = 0;
+        if (lbr_buf.entries)
+            bytes_left = xcopy_to_user(lbr_buf.entries, data->entries,
+                                lbr_capacity * sizeof(struct lbr_stack_entry));
+        xfree(data);
+        if (bytes_left || xcopy_to_user(request->lbr_buffer, &lbr_buf,
+                                        sizeof(struct lbr_data)))
+        {
+            xprintdbg("LIBIHT-COM: Copy LBR data to user failed\n");
+            return -1;
+        }
+    }
+
+    // Copy the BTS buffer of the cpu, records are attributed by sideband
+    if ((cpu_trace_config.features & LIBIHT_CPU_BTS) && request->bts_buffer)
+    {
+        if (copy_bts_to_user(state->ds_area, cpu_trace_config.bts_buffer_size,
+                                0, request->bts_buffer))
+            return -1;
+    }
+
+    // Drain the context switch sideband records
+    return ring_drain_to_user(state->sideband, request->sideband,
+                                request->sideband_count);
+}
+
+//
+// Internal helpers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cpu_in_mask
+// Description  : Check if a cpu is selected by the configured cpu mask. An all
+//                zero mask selects every cpu.
+//
+// Inputs       : cpu - the cpu core id
+// Outputs      : u32 - TRUE if selected, FALSE otherwise
+
+u32 cpu_in_mask(u32 cpu)
+{
+    u32 i;
+
+    for (i = 0; i < LIBIHT_CPU_MASK_WORDS; i++)
+    {
+        if (cpu_trace_config.cpu_mask[i])
+            break;
+    }
+    if (i == LIBIHT_CPU_MASK_WORDS)
+        return TRUE;
+
+    if (cpu >= LIBIHT_CPU_MASK_WORDS * 64)
+        return FALSE;
+
+    return (cpu_trace_config.cpu_mask[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cgroup_in_filter
+// Description  : Check if a cgroup is one of the cgroups of the filter.
+//
+// Inputs       : cgroup_id - the cgroup v2 id
+// Outputs      : u32 - TRUE if selected, FALSE otherwise
+
+u32 cgroup_in_filter(u64 cgroup_id)
+{
+    u32 i;
+
+    for (i = 0; i < cpu_trace_config.cgroup_count; i++)
+    {
+        if (cpu_trace_config.cgroup_ids[i] == cgroup_id)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_cpu_states
+// Description  : Free all per cpu states and their buffers.
+//
+// Inputs       : void
+// Outputs      : void
+
+void free_cpu_states(void)
+{
+    u32 i;
+    struct cpu_state *state;
+
+    if (cpu_states == NULL)
+        return;
+
+    for (i = 0; i < cpu_state_count; i++)
+    {
+        state = &cpu_states[i];
+        free_ring(state->sideband);
+        if (state->ds_area)
+        {
+            if (state->ds_area->bts_buffer_base)
+                xfree((void *)state->ds_area->bts_buffer_base);
+            xfree(state->ds_area);
+        }
+    }
+
+    xfree(cpu_states);
+    cpu_states = NULL;
+    cpu_state_count = 0;
+}
+
+//
+// Cross platform handlers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cpu_trace_ioctl_handler
+// Description  : The ioctl handler for the CPU scope tracing. Requests are
+//                serialized by the `cpu_trace_mutex`.
+//
+// Inputs       : request - the cpu ioctl request
+// Outputs      : s32 - 0 (or record count) on success, -1 on failure
+
+s32 cpu_trace_ioctl_handler(struct xioctl_request *request)
+{
+    s32 ret = 0;
+
+    xprintdbg("LIBIHT-COM: CPU ioctl command %d.\n", request->cmd);
+    xacquire_mutex(cpu_trace_mutex);
+    switch (request->cmd)
+    {
+        case LIBIHT_IOCTL_ENABLE_CPU:
+            xprintdbg("LIBIHT-COM: Enable CPU trace\n");
+            ret = enable_cpu_trace(&request->body.cpu);
+            break;
+        case LIBIHT_IOCTL_DISABLE_CPU:
+            xprintdbg("LIBIHT-COM: Disable CPU trace\n");
+            ret = disable_cpu_trace(&request->body.cpu);
+            break;
+        case LIBIHT_IOCTL_DUMP_CPU:
+            xprintdbg("LIBIHT-COM: Dump CPU trace for cpu %d\n",
+                        request->body.cpu.cpu);
+            ret = dump_cpu_trace(&request->body.cpu);
+            break;
+        default:
+            xprintdbg("LIBIHT-COM: Invalid CPU ioctl command\n");
+            ret = -1;
+            break;
+    }
+    xrelease_mutex(cpu_trace_mutex);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cpu_trace_cswitch_handler
+// Description  : The context switch handler for the CPU scope tracing. The
+//                trace keeps running, only a sideband record is emitted. With
+//                a cgroup filter, the trace runs only while the next thread
+//                belongs to a selected cgroup, so tasks moving in or out of
+//                the cgroups are picked up at their next switch.
+//
+// Inputs       : prev_pid - the previous thread id
+//                prev_tgid - the previous process id
+//                next_pid - the next thread id
+//                next_tgid - the next process id
+//                next_cgroup - the cgroup v2 id of the next thread
+// Outputs      : void
+
+void cpu_trace_cswitch_handler(u32 prev_pid, u32 prev_tgid,
+                                u32 next_pid, u32 next_tgid, u64 next_cgroup)
+{
+    u32 cpu, match;
+    struct cpu_state *state;
+    struct cpu_sideband_record record;
+
+    if (!cpu_trace_enabled)
+        return;
+
+    cpu = xcoreid();
+    if (cpu >= cpu_state_count || !cpu_states[cpu].active)
+        return;
+    state = &cpu_states[cpu];
+
+    if (cpu_trace_config.cgroup_count)
+    {
+        // Switches between untraced threads are not recorded
+        match = cgroup_in_filter(next_cgroup);
+        if (!match && !state->tracing)
+            return;
+        if (match != state->tracing)
+            set_cpu_trace_bits(state, match);
+    }
+
+    record.timestamp = xget_timestamp();
+    record.cpu = cpu;
+    record.prev_pid = prev_pid;
+    record.prev_tgid = prev_tgid;
+    record.next_pid = next_pid;
+    record.next_tgid = next_tgid;
+    record.reserved = 0;
+    record.bts_offset = 0;
+    if (state->ds_area)
+        record.bts_offset = (state->ds_area->bts_index -
+                                state->ds_area->bts_buffer_base) /
+                                sizeof(struct bts_record);
+    record.next_cgroup = next_cgroup;
+
+    ring_push(state->sideband, &record);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cpu_trace_init
+// Description  : Initialize the CPU scope tracing.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 cpu_trace_init(void)
+{
+    xprintdbg("LIBIHT-COM: Init CPU trace related structs.\n");
+    xinit_mutex(cpu_trace_mutex);
+    cpu_trace_enabled = FALSE;
+    cpu_states = NULL;
+    cpu_state_count = 0;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cpu_trace_exit
+// Description  : Stop the CPU scope tracing if running and free its states.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 cpu_trace_exit(void)
+{
+    xacquire_mutex(cpu_trace_mutex);
+    if (cpu_trace_enabled)
+    {
+        xprintdbg("LIBIHT-COM: Stopping CPU trace on all cpus...\n");
+        cpu_trace_enabled = FALSE;
+        xon_each_cpu(stop_cpu_trace);
+    }
+    free_cpu_states();
+    xrelease_mutex(cpu_trace_mutex);
+
+    return 0;
+}
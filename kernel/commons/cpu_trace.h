@@ -0,0 +1,109 @@
+#ifndef _COMMONS_CPU_TRACE_H
+#define _COMMONS_CPU_TRACE_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/cpu_trace.h
+//  Description    : This is the header file for the CPU scope tracing module.
+//                   In CPU scope the LBR and BTS run continuously on each
+//                   selected cpu with per cpu buffers, and context switches
+//                   only emit sideband records instead of saving and
+//                   restoring per task state. The trace can be limited to
+//                   the tasks of a set of cgroups.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "types.h"
+#include "xplat.h"
+#include "xioctl.h"
+#include "ring.h"
+#include "lbr.h"
+#include "bts.h"
+
+// cpp cross compile handler
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+//
+// Library constants
+
+// Number of context switch sideband records kept per cpu
+#define CPU_SIDEBAND_RING_SIZE  0x1000
+
+//
+// Type definitions
+
+// Define per cpu trace state
+struct cpu_state
+{
+    u32 cpu;                            // CPU core id
+    u32 active;                         // Whether the cpu is traced
+    u32 tracing;                        // Whether the trace bits are set
+    struct ds_area *ds_area;            // Per cpu debug store area
+    struct ring_buffer *sideband;       // Context switch sideband records
+};
+
+//
+// Global Variables
+
+extern u32 cpu_trace_enabled;
+// Whether the CPU scope tracing is running.
+
+extern char cpu_trace_mutex[MAX_MUTEX_LEN];
+// The mutex serializing the CPU scope ioctls and exit.
+
+//
+// Function Prototypes
+
+void start_cpu_trace(void);
+// Start the CPU scope tracing on the current cpu.
+
+void stop_cpu_trace(void);
+// Stop the CPU scope tracing on the current cpu.
+
+void set_cpu_trace_bits(struct cpu_state *state, u32 on);
+// Turn the trace bits of the current cpu on or off.
+
+void snapshot_cpu_lbr(void *info);
+// Read the LBR stack of the current cpu into a kernel LBR data.
+
+s32 enable_cpu_trace(struct cpu_ioctl_request *request);
+// Enable the CPU scope tracing
+
+s32 disable_cpu_trace(struct cpu_ioctl_request *request);
+// Disable the CPU scope tracing
+
+s32 dump_cpu_trace(struct cpu_ioctl_request *request);
+// Dump the LBR, BTS and sideband records of one cpu
+
+u32 cpu_in_mask(u32 cpu);
+// Check if a cpu is selected by the cpu mask
+
+u32 cgroup_in_filter(u64 cgroup_id);
+// Check if a cgroup is selected by the cgroup filter
+
+void free_cpu_states(void);
+// Free all per cpu states
+
+s32 cpu_trace_ioctl_handler(struct xioctl_request *request);
+// Handle the CPU scope ioctl request
+
+void cpu_trace_cswitch_handler(u32 prev_pid, u32 prev_tgid,
+                                u32 next_pid, u32 next_tgid, u64 next_cgroup);
+// Record a context switch sideband record
+
+s32 cpu_trace_init(void);
+// Initialize the CPU scope tracing
+
+s32 cpu_trace_exit(void);
+// Exit the CPU scope tracing
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _COMMONS_CPU_TRACE_H
@@ -0,0 +1,275 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/crash.c
+//  Description    : This is the implementation of the crash capture for the
+//                   libiht library. The platform hooks report fatal signals
+//                   and abnormal exits of the current thread; if the thread is
+//                   traced, its last branches are kept in a global ring until
+//                   they are dumped, even after the process is gone.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "crash.h"
+
+//
+// Global Variables
+
+char crash_lock[MAX_LOCK_LEN];
+// The lock for crash_scratch and crash_last_tgid.
+
+struct crash_record crash_scratch;
+// The crash record being built, too large for the stack of the hooks.
+
+u32 crash_last_tgid;
+// The process of the last crash record.
+
+struct ring_buffer *crash_ring;
+// The crash records of all traced threads.
+
+//
+// Crash capture
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : capture_crash
+// Description  : Build the crash record of the current thread and append it
+//                to the crash ring. The LBR stack is taken from the cpu if it
+//                is loaded there, otherwise from the last saved stack.
+//
+// Inputs       : state - the LBR state of the current thread
+//                pid - the thread id
+//                tgid - the process id
+//                signal - the fatal signal or exit status
+//                code - the signal code, 0 if unknown
+//                addr - the faulting address, 0 if unknown
+// Outputs      : void
+
+void capture_crash(struct lbr_state *state, u32 pid, u32 tgid, u32 signal,
+                    u32 code, u64 addr)
+{
+    struct crash_record *record = &crash_scratch;
+    struct bts_state *bts;
+    char irql_flag[MAX_IRQL_LEN];
+    u32 cnt;
+
+    if (crash_ring == NULL)
+        return;
+
+    if (state->loaded && state->cpu == xcoreid())
+        snapshot_lbr(NULL);
+    bts = find_bts_state(pid);
+
+    cnt = lbr_capacity < LIBIHT_LBR_MAX_ENTRIES ?
+            (u32)lbr_capacity : LIBIHT_LBR_MAX_ENTRIES;
+
+    xacquire_lock(crash_lock, irql_flag);
+    crash_last_tgid = tgid;
+
+    xmemset(record, 0, sizeof(struct crash_record));
+    record->timestamp = xget_timestamp();
+    record->pid = pid;
+    record->tgid = tgid;
+    record->signal = signal;
+    record->code = code;
+    record->addr = addr;
+    record->cpu = xcoreid();
+    record->lbr_tos = state->data->lbr_tos;
+    xmemcpy(record->entries, state->data->entries,
+            cnt * sizeof(struct lbr_stack_entry));
+    record->bts_count = copy_bts_tail(bts, record->bts);
+
+    ring_push(crash_ring, record);
+    xrelease_lock(crash_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : copy_bts_tail
+// Description  : Copy the newest records of the BTS buffer of a thread, oldest
+//                first. The buffer is circular, it has wrapped once its last
+//                record was written.
+//
+// Inputs       : state - the BTS state of the thread, may be NULL
+//                tail - the LIBIHT_CRASH_BTS_RECORDS records to fill
+// Outputs      : u32 - number of records copied
+
+u32 copy_bts_tail(struct bts_state *state, struct bts_record *tail)
+{
+    struct bts_record *base;
+    u64 total, index, cnt, i;
+
+    if (state == NULL || state->ds_area == NULL ||
+        state->ds_area->bts_buffer_base == 0)
+        return 0;
+
+    base = (struct bts_record *)state->ds_area->bts_buffer_base;
+    total = state->config.bts_buffer_size / sizeof(struct bts_record);
+    index = (state->ds_area->bts_index - state->ds_area->bts_buffer_base) /
+                sizeof(struct bts_record);
+    if (total == 0 || index > total)
+        return 0;
+
+    cnt = base[total - 1].from ? total : index;
+    if (cnt > LIBIHT_CRASH_BTS_RECORDS)
+        cnt = LIBIHT_CRASH_BTS_RECORDS;
+
+    for (i = 0; i < cnt; i++)
+        tail[i] = base[(index + total - cnt + i) % total];
+
+    return (u32)cnt;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_crash
+// Description  : Move the pending crash records to the buffer of the request.
+//
+// Inputs       : request - the crash ioctl request
+// Outputs      : s32 - number of records copied, -1 on failure
+
+s32 dump_crash(struct crash_ioctl_request *request)
+{
+    if (crash_ring == NULL)
+        return -1;
+
+    return ring_drain_to_user(crash_ring, request->records,
+                                request->record_count);
+}
+
+//
+// Cross platform handlers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crash_ioctl_handler
+// Description  : The ioctl handler for the crash capture.
+//
+// Inputs       : request - the crash ioctl request
+// Outputs      : s32 - record count on success, -1 on failure
+
+s32 crash_ioctl_handler(struct xioctl_request *request)
+{
+    s32 ret = 0;
+
+    xprintdbg("LIBIHT-COM: Crash capture ioctl command %d.\n", request->cmd);
+    switch (request->cmd)
+    {
+        case LIBIHT_IOCTL_DUMP_CRASH:
+            ret = dump_crash(&request->body.crash);
+            break;
+        default:
+            xprintdbg("LIBIHT-COM: Invalid crash capture ioctl command\n");
+            ret = -1;
+            break;
+    }
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crash_signal_handler
+// Description  : The fatal signal handler for the crash capture. Must be
+//                called by the thread taking the signal, before its default
+//                action runs.
+//
+// Inputs       : pid - the thread id
+//                tgid - the process id
+//                signal - the fatal signal
+//                code - the signal code
+//                addr - the faulting address, 0 if unknown
+// Outputs      : void
+
+void crash_signal_handler(u32 pid, u32 tgid, u32 signal, u32 code, u64 addr)
+{
+    struct lbr_state *state;
+
+    state = find_lbr_state(pid);
+    if (state == NULL)
+        return;
+
+    xprintdbg("LIBIHT-COM: Crash capture for pid %d, signal %d\n", pid, signal);
+    capture_crash(state, pid, tgid, signal, code, addr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crash_exitproc_handler
+// Description  : The process exit handler for the crash capture. Must be
+//                called by the exiting thread, before the LBR handler removes
+//                its state. Threads of a process that already has a crash
+//                record are killed along with the crashed one, so they are not
+//                recorded again.
+//
+// Inputs       : pid - the thread id
+//                tgid - the process id
+//                status - the fatal signal or error status, 0 on normal exit
+// Outputs      : void
+
+void crash_exitproc_handler(u32 pid, u32 tgid, u32 status)
+{
+    struct lbr_state *state;
+    char irql_flag[MAX_IRQL_LEN];
+    u32 recorded;
+
+    if (status == 0)
+        return;
+
+    state = find_lbr_state(pid);
+    if (state == NULL)
+        return;
+
+    xacquire_lock(crash_lock, irql_flag);
+    recorded = crash_last_tgid == tgid;
+    xrelease_lock(crash_lock, irql_flag);
+    if (recorded)
+        return;
+
+    xprintdbg("LIBIHT-COM: Crash capture for pid %d, exit status %x\n",
+                pid, status);
+    capture_crash(state, pid, tgid, status, 0, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crash_init
+// Description  : Initialize the crash capture and the crash record ring.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 crash_init(void)
+{
+    xprintdbg("LIBIHT-COM: Init crash capture related structs.\n");
+    xinit_lock(crash_lock);
+    crash_last_tgid = 0;
+
+    crash_ring = create_ring(sizeof(struct crash_record), CRASH_RING_SIZE);
+    if (crash_ring == NULL)
+    {
+        xprintdbg("LIBIHT-COM: Create crash ring failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crash_exit
+// Description  : Free the crash record ring.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 crash_exit(void)
+{
+    xprintdbg("LIBIHT-COM: Freeing crash ring...\n");
+    free_ring(crash_ring);
+    crash_ring = NULL;
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef _COMMONS_CRASH_H
+#define _COMMONS_CRASH_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/crash.h
+//  Description    : This is the header file for the crash capture module. When
+//                   a traced thread takes a fatal signal or exits abnormally,
+//                   its LBR stack and the tail of its BTS buffer are copied to
+//                   a global ring that outlives the process.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "types.h"
+#include "xplat.h"
+#include "xioctl.h"
+#include "ring.h"
+#include "lbr.h"
+#include "bts.h"
+
+// cpp cross compile handler
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+//
+// Library constants
+
+// Number of crash records kept for all threads
+#define CRASH_RING_SIZE         0x20
+
+//
+// Global Variables
+
+extern char crash_lock[MAX_LOCK_LEN];
+// The lock for crash_scratch and crash_last_tgid.
+
+//
+// Function Prototypes
+
+void capture_crash(struct lbr_state *state, u32 pid, u32 tgid, u32 signal,
+                    u32 code, u64 addr);
+// Append the last branches of the current thread to the crash ring
+
+u32 copy_bts_tail(struct bts_state *state, struct bts_record *tail);
+// Copy the newest BTS records of a thread, oldest first
+
+s32 dump_crash(struct crash_ioctl_request *request);
+// Move the pending crash records to userspace
+
+s32 crash_ioctl_handler(struct xioctl_request *request);
+// Handle the crash capture ioctl request
+
+void crash_signal_handler(u32 pid, u32 tgid, u32 signal, u32 code, u64 addr);
+// Handle a fatal signal taken by the current thread
+
+void crash_exitproc_handler(u32 pid, u32 tgid, u32 status);
+// Handle the exit of the current thread
+
+s32 crash_init(void);
+// Initialize the crash capture
+
+s32 crash_exit(void);
+// Exit the crash capture
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _COMMONS_CRASH_H
@@ -0,0 +1,589 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/exec_rule.c
+//  Description    : This is the implementation of the exec rules for the
+//                   libiht library. Rules are kept in a small fixed table
+//                   updated by ioctl, and checked each time a process is
+//                   executed. The exec hook may run in atomic context, so each
+//                   rule keeps the LBR/BTS states of its next match allocated
+//                   beforehand. A match attaches them before the new image
+//                   runs, and a kernel worker allocates the next ones.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "exec_rule.h"
+
+//
+// Global Variables
+
+char exec_rule_lock[MAX_LOCK_LEN];
+// The lock for exec_rule_table.
+
+struct exec_rule_entry exec_rule_table[MAX_EXEC_RULES];
+// The exec rule table, indexed by rule id.
+
+//
+// Rule table management
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_exec_rule
+// Description  : Add the exec rule of the request to the first free entry of
+//                the rule table.
+//
+// Inputs       : request - the rule ioctl request
+// Outputs      : s32 - the rule id on success, -1 on failure
+
+s32 add_exec_rule(struct rule_ioctl_request *request)
+{
+    s32 i, ret = -1;
+    struct lbr_state *lbr;
+    struct bts_state *bts;
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (request->rule.match != LIBIHT_RULE_COMM &&
+        request->rule.match != LIBIHT_RULE_PATH)
+    {
+        xprintdbg("LIBIHT-COM: Invalid exec rule match %d\n",
+                    request->rule.match);
+        return -1;
+    }
+
+    if (request->rule.features == 0 || request->rule.pattern[0] == '\0')
+    {
+        xprintdbg("LIBIHT-COM: Empty exec rule\n");
+        return -1;
+    }
+
+    // Patterns from userspace may not be terminated
+    request->rule.pattern[LIBIHT_RULE_PATTERN_LEN - 1] = '\0';
+
+    // The states of the first match are allocated before the rule is seen
+    alloc_exec_rule_spares(&request->rule, &lbr, &bts);
+    if (((request->rule.features & LIBIHT_RULE_LBR) && lbr == NULL) ||
+        ((request->rule.features & LIBIHT_RULE_BTS) && bts == NULL))
+    {
+        xprintdbg("LIBIHT-COM: Allocate exec rule states failed\n");
+        free_exec_rule_spares(lbr, bts);
+        return -1;
+    }
+
+    xacquire_lock(exec_rule_lock, irql_flag);
+
+    for (i = 0; i < MAX_EXEC_RULES; i++)
+    {
+        if (!exec_rule_table[i].used)
+        {
+            exec_rule_table[i].rule = request->rule;
+            exec_rule_table[i].used = TRUE;
+            exec_rule_table[i].lbr_spare = lbr;
+            exec_rule_table[i].bts_spare = bts;
+            lbr = NULL;
+            bts = NULL;
+            ret = i;
+            break;
+        }
+    }
+
+    xrelease_lock(exec_rule_lock, irql_flag);
+
+    free_exec_rule_spares(lbr, bts);
+    if (ret < 0)
+        xprintdbg("LIBIHT-COM: Exec rule table full\n");
+    else
+        xprintdbg("LIBIHT-COM: Exec rule %d added: %s\n", ret,
+                    request->rule.pattern);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : del_exec_rule
+// Description  : Delete the exec rule with the rule id of the request and
+//                free its unused states. Processes already attached keep
+//                their trace.
+//
+// Inputs       : request - the rule ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 del_exec_rule(struct rule_ioctl_request *request)
+{
+    s32 ret = -1;
+    struct exec_rule_entry *entry;
+    struct lbr_state *lbr = NULL;
+    struct bts_state *bts = NULL;
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (request->rule_id >= MAX_EXEC_RULES)
+        return -1;
+
+    entry = &exec_rule_table[request->rule_id];
+    xacquire_lock(exec_rule_lock, irql_flag);
+
+    if (entry->used)
+    {
+        entry->used = FALSE;
+        lbr = entry->lbr_spare;
+        bts = entry->bts_spare;
+        entry->lbr_spare = NULL;
+        entry->bts_spare = NULL;
+        ret = 0;
+    }
+
+    xrelease_lock(exec_rule_lock, irql_flag);
+
+    free_exec_rule_spares(lbr, bts);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clear_exec_rules
+// Description  : Delete all exec rules of the rule table.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success
+
+s32 clear_exec_rules(void)
+{
+    struct rule_ioctl_request request;
+
+    for (request.rule_id = 0; request.rule_id < MAX_EXEC_RULES;
+            request.rule_id++)
+        del_exec_rule(&request);
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : alloc_exec_rule_spares
+// Description  : Allocate the LBR/BTS states that the next match of an exec
+//                rule attaches, according to the features of the rule. A
+//                state that cannot be allocated is returned as NULL.
+//
+// Inputs       : rule - the exec rule
+//                lbr - the LBR state (output)
+//                bts - the BTS state and buffer (output)
+// Outputs      : void
+
+void alloc_exec_rule_spares(struct exec_rule *rule, struct lbr_state **lbr,
+                            struct bts_state **bts)
+{
+    *lbr = NULL;
+    *bts = NULL;
+
+    if (rule->features & LIBIHT_RULE_LBR)
+        *lbr = create_lbr_state();
+
+    if (rule->features & LIBIHT_RULE_BTS)
+    {
+        *bts = create_bts_state();
+        if (*bts == NULL)
+            return;
+
+        (*bts)->config.bts_buffer_size = rule->bts_buffer_size ?
+                        rule->bts_buffer_size : DEFAULT_BTS_BUFFER_SIZE;
+        if (setup_bts_buffer(*bts))
+        {
+            free_bts_state(*bts);
+            *bts = NULL;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_exec_rule_spares
+// Description  : Free the LBR/BTS states of an exec rule that were not
+//                attached.
+//
+// Inputs       : lbr - the LBR state (may be NULL)
+//                bts - the BTS state (may be NULL)
+// Outputs      : void
+
+void free_exec_rule_spares(struct lbr_state *lbr, struct bts_state *bts)
+{
+    if (lbr)
+    {
+        xfree(lbr->data->entries);
+        xfree(lbr->data);
+        xfree(lbr);
+    }
+
+    if (bts)
+        free_bts_state(bts);
+}
+
+//
+// Rule matching
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : glob_match
+// Description  : Match a string against a glob pattern, where '*' matches any
+//                sequence and '?' matches any single character.
+//
+// Inputs       : pattern - the glob pattern
+//                str - the string to be matched
+// Outputs      : u32 - TRUE if matched, FALSE otherwise
+
+u32 glob_match(const char *pattern, const char *str)
+{
+    const char *star = NULL, *retry = NULL;
+
+    while (*str)
+    {
+        if (*pattern == '*')
+        {
+            // Remember the star and first try to match it with nothing
+            star = pattern++;
+            retry = str;
+        }
+        else if (*pattern == '?' || *pattern == *str)
+        {
+            pattern++;
+            str++;
+        }
+        else if (star)
+        {
+            // Let the last star eat one more character
+            pattern = star + 1;
+            str = ++retry;
+        }
+        else
+        {
+            return FALSE;
+        }
+    }
+
+    while (*pattern == '*')
+        pattern++;
+
+    return *pattern == '\0';
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : path_basename
+// Description  : Get the last component of a path, both '/' and '\' are
+//                treated as separators.
+//
+// Inputs       : path - the path
+// Outputs      : const char* - the last component inside `path`
+
+const char *path_basename(const char *path)
+{
+    const char *base = path;
+
+    for (; *path; path++)
+    {
+        if (*path == '/' || *path == '\\')
+            base = path + 1;
+    }
+
+    return base;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_exec_rule
+// Description  : Find the first exec rule matching the command name or the
+//                executable path, and copy it out of the rule table.
+//
+// Inputs       : comm - the command name
+//                path - the executable path
+//                rule - the matched rule (output)
+// Outputs      : s32 - the rule id if found, -1 otherwise
+
+s32 find_exec_rule(const char *comm, const char *path, struct exec_rule *rule)
+{
+    s32 i, ret = -1;
+    const char *field;
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(exec_rule_lock, irql_flag);
+
+    for (i = 0; i < MAX_EXEC_RULES; i++)
+    {
+        if (!exec_rule_table[i].used)
+            continue;
+
+        field = exec_rule_table[i].rule.match == LIBIHT_RULE_PATH ?
+                    path : comm;
+        if (field && glob_match(exec_rule_table[i].rule.pattern, field))
+        {
+            *rule = exec_rule_table[i].rule;
+            ret = i;
+            break;
+        }
+    }
+
+    xrelease_lock(exec_rule_lock, irql_flag);
+
+    return ret;
+}
+
+//
+// Cross platform handlers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : exec_rule_ioctl_handler
+// Description  : The ioctl handler for the exec rules.
+//
+// Inputs       : request - the rule ioctl request
+// Outputs      : s32 - 0 (or rule id) on success, -1 on failure
+
+s32 exec_rule_ioctl_handler(struct xioctl_request *request)
+{
+    s32 ret = 0;
+
+    xprintdbg("LIBIHT-COM: Exec rule ioctl command %d.\n", request->cmd);
+    switch (request->cmd)
+    {
+        case LIBIHT_IOCTL_ADD_RULE:
+            ret = add_exec_rule(&request->body.rule);
+            break;
+        case LIBIHT_IOCTL_DEL_RULE:
+            xprintdbg("LIBIHT-COM: Delete exec rule %d\n",
+                        request->body.rule.rule_id);
+            ret = del_exec_rule(&request->body.rule);
+            break;
+        case LIBIHT_IOCTL_CLEAR_RULES:
+            xprintdbg("LIBIHT-COM: Clear exec rules\n");
+            ret = clear_exec_rules();
+            break;
+        default:
+            xprintdbg("LIBIHT-COM: Invalid exec rule ioctl command\n");
+            ret = -1;
+            break;
+    }
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : exec_rule_refill
+// Description  : Allocate the states of the next match of an exec rule after
+//                a match took them. Runs on a kernel worker. The states are
+//                dropped if the rule was deleted or refilled meanwhile.
+//
+// Inputs       : info - the exec rule work
+// Outputs      : void
+
+void exec_rule_refill(void *info)
+{
+    struct exec_rule_work *work = (struct exec_rule_work *)info;
+    struct exec_rule_entry *entry = &exec_rule_table[work->rule_id];
+    struct lbr_state *lbr;
+    struct bts_state *bts;
+    char irql_flag[MAX_IRQL_LEN];
+
+    alloc_exec_rule_spares(&work->rule, &lbr, &bts);
+
+    xacquire_lock(exec_rule_lock, irql_flag);
+    if (entry->used && entry->lbr_spare == NULL)
+    {
+        entry->lbr_spare = lbr;
+        lbr = NULL;
+    }
+    if (entry->used && entry->bts_spare == NULL)
+    {
+        entry->bts_spare = bts;
+        bts = NULL;
+    }
+    xrelease_lock(exec_rule_lock, irql_flag);
+
+    free_exec_rule_spares(lbr, bts);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : exec_rule_attach
+// Description  : Enable the features of a matched exec rule for the executed
+//                process, when the rule had no spare states left because of
+//                back to back matches. Runs on a kernel worker, since enabling
+//                a trace allocates, so the first instructions of the process
+//                may be missed.
+//
+// Inputs       : info - the exec rule work
+// Outputs      : void
+
+void exec_rule_attach(void *info)
+{
+    struct exec_rule_work *work = (struct exec_rule_work *)info;
+    struct lbr_ioctl_request lbr_request;
+    struct bts_ioctl_request bts_request;
+    struct lbr_state *lbr;
+    struct bts_state *bts;
+
+    if ((work->rule.features & LIBIHT_RULE_LBR) &&
+        find_lbr_state(work->pid) == NULL)
+    {
+        xmemset(&lbr_request, 0, sizeof(lbr_request));
+        lbr_request.lbr_config.pid = work->pid;
+        lbr_request.lbr_config.scope = work->rule.scope;
+        lbr_request.lbr_config.lbr_select = work->rule.lbr_select;
+        if (enable_lbr(&lbr_request))
+            xprintdbg("LIBIHT-COM: Exec rule %d enable LBR failed\n",
+                        work->rule_id);
+        else if (work->rule.scope != LIBIHT_SCOPE_PROCESS &&
+                    (lbr = find_lbr_state(work->pid)) != NULL)
+            own_lbr_state(lbr, LBR_OWNER_EXEC_RULE, work->rule_id);
+    }
+
+    if ((work->rule.features & LIBIHT_RULE_BTS) &&
+        find_bts_state(work->pid) == NULL)
+    {
+        xmemset(&bts_request, 0, sizeof(bts_request));
+        bts_request.bts_config.pid = work->pid;
+        bts_request.bts_config.scope = work->rule.scope;
+        bts_request.bts_config.bts_config = work->rule.bts_config;
+        bts_request.bts_config.bts_buffer_size = work->rule.bts_buffer_size;
+        if (enable_bts(&bts_request))
+            xprintdbg("LIBIHT-COM: Exec rule %d enable BTS failed\n",
+                        work->rule_id);
+        else if (work->rule.scope != LIBIHT_SCOPE_PROCESS &&
+                    (bts = find_bts_state(work->pid)) != NULL)
+            own_bts_state(bts, BTS_OWNER_EXEC_RULE, work->rule_id);
+    }
+
+    exec_rule_refill(info);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : exec_rule_exec_handler
+// Description  : The exec handler for the exec rules, which may be called in
+//                atomic context. Attach the spare states of the first matching
+//                rule to the executed process, which is single threaded after
+//                exec, before it returns to user space. Then queue the
+//                allocation of the next spares, or the whole attach if the
+//                spares were already taken.
+//
+// Inputs       : pid - the pid of the executed process
+//                comm - the command name (NULL to use the path basename)
+//                path - the executable path
+// Outputs      : void
+
+void exec_rule_exec_handler(u32 pid, const char *comm, const char *path)
+{
+    s32 ret = 0;
+    struct exec_rule_work work;
+    struct exec_rule_entry *entry;
+    struct lbr_ioctl_request lbr_request;
+    struct bts_ioctl_request bts_request;
+    struct lbr_state *lbr = NULL;
+    struct bts_state *bts = NULL;
+    u32 missing = FALSE;
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (path == NULL)
+        return;
+    if (comm == NULL)
+        comm = path_basename(path);
+
+    work.rule_id = find_exec_rule(comm, path, &work.rule);
+    if (work.rule_id < 0)
+        return;
+    work.pid = pid;
+
+    xprintdbg("LIBIHT-COM: Exec rule %d matched pid %d (%s)\n",
+                work.rule_id, pid, path);
+
+    // Take the spares under the lock, a deleted rule has none
+    entry = &exec_rule_table[work.rule_id];
+    xacquire_lock(exec_rule_lock, irql_flag);
+    if (entry->used)
+    {
+        lbr = entry->lbr_spare;
+        bts = entry->bts_spare;
+        entry->lbr_spare = NULL;
+        entry->bts_spare = NULL;
+    }
+    xrelease_lock(exec_rule_lock, irql_flag);
+
+    if (work.rule.features & LIBIHT_RULE_LBR)
+    {
+        xmemset(&lbr_request, 0, sizeof(lbr_request));
+        lbr_request.lbr_config.pid = pid;
+        lbr_request.lbr_config.scope = work.rule.scope;
+        lbr_request.lbr_config.lbr_select = work.rule.lbr_select;
+        if (lbr == NULL)
+            missing = TRUE;
+        else if (attach_lbr_state(lbr, &lbr_request))
+            xprintdbg("LIBIHT-COM: Exec rule %d attach LBR failed\n",
+                        work.rule_id);
+        else if (work.rule.scope != LIBIHT_SCOPE_PROCESS)
+            own_lbr_state(lbr, LBR_OWNER_EXEC_RULE, work.rule_id);
+    }
+
+    if (work.rule.features & LIBIHT_RULE_BTS)
+    {
+        xmemset(&bts_request, 0, sizeof(bts_request));
+        bts_request.bts_config.pid = pid;
+        bts_request.bts_config.scope = work.rule.scope;
+        bts_request.bts_config.bts_config = work.rule.bts_config;
+        bts_request.bts_config.bts_buffer_size = work.rule.bts_buffer_size;
+        if (bts == NULL)
+            missing = TRUE;
+        else if (attach_bts_state(bts, &bts_request))
+            xprintdbg("LIBIHT-COM: Exec rule %d attach BTS failed\n",
+                        work.rule_id);
+        else if (work.rule.scope != LIBIHT_SCOPE_PROCESS)
+            own_bts_state(bts, BTS_OWNER_EXEC_RULE, work.rule_id);
+    }
+
+    // Queue under the lock, so the flush on exit covers all queued work
+    xacquire_lock(exec_rule_lock, irql_flag);
+    if (entry->used)
+        ret = xqueue_work(missing ? exec_rule_attach : exec_rule_refill,
+                            &work, sizeof(work));
+    xrelease_lock(exec_rule_lock, irql_flag);
+
+    if (ret)
+        xprintdbg("LIBIHT-COM: Exec rule %d queue work failed\n",
+                    work.rule_id);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : exec_rule_init
+// Description  : Initialize the exec rule table.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 exec_rule_init(void)
+{
+    xprintdbg("LIBIHT-COM: Init exec rule table.\n");
+    xinit_lock(exec_rule_lock);
+    xmemset(exec_rule_table, 0, sizeof(exec_rule_table));
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : exec_rule_exit
+// Description  : Clear the exec rule table and wait for the queued work.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 exec_rule_exit(void)
+{
+    s32 ret;
+
+    // No attach is queued once the table is empty
+    ret = clear_exec_rules();
+    xflush_work();
+
+    return ret;
+}
@@ -0,0 +1,110 @@
+#ifndef _COMMONS_EXEC_RULE_H
+#define _COMMONS_EXEC_RULE_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/exec_rule.h
+//  Description    : This is the header file for the exec rule module, which
+//                   attaches a preconfigured LBR/BTS trace to any process
+//                   whose command name or executable path matches a rule
+//                   when it is executed.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "types.h"
+#include "xplat.h"
+#include "xioctl.h"
+#include "lbr.h"
+#include "bts.h"
+
+// cpp cross compile handler
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+//
+// Library constants
+
+// Number of entries in the exec rule table
+#define MAX_EXEC_RULES          16
+
+//
+// Type definitions
+
+// Define exec rule table entry
+struct exec_rule_entry
+{
+    u32 used;                           // Whether the entry holds a rule
+    struct exec_rule rule;              // The exec rule
+    struct lbr_state *lbr_spare;        // LBR state for the next match
+    struct bts_state *bts_spare;        // BTS state for the next match
+};
+
+// Define deferred work of a matched exec rule
+struct exec_rule_work
+{
+    u32 pid;                            // The executed process (0 to refill)
+    s32 rule_id;                        // The matched rule id
+    struct exec_rule rule;              // Copy of the matched rule
+};
+
+//
+// Global Variables
+
+extern char exec_rule_lock[MAX_LOCK_LEN];
+// The lock for exec_rule_table.
+
+//
+// Function Prototypes
+
+s32 add_exec_rule(struct rule_ioctl_request *request);
+// Add an exec rule to the rule table
+
+s32 del_exec_rule(struct rule_ioctl_request *request);
+// Delete an exec rule from the rule table
+
+s32 clear_exec_rules(void);
+// Delete all exec rules
+
+u32 glob_match(const char *pattern, const char *str);
+// Match a string against a glob pattern
+
+const char *path_basename(const char *path);
+// Get the last component of a path
+
+s32 find_exec_rule(const char *comm, const char *path, struct exec_rule *rule);
+// Find the first exec rule matching a command name or path
+
+s32 exec_rule_ioctl_handler(struct xioctl_request *request);
+// Handle the exec rule ioctl request
+
+void alloc_exec_rule_spares(struct exec_rule *rule, struct lbr_state **lbr,
+                            struct bts_state **bts);
+// Allocate the states attached on the next match of an exec rule
+
+void free_exec_rule_spares(struct lbr_state *lbr, struct bts_state *bts);
+// Free the unused states of an exec rule
+
+void exec_rule_refill(void *info);
+// Allocate the states of an exec rule again after a match, in process context
+
+void exec_rule_attach(void *info);
+// Attach the trace of a matched exec rule without spares, in process context
+
+void exec_rule_exec_handler(u32 pid, const char *comm, const char *path);
+// Attach the matching exec rule to an executed process
+
+s32 exec_rule_init(void);
+// Initialize the exec rule table
+
+s32 exec_rule_exit(void);
+// Clear the exec rule table
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _COMMONS_EXEC_RULE_H
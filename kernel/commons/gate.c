@@ -0,0 +1,428 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/gate.c
+//  Description    : This is the implementation of the trace gates for the
+//                   libiht library. The gate word of a thread is read at each
+//                   of its context switches: the wanted flag pauses or
+//                   resumes its LBR/BTS states, and every change of the flag
+//                   or the region id is recorded as a region record. The gate
+//                   is not watched in between, a store only takes effect at
+//                   the next context switch of the thread.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "gate.h"
+
+//
+// Global Variables
+
+char gate_state_lock[MAX_LOCK_LEN];
+// The lock for gate_state_list.
+
+char gate_state_head[MAX_LIST_LEN];
+// The head of the gate_state_list.
+
+struct ring_buffer *gate_ring;
+// The region records of all trace gates.
+
+//
+// Trace gate management
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : attach_gate
+// Description  : Pin the trace gate given by the request and attach it to the
+//                current thread, replacing any previous gate of the thread.
+//                The gate is honored right away.
+//
+// Inputs       : request - the gate ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 attach_gate(struct gate_ioctl_request *request)
+{
+    struct gate_state *state;
+    struct lbr_state *lbr;
+    struct bts_state *bts;
+    char irql_flag[MAX_IRQL_LEN];
+
+    // An aligned gate never crosses a page boundary
+    if (request->gate == NULL ||
+        ((u64)request->gate & (sizeof(struct trace_gate) - 1)))
+    {
+        xprintdbg("LIBIHT-COM: Invalid trace gate address\n");
+        return -1;
+    }
+
+    state = xmalloc(sizeof(struct gate_state));
+    if (state == NULL)
+        return -1;
+    xmemset(state, 0, sizeof(struct gate_state));
+
+    state->gate = xpin_user_page(request->gate, state->pin);
+    if (state->gate == NULL)
+    {
+        xprintdbg("LIBIHT-COM: Pin trace gate failed\n");
+        xfree(state);
+        return -1;
+    }
+
+    state->pid = xgetcurrent_pid();
+    state->last_wanted = !state->gate->wanted;
+
+    remove_gate_state(find_gate_state(state->pid));
+
+    xacquire_lock(gate_state_lock, irql_flag);
+    xprintdbg("LIBIHT-COM: Insert trace gate for pid %d\n", state->pid);
+    xlist_add(state->list, gate_state_head);
+    xrelease_lock(gate_state_lock, irql_flag);
+
+    observe_gate(state);
+
+    lbr = find_lbr_state(state->pid);
+    if (lbr)
+        sync_lbr_paused(lbr);
+    bts = find_bts_state(state->pid);
+    if (bts)
+        sync_bts_paused(bts);
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : detach_gate
+// Description  : Detach and unpin the trace gate of the current thread. The
+//                gate pause of its LBR/BTS states is lifted, a pause request
+//                still applies.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 detach_gate(void)
+{
+    struct gate_state *state;
+    struct lbr_state *lbr;
+    struct bts_state *bts;
+
+    state = find_gate_state(xgetcurrent_pid());
+    if (state == NULL)
+    {
+        xprintdbg("LIBIHT-COM: No trace gate for pid %d\n",
+                    xgetcurrent_pid());
+        return -1;
+    }
+
+    remove_gate_state(state);
+
+    lbr = find_lbr_state(xgetcurrent_pid());
+    if (lbr)
+    {
+        pause_lbr_state(lbr, LBR_PAUSE_GATE, FALSE);
+        sync_lbr_paused(lbr);
+    }
+    bts = find_bts_state(xgetcurrent_pid());
+    if (bts)
+    {
+        pause_bts_state(bts, BTS_PAUSE_GATE, FALSE);
+        sync_bts_paused(bts);
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_gate
+// Description  : Move the pending region records to the buffer of the request.
+//
+// Inputs       : request - the gate ioctl request
+// Outputs      : s32 - number of records copied, -1 on failure
+
+s32 dump_gate(struct gate_ioctl_request *request)
+{
+    if (gate_ring == NULL)
+        return -1;
+
+    return ring_drain_to_user(gate_ring, request->records,
+                                request->record_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : observe_gate
+// Description  : Read the trace gate of a thread, record a region record if
+//                the wanted flag or the region id changed since the last
+//                observation, and set the gate pause of its LBR/BTS states.
+//                A pause request stays in effect whatever the gate wants. The
+//                context switch handlers of LBR/BTS then skip or restore the
+//                states accordingly.
+//
+// Inputs       : state - the trace gate state
+// Outputs      : void
+
+void observe_gate(struct gate_state *state)
+{
+    struct gate_region_record record;
+    struct lbr_state *lbr;
+    struct bts_state *bts;
+    u32 wanted, region_id;
+
+    // The gate may be written by the thread at any time, read it only once
+    wanted = state->gate->wanted ? TRUE : FALSE;
+    region_id = state->gate->region_id;
+
+    lbr = find_lbr_state(state->pid);
+    if (lbr)
+        pause_lbr_state(lbr, LBR_PAUSE_GATE, !wanted);
+    bts = find_bts_state(state->pid);
+    if (bts)
+        pause_bts_state(bts, BTS_PAUSE_GATE, !wanted);
+
+    if (wanted == state->last_wanted && region_id == state->last_region)
+        return;
+
+    state->last_wanted = wanted;
+    state->last_region = region_id;
+    if (gate_ring == NULL)
+        return;
+
+    record.timestamp = xget_timestamp();
+    record.pid = state->pid;
+    record.region_id = region_id;
+    record.wanted = wanted;
+    record.cpu = xcoreid();
+    record.bts_offset = 0;
+    if (bts && bts->ds_area)
+        record.bts_offset = (bts->ds_area->bts_index -
+                                bts->ds_area->bts_buffer_base) /
+                                sizeof(struct bts_record);
+    ring_push(gate_ring, &record);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_gate_state
+// Description  : Find the trace gate state for the given thread id.
+//
+// Inputs       : pid - the thread id
+// Outputs      : struct gate_state* - the trace gate state
+
+struct gate_state *find_gate_state(u32 pid)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct gate_state *curr_state, *ret_state = NULL;
+    void *curr_list;
+    u64 offset;
+
+    xacquire_lock(gate_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct gate_state *)0)->list);
+    curr_list = xlist_next(gate_state_head);
+    while (curr_list != NULL && curr_list != gate_state_head)
+    {
+        curr_state = (struct gate_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (pid != 0 && curr_state->pid == pid)
+        {
+            ret_state = curr_state;
+            break;
+        }
+    }
+
+    xrelease_lock(gate_state_lock, irql_flag);
+
+    return ret_state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_gate_state
+// Description  : Remove the trace gate state from the list, then unpin its
+//                page and free it.
+//
+// Inputs       : old_state - the old trace gate state
+// Outputs      : void
+
+void remove_gate_state(struct gate_state *old_state)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (old_state == NULL)
+        return;
+
+    xacquire_lock(gate_state_lock, irql_flag);
+    xprintdbg("LIBIHT-COM: Remove trace gate for pid %d\n", old_state->pid);
+    xlist_del(old_state->list);
+    xrelease_lock(gate_state_lock, irql_flag);
+
+    xunpin_user_page(old_state->pin);
+    xfree(old_state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_gate_state_list
+// Description  : Free the trace gate state list.
+//
+// Inputs       : void
+// Outputs      : void
+
+void free_gate_state_list(void)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct gate_state *curr_state;
+    u64 offset;
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct gate_state *)0)->list);
+
+    // Pages are unpinned outside of the lock, one state at a time
+    while (TRUE)
+    {
+        xacquire_lock(gate_state_lock, irql_flag);
+        if (xlist_next(gate_state_head) == gate_state_head)
+        {
+            xrelease_lock(gate_state_lock, irql_flag);
+            break;
+        }
+        curr_state = (struct gate_state *)
+                        ((u64)xlist_next(gate_state_head) - offset);
+        xlist_del(curr_state->list);
+        xrelease_lock(gate_state_lock, irql_flag);
+
+        xprintdbg("LIBIHT-COM: Free trace gate for pid %d\n", curr_state->pid);
+        xunpin_user_page(curr_state->pin);
+        xfree(curr_state);
+    }
+}
+
+//
+// Cross platform handlers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gate_ioctl_handler
+// Description  : The ioctl handler for the trace gates.
+//
+// Inputs       : request - the gate ioctl request
+// Outputs      : s32 - 0 (or record count) on success, -1 on failure
+
+s32 gate_ioctl_handler(struct xioctl_request *request)
+{
+    s32 ret = 0;
+
+    xprintdbg("LIBIHT-COM: Trace gate ioctl command %d.\n", request->cmd);
+    switch (request->cmd)
+    {
+        case LIBIHT_IOCTL_ATTACH_GATE:
+            xprintdbg("LIBIHT-COM: Attach trace gate for pid %d\n",
+                        xgetcurrent_pid());
+            ret = attach_gate(&request->body.gate);
+            break;
+        case LIBIHT_IOCTL_DETACH_GATE:
+            xprintdbg("LIBIHT-COM: Detach trace gate for pid %d\n",
+                        xgetcurrent_pid());
+            ret = detach_gate();
+            break;
+        case LIBIHT_IOCTL_DUMP_GATE:
+            ret = dump_gate(&request->body.gate);
+            break;
+        default:
+            xprintdbg("LIBIHT-COM: Invalid trace gate ioctl command\n");
+            ret = -1;
+            break;
+    }
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gate_cswitch_handler
+// Description  : The context switch handler for the trace gates. Must run
+//                before the LBR/BTS handlers, so the next thread is restored
+//                or skipped according to its gate.
+//
+// Inputs       : prev_pid - the pid of the previous thread
+//                next_pid - the pid of the next thread
+// Outputs      : void
+
+void gate_cswitch_handler(u32 prev_pid, u32 next_pid)
+{
+    struct gate_state *prev_state, *next_state;
+
+    // Fast path when no gate is attached
+    if (xlist_next(gate_state_head) == gate_state_head)
+        return;
+
+    prev_state = find_gate_state(prev_pid);
+    next_state = find_gate_state(next_pid);
+
+    // Catch the region changes made during the slice that just ended
+    if (prev_state)
+        observe_gate(prev_state);
+
+    if (next_state)
+        observe_gate(next_state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gate_exitproc_handler
+// Description  : The process exit handler for the trace gates.
+//
+// Inputs       : pid - the pid of the exiting thread
+// Outputs      : void
+
+void gate_exitproc_handler(u32 pid)
+{
+    remove_gate_state(find_gate_state(pid));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gate_init
+// Description  : Initialize the trace gates and the region record ring.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 gate_init(void)
+{
+    xprintdbg("LIBIHT-COM: Init trace gate related structs.\n");
+    xinit_lock(gate_state_lock);
+    xinit_list_head(gate_state_head);
+
+    gate_ring = create_ring(sizeof(struct gate_region_record),
+                            GATE_RING_SIZE);
+    if (gate_ring == NULL)
+    {
+        xprintdbg("LIBIHT-COM: Create trace gate ring failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gate_exit
+// Description  : Unpin all trace gates and free the region record ring.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 gate_exit(void)
+{
+    xprintdbg("LIBIHT-COM: Freeing trace gate state list...\n");
+    free_gate_state_list();
+
+    free_ring(gate_ring);
+    gate_ring = NULL;
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef _COMMONS_GATE_H
+#define _COMMONS_GATE_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/gate.h
+//  Description    : This is the header file for the trace gate module. A
+//                   trace gate is a control word in a page of the traced
+//                   thread, pinned and shared with the kernel, so the thread
+//                   can turn its LBR/BTS trace on and off and tag regions
+//                   with plain memory stores. The gate is only read at the
+//                   context switches of the thread, so a store takes effect
+//                   at its next switch, not right away.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "types.h"
+#include "xplat.h"
+#include "xioctl.h"
+#include "ring.h"
+#include "lbr.h"
+#include "bts.h"
+
+// cpp cross compile handler
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+//
+// Library constants
+
+// Number of region records kept for all gates
+#define GATE_RING_SIZE          0x1000
+
+//
+// Type definitions
+
+// Define trace gate state
+struct gate_state
+{
+    char list[MAX_LIST_LEN];            // Kernel linked list
+    char pin[MAX_PIN_LEN];              // Pinned user page handle
+    struct trace_gate *gate;            // Kernel view of the trace gate
+    u32 pid;                            // Thread owning the gate
+    u32 last_wanted;                    // Wanted flag last observed
+    u32 last_region;                    // Region id last observed
+};
+
+//
+// Global Variables
+
+extern char gate_state_lock[MAX_LOCK_LEN];
+// The lock for gate_state_list.
+
+extern char gate_state_head[MAX_LIST_LEN];
+// The head of the gate_state_list.
+
+//
+// Function Prototypes
+
+s32 attach_gate(struct gate_ioctl_request *request);
+// Attach a trace gate to the current thread
+
+s32 detach_gate(void);
+// Detach the trace gate of the current thread
+
+s32 dump_gate(struct gate_ioctl_request *request);
+// Dump the region records of all trace gates
+
+void observe_gate(struct gate_state *state);
+// Apply the trace gate of a thread to its LBR/BTS states
+
+struct gate_state *find_gate_state(u32 pid);
+// Find the trace gate state by pid
+
+void remove_gate_state(struct gate_state *old_state);
+// Remove the trace gate state from the list and unpin its page
+
+void free_gate_state_list(void);
+// Free all trace gate states
+
+s32 gate_ioctl_handler(struct xioctl_request *request);
+// Handle the trace gate ioctl request
+
+void gate_cswitch_handler(u32 prev_pid, u32 next_pid);
+// Honor the trace gates of the switched threads
+
+void gate_exitproc_handler(u32 pid);
+// Release the trace gate of an exiting thread
+
+s32 gate_init(void);
+// Initialize the trace gates
+
+s32 gate_exit(void);
+// Exit the trace gates
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _COMMONS_GATE_H
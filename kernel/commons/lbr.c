@@ -15,6 +15,8 @@
 
 // Include Files
 #include "lbr.h"
+#include "cpu_trace.h"
+#include "sample.h"
 
 //
 // Global Variables
@@ -28,6 +30,12 @@ char lbr_state_lock[MAX_LOCK_LEN];
 char lbr_state_head[MAX_LIST_LEN];
 // The head of the lbr_state_list.
 
+u32 lbr_syscall_users;
+// The number of LBR states with a syscall snapshot ring.
+
+u32 lbr_syscall_hooked;
+// Whether the syscall entry is hooked, kept until the module exits.
+
 static const struct cpu_to_lbr cpu_lbr_maps[] = {
     {0x5c, 32}, {0x5f, 32}, {0x4e, 32}, {0x5e, 32}, {0x8e, 32}, {0x9e, 32},
     {0x55, 32}, {0x66, 32}, {0x7a, 32}, {0x67, 32}, {0x6a, 32}, {0x6c, 32},
@@ -76,6 +84,7 @@ void get_lbr(struct lbr_state *state)
         xrdmsr(MSR_LBR_NHM_TO + i, &state->data->entries[i].to);
     }
 
+    state->loaded = FALSE;
     xrelease_lock(lbr_state_lock, irql_flag);
 }
 
@@ -106,6 +115,8 @@ void put_lbr(struct lbr_state *state)
         xwrmsr(MSR_LBR_NHM_TO + i, state->data->entries[i].to);
     }
 
+    state->loaded = TRUE;
+    state->cpu = xcoreid();
     xrelease_lock(lbr_state_lock, irql_flag);
 
     // Enable LBR
@@ -163,6 +174,24 @@ s32 enable_lbr(struct lbr_ioctl_request *request)
 {
     struct lbr_state *state;
 
+    if (cpu_trace_enabled)
+    {
+        xprintdbg("LIBIHT-COM: LBR per task trace conflicts with CPU trace\n");
+        return -1;
+    }
+
+    if (sample_enabled)
+    {
+        xprintdbg("LIBIHT-COM: LBR per task trace conflicts with sampling\n");
+        return -1;
+    }
+
+    if (hook_lbr_syscall(&request->lbr_config))
+        return -1;
+
+    if (request->lbr_config.scope == LIBIHT_SCOPE_PROCESS)
+        return enable_lbr_process(request);
+
     state = find_lbr_state(request->lbr_config.pid);
     if (state)
     {
@@ -182,8 +211,21 @@ s32 enable_lbr(struct lbr_ioctl_request *request)
     state->parent = NULL;
     state->config.pid = request->lbr_config.pid ?
                                     request->lbr_config.pid : xgetcurrent_pid();
+    state->config.scope = LIBIHT_SCOPE_THREAD;
     state->config.lbr_select = request->lbr_config.lbr_select ?
                                     request->lbr_config.lbr_select : LBR_SELECT;
+    state->config.offcpu_records = request->lbr_config.offcpu_records;
+    state->config.syscall_records = request->lbr_config.syscall_records;
+    xmemcpy(state->config.syscall_mask, request->lbr_config.syscall_mask,
+            sizeof(state->config.syscall_mask));
+    if (setup_lbr_rings(state))
+    {
+        xprintdbg("LIBIHT-COM: Create LBR snapshot rings failed\n");
+        xfree(state->data->entries);
+        xfree(state->data);
+        xfree(state);
+        return -1;
+    }
     insert_lbr_state(state);
 
     // If the requesting process is the current process, trace it right away
@@ -194,16 +236,958 @@ s32 enable_lbr(struct lbr_ioctl_request *request)
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : disable_lbr
-// Description  : Disable the LBR feature for the requested process id.
+// Function     : enable_lbr_process
+// Description  : Enable the LBR feature for every thread of the requested
+//                process (thread group) id. Each thread gets its own LBR
+//                state, and threads created later join the trace through
+//                `lbr_newproc_handler`.
+//
+// Inputs       : request - the LBR ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 enable_lbr_process(struct lbr_ioctl_request *request)
+{
+    struct lbr_state *state;
+    u32 *tids, tgid, tid_cnt, max_cnt, i;
+
+    tgid = request->lbr_config.pid ?
+                request->lbr_config.pid : xgetcurrent_tgid();
+    if (find_lbr_proc_state(tgid))
+    {
+        xprintdbg("LIBIHT-COM: LBR already enabled for process %d\n", tgid);
+        return -1;
+    }
+
+    // Collect the thread ids, retry with a larger array if it is too small
+    max_cnt = MAX_PROC_THREADS;
+    while (TRUE)
+    {
+        tids = xmalloc(max_cnt * sizeof(u32));
+        if (tids == NULL)
+            return -1;
+
+        tid_cnt = xget_thread_ids(tgid, tids, max_cnt);
+        if (tid_cnt <= max_cnt)
+            break;
+
+        xfree(tids);
+        max_cnt = tid_cnt << 1;
+    }
+
+    if (tid_cnt == 0)
+    {
+        xprintdbg("LIBIHT-COM: No threads found for process %d\n", tgid);
+        xfree(tids);
+        return -1;
+    }
+
+    for (i = 0; i < tid_cnt; i++)
+    {
+        // Threads traced on their own keep their existing state
+        if (find_lbr_state(tids[i]))
+            continue;
+
+        state = create_lbr_state();
+        if (state == NULL)
+        {
+            xprintdbg("LIBIHT-COM: Create LBR state failed\n");
+            xfree(tids);
+            remove_lbr_proc_states(tgid);
+            return -1;
+        }
+
+        state->parent = NULL;
+        state->tgid = tgid;
+        state->config.pid = tids[i];
+        state->config.scope = LIBIHT_SCOPE_PROCESS;
+        state->config.lbr_select = request->lbr_config.lbr_select ?
+                                    request->lbr_config.lbr_select : LBR_SELECT;
+        state->config.offcpu_records = request->lbr_config.offcpu_records;
+        state->config.syscall_records = request->lbr_config.syscall_records;
+        xmemcpy(state->config.syscall_mask, request->lbr_config.syscall_mask,
+                sizeof(state->config.syscall_mask));
+        if (setup_lbr_rings(state))
+        {
+            xprintdbg("LIBIHT-COM: Create LBR snapshot rings failed\n");
+            xfree(state->data->entries);
+            xfree(state->data);
+            xfree(state);
+            xfree(tids);
+            remove_lbr_proc_states(tgid);
+            return -1;
+        }
+        insert_lbr_state(state);
+
+        // If the thread is the current one, trace it right away
+        if (state->config.pid == xgetcurrent_pid())
+            put_lbr(state);
+    }
+
+    xfree(tids);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : attach_lbr_state
+// Description  : Enable the LBR for a single threaded process or a thread with
+//                an LBR state allocated beforehand by `create_lbr_state`, so
+//                it can be called in atomic context. Snapshot rings are not
+//                supported. The state is freed on failure.
+//
+// Inputs       : state - the preallocated LBR state
+//                request - the LBR ioctl request, its pid must be nonzero
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 attach_lbr_state(struct lbr_state *state, struct lbr_ioctl_request *request)
+{
+    u32 pid = request->lbr_config.pid;
+
+    if (cpu_trace_enabled || sample_enabled || find_lbr_state(pid) ||
+        request->lbr_config.offcpu_records || request->lbr_config.syscall_records)
+    {
+        xprintdbg("LIBIHT-COM: Attach LBR to pid %d refused\n", pid);
+        xfree(state->data->entries);
+        xfree(state->data);
+        xfree(state);
+        return -1;
+    }
+
+    state->parent = NULL;
+    state->tgid = pid;
+    state->config.pid = pid;
+    state->config.scope = request->lbr_config.scope == LIBIHT_SCOPE_PROCESS ?
+                            LIBIHT_SCOPE_PROCESS : LIBIHT_SCOPE_THREAD;
+    state->config.lbr_select = request->lbr_config.lbr_select ?
+                                request->lbr_config.lbr_select : LBR_SELECT;
+    insert_lbr_state(state);
+
+    // If the thread is the current one, trace it right away
+    if (pid == xgetcurrent_pid())
+        put_lbr(state);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disable_lbr
+// Description  : Disable the LBR feature for the requested process id.
+//
+// Inputs       : request - the LBR ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+
+s32 disable_lbr(struct lbr_ioctl_request *request)
+{
+    struct lbr_state *state;
+
+    if (request->lbr_config.scope == LIBIHT_SCOPE_PROCESS)
+    {
+        if (find_lbr_proc_state(request->lbr_config.pid) == NULL)
+        {
+            xprintdbg("LIBIHT-COM: LBR not enabled for process %d\n",
+                        request->lbr_config.pid);
+            return -1;
+        }
+
+        remove_lbr_proc_states(request->lbr_config.pid);
+        return 0;
+    }
+
+    state = find_lbr_state(request->lbr_config.pid);
+    if (state == NULL)
+    {
+        xprintdbg("LIBIHT-COM: LBR not enabled for pid %d\n",
+                    request->lbr_config.pid);
+        return -1;
+    }
+
+    if (state->config.pid == xgetcurrent_pid())
+        get_lbr(state);
+    remove_lbr_state(state);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_lbr
+// Description  : Dump the LBR registers for the given process id.
+//
+// Inputs       : request - the LBR ioctl request
+// Outputs      : s32 - 0 on success (number of threads dumped for process
+//                scope requests), -1 on failure
+
+s32 dump_lbr(struct lbr_ioctl_request *request)
+{
+    struct lbr_state* state;
+
+    if (request->lbr_config.scope == LIBIHT_SCOPE_PROCESS)
+        return dump_lbr_process(request);
+
+    state = find_lbr_state(request->lbr_config.pid);
+    if (state == NULL)
+    {
+        xprintdbg("LIBIHT-COM: LBR not enabled for pid %d\n",
+                    request->lbr_config.pid);
+        return -1;
+    }
+
+    // Examine if the current process is the owner of the LBR state
+    if (state->config.pid == xgetcurrent_pid())
+    {
+        xprintdbg("LIBIHT-COM: Dump LBR for current process\n");
+        // Get fresh LBR info, a paused state stays off
+        if (state->loaded)
+            get_lbr(state);
+        if (!state->paused)
+            put_lbr(state);
+    }
+    else
+    {
+        // Take a fresh copy if the thread is running on another cpu
+        refresh_remote_lbr(request);
+    }
+
+    // The thread may have exited since
+    return dump_lbr_threads(request, FALSE) > 0 ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_lbr_process
+// Description  : Dump the LBR registers of every traced thread of the given
+//                process id. Each thread is dumped into its own `lbr_data`
+//                of the request buffer array, tagged with the thread id.
+//
+// Inputs       : request - the LBR ioctl request
+// Outputs      : s32 - number of threads dumped, -1 on failure
+
+s32 dump_lbr_process(struct lbr_ioctl_request *request)
+{
+    struct lbr_state *state;
+
+    if (find_lbr_proc_state(request->lbr_config.pid) == NULL)
+    {
+        xprintdbg("LIBIHT-COM: LBR not enabled for process %d\n",
+                    request->lbr_config.pid);
+        return -1;
+    }
+
+    // Get fresh LBR info if the caller is one of the traced threads
+    state = find_lbr_state(xgetcurrent_pid());
+    if (state && state->config.scope == LIBIHT_SCOPE_PROCESS &&
+        state->tgid == request->lbr_config.pid)
+    {
+        if (state->loaded)
+            get_lbr(state);
+        if (!state->paused)
+            put_lbr(state);
+    }
+
+    // Take fresh copies of the threads running on other cpus
+    refresh_remote_lbr(request);
+
+    return dump_lbr_threads(request, TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_lbr_threads
+// Description  : Dump the saved LBR registers of the requested thread, or of
+//                every traced thread of the requested process. The stacks
+//                are staged in a kernel buffer under the `lbr_state_lock`,
+//                and only copied to the userspace buffer array once the lock
+//                is released, since the copies may fault and sleep.
+//
+// Inputs       : request - the LBR ioctl request
+//                process - TRUE for the process scope, FALSE for one thread
+// Outputs      : s32 - number of threads dumped, -1 on failure
+
+s32 dump_lbr_threads(struct lbr_ioctl_request *request, u32 process)
+{
+    s32 ret = 0;
+    struct lbr_state *curr_state;
+    struct lbr_data *stage = NULL;
+    struct lbr_stack_entry *entries;
+    char irql_flag[MAX_IRQL_LEN];
+    void *curr_list;
+    u32 cnt = 0, max_cnt, i;
+    u64 offset;
+
+    // Size the stage for the threads traced now, later ones are left out
+    max_cnt = 0;
+    xacquire_lock(lbr_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct lbr_state *)0)->list);
+    curr_list = xlist_next(lbr_state_head);
+    while (curr_list != NULL && curr_list != lbr_state_head)
+    {
+        curr_state = (struct lbr_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (process ? (curr_state->config.scope == LIBIHT_SCOPE_PROCESS &&
+                        curr_state->tgid == request->lbr_config.pid) :
+                        curr_state->config.pid == request->lbr_config.pid)
+            max_cnt++;
+    }
+
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    // A thread scope request has a single buffer
+    if (!process && max_cnt > 1)
+        max_cnt = 1;
+    if (process && request->buffer && max_cnt > request->buffer_count)
+        max_cnt = request->buffer_count;
+    if (max_cnt == 0)
+        return 0;
+
+    stage = xvmalloc((u64)max_cnt * (sizeof(struct lbr_data) +
+                        lbr_capacity * sizeof(struct lbr_stack_entry)));
+    if (stage == NULL)
+        return -1;
+    entries = (struct lbr_stack_entry *)(stage + max_cnt);
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+
+    curr_list = xlist_next(lbr_state_head);
+    while (curr_list != NULL && curr_list != lbr_state_head && cnt < max_cnt)
+    {
+        curr_state = (struct lbr_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (process ? (curr_state->config.scope != LIBIHT_SCOPE_PROCESS ||
+                        curr_state->tgid != request->lbr_config.pid) :
+                        curr_state->config.pid != request->lbr_config.pid)
+            continue;
+
+        stage[cnt].entries = entries + (u64)cnt * lbr_capacity;
+        dump_lbr_state(curr_state, stage + cnt);
+        cnt++;
+    }
+
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    for (i = 0; i < cnt && request->buffer; i++)
+    {
+        if (copy_lbr_to_user(stage + i, request->buffer + i))
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    xvfree(stage);
+    return ret ? ret : (s32)cnt;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_lbr_state
+// Description  : Copy the saved LBR registers of one LBR state to a kernel LBR
+//                data, whose entries hold `lbr_capacity` entries. Caller
+//                should hold the `lbr_state_lock`.
+//
+// Inputs       : state - the LBR state
+//                data - the kernel LBR data
+// Outputs      : void
+
+void dump_lbr_state(struct lbr_state *state, struct lbr_data *data)
+{
+    u64 i;
+
+    // Dump the LBR state
+    xprintdbg("PROC_PID:             %d\n", state->config.pid);
+    xprintdbg("MSR_LBR_SELECT:       0x%llx\n", state->config.lbr_select);
+    xprintdbg("MSR_LBR_TOS:          %lld\n", state->data->lbr_tos);
+
+    for (i = 0; i < lbr_capacity; i++)
+    {
+        xprintdbg("MSR_LBR_NHM_FROM[%2d]: 0x%llx\n", i,
+                    state->data->entries[i].from);
+        xprintdbg("MSR_LBR_NHM_TO  [%2d]: 0x%llx\n", i,
+                    state->data->entries[i].to);
+    }
+
+    xprintdbg("LIBIHT-COM: LBR info for cpuid: %d\n", xcoreid());
+
+    data->lbr_tos = state->data->lbr_tos;
+    data->tid = state->config.pid;
+    data->entry_count = (u32)lbr_capacity;
+    xmemcpy(data->entries, state->data->entries,
+            lbr_capacity * sizeof(struct lbr_stack_entry));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : copy_lbr_to_user
+// Description  : Copy a kernel LBR data staged by `dump_lbr_state` to a
+//                userspace LBR data buffer. Must not be called with a lock
+//                held, the copies may fault.
+//
+// Inputs       : data - the kernel LBR data
+//                buffer - the userspace LBR data buffer
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 copy_lbr_to_user(struct lbr_data *data, struct lbr_data *buffer)
+{
+    u64 bytes_left;
+    struct lbr_data req_buf;
+
+    // Get a copy of data from userspace buffer
+    bytes_left = xcopy_from_user(&req_buf, buffer, sizeof(struct lbr_data));
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy LBR data from user failed\n");
+        return -1;
+    }
+
+    // A bounded buffer must hold the whole stack
+    if (req_buf.entry_count)
+    {
+        if (req_buf.entry_count < data->entry_count)
+        {
+            xprintdbg("LIBIHT-COM: LBR data buffer too small, %d entries "
+                        "needed\n", data->entry_count);
+            return -1;
+        }
+        req_buf.entry_count = data->entry_count;
+    }
+
+    // Dump data to userspace entry ptr
+    req_buf.lbr_tos = data->lbr_tos;
+    req_buf.tid = data->tid;
+    if (req_buf.entries)
+    {
+        bytes_left = xcopy_to_user(req_buf.entries, data->entries,
+                        data->entry_count * sizeof(struct lbr_stack_entry));
+        if (bytes_left)
+        {
+            xprintdbg("LIBIHT-COM: Copy LBR data to user failed\n");
+            return -1;
+        }
+    }
+
+    // Copy updated data back to userspace buffer
+    bytes_left = xcopy_to_user(buffer, &req_buf, sizeof(struct lbr_data));
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy LBR data to user failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : snapshot_lbr
+// Description  : Read the LBR stack of the state loaded on the current cpu
+//                into its kernel copy, without switching the thread out. Run
+//                on the target cpu (by IPI), so it cannot race with a context
+//                switch there. The LBR is frozen while it is read.
+//
+// Inputs       : info - unused
+// Outputs      : void
+
+void snapshot_lbr(void *info)
+{
+    struct lbr_state *curr_state;
+    char irql_flag[MAX_IRQL_LEN];
+    void *curr_list;
+    u64 offset, dbgctlmsr;
+    u32 i, cpu = xcoreid();
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct lbr_state *)0)->list);
+    curr_list = xlist_next(lbr_state_head);
+    while (curr_list != NULL && curr_list != lbr_state_head)
+    {
+        curr_state = (struct lbr_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (!curr_state->loaded || curr_state->cpu != cpu)
+            continue;
+
+        xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
+        xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr & ~DEBUGCTLMSR_LBR);
+
+        xrdmsr(MSR_LBR_TOS, &curr_state->data->lbr_tos);
+        for (i = 0; i < lbr_capacity; i++)
+        {
+            xrdmsr(MSR_LBR_NHM_FROM + i, &curr_state->data->entries[i].from);
+            xrdmsr(MSR_LBR_NHM_TO + i, &curr_state->data->entries[i].to);
+        }
+
+        xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
+        break;
+    }
+
+    xrelease_lock(lbr_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : refresh_remote_lbr
+// Description  : Snapshot the LBR stacks of the requested threads that are
+//                running on other cpus, so a dump does not return the data
+//                saved at their last switch out. The running threads are not
+//                descheduled, only their cpus are interrupted.
+//
+// Inputs       : request - the LBR ioctl request
+// Outputs      : void
+
+void refresh_remote_lbr(struct lbr_ioctl_request *request)
+{
+    struct lbr_state *curr_state;
+    char irql_flag[MAX_IRQL_LEN];
+    void *curr_list;
+    u64 offset, *cpu_mask;
+    u32 cpu, cpu_cnt, self;
+
+    cpu_cnt = xcpu_count();
+    cpu_mask = xmalloc(((cpu_cnt + 63) / 64) * sizeof(u64));
+    if (cpu_mask == NULL)
+        return;
+    xmemset(cpu_mask, 0, ((cpu_cnt + 63) / 64) * sizeof(u64));
+
+    // Collect the cpus, IPIs cannot be sent with the lock held
+    self = xcoreid();
+    xacquire_lock(lbr_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct lbr_state *)0)->list);
+    curr_list = xlist_next(lbr_state_head);
+    while (curr_list != NULL && curr_list != lbr_state_head)
+    {
+        curr_state = (struct lbr_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (request->lbr_config.scope == LIBIHT_SCOPE_PROCESS ?
+            (curr_state->config.scope != LIBIHT_SCOPE_PROCESS ||
+                curr_state->tgid != request->lbr_config.pid) :
+            curr_state->config.pid != request->lbr_config.pid)
+            continue;
+
+        if (curr_state->loaded && curr_state->cpu != self &&
+            curr_state->cpu < cpu_cnt)
+            cpu_mask[curr_state->cpu / 64] |= 1ULL << (curr_state->cpu % 64);
+    }
+
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    for (cpu = 0; cpu < cpu_cnt; cpu++)
+    {
+        if (cpu_mask[cpu / 64] & (1ULL << (cpu % 64)))
+        {
+            xprintdbg("LIBIHT-COM: Snapshot LBR on cpu core %d\n", cpu);
+            xon_cpu(cpu, snapshot_lbr, NULL);
+        }
+    }
+
+    xfree(cpu_mask);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : setup_lbr_rings
+// Description  : Allocate the off-cpu and syscall snapshot rings of an LBR
+//                state, if its configuration asks for them. Nothing is left
+//                allocated on failure.
+//
+// Inputs       : state - the LBR state
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 setup_lbr_rings(struct lbr_state *state)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    u32 records;
+
+    records = state->config.offcpu_records;
+    if (records > LBR_OFFCPU_MAX_RECORDS)
+        records = LBR_OFFCPU_MAX_RECORDS;
+    state->config.offcpu_records = records;
+    if (records)
+    {
+        state->offcpu = create_ring(sizeof(struct lbr_offcpu_record), records);
+        if (state->offcpu == NULL)
+            return -1;
+    }
+
+    records = state->config.syscall_records;
+    if (records > LBR_SYSCALL_MAX_RECORDS)
+        records = LBR_SYSCALL_MAX_RECORDS;
+    state->config.syscall_records = records;
+    if (records)
+    {
+        state->syscall = create_ring(sizeof(struct lbr_syscall_record),
+                                        records);
+        if (state->syscall == NULL)
+        {
+            free_ring(state->offcpu);
+            state->offcpu = NULL;
+            return -1;
+        }
+
+        xacquire_lock(lbr_state_lock, irql_flag);
+        lbr_syscall_users++;
+        xrelease_lock(lbr_state_lock, irql_flag);
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_lbr_rings
+// Description  : Free the snapshot rings of an LBR state. Caller should hold
+//                the lbr_state_lock.
+//
+// Inputs       : state - the LBR state
+// Outputs      : void
+
+void free_lbr_rings(struct lbr_state *state)
+{
+    free_ring(state->offcpu);
+    state->offcpu = NULL;
+
+    if (state->syscall)
+    {
+        free_ring(state->syscall);
+        state->syscall = NULL;
+        lbr_syscall_users--;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : push_lbr_offcpu
+// Description  : Append the LBR stack just saved from a switched out thread
+//                to its off-cpu ring. The stack shows the code path that led
+//                into the blocking call or the preemption.
+//
+// Inputs       : state - the LBR state of the switched out thread
+//                prev_state - the task state index of the thread
+//                next_pid - the thread switched in
+// Outputs      : void
+
+void push_lbr_offcpu(struct lbr_state *state, u32 prev_state, u32 next_pid)
+{
+    struct lbr_offcpu_record record;
+    u32 cnt;
+
+    cnt = lbr_capacity < LIBIHT_LBR_MAX_ENTRIES ?
+            lbr_capacity : LIBIHT_LBR_MAX_ENTRIES;
+
+    record.timestamp = xget_timestamp();
+    record.pid = state->config.pid;
+    record.prev_state = prev_state;
+    record.next_pid = next_pid;
+    record.cpu = xcoreid();
+    record.lbr_tos = state->data->lbr_tos;
+    xmemcpy(record.entries, state->data->entries,
+            cnt * sizeof(struct lbr_stack_entry));
+    if (cnt < LIBIHT_LBR_MAX_ENTRIES)
+        xmemset(record.entries + cnt, 0,
+                (LIBIHT_LBR_MAX_ENTRIES - cnt) * sizeof(struct lbr_stack_entry));
+
+    ring_push(state->offcpu, &record);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drain_lbr_rings
+// Description  : Move the pending records of a snapshot ring of the requested
+//                thread, or of every thread traced in the scope of the
+//                requested process, to a userspace buffer. The rings are
+//                collected with a reference under the lbr_state_lock, so a
+//                thread exiting during the copy does not free its ring under
+//                the drain.
+//
+// Inputs       : request - the LBR ioctl request
+//                selector - LBR_RING_OFFCPU or LBR_RING_SYSCALL
+//                buffer - the userspace buffer of the records
+//                max_cnt - the number of records the buffer holds
+// Outputs      : s32 - number of records copied, -1 on failure
+
+s32 drain_lbr_rings(struct lbr_ioctl_request *request, u32 selector,
+                    void *buffer, u32 max_cnt)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct lbr_state *curr_state;
+    struct ring_buffer **rings, *ring;
+    void *curr_list;
+    u32 pid, process, ring_cnt, max_rings, i;
+    s32 cnt, total = 0;
+    u64 offset, entry_size = 0;
+
+    process = request->lbr_config.scope == LIBIHT_SCOPE_PROCESS;
+    pid = request->lbr_config.pid;
+    if (pid == 0)
+        pid = process ? xgetcurrent_tgid() : xgetcurrent_pid();
+
+    // Collect the rings, retry with a larger array if it is too small
+    max_rings = process ? MAX_PROC_THREADS : 1;
+    while (TRUE)
+    {
+        rings = xmalloc(max_rings * sizeof(struct ring_buffer *));
+        if (rings == NULL)
+            return -1;
+        ring_cnt = 0;
+
+        xacquire_lock(lbr_state_lock, irql_flag);
+
+        // offsetof(st, m) macro implementation of stddef.h
+        offset = (u64)(&((struct lbr_state *)0)->list);
+        curr_list = xlist_next(lbr_state_head);
+        while (curr_list != NULL && curr_list != lbr_state_head)
+        {
+            curr_state = (struct lbr_state *)((u64)curr_list - offset);
+            curr_list = xlist_next(curr_list);
+            if (process ? (curr_state->config.scope != LIBIHT_SCOPE_PROCESS ||
+                            curr_state->tgid != pid) :
+                            curr_state->config.pid != pid)
+                continue;
+
+            ring = selector == LBR_RING_SYSCALL ?
+                    curr_state->syscall : curr_state->offcpu;
+            if (ring == NULL)
+                continue;
+            if (ring_cnt < max_rings)
+            {
+                ring_get(ring);
+                rings[ring_cnt] = ring;
+            }
+            ring_cnt++;
+        }
+
+        xrelease_lock(lbr_state_lock, irql_flag);
+
+        if (ring_cnt <= max_rings)
+            break;
+
+        for (i = 0; i < max_rings; i++)
+            free_ring(rings[i]);
+        xfree(rings);
+        max_rings = ring_cnt << 1;
+    }
+
+    if (ring_cnt == 0 && !process)
+    {
+        xprintdbg("LIBIHT-COM: LBR snapshot ring %d not enabled for pid %d\n",
+                    selector, pid);
+        xfree(rings);
+        return -1;
+    }
+
+    for (i = 0; i < ring_cnt; i++)
+    {
+        if (total >= 0 && (u32)total < max_cnt)
+        {
+            entry_size = rings[i]->entry_size;
+            cnt = ring_drain_to_user(rings[i],
+                                        (u8 *)buffer + total * entry_size,
+                                        max_cnt - total);
+            total = cnt < 0 ? -1 : total + cnt;
+        }
+        free_ring(rings[i]);
+    }
+
+    xfree(rings);
+    return total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_lbr_offcpu
+// Description  : Move the pending off-cpu records of the requested thread, or
+//                of every traced thread of the requested process, to the
+//                off-cpu buffer of the request.
+//
+// Inputs       : request - the LBR ioctl request
+// Outputs      : s32 - number of records copied, -1 on failure
+
+s32 dump_lbr_offcpu(struct lbr_ioctl_request *request)
+{
+    return drain_lbr_rings(request, LBR_RING_OFFCPU, request->offcpu,
+                            request->offcpu_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hook_lbr_syscall
+// Description  : Hook the syscall entry of all threads, if the configuration
+//                asks for syscall snapshots. The hook is installed by the
+//                first such request and kept until the module exits, the
+//                handler returns right away while no state has a syscall
+//                ring.
+//
+// Inputs       : config - the LBR configuration of the request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 hook_lbr_syscall(struct lbr_config *config)
+{
+    if (config->syscall_records == 0 || lbr_syscall_hooked)
+        return 0;
+
+    if (xregister_syscall_hook(lbr_syscall_handler))
+    {
+        xprintdbg("LIBIHT-COM: Hook syscall entry failed\n");
+        return -1;
+    }
+
+    lbr_syscall_hooked = TRUE;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_syscall_selected
+// Description  : Check if a syscall is selected by the syscall mask of a
+//                configuration. An empty mask selects all syscalls.
+//
+// Inputs       : config - the LBR configuration
+//                syscall - the syscall number
+// Outputs      : u32 - TRUE if selected, FALSE otherwise
+
+u32 lbr_syscall_selected(struct lbr_config *config, u32 syscall)
+{
+    u32 i;
+
+    for (i = 0; i < LIBIHT_SYSCALL_MASK_WORDS; i++)
+    {
+        if (config->syscall_mask[i])
+            break;
+    }
+    if (i == LIBIHT_SYSCALL_MASK_WORDS)
+        return TRUE;
+
+    if (syscall >= LIBIHT_SYSCALL_MASK_WORDS * 64)
+        return FALSE;
+
+    return (config->syscall_mask[syscall / 64] >> (syscall % 64)) & 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : push_lbr_syscall
+// Description  : Append the LBR stack of the current thread entering a
+//                syscall to its syscall ring. The stack is read live from the
+//                cpu, so it shows the user code path that led to the syscall.
+//
+// Inputs       : state - the LBR state of the current thread
+//                syscall - the syscall number
+// Outputs      : void
+
+void push_lbr_syscall(struct lbr_state *state, u32 syscall)
+{
+    struct lbr_syscall_record record;
+    char irql_flag[MAX_IRQL_LEN];
+    u64 dbgctlmsr;
+    u32 i, cnt;
+
+    cnt = lbr_capacity < LIBIHT_LBR_MAX_ENTRIES ?
+            (u32)lbr_capacity : LIBIHT_LBR_MAX_ENTRIES;
+    xmemset(&record, 0, sizeof(record));
+
+    // The lock also keeps the thread on this cpu while the stack is read
+    xacquire_lock(lbr_state_lock, irql_flag);
+    if (!state->loaded || state->cpu != xcoreid())
+    {
+        xrelease_lock(lbr_state_lock, irql_flag);
+        return;
+    }
+
+    xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
+    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr & ~DEBUGCTLMSR_LBR);
+
+    xrdmsr(MSR_LBR_TOS, &record.lbr_tos);
+    for (i = 0; i < cnt; i++)
+    {
+        xrdmsr(MSR_LBR_NHM_FROM + i, &record.entries[i].from);
+        xrdmsr(MSR_LBR_NHM_TO + i, &record.entries[i].to);
+    }
+
+    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    record.timestamp = xget_timestamp();
+    record.pid = state->config.pid;
+    record.syscall = syscall;
+    record.cpu = xcoreid();
+
+    ring_push(state->syscall, &record);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_lbr_syscall
+// Description  : Move the pending syscall records of the requested thread, or
+//                of every traced thread of the requested process, to the
+//                syscall buffer of the request.
+//
+// Inputs       : request - the LBR ioctl request
+// Outputs      : s32 - number of records copied, -1 on failure
+
+s32 dump_lbr_syscall(struct lbr_ioctl_request *request)
+{
+    return drain_lbr_rings(request, LBR_RING_SYSCALL, request->syscall,
+                            request->syscall_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_lbr_paused
+// Description  : Pause or resume the LBR for the given process id. The LBR
+//                state stays allocated and listed, only the trace bit of a
+//                running thread is flipped, and paused threads are skipped by
+//                the context switch handler.
 //
 // Inputs       : request - the LBR ioctl request
+//                paused - TRUE to pause, FALSE to resume
 // Outputs      : s32 - 0 on success, -1 on failure
 
-
-s32 disable_lbr(struct lbr_ioctl_request *request)
+s32 set_lbr_paused(struct lbr_ioctl_request *request, u32 paused)
 {
-    struct lbr_state *state;
+    struct lbr_state *state, *curr_state;
+    char irql_flag[MAX_IRQL_LEN];
+    void *curr_list;
+    u64 offset;
+
+    if (request->lbr_config.scope == LIBIHT_SCOPE_PROCESS)
+    {
+        if (find_lbr_proc_state(request->lbr_config.pid) == NULL)
+        {
+            xprintdbg("LIBIHT-COM: LBR not enabled for process %d\n",
+                        request->lbr_config.pid);
+            return -1;
+        }
+
+        xacquire_lock(lbr_state_lock, irql_flag);
+
+        // offsetof(st, m) macro implementation of stddef.h
+        offset = (u64)(&((struct lbr_state *)0)->list);
+        curr_list = xlist_next(lbr_state_head);
+        while (curr_list != NULL && curr_list != lbr_state_head)
+        {
+            curr_state = (struct lbr_state *)((u64)curr_list - offset);
+            curr_list = xlist_next(curr_list);
+            if (curr_state->config.scope == LIBIHT_SCOPE_PROCESS &&
+                curr_state->tgid == request->lbr_config.pid)
+            {
+                curr_state->user_paused = paused;
+                curr_state->paused = curr_state->user_paused ||
+                                        curr_state->gate_paused;
+            }
+        }
+
+        xrelease_lock(lbr_state_lock, irql_flag);
+
+        // Apply right away if the caller is one of the traced threads
+        state = find_lbr_state(xgetcurrent_pid());
+        if (state && state->config.scope == LIBIHT_SCOPE_PROCESS &&
+            state->tgid == request->lbr_config.pid)
+            sync_lbr_paused(state);
+        return 0;
+    }
 
     state = find_lbr_state(request->lbr_config.pid);
     if (state == NULL)
@@ -213,104 +1197,92 @@ s32 disable_lbr(struct lbr_ioctl_request *request)
         return -1;
     }
 
-    if (state->config.pid == xgetcurrent_pid())
-        get_lbr(state);
-    remove_lbr_state(state);
+    pause_lbr_state(state, LBR_PAUSE_USER, paused);
+    sync_lbr_paused(state);
     return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : dump_lbr
-// Description  : Dump the LBR registers for the given process id.
+// Function     : pause_lbr_state
+// Description  : Set a pause source of an LBR state. The state is paused while
+//                either the user (ioctl or window) or the trace gate pauses
+//                it, so one never overrides the other.
 //
-// Inputs       : request - the LBR ioctl request
-// Outputs      : s32 - 0 on success, -1 on failure
+// Inputs       : state - the LBR state
+//                source - LBR_PAUSE_USER or LBR_PAUSE_GATE
+//                paused - TRUE to pause, FALSE to resume
+// Outputs      : void
 
-s32 dump_lbr(struct lbr_ioctl_request *request)
+void pause_lbr_state(struct lbr_state *state, u32 source, u32 paused)
 {
-    u64 i, bytes_left;
-    struct lbr_state* state;
-    struct lbr_data req_buf;
     char irql_flag[MAX_IRQL_LEN];
 
-    state = find_lbr_state(request->lbr_config.pid);
-    if (state == NULL)
-    {
-        xprintdbg("LIBIHT-COM: LBR not enabled for pid %d\n",
-                    request->lbr_config.pid);
-        return -1;
-    }
-
-    // Examine if the current process is the owner of the LBR state
-    if (state->config.pid == xgetcurrent_pid())
-    {
-        xprintdbg("LIBIHT-COM: Dump LBR for current process\n");
-        // Get fresh LBR info
-        get_lbr(state);
-        put_lbr(state);
-    }
-
     xacquire_lock(lbr_state_lock, irql_flag);
+    if (source == LBR_PAUSE_GATE)
+        state->gate_paused = paused;
+    else
+        state->user_paused = paused;
+    state->paused = state->user_paused || state->gate_paused;
+    xrelease_lock(lbr_state_lock, irql_flag);
+}
 
-    // Dump the LBR state
-    xprintdbg("PROC_PID:             %d\n", state->config.pid);
-    xprintdbg("MSR_LBR_SELECT:       0x%llx\n", state->config.lbr_select);
-    xprintdbg("MSR_LBR_TOS:          %lld\n", state->data->lbr_tos);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : own_lbr_state
+// Description  : Hand an LBR state over to a kernel owner, such as the
+//                trace window or the exec rule that enabled it. An owned
+//                state is freed when its thread exits or its owner is
+//                deleted, while a state enabled by the user stays until it
+//                is disabled.
+//
+// Inputs       : state - the LBR state
+//                owner - LBR_OWNER_WINDOW or LBR_OWNER_EXEC_RULE
+//                owner_id - the window or exec rule id
+// Outputs      : void
 
-    for (i = 0; i < lbr_capacity; i++)
-    {
-        xprintdbg("MSR_LBR_NHM_FROM[%2d]: 0x%llx\n", i,
-                    state->data->entries[i].from);
-        xprintdbg("MSR_LBR_NHM_TO  [%2d]: 0x%llx\n", i,
-                    state->data->entries[i].to);
-    }
+void own_lbr_state(struct lbr_state *state, u32 owner, u32 owner_id)
+{
+    char irql_flag[MAX_IRQL_LEN];
 
-    xprintdbg("LIBIHT-COM: LBR info for cpuid: %d\n", xcoreid());
+    xacquire_lock(lbr_state_lock, irql_flag);
+    state->owner = owner;
+    state->owner_id = owner_id;
+    xrelease_lock(lbr_state_lock, irql_flag);
+}
 
-    // Dump the LBR data to userspace buffer
-    if (request->buffer)
-    {
-        // Get a copy of data from userspace buffer
-        bytes_left = xcopy_from_user(&req_buf, request->buffer,
-                                        sizeof(struct lbr_data));
-        if (bytes_left)
-        {
-            xprintdbg("LIBIHT-COM: Copy LBR data from user failed\n");
-            xrelease_lock(lbr_state_lock, irql_flag);
-            return -1;
-        }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sync_lbr_paused
+// Description  : Apply the paused flag of an LBR state to the current cpu if
+//                the state belongs to the current thread. While the LBR stack
+//                of the state is still loaded, only the DEBUGCTL bit is
+//                flipped.
+//
+// Inputs       : state - the LBR state
+// Outputs      : void
 
-        // Dump data to userspace entry ptr
-        req_buf.lbr_tos = state->data->lbr_tos;
-        if (req_buf.entries)
-        {
-            bytes_left = xcopy_to_user(req_buf.entries,
-                                        state->data->entries,
-                                        lbr_capacity * sizeof(struct lbr_stack_entry));
+void sync_lbr_paused(struct lbr_state *state)
+{
+    u64 dbgctlmsr;
 
-            if (bytes_left)
-            {
-                xprintdbg("LIBIHT-COM: Copy LBR data to user failed\n");
-                xrelease_lock(lbr_state_lock, irql_flag);
-                return -1;
-            }
-        }
+    if (state->config.pid != xgetcurrent_pid())
+        return;
 
-        // Copy updated data back to userspace buffer
-        bytes_left = xcopy_to_user(request->buffer, &req_buf,
-                                    sizeof(struct lbr_data));
-        if (bytes_left)
-        {
-            xprintdbg("LIBIHT-COM: Copy LBR data to user failed\n");
-            xrelease_lock(lbr_state_lock, irql_flag);
-            return -1;
-        }
+    if (!state->loaded)
+    {
+        // Saved since the pause, restore the stack on resume
+        if (!state->paused)
+            put_lbr(state);
+        return;
     }
 
-    xrelease_lock(lbr_state_lock, irql_flag);
-
-    return 0;
+    xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
+    if (state->paused)
+        dbgctlmsr &= ~DEBUGCTLMSR_LBR;
+    else
+        dbgctlmsr |= DEBUGCTLMSR_LBR;
+    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -324,7 +1296,48 @@ s32 dump_lbr(struct lbr_ioctl_request *request)
 
 s32 config_lbr(struct lbr_ioctl_request *request)
 {
-    struct lbr_state* state;
+    struct lbr_state *state, *curr_state;
+    char irql_flag[MAX_IRQL_LEN];
+    void *curr_list;
+    u64 offset;
+
+    if (request->lbr_config.scope == LIBIHT_SCOPE_PROCESS)
+    {
+        if (find_lbr_proc_state(request->lbr_config.pid) == NULL)
+        {
+            xprintdbg("LIBIHT-COM: LBR not enabled for process %d\n",
+                        request->lbr_config.pid);
+            return -1;
+        }
+
+        // Pause the current thread first if it belongs to the process
+        state = find_lbr_state(xgetcurrent_pid());
+        if (state && (state->config.scope != LIBIHT_SCOPE_PROCESS ||
+            state->tgid != request->lbr_config.pid))
+            state = NULL;
+        if (state && state->loaded)
+            get_lbr(state);
+
+        xacquire_lock(lbr_state_lock, irql_flag);
+
+        // offsetof(st, m) macro implementation of stddef.h
+        offset = (u64)(&((struct lbr_state *)0)->list);
+        curr_list = xlist_next(lbr_state_head);
+        while (curr_list != NULL && curr_list != lbr_state_head)
+        {
+            curr_state = (struct lbr_state *)((u64)curr_list - offset);
+            curr_list = xlist_next(curr_list);
+            if (curr_state->config.scope == LIBIHT_SCOPE_PROCESS &&
+                curr_state->tgid == request->lbr_config.pid)
+                curr_state->config.lbr_select = request->lbr_config.lbr_select;
+        }
+
+        xrelease_lock(lbr_state_lock, irql_flag);
+
+        if (state && !state->paused)
+            put_lbr(state);
+        return 0;
+    }
 
     state = find_lbr_state(request->lbr_config.pid);
     if (state == NULL)
@@ -336,9 +1349,11 @@ s32 config_lbr(struct lbr_ioctl_request *request)
 
     if (state->config.pid == xgetcurrent_pid())
     {
-        get_lbr(state);
+        if (state->loaded)
+            get_lbr(state);
         state->config.lbr_select = request->lbr_config.lbr_select;
-        put_lbr(state);
+        if (!state->paused)
+            put_lbr(state);
     }
     else
     {
@@ -430,6 +1445,80 @@ struct lbr_state* find_lbr_state(u32 pid)
     return ret_state;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_lbr_proc_state
+// Description  : Find any process scope LBR state of the given thread group.
+//
+// Inputs       : tgid - the thread group id (user process pid)
+// Outputs      : struct lbr_state* - the LBR state
+
+struct lbr_state* find_lbr_proc_state(u32 tgid)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct lbr_state *curr_state, *ret_state = NULL;
+    void *curr_list;
+    u64 offset;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct lbr_state *)0)->list);
+    curr_list = xlist_next(lbr_state_head);
+    while (curr_list != NULL && curr_list != lbr_state_head)
+    {
+        curr_state = (struct lbr_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (tgid != 0 && curr_state->config.scope == LIBIHT_SCOPE_PROCESS &&
+            curr_state->tgid == tgid)
+        {
+            ret_state = curr_state;
+            break;
+        }
+    }
+
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    return ret_state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_lbr_owned_state
+// Description  : Find any LBR state of a kernel owner.
+//
+// Inputs       : owner - LBR_OWNER_WINDOW or LBR_OWNER_EXEC_RULE
+//                owner_id - the window or exec rule id
+// Outputs      : struct lbr_state* - the LBR state, NULL if not found
+
+struct lbr_state* find_lbr_owned_state(u32 owner, u32 owner_id)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct lbr_state *curr_state, *ret_state = NULL;
+    void *curr_list;
+    u64 offset;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct lbr_state *)0)->list);
+    curr_list = xlist_next(lbr_state_head);
+    while (curr_list != NULL && curr_list != lbr_state_head)
+    {
+        curr_state = (struct lbr_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (curr_state->owner == owner && curr_state->owner_id == owner_id)
+        {
+            ret_state = curr_state;
+            break;
+        }
+    }
+
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    return ret_state;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : insert_lbr_state
@@ -471,12 +1560,55 @@ void remove_lbr_state(struct lbr_state* old_state)
     xprintdbg("LIBIHT-COM: Remove LBR state for pid %d\n",
                 old_state->config.pid);
     xlist_del(old_state->list);
+    free_lbr_rings(old_state);
     xfree(old_state->data->entries);
     xfree(old_state->data);
     xfree(old_state);
     xrelease_lock(lbr_state_lock, irql_flag);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_lbr_proc_states
+// Description  : Remove all process scope LBR states of the given thread
+//                group from the list.
+//
+// Inputs       : tgid - the thread group id (user process pid)
+// Outputs      : void
+
+void remove_lbr_proc_states(u32 tgid)
+{
+    struct lbr_state *state;
+
+    while ((state = find_lbr_proc_state(tgid)) != NULL)
+    {
+        if (state->config.pid == xgetcurrent_pid())
+            get_lbr(state);
+        remove_lbr_state(state);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_lbr_owned_states
+// Description  : Remove all LBR states of a kernel owner from the list.
+//
+// Inputs       : owner - LBR_OWNER_WINDOW or LBR_OWNER_EXEC_RULE
+//                owner_id - the window or exec rule id
+// Outputs      : void
+
+void remove_lbr_owned_states(u32 owner, u32 owner_id)
+{
+    struct lbr_state *state;
+
+    while ((state = find_lbr_owned_state(owner, owner_id)) != NULL)
+    {
+        if (state->config.pid == xgetcurrent_pid())
+            get_lbr(state);
+        remove_lbr_state(state);
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : free_lbr_state_list
@@ -505,6 +1637,7 @@ void free_lbr_state_list(void)
                     curr_state->config.pid);
 
         xlist_del(curr_state->list);
+        free_lbr_rings(curr_state);
         xfree(curr_state->data->entries);
         xfree(curr_state->data);
         xfree(curr_state);
@@ -548,6 +1681,26 @@ s32 lbr_ioctl_handler(struct xioctl_request *request)
                         request->body.lbr.lbr_config.pid);
             ret = config_lbr(&request->body.lbr);
             break;
+        case LIBIHT_IOCTL_PAUSE_LBR:
+            xprintdbg("LIBIHT-COM: Pause LBR for pid %d\n",
+                        request->body.lbr.lbr_config.pid);
+            ret = set_lbr_paused(&request->body.lbr, TRUE);
+            break;
+        case LIBIHT_IOCTL_RESUME_LBR:
+            xprintdbg("LIBIHT-COM: Resume LBR for pid %d\n",
+                        request->body.lbr.lbr_config.pid);
+            ret = set_lbr_paused(&request->body.lbr, FALSE);
+            break;
+        case LIBIHT_IOCTL_DUMP_LBR_OFFCPU:
+            xprintdbg("LIBIHT-COM: Dump LBR off-cpu records for pid %d\n",
+                        request->body.lbr.lbr_config.pid);
+            ret = dump_lbr_offcpu(&request->body.lbr);
+            break;
+        case LIBIHT_IOCTL_DUMP_LBR_SYSCALL:
+            xprintdbg("LIBIHT-COM: Dump LBR syscall records for pid %d\n",
+                        request->body.lbr.lbr_config.pid);
+            ret = dump_lbr_syscall(&request->body.lbr);
+            break;
         default:
             xprintdbg("LIBIHT-COM: Invalid LBR ioctl command\n");
             ret = -1;
@@ -560,54 +1713,66 @@ s32 lbr_ioctl_handler(struct xioctl_request *request)
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lbr_cswitch_handler
-// Description  : The context switch handler for the LBR feature.
+// Description  : The context switch handler for the LBR feature. The LBR
+//                stack saved from the previous thread is also appended to
+//                its off-cpu ring if configured.
 //
 // Inputs       : prev_pid - the previous process id
 //                next_pid - the next process id
+//                prev_state - the task state index of the previous process
 // Outputs      : void
 
-void lbr_cswitch_handler(u32 prev_pid, u32 next_pid)
+void lbr_cswitch_handler(u32 prev_pid, u32 next_pid, u32 prev_state)
 {
-    struct lbr_state *prev_state, *next_state;
+    struct lbr_state *prev, *next;
 
-    prev_state = find_lbr_state(prev_pid);
-    next_state = find_lbr_state(next_pid);
+    prev = find_lbr_state(prev_pid);
+    next = find_lbr_state(next_pid);
 
-    if (prev_state)
+    // A paused state is saved once on its first switch out, then skipped
+    if (prev && prev->loaded)
     {
         xprintdbg("LIBIHT-COM: LBR context switch from pid %d on cpu core %d\n",
-                    prev_state->config.pid, xcoreid());
-        get_lbr(prev_state);
+                    prev->config.pid, xcoreid());
+        get_lbr(prev);
+        if (prev->offcpu)
+            push_lbr_offcpu(prev, prev_state, next_pid);
     }
 
-    if (next_state)
+    if (next && !next->paused)
     {
         xprintdbg("LIBIHT-COM: LBR context switch to pid %d on cpu core %d\n",
-                    next_state->config.pid, xcoreid());
-        put_lbr(next_state);
+                    next->config.pid, xcoreid());
+        put_lbr(next);
     }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lbr_newproc_handler
-// Description  : The new process handler for the LBR feature.
+// Description  : The new process handler for the LBR feature. A new thread of
+//                a process traced in process scope joins the process trace,
+//                otherwise the child inherits the trace of its parent.
 //
 // Inputs       : parent_pid - the parent process id
 //                child_pid - the child process id
+//                child_tgid - the child thread group id
 // Outputs      : void
 
-void lbr_newproc_handler(u32 parent_pid, u32 child_pid)
+void lbr_newproc_handler(u32 parent_pid, u32 child_pid, u32 child_tgid)
 {
-    struct lbr_state *parent_state, *child_state;
+    struct lbr_state *parent_state = NULL, *child_state;
     char irql_flag[MAX_IRQL_LEN];
 
-    parent_state = find_lbr_state(parent_pid);
+    if (child_pid != child_tgid)
+        parent_state = find_lbr_proc_state(child_tgid);
+    if (parent_state == NULL)
+        parent_state = find_lbr_state(parent_pid);
     if (parent_state == NULL)
         return;
 
     xprintdbg("LIBIHT-COM: LBR new child process pid %d, parent pid %d\n",
-                child_pid, parent_pid);
+                child_pid, parent_state->config.pid);
     child_state = create_lbr_state();
     if (child_state == NULL)
         return;
@@ -615,19 +1780,91 @@ void lbr_newproc_handler(u32 parent_pid, u32 child_pid)
     xacquire_lock(lbr_state_lock, irql_flag);
     // Copy parent state to child state
     child_state->parent = parent_state;
+    child_state->tgid = child_tgid;
     child_state->config.pid = child_pid;
+    child_state->config.scope = parent_state->config.scope;
     child_state->config.lbr_select = parent_state->config.lbr_select;
-    xmemcpy(child_state->data, parent_state->data,
-                sizeof(struct lbr_data) +
-                    lbr_capacity * sizeof(struct lbr_stack_entry));
+    child_state->config.offcpu_records = parent_state->config.offcpu_records;
+    child_state->config.syscall_records = parent_state->config.syscall_records;
+    xmemcpy(child_state->config.syscall_mask, parent_state->config.syscall_mask,
+            sizeof(child_state->config.syscall_mask));
+    // The trace gate belongs to the parent thread only
+    child_state->user_paused = parent_state->user_paused;
+    child_state->paused = child_state->user_paused;
+    child_state->owner = parent_state->owner;
+    child_state->owner_id = parent_state->owner_id;
+    child_state->data->lbr_tos = parent_state->data->lbr_tos;
+    xmemcpy(child_state->data->entries, parent_state->data->entries,
+                lbr_capacity * sizeof(struct lbr_stack_entry));
     xrelease_lock(lbr_state_lock, irql_flag);
+
+    if (setup_lbr_rings(child_state))
+    {
+        xfree(child_state->data->entries);
+        xfree(child_state->data);
+        xfree(child_state);
+        return;
+    }
     insert_lbr_state(child_state);
 
     // If the child process is the current process, trace it right away
-    if (child_pid == xgetcurrent_pid())
+    if (child_pid == xgetcurrent_pid() && !child_state->paused)
         put_lbr(child_state);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_exitproc_handler
+// Description  : The process exit handler for the LBR feature. Threads traced
+//                in process scope or by a kernel owner are detached when they
+//                exit, so that short-lived workers do not pile up in the
+//                state list and a recycled pid does not inherit the trace.
+//
+// Inputs       : pid - the exiting process id
+// Outputs      : void
+
+void lbr_exitproc_handler(u32 pid)
+{
+    struct lbr_state *state;
+
+    state = find_lbr_state(pid);
+    if (state == NULL || (state->config.scope != LIBIHT_SCOPE_PROCESS &&
+        state->owner == LBR_OWNER_USER))
+        return;
+
+    xprintdbg("LIBIHT-COM: LBR traced thread %d exit\n", pid);
+    if (pid == xgetcurrent_pid())
+        get_lbr(state);
+    remove_lbr_state(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_syscall_handler
+// Description  : The syscall entry handler for the LBR feature. Must be called
+//                by the thread entering the syscall. Selected syscalls of
+//                threads with a syscall ring get a snapshot of their LBR.
+//
+// Inputs       : pid - the thread id
+//                syscall - the syscall number
+// Outputs      : void
+
+void lbr_syscall_handler(u32 pid, u32 syscall)
+{
+    struct lbr_state *state;
+
+    // Fast path when no thread asked for syscall snapshots
+    if (lbr_syscall_users == 0)
+        return;
+
+    state = find_lbr_state(pid);
+    if (state == NULL || state->syscall == NULL || state->paused)
+        return;
+
+    if (lbr_syscall_selected(&state->config, syscall))
+        push_lbr_syscall(state, syscall);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lbr_check
@@ -713,6 +1950,14 @@ s32 lbr_exit(void)
     xprintdbg("LIBIHT-COM: Flushing LBR for all cpus...\n");
     xon_each_cpu(flush_lbr);
 
+    // Remove the syscall hook before the states it looks up
+    if (lbr_syscall_hooked)
+    {
+        xprintdbg("LIBIHT-COM: Removing LBR syscall hook...\n");
+        xunregister_syscall_hook();
+        lbr_syscall_hooked = FALSE;
+    }
+
     // Free all LBR state
     xprintdbg("LIBIHT-COM: Freeing LBR state list...\n");
     free_lbr_state_list();
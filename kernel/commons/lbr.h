@@ -16,6 +16,7 @@
 #include "types.h"
 #include "xplat.h"
 #include "xioctl.h"
+#include "ring.h"
 
 // cpp cross compile handler
 #ifdef __cplusplus
@@ -68,6 +69,25 @@ extern "C" {
  */
 #define LBR_SELECT              (1UL <<  0)
 
+// Maximum number of off-cpu LBR records kept per thread
+#define LBR_OFFCPU_MAX_RECORDS  0x1000
+
+// Maximum number of syscall LBR records kept per thread
+#define LBR_SYSCALL_MAX_RECORDS 0x1000
+
+// Snapshot rings of an LBR state
+#define LBR_RING_OFFCPU         0
+#define LBR_RING_SYSCALL        1
+
+// Pause sources of an LBR state
+#define LBR_PAUSE_USER          0
+#define LBR_PAUSE_GATE          1
+
+// Owners of an LBR state, a state owned by the kernel is freed on thread exit
+#define LBR_OWNER_USER          0
+#define LBR_OWNER_WINDOW        1
+#define LBR_OWNER_EXEC_RULE     2
+
 //
 // Type definitions
 
@@ -78,6 +98,16 @@ struct lbr_state
     struct lbr_state *parent;         // Parent lbr_state
     struct lbr_config config;         // LBR configuration
     struct lbr_data *data;            // LBR data
+    u32 tgid;                         // Thread group id (process scope)
+    u32 paused;                       // Tracing paused, skip save/restore
+    u32 user_paused;                  // Paused by an ioctl or a window
+    u32 gate_paused;                  // Paused by the trace gate
+    u32 owner;                        // LBR_OWNER_* that enabled the state
+    u32 owner_id;                     // Window or exec rule id of the owner
+    u32 loaded;                       // LBR stack loaded on the running cpu
+    u32 cpu;                          // CPU core the LBR stack is loaded on
+    struct ring_buffer *offcpu;       // Off-cpu snapshots (may be NULL)
+    struct ring_buffer *syscall;      // Syscall snapshots (may be NULL)
 };
 
 // CPU - LBR map
@@ -99,6 +129,9 @@ extern char lbr_state_lock[MAX_LOCK_LEN];
 extern char lbr_state_head[MAX_LIST_LEN];
 // The head of the lbr_state_list.
 
+extern u32 lbr_syscall_users;
+// The number of LBR states with a syscall snapshot ring.
+
 //
 // Function Prototypes
 
@@ -114,12 +147,76 @@ void flush_lbr(void);
 s32 enable_lbr(struct lbr_ioctl_request *request);
 // Enable the LBR.
 
+s32 enable_lbr_process(struct lbr_ioctl_request *request);
+// Enable the LBR for all threads of a given process.
+
+s32 attach_lbr_state(struct lbr_state *state, struct lbr_ioctl_request *request);
+// Enable the LBR with a preallocated state, without allocating.
+
 s32 disable_lbr(struct lbr_ioctl_request *request);
 // Disable the LBR.
 
 s32 dump_lbr(struct lbr_ioctl_request *request);
 // Dump the LBR of a given process.
 
+s32 dump_lbr_process(struct lbr_ioctl_request *request);
+// Dump the LBR of all threads of a given process.
+
+s32 dump_lbr_threads(struct lbr_ioctl_request *request, u32 process);
+// Dump the LBR of a thread or of all threads of a process through a stage.
+
+void dump_lbr_state(struct lbr_state *state, struct lbr_data *data);
+// Copy a single LBR state to a kernel LBR data.
+
+s32 copy_lbr_to_user(struct lbr_data *data, struct lbr_data *buffer);
+// Copy a kernel LBR data to the userspace buffer.
+
+void snapshot_lbr(void *info);
+// Snapshot the LBR stack of the state loaded on the current cpu.
+
+void refresh_remote_lbr(struct lbr_ioctl_request *request);
+// Snapshot the LBR stacks of the requested threads running on other cpus.
+
+s32 setup_lbr_rings(struct lbr_state *state);
+// Allocate the off-cpu and syscall snapshot rings of an LBR state if configured.
+
+void free_lbr_rings(struct lbr_state *state);
+// Free the snapshot rings of an LBR state.
+
+void push_lbr_offcpu(struct lbr_state *state, u32 prev_state, u32 next_pid);
+// Append the saved LBR stack of a switched out thread to its off-cpu ring.
+
+s32 drain_lbr_rings(struct lbr_ioctl_request *request, u32 selector,
+                    void *buffer, u32 max_cnt);
+// Drain a snapshot ring of a thread or of all threads of a process.
+
+s32 dump_lbr_offcpu(struct lbr_ioctl_request *request);
+// Dump the off-cpu snapshots of a thread or of all threads of a process.
+
+s32 hook_lbr_syscall(struct lbr_config *config);
+// Hook the syscall entry if the configuration asks for syscall snapshots.
+
+u32 lbr_syscall_selected(struct lbr_config *config, u32 syscall);
+// Check if a syscall is selected by the syscall mask of a configuration.
+
+void push_lbr_syscall(struct lbr_state *state, u32 syscall);
+// Append the live LBR stack of the current thread to its syscall ring.
+
+s32 dump_lbr_syscall(struct lbr_ioctl_request *request);
+// Dump the syscall snapshots of a thread or of all threads of a process.
+
+s32 set_lbr_paused(struct lbr_ioctl_request *request, u32 paused);
+// Pause or resume the LBR without freeing its state.
+
+void pause_lbr_state(struct lbr_state *state, u32 source, u32 paused);
+// Set a pause source of an LBR state and update its paused flag.
+
+void own_lbr_state(struct lbr_state *state, u32 owner, u32 owner_id);
+// Hand an LBR state over to a kernel owner.
+
+void sync_lbr_paused(struct lbr_state *state);
+// Apply the paused flag of the current thread LBR state.
+
 s32 config_lbr(struct lbr_ioctl_request *request);
 // Configure the LBR.
 
@@ -129,24 +226,42 @@ struct lbr_state *create_lbr_state(void);
 struct lbr_state *find_lbr_state(u32 pid);
 // Find a lbr_state from the lbr_state_list.
 
+struct lbr_state *find_lbr_proc_state(u32 tgid);
+// Find any process scope lbr_state of a thread group.
+
+struct lbr_state *find_lbr_owned_state(u32 owner, u32 owner_id);
+// Find any lbr_state of a kernel owner.
+
 void insert_lbr_state(struct lbr_state *new_state);
 // Insert a new lbr_state to the lbr_state_list.
 
 void remove_lbr_state(struct lbr_state *old_state);
 // Remove a lbr_state from the lbr_state_list.
 
+void remove_lbr_proc_states(u32 tgid);
+// Remove all process scope lbr_states of a thread group.
+
+void remove_lbr_owned_states(u32 owner, u32 owner_id);
+// Remove all lbr_states of a kernel owner.
+
 void free_lbr_state_list(void);
 // Free the lbr_state_list.
 
 s32 lbr_ioctl_handler(struct xioctl_request *request);
 // The ioctl handler for the LBR.
 
-void lbr_cswitch_handler(u32 prev_pid, u32 next_pid);
+void lbr_cswitch_handler(u32 prev_pid, u32 next_pid, u32 prev_state);
 // The context switch handler for the LBR.
 
-void lbr_newproc_handler(u32 parent_pid, u32 child_pid);
+void lbr_newproc_handler(u32 parent_pid, u32 child_pid, u32 child_tgid);
 // The new process handler for the LBR.
 
+void lbr_exitproc_handler(u32 pid);
+// The process exit handler for the LBR.
+
+void lbr_syscall_handler(u32 pid, u32 syscall);
+// The syscall entry handler for the LBR.
+
 s32 lbr_check(void);
 // Check if the LBR is available.
 
@@ -0,0 +1,1337 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/pt.c
+//  Description    : This is the implementation of the Intel PT feature for the
+//                   libiht library. The packets are written by the cpu into a
+//                   ring of 4K output pages described by linked ToPA tables,
+//                   and copied out in trace order on dump. Decoding is left
+//                   to the user library.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "pt.h"
+
+//
+// Global Variables
+char pt_state_lock[MAX_LOCK_LEN];
+// Lock for pt state list
+
+char pt_state_head[MAX_LIST_LEN];
+// Head of pt state list
+
+u32 pt_supported;
+// Whether the cpu can trace into a multi entry ToPA buffer
+
+u32 pt_cap;
+// Intel PT capabilities, CPUID.(EAX=14H, ECX=0):EBX
+
+u64 pt_ctl_mask;
+// MSR_IA32_RTIT_CTL bits a configuration may set on this cpu
+
+u32 pt_range_count;
+// Number of address ranges of this cpu
+
+u32 pt_mtc_bitmap;
+// Supported MTC frequencies
+
+u32 pt_cyc_bitmap;
+// Supported cycle thresholds
+
+u32 pt_psb_bitmap;
+// Supported PSB frequencies
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_pt
+// Description  : Stop the trace of a PT state on the current cpu, which
+//                flushes its pending packets, and save its output position.
+//
+// Inputs       : state - the PT state
+// Outputs      : void
+
+void get_pt(struct pt_state *state)
+{
+    u64 ctl, offset;
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(pt_state_lock, irql_flag);
+
+    // Disable PT, the output MSRs can only be read back once it stopped
+    xrdmsr(MSR_IA32_RTIT_CTL, &ctl);
+    ctl &= ~RTIT_CTL_TRACEEN;
+    xwrmsr(MSR_IA32_RTIT_CTL, ctl);
+
+    xrdmsr(MSR_IA32_RTIT_OUTPUT_BASE, &state->output_base);
+    xrdmsr(MSR_IA32_RTIT_OUTPUT_MASK, &state->output_mask);
+    xrdmsr(MSR_IA32_RTIT_STATUS, &state->status);
+    if (state->status & RTIT_STATUS_ERROR)
+        xprintdbg("LIBIHT-COM: PT operational error for pid %d.\n",
+                    state->config.pid);
+
+    // The output ring is circular, going backward means it wrapped
+    offset = pt_output_offset(state);
+    if (offset < state->offset)
+        state->wrapped = TRUE;
+    state->offset = offset;
+
+    state->loaded = FALSE;
+    xrelease_lock(pt_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_pt
+// Description  : Restore the output position and filters of a PT state on the
+//                current cpu and start its trace.
+//
+// Inputs       : state - the PT state
+// Outputs      : void
+
+void put_pt(struct pt_state *state)
+{
+    struct pt_range *range;
+    char irql_flag[MAX_IRQL_LEN];
+    u32 i;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+
+    // Other trace MSRs may only be written with the trace disabled
+    xwrmsr(MSR_IA32_RTIT_CTL, 0);
+    xwrmsr(MSR_IA32_RTIT_OUTPUT_BASE, state->output_base);
+    xwrmsr(MSR_IA32_RTIT_OUTPUT_MASK, state->output_mask);
+    xwrmsr(MSR_IA32_RTIT_STATUS, state->status);
+
+    if (state->ctl & RTIT_CTL_CR3EN)
+        xwrmsr(MSR_IA32_RTIT_CR3_MATCH, state->cr3);
+
+    for (i = 0; i < state->config.range_count; i++)
+    {
+        range = &state->config.ranges[i];
+        xwrmsr(MSR_IA32_RTIT_ADDR0_A + 2 * i, range->start);
+        xwrmsr(MSR_IA32_RTIT_ADDR0_A + 2 * i + 1, range->end);
+    }
+
+    // Enable PT
+    xwrmsr(MSR_IA32_RTIT_CTL, state->ctl | RTIT_CTL_TRACEEN);
+
+    state->loaded = TRUE;
+    xrelease_lock(pt_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_pt
+// Description  : Stop the trace on the current cpu. Caller should ensure this
+//                function is called with interrupts disabled (either on single
+//                core or with interrupts disabled for that core).
+//
+// Inputs       : void
+// Outputs      : void
+
+void flush_pt(void)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    xlock_core(irql_flag);
+
+    xprintdbg("LIBIHT-COM: Flush PT on cpu core: %d...\n", xcoreid());
+    xwrmsr(MSR_IA32_RTIT_CTL, 0);
+
+    xrelease_core(irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_output_offset
+// Description  : Compute the offset of the next packet byte in the output
+//                ring of a PT state, from its saved ToPA table, entry index
+//                and page offset.
+//
+// Inputs       : state - the PT state
+// Outputs      : The output offset in bytes
+
+u64 pt_output_offset(struct pt_state *state)
+{
+    u64 table, entry, page;
+
+    for (table = 0; table < state->table_count; table++)
+        if (xvirt_to_phys(state->topa[table]) == state->output_base)
+            break;
+    if (table == state->table_count)
+        return 0;
+
+    entry = (state->output_mask & 0xffffff80) >> 7;
+    page = table * PT_TOPA_ENTRIES + entry;
+    if (page >= state->page_count)
+        return 0;
+
+    return page * PT_PAGE_SIZE +
+            ((state->output_mask >> 32) & (PT_PAGE_SIZE - 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_pt
+// Description  : Enable the PT.
+//
+// Inputs       : request - the PT ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 enable_pt(struct pt_ioctl_request *request)
+{
+    struct pt_state *state;
+
+    if (request->pt_config.scope == LIBIHT_SCOPE_PROCESS)
+        return enable_pt_process(request);
+
+    state = find_pt_state(request->pt_config.pid);
+    if (state)
+    {
+        xprintdbg("LIBIHT-COM: PT already enabled for pid %d.\n",
+                    request->pt_config.pid);
+        return -1;
+    }
+
+    state = create_pt_state();
+    if (state == NULL)
+    {
+        xprintdbg("LIBIHT-COM: Create PT state failed.\n");
+        return -1;
+    }
+
+    // Setup fields for PT state
+    state->parent = NULL;
+    state->config.pid = request->pt_config.pid ?
+                request->pt_config.pid : xgetcurrent_pid();
+    state->config.scope = LIBIHT_SCOPE_THREAD;
+    if (config_pt_state(state, &request->pt_config))
+    {
+        xprintdbg("LIBIHT-COM: Invalid PT configuration.\n");
+        free_pt_state(state);
+        return -1;
+    }
+
+    if (setup_pt_buffer(state))
+    {
+        xprintdbg("LIBIHT-COM: Allocate PT buffer failed.\n");
+        free_pt_state(state);
+        return -1;
+    }
+
+    insert_pt_state(state);
+    // If the requesting process is the current process, trace it right away
+    if (state->config.pid == xgetcurrent_pid())
+        put_pt(state);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_pt_process
+// Description  : Enable the PT for every thread of the requested process
+//                (thread group). Each thread gets its own PT state and
+//                buffer, and threads created later join the trace through
+//                `pt_newproc_handler`.
+//
+// Inputs       : request - the PT ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 enable_pt_process(struct pt_ioctl_request *request)
+{
+    struct pt_state *state;
+    u32 *tids, tgid, tid_cnt, max_cnt, i;
+
+    tgid = request->pt_config.pid ?
+                request->pt_config.pid : xgetcurrent_tgid();
+    if (find_pt_proc_state(tgid))
+    {
+        xprintdbg("LIBIHT-COM: PT already enabled for process %d.\n", tgid);
+        return -1;
+    }
+
+    // Collect the thread ids, retry with a larger array if it is too small
+    max_cnt = MAX_PROC_THREADS;
+    while (TRUE)
+    {
+        tids = xmalloc(max_cnt * sizeof(u32));
+        if (tids == NULL)
+            return -1;
+
+        tid_cnt = xget_thread_ids(tgid, tids, max_cnt);
+        if (tid_cnt <= max_cnt)
+            break;
+
+        xfree(tids);
+        max_cnt = tid_cnt << 1;
+    }
+
+    if (tid_cnt == 0)
+    {
+        xprintdbg("LIBIHT-COM: No threads found for process %d.\n", tgid);
+        xfree(tids);
+        return -1;
+    }
+
+    for (i = 0; i < tid_cnt; i++)
+    {
+        // Threads traced on their own keep their existing state
+        if (find_pt_state(tids[i]))
+            continue;
+
+        state = create_pt_state();
+        if (state == NULL)
+            goto fail;
+
+        state->parent = NULL;
+        state->tgid = tgid;
+        state->config.pid = tids[i];
+        state->config.scope = LIBIHT_SCOPE_PROCESS;
+        if (config_pt_state(state, &request->pt_config) ||
+            setup_pt_buffer(state))
+        {
+            free_pt_state(state);
+            goto fail;
+        }
+
+        insert_pt_state(state);
+
+        // If the thread is the current one, trace it right away
+        if (state->config.pid == xgetcurrent_pid())
+            put_pt(state);
+    }
+
+    xfree(tids);
+    return 0;
+
+fail:
+    xprintdbg("LIBIHT-COM: Create PT state failed.\n");
+    xfree(tids);
+    remove_pt_proc_states(tgid);
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disable_pt
+// Description  : Disable the PT tracing for a given process in request.
+//
+// Inputs       : request - the PT ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 disable_pt(struct pt_ioctl_request *request)
+{
+    struct pt_state *state;
+
+    if (request->pt_config.scope == LIBIHT_SCOPE_PROCESS)
+    {
+        if (find_pt_proc_state(request->pt_config.pid) == NULL)
+        {
+            xprintdbg("LIBIHT-COM: PT not enabled for process %d.\n",
+                        request->pt_config.pid);
+            return -1;
+        }
+
+        remove_pt_proc_states(request->pt_config.pid);
+        return 0;
+    }
+
+    state = find_pt_state(request->pt_config.pid);
+    if (state == NULL)
+    {
+        xprintdbg("LIBIHT-COM: PT not enabled for pid %d.\n",
+                    request->pt_config.pid);
+        return -1;
+    }
+
+    if (state->config.pid == xgetcurrent_pid())
+        get_pt(state);
+    remove_pt_state(state);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_pt
+// Description  : Dump the PT packets for a given process in request. The
+//                output position of a thread is only saved when its trace
+//                stops, so the trace of the current thread is stopped and
+//                frozen around the dump. The copies to userspace may sleep,
+//                and a frozen state is not restored by the context switches
+//                meanwhile.
+//
+// Inputs       : request - the PT ioctl request
+// Outputs      : 0 if successful (number of threads dumped for process scope
+//                requests), -1 if failure
+
+s32 dump_pt(struct pt_ioctl_request *request)
+{
+    s32 ret;
+    struct pt_state *curr_state;
+
+    curr_state = find_pt_state(xgetcurrent_pid());
+    if (curr_state && curr_state->loaded)
+    {
+        curr_state->frozen = TRUE;
+        get_pt(curr_state);
+    }
+    else
+    {
+        curr_state = NULL;
+    }
+
+    if (request->pt_config.scope == LIBIHT_SCOPE_PROCESS)
+    {
+        ret = dump_pt_process(request);
+    }
+    else if (dump_pt_threads(request, FALSE) <= 0)
+    {
+        // The thread may have exited since
+        xprintdbg("LIBIHT-COM: PT dump failed for pid %d.\n",
+                    request->pt_config.pid);
+        ret = -1;
+    }
+    else
+    {
+        ret = 0;
+    }
+
+    // The state may have been disabled during the dump
+    if (curr_state && find_pt_state(xgetcurrent_pid()) == curr_state)
+    {
+        curr_state->frozen = FALSE;
+        put_pt(curr_state);
+    }
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_pt_process
+// Description  : Dump the PT packets of every traced thread of the process in
+//                request. Each thread is dumped into its own `pt_data` of the
+//                request buffer array, tagged with the thread id.
+//
+// Inputs       : request - the PT ioctl request
+// Outputs      : number of threads dumped, -1 if failure
+
+s32 dump_pt_process(struct pt_ioctl_request *request)
+{
+    if (find_pt_proc_state(request->pt_config.pid) == NULL)
+    {
+        xprintdbg("LIBIHT-COM: PT not enabled for process %d.\n",
+                    request->pt_config.pid);
+        return -1;
+    }
+
+    return dump_pt_threads(request, TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_pt_threads
+// Description  : Dump the PT packets of the requested thread, or of every
+//                traced thread of the requested process. A reference is
+//                taken on each state under the `pt_state_lock`, and the
+//                states are dumped once the lock is released, since the
+//                copies to userspace may fault and sleep.
+//
+// Inputs       : request - the PT ioctl request
+//                process - TRUE for the process scope, FALSE for one thread
+// Outputs      : number of threads dumped, -1 if failure
+
+s32 dump_pt_threads(struct pt_ioctl_request *request, u32 process)
+{
+    s32 ret = 0;
+    struct pt_state *curr_state, **states;
+    char irql_flag[MAX_IRQL_LEN];
+    void *curr_list;
+    u32 state_cnt, max_states, limit, i;
+    u64 offset;
+
+    // A thread scope request has a single buffer
+    limit = process ? (request->buffer ? request->buffer_count : ~0U) : 1;
+
+    // Collect the states, retry with a larger array if it is too small
+    max_states = process ? MAX_PROC_THREADS : 1;
+    while (TRUE)
+    {
+        states = xmalloc(max_states * sizeof(struct pt_state *));
+        if (states == NULL)
+            return -1;
+        state_cnt = 0;
+
+        xacquire_lock(pt_state_lock, irql_flag);
+
+        // offsetof(st, m) macro implementation of stddef.h
+        offset = (u64)(&((struct pt_state *)0)->list);
+        curr_list = xlist_next(pt_state_head);
+        while (curr_list != NULL && curr_list != pt_state_head &&
+                state_cnt < limit)
+        {
+            curr_state = (struct pt_state *)((u64)curr_list - offset);
+            curr_list = xlist_next(curr_list);
+            if (process ? (curr_state->config.scope != LIBIHT_SCOPE_PROCESS ||
+                            curr_state->tgid != request->pt_config.pid) :
+                            curr_state->config.pid != request->pt_config.pid)
+                continue;
+
+            if (state_cnt < max_states)
+            {
+                curr_state->refs++;
+                states[state_cnt] = curr_state;
+            }
+            state_cnt++;
+        }
+
+        xrelease_lock(pt_state_lock, irql_flag);
+
+        if (state_cnt <= max_states)
+            break;
+
+        for (i = 0; i < max_states; i++)
+            release_pt_state(states[i]);
+        xfree(states);
+        max_states = state_cnt << 1;
+    }
+
+    for (i = 0; i < state_cnt; i++)
+    {
+        if (ret == 0 && dump_pt_state(states[i],
+                            request->buffer ? request->buffer + i : NULL))
+            ret = -1;
+        release_pt_state(states[i]);
+    }
+
+    xfree(states);
+    return ret ? ret : (s32)state_cnt;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_pt_state
+// Description  : Copy the newest packets of one PT state, oldest first, to the
+//                userspace buffer if provided. Without a packet buffer only
+//                the number of available bytes is returned. The output
+//                position is read under the `pt_state_lock`, and the pages
+//                are copied once it is released, they stay allocated as long
+//                as the reference is held. Caller should hold a reference on
+//                the state, but not the lock.
+//
+// Inputs       : state - the PT state
+//                buffer - the userspace PT data buffer (may be NULL)
+// Outputs      : 0 if successful, -1 if failure
+
+s32 dump_pt_state(struct pt_state *state, struct pt_data *buffer)
+{
+    u64 i, total, avail, pos, chunk, copied, bytes_left, out_offset;
+    u32 tid, wrapped;
+    u8 *last_page;
+    struct pt_data req_buf;
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(pt_state_lock, irql_flag);
+
+    total = (u64)state->page_count * PT_PAGE_SIZE;
+
+    // A written last page also means the ring wrapped, the output position
+    // may have passed the saved one again since the last switch
+    if (!state->wrapped && state->offset / PT_PAGE_SIZE < state->page_count - 1)
+    {
+        last_page = state->pages[state->page_count - 1];
+        for (i = 0; i < PT_PAGE_SIZE; i++)
+        {
+            if (last_page[i])
+            {
+                state->wrapped = TRUE;
+                break;
+            }
+        }
+    }
+
+    out_offset = state->offset;
+    wrapped = state->wrapped;
+    tid = state->config.pid;
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    avail = wrapped ? total : out_offset;
+    xprintdbg("LIBIHT-COM: PT buffer pages: %d, offset: 0x%llx, wrapped: %d\n",
+                state->page_count, out_offset, wrapped);
+
+    if (buffer == NULL)
+        return 0;
+
+    // Get a copy of data from userspace buffer
+    bytes_left = xcopy_from_user(&req_buf, buffer, sizeof(struct pt_data));
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy PT data from user failed.\n");
+        return -1;
+    }
+
+    req_buf.tid = tid;
+    req_buf.wrapped = wrapped;
+    if (req_buf.buffer == NULL)
+    {
+        req_buf.size = avail;
+    }
+    else
+    {
+        // Keep the newest packets if the userspace buffer is too small
+        if (req_buf.size < avail)
+        {
+            avail = req_buf.size;
+            req_buf.wrapped = TRUE;
+        }
+
+        pos = (out_offset + total - avail) % total;
+        for (copied = 0; copied < avail; copied += chunk)
+        {
+            chunk = PT_PAGE_SIZE - pos % PT_PAGE_SIZE;
+            if (chunk > avail - copied)
+                chunk = avail - copied;
+
+            bytes_left = xcopy_to_user(req_buf.buffer + copied,
+                                        state->pages[pos / PT_PAGE_SIZE] +
+                                        pos % PT_PAGE_SIZE, chunk);
+            if (bytes_left)
+            {
+                xprintdbg("LIBIHT-COM: Copy to user failed.\n");
+                return -1;
+            }
+            pos = (pos + chunk) % total;
+        }
+        req_buf.size = avail;
+    }
+
+    // Copy updated data back to userspace buffer
+    bytes_left = xcopy_to_user(buffer, &req_buf, sizeof(struct pt_data));
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy to user failed.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : config_pt_state
+// Description  : Validate a PT configuration against the capabilities of the
+//                cpu and apply it to a PT state. Branch packets and the ToPA
+//                output are always on, and user mode is traced if no mode is
+//                given. The pid of the state must be set for CR3 filtering.
+//
+// Inputs       : state - the PT state
+//                config - the requested PT configuration
+// Outputs      : 0 if successful, -1 if failure
+
+s32 config_pt_state(struct pt_state *state, struct pt_config *config)
+{
+    struct pt_range *range;
+    u64 ctl, size;
+    u32 i;
+
+    ctl = config->pt_config ? config->pt_config : DEFAULT_PT_CONFIG;
+    if (ctl & ~pt_ctl_mask)
+    {
+        xprintdbg("LIBIHT-COM: Unsupported PT config bits 0x%llx.\n",
+                    ctl & ~pt_ctl_mask);
+        return -1;
+    }
+
+    if (!(ctl & (RTIT_CTL_OS | RTIT_CTL_USR)))
+        ctl |= RTIT_CTL_USR;
+    ctl |= RTIT_CTL_TOPA | RTIT_CTL_BRANCH_EN;
+
+    // Encoded fields must be set in the capability bitmaps
+    if ((ctl & RTIT_CTL_MTC_EN) &&
+        !(pt_mtc_bitmap & (1 << RTIT_CTL_MTC_RANGE_OF(ctl))))
+        return -1;
+    if (RTIT_CTL_CYC_THRESH_OF(ctl) &&
+        !(pt_cyc_bitmap & (1 << RTIT_CTL_CYC_THRESH_OF(ctl))))
+        return -1;
+    if (RTIT_CTL_PSB_FREQ_OF(ctl) &&
+        !(pt_psb_bitmap & (1 << RTIT_CTL_PSB_FREQ_OF(ctl))))
+        return -1;
+
+    if (config->range_count > pt_range_count)
+    {
+        xprintdbg("LIBIHT-COM: PT supports %d address ranges.\n",
+                    pt_range_count);
+        return -1;
+    }
+
+    for (i = 0; i < config->range_count; i++)
+    {
+        range = &config->ranges[i];
+        if (range->start > range->end)
+            return -1;
+
+        if (range->mode == LIBIHT_PT_RANGE_FILTER)
+            ctl |= 1ULL << (32 + 4 * i);
+        else if (range->mode == LIBIHT_PT_RANGE_STOP)
+            ctl |= 2ULL << (32 + 4 * i);
+        else
+            return -1;
+    }
+
+    if (config->cr3_filter)
+    {
+        if (!(pt_cap & PT_CAP_CR3_FILTER))
+            return -1;
+
+        // Match the user page table base of the task, which is unknown on
+        // kernels using PCID, so the filter is refused there
+        state->cr3 = xget_task_cr3(state->config.pid);
+        if (state->cr3 == 0)
+        {
+            xprintdbg("LIBIHT-COM: PT CR3 filter unavailable for pid %d.\n",
+                        state->config.pid);
+            return -1;
+        }
+        ctl |= RTIT_CTL_CR3EN;
+    }
+
+    size = config->pt_buffer_size ?
+                config->pt_buffer_size : DEFAULT_PT_BUFFER_SIZE;
+    if (size > MAX_PT_BUFFER_SIZE)
+        return -1;
+    size = (size + PT_PAGE_SIZE - 1) & ~((u64)PT_PAGE_SIZE - 1);
+
+    // Keep the requested bits, children validate them again
+    state->ctl = ctl;
+    state->config.pt_config = config->pt_config;
+    state->config.pt_buffer_size = size;
+    state->config.cr3_filter = config->cr3_filter;
+    state->config.range_count = config->range_count;
+    for (i = 0; i < config->range_count; i++)
+        state->config.ranges[i] = config->ranges[i];
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : create_pt_state
+// Description  : Create a new PT state.
+//
+// Inputs       : void
+// Outputs      : The new PT state
+
+struct pt_state *create_pt_state(void)
+{
+    struct pt_state *state;
+
+    state = xmalloc(sizeof(struct pt_state));
+    if (state == NULL)
+        return NULL;
+    xmemset(state, 0, sizeof(struct pt_state));
+    state->refs = 1;
+
+    return state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : setup_pt_buffer
+// Description  : Allocate the zeroed output pages of the configured buffer
+//                size and the ToPA tables pointing to them. The last entry of
+//                each table links to the next one, and the last table links
+//                back to the first, so the output ring never stops.
+//
+// Inputs       : state - the PT state
+// Outputs      : 0 if successful, -1 if failure
+
+s32 setup_pt_buffer(struct pt_state *state)
+{
+    u32 i, table, entries;
+
+    state->page_count = (u32)(state->config.pt_buffer_size / PT_PAGE_SIZE);
+    state->table_count = (state->page_count + PT_TOPA_ENTRIES - 1) /
+                            PT_TOPA_ENTRIES;
+
+    state->pages = xmalloc(state->page_count * sizeof(u8 *));
+    state->topa = xmalloc(state->table_count * sizeof(u64 *));
+    if (state->pages == NULL || state->topa == NULL)
+        return -1;
+    xmemset(state->pages, 0, state->page_count * sizeof(u8 *));
+    xmemset(state->topa, 0, state->table_count * sizeof(u64 *));
+
+    // Output regions and tables must be 4K aligned physical pages
+    for (i = 0; i < state->page_count; i++)
+    {
+        state->pages[i] = xmalloc(PT_PAGE_SIZE);
+        if (state->pages[i] == NULL ||
+            ((u64)state->pages[i] & (PT_PAGE_SIZE - 1)))
+            return -1;
+        xmemset(state->pages[i], 0, PT_PAGE_SIZE);
+    }
+
+    for (table = 0; table < state->table_count; table++)
+    {
+        state->topa[table] = xmalloc(PT_PAGE_SIZE);
+        if (state->topa[table] == NULL ||
+            ((u64)state->topa[table] & (PT_PAGE_SIZE - 1)))
+            return -1;
+        xmemset(state->topa[table], 0, PT_PAGE_SIZE);
+    }
+
+    for (table = 0; table < state->table_count; table++)
+    {
+        entries = state->page_count - table * PT_TOPA_ENTRIES;
+        if (entries > PT_TOPA_ENTRIES)
+            entries = PT_TOPA_ENTRIES;
+
+        for (i = 0; i < entries; i++)
+            state->topa[table][i] = xvirt_to_phys(
+                        state->pages[table * PT_TOPA_ENTRIES + i]);
+        state->topa[table][entries] = PT_TOPA_END | xvirt_to_phys(
+                        state->topa[(table + 1) % state->table_count]);
+    }
+
+    // Start at the first entry of the first table
+    state->output_base = xvirt_to_phys(state->topa[0]);
+    state->output_mask = 0x7f;
+    state->status = 0;
+    state->offset = 0;
+
+    xprintdbg("LIBIHT-COM: PT buffer pages: %d, ToPA tables: %d, "
+                "output base: %llx.\n", state->page_count,
+                state->table_count, state->output_base);
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_pt_state
+// Description  : Free a PT state, its output pages and ToPA tables, even if
+//                only partially allocated. The state should not be in the
+//                list.
+//
+// Inputs       : state - the PT state
+// Outputs      : void
+
+void free_pt_state(struct pt_state *state)
+{
+    u32 i;
+
+    if (state->pages)
+    {
+        for (i = 0; i < state->page_count; i++)
+            if (state->pages[i])
+                xfree(state->pages[i]);
+        xfree(state->pages);
+    }
+
+    if (state->topa)
+    {
+        for (i = 0; i < state->table_count; i++)
+            if (state->topa[i])
+                xfree(state->topa[i]);
+        xfree(state->topa);
+    }
+
+    xfree(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_pt_state
+// Description  : Drop a reference to a PT state. The state and its buffers
+//                are freed with the last reference, so a state can be removed
+//                while a dump still copies it. References are taken with the
+//                `pt_state_lock` held.
+//
+// Inputs       : state - the PT state
+// Outputs      : void
+
+void release_pt_state(struct pt_state *state)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    u32 refs;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+    refs = --state->refs;
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    if (refs == 0)
+        free_pt_state(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_pt_state
+// Description  : Find a PT state by pid.
+//
+// Inputs       : pid - the pid of the target process
+// Outputs      : The PT state
+
+struct pt_state *find_pt_state(u32 pid)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct pt_state *curr_state, *ret_state = NULL;
+    void *curr_list;
+    u64 offset;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct pt_state *)0)->list);
+    curr_list = xlist_next(pt_state_head);
+    while (curr_list != NULL && curr_list != pt_state_head)
+    {
+        curr_state = (struct pt_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (curr_state->config.pid == pid)
+        {
+            ret_state = curr_state;
+            break;
+        }
+    }
+
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    return ret_state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_pt_proc_state
+// Description  : Find any process scope PT state of a thread group.
+//
+// Inputs       : tgid - the thread group id (user process pid)
+// Outputs      : The PT state
+
+struct pt_state *find_pt_proc_state(u32 tgid)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct pt_state *curr_state, *ret_state = NULL;
+    void *curr_list;
+    u64 offset;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct pt_state *)0)->list);
+    curr_list = xlist_next(pt_state_head);
+    while (curr_list != NULL && curr_list != pt_state_head)
+    {
+        curr_state = (struct pt_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (tgid != 0 && curr_state->config.scope == LIBIHT_SCOPE_PROCESS &&
+            curr_state->tgid == tgid)
+        {
+            ret_state = curr_state;
+            break;
+        }
+    }
+
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    return ret_state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insert_pt_state
+// Description  : Insert a new PT state into the list.
+//
+// Inputs       : new_state - the new PT state
+// Outputs      : void
+
+void insert_pt_state(struct pt_state *new_state)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (new_state == NULL)
+        return;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+    xprintdbg("LIBIHT-COM: Insert PT state for pid %d.\n",
+                new_state->config.pid);
+    xlist_add(new_state->list, pt_state_head);
+    xrelease_lock(pt_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_pt_state
+// Description  : Remove a PT state from the list.
+//
+// Inputs       : old_state - the old PT state
+// Outputs      : void
+
+void remove_pt_state(struct pt_state *old_state)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (old_state == NULL)
+        return;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+    xprintdbg("LIBIHT-COM: Remove PT state for pid %d.\n",
+                old_state->config.pid);
+    xlist_del(&old_state->list);
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    // A dump may still hold the state
+    release_pt_state(old_state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_pt_proc_states
+// Description  : Remove all process scope PT states of a thread group.
+//
+// Inputs       : tgid - the thread group id (user process pid)
+// Outputs      : void
+
+void remove_pt_proc_states(u32 tgid)
+{
+    struct pt_state *state;
+
+    while ((state = find_pt_proc_state(tgid)) != NULL)
+    {
+        if (state->config.pid == xgetcurrent_pid())
+            get_pt(state);
+        remove_pt_state(state);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_pt_state_list
+// Description  : Free the PT state list.
+//
+// Inputs       : void
+// Outputs      : void
+
+void free_pt_state_list(void)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct pt_state *curr_state;
+    void *curr_list;
+    u64 offset;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct pt_state *)0)->list);
+    curr_list = xlist_next(pt_state_head);
+    while (curr_list != NULL && curr_list != pt_state_head)
+    {
+        curr_state = (struct pt_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        xprintdbg("LIBIHT-COM: Free PT state for pid %d.\n",
+                    curr_state->config.pid);
+
+        xlist_del(curr_state->list);
+        if (--curr_state->refs == 0)
+            free_pt_state(curr_state);
+    }
+
+    xrelease_lock(pt_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_ioctl_handler
+// Description  : The ioctl handler for the PT.
+//
+// Inputs       : request - the cross platform ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 pt_ioctl_handler(struct xioctl_request *request)
+{
+    s32 ret = 0;
+
+    xprintdbg("LIBIHT-COM: PT ioctl command %d.\n", request->cmd);
+    if (!pt_supported)
+    {
+        xprintdbg("LIBIHT-COM: PT is not supported or available.\n");
+        return -1;
+    }
+
+    switch (request->cmd)
+    {
+    case LIBIHT_IOCTL_ENABLE_PT:
+        xprintdbg("LIBIHT-COM: Enable PT for pid %d.\n",
+                    request->body.pt.pt_config.pid);
+        ret = enable_pt(&request->body.pt);
+        break;
+
+    case LIBIHT_IOCTL_DISABLE_PT:
+        xprintdbg("LIBIHT-COM: Disable PT for pid %d.\n",
+                    request->body.pt.pt_config.pid);
+        ret = disable_pt(&request->body.pt);
+        break;
+
+    case LIBIHT_IOCTL_DUMP_PT:
+        xprintdbg("LIBIHT-COM: Dump PT for pid %d.\n",
+                    request->body.pt.pt_config.pid);
+        ret = dump_pt(&request->body.pt);
+        break;
+
+    default:
+        xprintdbg("LIBIHT-COM: Invalid PT ioctl command.\n");
+        ret = -1;
+        break;
+    }
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_cswitch_handler
+// Description  : The context switch handler for the PT.
+//
+// Inputs       : prev_pid - the pid of the previous process
+//                next_pid - the pid of the next process
+// Outputs      : void
+
+void pt_cswitch_handler(u32 prev_pid, u32 next_pid)
+{
+    struct pt_state *prev_state, *next_state;
+
+    prev_state = find_pt_state(prev_pid);
+    next_state = find_pt_state(next_pid);
+
+    if (prev_state && prev_state->loaded)
+    {
+        xprintdbg("LIBIHT-COM: PT context switch from pid %d on core %d\n",
+            prev_state->config.pid, xcoreid());
+        get_pt(prev_state);
+    }
+
+    // A state being dumped is restored once the dump is done
+    if (next_state && !next_state->frozen)
+    {
+        xprintdbg("LIBIHT-COM: PT context switch to pid %d on core %d\n",
+                next_state->config.pid, xcoreid());
+        put_pt(next_state);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_newproc_handler
+// Description  : The new process handler for the PT. A new thread of a
+//                process traced in process scope joins the process trace,
+//                otherwise the child inherits the trace of its parent. A
+//                forked child is matched against its own page tables.
+//
+// Inputs       : parent_pid - the pid of the parent process
+//                child_pid - the pid of the child process
+//                child_tgid - the thread group id of the child process
+// Outputs      : void
+
+void pt_newproc_handler(u32 parent_pid, u32 child_pid, u32 child_tgid)
+{
+    struct pt_state *parent_state = NULL, *child_state;
+
+    if (child_pid != child_tgid)
+        parent_state = find_pt_proc_state(child_tgid);
+    if (parent_state == NULL)
+        parent_state = find_pt_state(parent_pid);
+    if (parent_state == NULL)
+        return;
+
+    xprintdbg("LIBIHT-COM: PT new process %d parent pid %d\n",
+            child_pid, parent_state->config.pid);
+    child_state = create_pt_state();
+    if (child_state == NULL)
+        return;
+
+    child_state->parent = parent_state;
+    child_state->tgid = child_tgid;
+    child_state->config.pid = child_pid;
+    child_state->config.scope = parent_state->config.scope;
+
+    // The child records into its own buffer, parent packets are not copied
+    if (config_pt_state(child_state, &parent_state->config) ||
+        setup_pt_buffer(child_state))
+    {
+        free_pt_state(child_state);
+        return;
+    }
+    insert_pt_state(child_state);
+
+    // If the child process is the current process, trace it right away
+    if (child_pid == xgetcurrent_pid())
+        put_pt(child_state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_exitproc_handler
+// Description  : The process exit handler for the PT. Threads traced in
+//                process scope are detached and their buffers released when
+//                they exit.
+//
+// Inputs       : pid - the pid of the exiting process
+// Outputs      : void
+
+void pt_exitproc_handler(u32 pid)
+{
+    struct pt_state *state;
+
+    state = find_pt_state(pid);
+    if (state == NULL || state->config.scope != LIBIHT_SCOPE_PROCESS)
+        return;
+
+    xprintdbg("LIBIHT-COM: PT process scope thread %d exit\n", pid);
+    if (pid == xgetcurrent_pid())
+        get_pt(state);
+    remove_pt_state(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_exec_handler
+// Description  : The exec handler for the PT. The new program runs on new
+//                page tables, so the CR3 filter of the thread is updated. Must
+//                be called by the thread doing the exec.
+//
+// Inputs       : pid - the pid of the process
+// Outputs      : void
+
+void pt_exec_handler(u32 pid)
+{
+    struct pt_state *state;
+    u32 loaded;
+
+    state = find_pt_state(pid);
+    if (state == NULL || !(state->ctl & RTIT_CTL_CR3EN))
+        return;
+
+    loaded = state->loaded;
+    if (loaded)
+        get_pt(state);
+
+    state->cr3 = xget_task_cr3(pid);
+    xprintdbg("LIBIHT-COM: PT exec of pid %d, cr3 %llx\n", pid, state->cr3);
+
+    if (loaded)
+        put_pt(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_check
+// Description  : Check if the PT is available with a multi entry ToPA
+//                output, and find the configuration bits it supports.
+//
+// Inputs       : void
+// Outputs      : 0 if successful, -1 if failure
+
+s32 pt_check(void)
+{
+    u32 eax, ebx, ecx, edx, max_leaf;
+
+    xcpuid(0, &max_leaf, &ebx, &ecx, &edx);
+    if (max_leaf < CPUID_LEAF_PT)
+        return -1;
+
+    xcpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+    if (!(ebx & (1 << X64_FEATURE_INTEL_PT)))
+        return -1;
+
+    // Output pages are scattered, so ToPA with multiple entries is needed
+    xcpuid_count(CPUID_LEAF_PT, 0, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & PT_CAP_TOPA) || !(ecx & PT_CAP_TOPA_MULTI))
+        return -1;
+
+    pt_cap = ebx;
+    pt_ctl_mask = RTIT_CTL_OS | RTIT_CTL_USR | RTIT_CTL_TOPA |
+                    RTIT_CTL_TSC_EN | RTIT_CTL_DISRETC | RTIT_CTL_BRANCH_EN;
+    if (pt_cap & PT_CAP_PSB_CYC)
+        pt_ctl_mask |= RTIT_CTL_CYCLEACC | RTIT_CTL_CYC_THRESH |
+                        RTIT_CTL_PSB_FREQ;
+    if (pt_cap & PT_CAP_MTC)
+        pt_ctl_mask |= RTIT_CTL_MTC_EN | RTIT_CTL_MTC_RANGE;
+    if (pt_cap & PT_CAP_PTWRITE)
+        pt_ctl_mask |= RTIT_CTL_PTW_EN | RTIT_CTL_FUP_ON_PTW;
+    if (pt_cap & PT_CAP_POWER_EVENT)
+        pt_ctl_mask |= RTIT_CTL_PWR_EVT_EN;
+
+    pt_range_count = 0;
+    pt_mtc_bitmap = 0;
+    pt_cyc_bitmap = 0;
+    pt_psb_bitmap = 0;
+    if (eax >= 1)
+    {
+        xcpuid_count(CPUID_LEAF_PT, 1, &eax, &ebx, &ecx, &edx);
+        if (pt_cap & PT_CAP_IP_FILTER)
+            pt_range_count = eax & 0x7;
+        if (pt_range_count > LIBIHT_PT_MAX_RANGES)
+            pt_range_count = LIBIHT_PT_MAX_RANGES;
+        pt_mtc_bitmap = eax >> 16;
+        pt_cyc_bitmap = ebx & 0xffff;
+        pt_psb_bitmap = ebx >> 16;
+    }
+
+    xprintdbg("LIBIHT-COM: PT capabilities 0x%x, address ranges %d.\n",
+                pt_cap, pt_range_count);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_init
+// Description  : Initialize the PT. The state list is set up even if the PT
+//                is not available, so the platform handlers can still run.
+//
+// Inputs       : void
+// Outputs      : 0 if successful, -1 if failure
+
+s32 pt_init(void)
+{
+    xprintdbg("LIBIHT-COM: Init PT related structs.\n");
+    xinit_lock(pt_state_lock);
+    xinit_list_head(pt_state_head);
+
+    // Check if PT is supported and available
+    pt_supported = pt_check() == 0;
+    if (!pt_supported)
+    {
+        xprintdbg("LIBIHT-COM: PT is not supported or available.\n");
+        return -1;
+    }
+
+    // Flush PT on each cpu
+    xprintdbg("LIBIHT-COM: Flushing PT for all cpus...\n");
+    xon_each_cpu(flush_pt);
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_exit
+// Description  : Exit the PT.
+//
+// Inputs       : void
+// Outputs      : 0 if successful, -1 if failure
+
+s32 pt_exit(void)
+{
+    // Flush PT on each cpu
+    if (pt_supported)
+    {
+        xprintdbg("LIBIHT-COM: Flushing PT for all cpus...\n");
+        xon_each_cpu(flush_pt);
+    }
+
+    // Free pt_state_list
+    xprintdbg("LIBIHT-COM: Freeing PT state list.\n");
+    free_pt_state_list();
+
+    return 0;
+}
@@ -0,0 +1,256 @@
+#ifndef _COMMONS_PT_H_
+#define _COMMONS_PT_H_
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/pt.h
+//  Description    : This is the header file for the Intel PT (Processor Trace)
+//                   module. Each traced thread writes its packet stream into
+//                   its own circular ToPA (Table of Physical Addresses)
+//                   buffer, which is saved and restored on context switch
+//                   like the BTS debug store area.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "types.h"
+#include "xplat.h"
+#include "xioctl.h"
+
+// cpp cross compile handler
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+//
+// Library constants
+
+// Intel-defined CPU features, CPUID level 0x00000007 (EBX)
+#ifndef X64_FEATURE_INTEL_PT
+#define X64_FEATURE_INTEL_PT    25
+#endif
+
+// CPUID leaf enumerating the Intel PT capabilities
+#define CPUID_LEAF_PT           0x14
+
+// MSR related constants
+#ifndef MSR_IA32_RTIT_CTL
+#define MSR_IA32_RTIT_CTL       0x00000570
+#endif
+
+#ifndef MSR_IA32_RTIT_STATUS
+#define MSR_IA32_RTIT_STATUS    0x00000571
+#endif
+
+#ifndef MSR_IA32_RTIT_CR3_MATCH
+#define MSR_IA32_RTIT_CR3_MATCH 0x00000572
+#endif
+
+#ifndef MSR_IA32_RTIT_OUTPUT_BASE
+#define MSR_IA32_RTIT_OUTPUT_BASE   0x00000560
+#endif
+
+#ifndef MSR_IA32_RTIT_OUTPUT_MASK
+#define MSR_IA32_RTIT_OUTPUT_MASK   0x00000561
+#endif
+
+// Address range n uses ADDR0_A + 2n as start and ADDR0_A + 2n + 1 as end
+#ifndef MSR_IA32_RTIT_ADDR0_A
+#define MSR_IA32_RTIT_ADDR0_A   0x00000580
+#endif
+
+// MSR bit shifts
+#define RTIT_CTL_TRACEEN        (1ULL <<  0)
+#define RTIT_CTL_CYCLEACC       (1ULL <<  1)
+#define RTIT_CTL_OS             (1ULL <<  2)
+#define RTIT_CTL_USR            (1ULL <<  3)
+#define RTIT_CTL_PWR_EVT_EN     (1ULL <<  4)
+#define RTIT_CTL_FUP_ON_PTW     (1ULL <<  5)
+#define RTIT_CTL_CR3EN          (1ULL <<  7)
+#define RTIT_CTL_TOPA           (1ULL <<  8)
+#define RTIT_CTL_MTC_EN         (1ULL <<  9)
+#define RTIT_CTL_TSC_EN         (1ULL << 10)
+#define RTIT_CTL_DISRETC        (1ULL << 11)
+#define RTIT_CTL_PTW_EN         (1ULL << 12)
+#define RTIT_CTL_BRANCH_EN      (1ULL << 13)
+#define RTIT_CTL_MTC_RANGE      (0xfULL << 14)
+#define RTIT_CTL_CYC_THRESH     (0xfULL << 19)
+#define RTIT_CTL_PSB_FREQ       (0xfULL << 24)
+#define RTIT_CTL_ADDR_CFG(n)    (0xfULL << (32 + 4 * (n)))
+
+#define RTIT_CTL_MTC_RANGE_OF(ctl)  (((ctl) >> 14) & 0xf)
+#define RTIT_CTL_CYC_THRESH_OF(ctl) (((ctl) >> 19) & 0xf)
+#define RTIT_CTL_PSB_FREQ_OF(ctl)   (((ctl) >> 24) & 0xf)
+
+#define RTIT_STATUS_ERROR       (1ULL <<  4)
+#define RTIT_STATUS_STOPPED     (1ULL <<  5)
+
+// ToPA entry bits, the output region size field is 0 for 4K regions
+#define PT_TOPA_END             (1ULL <<  0)
+#define PT_TOPA_INT             (1ULL <<  2)
+#define PT_TOPA_STOP            (1ULL <<  4)
+
+// Intel PT capabilities, CPUID level 0x00000014 sub-leaf 0
+#define PT_CAP_CR3_FILTER       (1 << 0)    // EBX
+#define PT_CAP_PSB_CYC          (1 << 1)    // EBX
+#define PT_CAP_IP_FILTER        (1 << 2)    // EBX
+#define PT_CAP_MTC              (1 << 3)    // EBX
+#define PT_CAP_PTWRITE          (1 << 4)    // EBX
+#define PT_CAP_POWER_EVENT      (1 << 5)    // EBX
+#define PT_CAP_TOPA             (1 << 0)    // ECX
+#define PT_CAP_TOPA_MULTI       (1 << 1)    // ECX
+
+// Trace user mode branches with timestamps, no compressed returns since the
+// decoder return stack is shallower than the hardware one
+#define DEFAULT_PT_CONFIG       (RTIT_CTL_BRANCH_EN | RTIT_CTL_USR | \
+                                    RTIT_CTL_TSC_EN | RTIT_CTL_DISRETC)
+
+// Output regions are single 4K pages, so no contiguous allocation is needed
+#define PT_PAGE_SIZE            0x1000
+
+// Output entries of one ToPA table, the last entry links to the next table
+#define PT_TOPA_ENTRIES         (PT_PAGE_SIZE / sizeof(u64) - 1)
+
+// PT buffer size, 1M = 256 output pages
+#define DEFAULT_PT_BUFFER_SIZE  0x100000
+#define MAX_PT_BUFFER_SIZE      0x4000000
+
+//
+// Type definitions
+
+// Define PT state
+struct pt_state
+{
+    char list[MAX_LIST_LEN];            // Kernel linked list
+    struct pt_state *parent;            // Parent pt_state
+    struct pt_config config;            // PT configuration
+    u32 tgid;                           // Thread group id (process scope)
+    u32 loaded;                         // Trace running on the current cpu
+    u32 frozen;                         // Not restored while being dumped
+    u32 refs;                           // References, freed with the last one
+    u64 ctl;                            // MSR_IA32_RTIT_CTL without TraceEn
+    u64 cr3;                            // MSR_IA32_RTIT_CR3_MATCH
+    u64 **topa;                         // ToPA tables, linked in a ring
+    u32 table_count;                    // Number of ToPA tables
+    u32 page_count;                     // Number of output pages
+    u8 **pages;                         // Output pages, in trace order
+    u64 output_base;                    // Saved MSR_IA32_RTIT_OUTPUT_BASE
+    u64 output_mask;                    // Saved MSR_IA32_RTIT_OUTPUT_MASK
+    u64 status;                         // Saved MSR_IA32_RTIT_STATUS
+    u64 offset;                         // Output offset in the buffer
+    u32 wrapped;                        // Older packets overwritten
+};
+
+//
+// Global Variables
+
+extern char pt_state_lock[MAX_LOCK_LEN];
+// The lock for pt_state_list.
+
+extern char pt_state_head[MAX_LIST_LEN];
+// The head of the pt_state_list.
+
+extern u32 pt_supported;
+// Whether the cpu can trace into a multi entry ToPA buffer.
+
+//
+// Function Prototypes
+
+void get_pt(struct pt_state *state);
+// Stop the trace of a PT state and save its output position
+
+void put_pt(struct pt_state *state);
+// Restore the output position of a PT state and start its trace
+
+void flush_pt(void);
+// Stop the trace on the current cpu
+
+u64 pt_output_offset(struct pt_state *state);
+// Compute the output offset of a PT state from its saved position
+
+s32 enable_pt(struct pt_ioctl_request *request);
+// Enable the PT
+
+s32 enable_pt_process(struct pt_ioctl_request *request);
+// Enable the PT for all threads of a given process
+
+s32 disable_pt(struct pt_ioctl_request *request);
+// Disable the PT
+
+s32 dump_pt(struct pt_ioctl_request *request);
+// Dump the PT packets
+
+s32 dump_pt_process(struct pt_ioctl_request *request);
+// Dump the PT packets of all threads of a given process
+
+s32 dump_pt_threads(struct pt_ioctl_request *request, u32 process);
+// Dump the PT packets of a thread or of all threads of a process
+
+s32 dump_pt_state(struct pt_state *state, struct pt_data *buffer);
+// Dump the PT packets of a single referenced PT state
+
+s32 config_pt_state(struct pt_state *state, struct pt_config *config);
+// Validate a PT configuration and apply it to a PT state
+
+struct pt_state *create_pt_state(void);
+// Create a new PT state
+
+s32 setup_pt_buffer(struct pt_state *state);
+// Allocate the output pages and ToPA tables of a PT state
+
+void free_pt_state(struct pt_state *state);
+// Free a PT state and its buffers
+
+void release_pt_state(struct pt_state *state);
+// Drop a reference to a PT state, free it with the last one
+
+struct pt_state *find_pt_state(u32 pid);
+// Find the PT state by pid
+
+struct pt_state *find_pt_proc_state(u32 tgid);
+// Find any process scope PT state by tgid
+
+void insert_pt_state(struct pt_state *new_state);
+// Insert the PT state into the list
+
+void remove_pt_state(struct pt_state *old_state);
+// Remove the PT state from the list
+
+void remove_pt_proc_states(u32 tgid);
+// Remove all process scope PT states of a thread group
+
+void free_pt_state_list(void);
+// Free the PT state list
+
+s32 pt_ioctl_handler(struct xioctl_request *request);
+// The ioctl handler for the PT
+
+void pt_cswitch_handler(u32 prev_pid, u32 next_pid);
+// The context switch handler for the PT
+
+void pt_newproc_handler(u32 parent_pid, u32 child_pid, u32 child_tgid);
+// The new process handler for the PT
+
+void pt_exitproc_handler(u32 pid);
+// The process exit handler for the PT
+
+void pt_exec_handler(u32 pid);
+// The exec handler for the PT
+
+s32 pt_check(void);
+// Check if the PT is available
+
+s32 pt_init(void);
+// Initialize the PT
+
+s32 pt_exit(void);
+// Exit the PT
+
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _COMMONS_PT_H_
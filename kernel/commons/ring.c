@@ -0,0 +1,245 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/ring.c
+//  Description    : This is the implementation of the record ring buffer for
+//                   the libiht library. Records are pushed from the trace
+//                   handlers (possibly with interrupts disabled) and drained
+//                   by the ioctl handlers.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "ring.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : create_ring
+// Description  : Create a new empty record ring buffer.
+//
+// Inputs       : entry_size - the size of one record
+//                capacity - the number of records the ring holds
+// Outputs      : struct ring_buffer* - the new ring buffer, NULL on failure
+
+struct ring_buffer *create_ring(u32 entry_size, u32 capacity)
+{
+    struct ring_buffer *ring;
+
+    if (entry_size == 0 || capacity == 0)
+        return NULL;
+
+    ring = xmalloc(sizeof(struct ring_buffer));
+    if (ring == NULL)
+        return NULL;
+    xmemset(ring, 0, sizeof(struct ring_buffer));
+
+    // Large rings do not need physically contiguous memory
+    ring->base = xvmalloc((u64)entry_size * capacity);
+    if (ring->base == NULL)
+    {
+        xfree(ring);
+        return NULL;
+    }
+
+    ring->entry_size = entry_size;
+    ring->capacity = capacity;
+    ring->refs = 1;
+    xinit_lock(ring->lock);
+
+    return ring;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_ring
+// Description  : Drop a reference to a record ring buffer. The ring and its
+//                storage are freed with the last reference, so an owner can
+//                free its ring while a dump still drains it.
+//
+// Inputs       : ring - the ring buffer
+// Outputs      : void
+
+void free_ring(struct ring_buffer *ring)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    u32 refs;
+
+    if (ring == NULL)
+        return;
+
+    xacquire_lock(ring->lock, irql_flag);
+    refs = --ring->refs;
+    xrelease_lock(ring->lock, irql_flag);
+    if (refs)
+        return;
+
+    xvfree(ring->base);
+    xfree(ring);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_get
+// Description  : Take a reference to a record ring buffer, released with
+//                `free_ring`. The caller must make sure the ring is alive,
+//                for instance by holding the lock of its owner.
+//
+// Inputs       : ring - the ring buffer
+// Outputs      : void
+
+void ring_get(struct ring_buffer *ring)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(ring->lock, irql_flag);
+    ring->refs++;
+    xrelease_lock(ring->lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_push
+// Description  : Append a record to the ring buffer. When the ring is full,
+//                the oldest record is overwritten and accounted as dropped.
+//
+// Inputs       : ring - the ring buffer
+//                entry - the record to be appended
+// Outputs      : void
+
+void ring_push(struct ring_buffer *ring, void *entry)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(ring->lock, irql_flag);
+
+    xmemcpy(ring->base + (ring->head % ring->capacity) * ring->entry_size,
+            entry, ring->entry_size);
+    ring->head++;
+    if (ring->head - ring->tail > ring->capacity)
+    {
+        ring->tail = ring->head - ring->capacity;
+        ring->dropped++;
+    }
+
+    xrelease_lock(ring->lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_try_push
+// Description  : Append a record to the ring buffer if its lock is free. Used
+//                from NMI context, where waiting for a lock held by the
+//                interrupted code would never end.
+//
+// Inputs       : ring - the ring buffer
+//                entry - the record to be appended
+// Outputs      : u32 - TRUE if appended, FALSE if the lock was busy
+
+u32 ring_try_push(struct ring_buffer *ring, void *entry)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (!xtry_acquire_lock(ring->lock, irql_flag))
+        return FALSE;
+
+    xmemcpy(ring->base + (ring->head % ring->capacity) * ring->entry_size,
+            entry, ring->entry_size);
+    ring->head++;
+    if (ring->head - ring->tail > ring->capacity)
+    {
+        ring->tail = ring->head - ring->capacity;
+        ring->dropped++;
+    }
+
+    xrelease_lock(ring->lock, irql_flag);
+    return TRUE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_reset
+// Description  : Discard all records in the ring buffer.
+//
+// Inputs       : ring - the ring buffer
+// Outputs      : void
+
+void ring_reset(struct ring_buffer *ring)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(ring->lock, irql_flag);
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+    xrelease_lock(ring->lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_drain_to_user
+// Description  : Move up to `max_cnt` of the oldest records to a userspace
+//                buffer. Records are staged in a kernel buffer under the ring
+//                lock, so the copy to userspace never happens with the lock
+//                held, and are only consumed once the copy succeeded. Two
+//                drains of one ring at the same time may both get a record.
+//
+// Inputs       : ring - the ring buffer
+//                buffer - the userspace buffer
+//                max_cnt - the number of records the buffer holds
+// Outputs      : s32 - number of records copied, -1 on failure
+
+s32 ring_drain_to_user(struct ring_buffer *ring, void *buffer, u32 max_cnt)
+{
+    u8 *stage;
+    u32 cnt, first, i;
+    u64 tail;
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (buffer == NULL || max_cnt == 0)
+        return 0;
+
+    if (max_cnt > ring->capacity)
+        max_cnt = ring->capacity;
+
+    stage = xvmalloc((u64)max_cnt * ring->entry_size);
+    if (stage == NULL)
+        return -1;
+
+    xacquire_lock(ring->lock, irql_flag);
+
+    cnt = (u32)(ring->head - ring->tail);
+    if (cnt > max_cnt)
+        cnt = max_cnt;
+
+    // Copy out in at most two chunks around the end of the storage
+    tail = ring->tail;
+    first = (u32)(tail % ring->capacity);
+    i = ring->capacity - first;
+    if (i > cnt)
+        i = cnt;
+    xmemcpy(stage, ring->base + (u64)first * ring->entry_size,
+            (u64)i * ring->entry_size);
+    if (cnt > i)
+        xmemcpy(stage + (u64)i * ring->entry_size, ring->base,
+                (u64)(cnt - i) * ring->entry_size);
+
+    xrelease_lock(ring->lock, irql_flag);
+
+    if (xcopy_to_user(buffer, stage, (u64)cnt * ring->entry_size))
+    {
+        xprintdbg("LIBIHT-COM: Copy ring records to user failed\n");
+        xvfree(stage);
+        return -1;
+    }
+
+    // Pushes during the copy may have moved the tail past the copied
+    // records already, and a reset moves the head back
+    xacquire_lock(ring->lock, irql_flag);
+    if (ring->tail < tail + cnt && ring->head >= tail + cnt)
+        ring->tail = tail + cnt;
+    xrelease_lock(ring->lock, irql_flag);
+
+    xvfree(stage);
+    return (s32)cnt;
+}
@@ -0,0 +1,68 @@
+#ifndef _COMMONS_RING_H
+#define _COMMONS_RING_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/ring.h
+//  Description    : This is the header file for the record ring buffer used
+//                   by libiht features to keep fixed size trace records. New
+//                   records overwrite the oldest ones when the ring is full.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "types.h"
+#include "xplat.h"
+
+// cpp cross compile handler
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+//
+// Type definitions
+
+// Define record ring buffer
+struct ring_buffer
+{
+    char lock[MAX_LOCK_LEN];    // Ring lock
+    u8 *base;                   // Ring storage
+    u32 entry_size;             // Size of one record
+    u32 capacity;               // Number of records the ring holds
+    u64 head;                   // Number of records ever written
+    u64 tail;                   // Number of records ever consumed
+    u64 dropped;                // Records overwritten before consumed
+    u32 refs;                   // References, freed with the last one
+};
+
+//
+// Function Prototypes
+
+struct ring_buffer *create_ring(u32 entry_size, u32 capacity);
+// Create a new record ring buffer.
+
+void free_ring(struct ring_buffer *ring);
+// Drop a reference to a record ring buffer, freeing it with the last one.
+
+void ring_get(struct ring_buffer *ring);
+// Take a reference to a record ring buffer.
+
+void ring_push(struct ring_buffer *ring, void *entry);
+// Append a record to the ring buffer.
+
+u32 ring_try_push(struct ring_buffer *ring, void *entry);
+// Append a record to the ring buffer unless its lock is busy.
+
+void ring_reset(struct ring_buffer *ring);
+// Discard all records in the ring buffer.
+
+s32 ring_drain_to_user(struct ring_buffer *ring, void *buffer, u32 max_cnt);
+// Move the oldest records of the ring buffer to a userspace buffer.
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _COMMONS_RING_H
@@ -0,0 +1,511 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/sample.c
+//  Description    : This is the implementation of the LBR sampling for the
+//                   libiht library. The LBR runs continuously on the sampled
+//                   cpus with FREEZE_LBRS_ON_PMI set, so on each counter
+//                   overflow the stack still holds the branches leading up to
+//                   the event. The overflow handler copies it out, tags it
+//                   with the interrupted instruction and thread, and unfreezes
+//                   the LBR. Without a usable PMU, a periodic timer on each
+//                   cpu drives the same handler.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "sample.h"
+#include "cpu_trace.h"
+
+//
+// Global Variables
+
+u32 sample_enabled;
+// Whether the LBR sampling is running.
+
+char sample_mutex[MAX_MUTEX_LEN];
+// The mutex serializing the sampling ioctls and exit, so a dump never drains
+// a ring freed by a concurrent disable.
+
+struct sample_config sample_config;
+// The configuration of the running LBR sampling.
+
+struct sample_state *sample_states;
+// The per cpu sampling states, indexed by cpu core id.
+
+u32 sample_state_count;
+// The number of entries in `sample_states`.
+
+u32 sample_lbr_frz;
+// Whether the LBR freeze is reported in the global status (perfmon v4).
+
+//
+// Low level per cpu registers access
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_lbr_sampling
+// Description  : Clear the LBR stack of the current cpu and start it, frozen
+//                on each PMI when sampling a PMU event. Called on each cpu
+//                with interrupts disabled.
+//
+// Inputs       : void
+// Outputs      : void
+
+void start_lbr_sampling(void)
+{
+    u32 i, cpu;
+    u64 dbgctlmsr;
+
+    cpu = xcoreid();
+    if (cpu >= sample_state_count || !sample_states[cpu].active)
+        return;
+
+    xwrmsr(MSR_LBR_SELECT, sample_config.lbr_select);
+    xwrmsr(MSR_LBR_TOS, 0);
+    for (i = 0; i < lbr_capacity; i++)
+    {
+        xwrmsr(MSR_LBR_NHM_FROM + i, 0);
+        xwrmsr(MSR_LBR_NHM_TO + i, 0);
+    }
+
+    // Other PMIs would freeze the LBR until the next timer tick
+    xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
+    dbgctlmsr |= DEBUGCTLMSR_LBR;
+    if (sample_config.event != LIBIHT_SAMPLE_TIMER)
+        dbgctlmsr |= DEBUGCTLMSR_FREEZE_LBRS_ON_PMI;
+    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
+
+    xprintdbg("LIBIHT-COM: LBR sampling started on cpu core: %d\n", cpu);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stop_lbr_sampling
+// Description  : Stop the LBR of the current cpu. Called on each cpu with
+//                interrupts disabled.
+//
+// Inputs       : void
+// Outputs      : void
+
+void stop_lbr_sampling(void)
+{
+    u32 cpu;
+    u64 dbgctlmsr;
+
+    cpu = xcoreid();
+    if (cpu >= sample_state_count || !sample_states[cpu].active)
+        return;
+
+    xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
+    dbgctlmsr &= ~(DEBUGCTLMSR_LBR | DEBUGCTLMSR_FREEZE_LBRS_ON_PMI);
+    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
+    xwrmsr(MSR_LBR_SELECT, 0);
+
+    xprintdbg("LIBIHT-COM: LBR sampling stopped on cpu core: %d\n", cpu);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sample_overflow_handler
+// Description  : The PMU counter overflow handler, called on the overflowing
+//                cpu in NMI context. Also the handler of the sampling timers,
+//                in interrupt context. The record is built in the per cpu
+//                scratch space to keep the NMI stack small, and pushed only
+//                if the ring is not being drained at the same time.
+//
+// Inputs       : info - the sampling state of the cpu
+//                ip - the interrupted instruction pointer
+// Outputs      : void
+
+void sample_overflow_handler(void *info, u64 ip)
+{
+    u32 i, cnt, pid, tgid, selected;
+    u64 dbgctlmsr;
+    struct sample_state *state = info;
+    struct lbr_sample_record *record = &state->scratch;
+
+    if (!sample_enabled)
+        return;
+
+    pid = xgetcurrent_pid();
+    tgid = xgetcurrent_tgid();
+    selected = sample_task_selected(pid, tgid);
+
+    // The PMI froze the LBR already, keep it off while reading
+    xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
+    if (selected)
+    {
+        xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr & ~DEBUGCTLMSR_LBR);
+
+        cnt = lbr_capacity < LIBIHT_LBR_MAX_ENTRIES ?
+                lbr_capacity : LIBIHT_LBR_MAX_ENTRIES;
+        xrdmsr(MSR_LBR_TOS, &record->lbr_tos);
+        for (i = 0; i < cnt; i++)
+        {
+            xrdmsr(MSR_LBR_NHM_FROM + i, &record->entries[i].from);
+            xrdmsr(MSR_LBR_NHM_TO + i, &record->entries[i].to);
+        }
+    }
+
+    // Unfreeze, also for the samples of other tasks
+    if (sample_lbr_frz)
+        xwrmsr(MSR_CORE_PERF_GLOBAL_STATUS_RESET, GLOBAL_STATUS_LBR_FRZ);
+    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr | DEBUGCTLMSR_LBR);
+
+    if (!selected)
+        return;
+
+    record->timestamp = xget_timestamp();
+    record->ip = ip;
+    record->pid = pid;
+    record->tgid = tgid;
+    record->cpu = state->cpu;
+    record->event = sample_config.event;
+
+    if (!ring_try_push(state->ring, record))
+        state->lost++;
+}
+
+//
+// Sampling request handlers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_sampling
+// Description  : Enable the LBR sampling on the cpus of the request mask. The
+//                LBR is started on every cpu before the counters (or timers)
+//                are created, so the first sample already has a full stack.
+//                Per task and CPU scope tracing must not run at the same time
+//                since they drive the same registers.
+//
+// Inputs       : request - the sample ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 enable_sampling(struct sample_ioctl_request *request)
+{
+    u32 i, eax, ebx, ecx, edx;
+    u64 min_period;
+    struct sample_state *state;
+
+    if (sample_enabled)
+    {
+        xprintdbg("LIBIHT-COM: LBR sampling already enabled\n");
+        return -1;
+    }
+
+    if (cpu_trace_enabled || xlist_next(lbr_state_head) != lbr_state_head)
+    {
+        xprintdbg("LIBIHT-COM: LBR sampling conflicts with LBR trace\n");
+        return -1;
+    }
+
+    // Setup config with defaults
+    sample_config = request->sample_config;
+    if (sample_config.lbr_select == 0)
+        sample_config.lbr_select = LBR_SELECT;
+    if (sample_config.event == LIBIHT_SAMPLE_TIMER)
+    {
+        if (sample_config.period == 0)
+            sample_config.period = SAMPLE_DEFAULT_TIMER_PERIOD;
+        min_period = SAMPLE_MIN_TIMER_PERIOD;
+        sample_lbr_frz = FALSE;
+    }
+    else
+    {
+        if (sample_config.period == 0)
+            sample_config.period = SAMPLE_DEFAULT_PERIOD;
+        min_period = SAMPLE_MIN_PERIOD;
+        xcpuid(0xA, &eax, &ebx, &ecx, &edx);
+        sample_lbr_frz = (eax & 0xFF) >= 4;
+    }
+
+    if (sample_config.period < min_period)
+    {
+        xprintdbg("LIBIHT-COM: LBR sampling period too small\n");
+        return -1;
+    }
+
+    sample_state_count = xcpu_count();
+    sample_states = xmalloc(sample_state_count * sizeof(struct sample_state));
+    if (sample_states == NULL)
+    {
+        sample_state_count = 0;
+        return -1;
+    }
+    xmemset(sample_states, 0, sample_state_count * sizeof(struct sample_state));
+
+    for (i = 0; i < sample_state_count; i++)
+    {
+        state = &sample_states[i];
+        state->cpu = i;
+        if (!sample_cpu_in_mask(i))
+            continue;
+
+        state->active = TRUE;
+        state->ring = create_ring(sizeof(struct lbr_sample_record),
+                                    SAMPLE_RING_SIZE);
+        if (state->ring == NULL)
+            goto fail;
+    }
+
+    sample_enabled = TRUE;
+    xon_each_cpu(start_lbr_sampling);
+
+    for (i = 0; i < sample_state_count; i++)
+    {
+        state = &sample_states[i];
+        if (!state->active)
+            continue;
+
+        if (sample_config.event == LIBIHT_SAMPLE_TIMER)
+            state->counter = xcreate_cpu_timer(i, sample_config.period,
+                                                sample_overflow_handler,
+                                                state);
+        else
+            state->counter = xcreate_pmu_counter(i, sample_config.event,
+                                                sample_config.period,
+                                                sample_overflow_handler,
+                                                state);
+        if (state->counter == NULL)
+        {
+            xprintdbg("LIBIHT-COM: Create sampling %s failed on cpu %d\n",
+                        sample_config.event == LIBIHT_SAMPLE_TIMER ?
+                        "timer" : "PMU counter", i);
+            disable_sampling(request);
+            return -1;
+        }
+    }
+
+    return 0;
+
+fail:
+    xprintdbg("LIBIHT-COM: Allocate LBR sampling buffers failed\n");
+    free_sample_states();
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disable_sampling
+// Description  : Disable the LBR sampling and release the per cpu states. The
+//                counters are released first, which waits for their running
+//                handlers.
+//
+// Inputs       : request - the sample ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 disable_sampling(struct sample_ioctl_request *request)
+{
+    if (!sample_enabled)
+    {
+        xprintdbg("LIBIHT-COM: LBR sampling not enabled\n");
+        return -1;
+    }
+
+    sample_enabled = FALSE;
+    free_sample_counters();
+
+    xon_each_cpu(stop_lbr_sampling);
+    free_sample_states();
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_sampling
+// Description  : Move the pending LBR sample records of one cpu to the
+//                userspace buffer of the request.
+//
+// Inputs       : request - the sample ioctl request
+// Outputs      : s32 - number of records copied, -1 on failure
+
+s32 dump_sampling(struct sample_ioctl_request *request)
+{
+    if (!sample_enabled || request->cpu >= sample_state_count ||
+        !sample_states[request->cpu].active)
+    {
+        xprintdbg("LIBIHT-COM: CPU %d not sampled\n", request->cpu);
+        return -1;
+    }
+
+    return ring_drain_to_user(sample_states[request->cpu].ring,
+                                request->records, request->record_count);
+}
+
+//
+// Internal helpers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sample_cpu_in_mask
+// Description  : Check if a cpu is selected by the sampling cpu mask. An all
+//                zero mask selects every cpu.
+//
+// Inputs       : cpu - the cpu core id
+// Outputs      : u32 - TRUE if selected, FALSE otherwise
+
+u32 sample_cpu_in_mask(u32 cpu)
+{
+    u32 i;
+
+    for (i = 0; i < LIBIHT_CPU_MASK_WORDS; i++)
+    {
+        if (sample_config.cpu_mask[i])
+            break;
+    }
+    if (i == LIBIHT_CPU_MASK_WORDS)
+        return TRUE;
+
+    if (cpu >= LIBIHT_CPU_MASK_WORDS * 64)
+        return FALSE;
+
+    return (sample_config.cpu_mask[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sample_task_selected
+// Description  : Check if the interrupted task is selected by the pid filter,
+//                which matches either a thread id or a process id. A zero pid
+//                selects every task.
+//
+// Inputs       : pid - the thread id
+//                tgid - the process id
+// Outputs      : u32 - TRUE if selected, FALSE otherwise
+
+u32 sample_task_selected(u32 pid, u32 tgid)
+{
+    return sample_config.pid == 0 || sample_config.pid == pid ||
+            sample_config.pid == tgid;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_sample_counters
+// Description  : Release the PMU counters or the timers of all cpus.
+//
+// Inputs       : void
+// Outputs      : void
+
+void free_sample_counters(void)
+{
+    u32 i;
+
+    for (i = 0; i < sample_state_count; i++)
+    {
+        if (sample_config.event == LIBIHT_SAMPLE_TIMER)
+            xfree_cpu_timer(sample_states[i].counter);
+        else
+            xfree_pmu_counter(sample_states[i].counter);
+        sample_states[i].counter = NULL;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_sample_states
+// Description  : Free all per cpu sampling states and their rings.
+//
+// Inputs       : void
+// Outputs      : void
+
+void free_sample_states(void)
+{
+    u32 i;
+
+    if (sample_states == NULL)
+        return;
+
+    for (i = 0; i < sample_state_count; i++)
+        free_ring(sample_states[i].ring);
+
+    xfree(sample_states);
+    sample_states = NULL;
+    sample_state_count = 0;
+}
+
+//
+// Cross platform handlers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sample_ioctl_handler
+// Description  : The ioctl handler for the LBR sampling. Requests are
+//                serialized by the `sample_mutex`.
+//
+// Inputs       : request - the sample ioctl request
+// Outputs      : s32 - 0 (or record count) on success, -1 on failure
+
+s32 sample_ioctl_handler(struct xioctl_request *request)
+{
+    s32 ret = 0;
+
+    xprintdbg("LIBIHT-COM: Sample ioctl command %d.\n", request->cmd);
+    xacquire_mutex(sample_mutex);
+    switch (request->cmd)
+    {
+        case LIBIHT_IOCTL_ENABLE_SAMPLE:
+            xprintdbg("LIBIHT-COM: Enable LBR sampling\n");
+            ret = enable_sampling(&request->body.sample);
+            break;
+        case LIBIHT_IOCTL_DISABLE_SAMPLE:
+            xprintdbg("LIBIHT-COM: Disable LBR sampling\n");
+            ret = disable_sampling(&request->body.sample);
+            break;
+        case LIBIHT_IOCTL_DUMP_SAMPLE:
+            xprintdbg("LIBIHT-COM: Dump LBR samples for cpu %d\n",
+                        request->body.sample.cpu);
+            ret = dump_sampling(&request->body.sample);
+            break;
+        default:
+            xprintdbg("LIBIHT-COM: Invalid sample ioctl command\n");
+            ret = -1;
+            break;
+    }
+    xrelease_mutex(sample_mutex);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sample_init
+// Description  : Initialize the LBR sampling.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 sample_init(void)
+{
+    xprintdbg("LIBIHT-COM: Init LBR sampling related structs.\n");
+    xinit_mutex(sample_mutex);
+    sample_enabled = FALSE;
+    sample_states = NULL;
+    sample_state_count = 0;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sample_exit
+// Description  : Stop the LBR sampling if running and free its states.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 sample_exit(void)
+{
+    xacquire_mutex(sample_mutex);
+    if (sample_enabled)
+    {
+        xprintdbg("LIBIHT-COM: Stopping LBR sampling on all cpus...\n");
+        disable_sampling(NULL);
+    }
+    xrelease_mutex(sample_mutex);
+
+    return 0;
+}
@@ -0,0 +1,124 @@
+#ifndef _COMMONS_SAMPLE_H
+#define _COMMONS_SAMPLE_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/sample.h
+//  Description    : This is the header file for the LBR sampling module. A
+//                   core PMU counter overflows every N events (or a high
+//                   resolution timer fires) on each sampled cpu, and each
+//                   interrupt appends the LBR stack, tagged with the
+//                   interrupted instruction and thread, to a per cpu ring.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "types.h"
+#include "xplat.h"
+#include "xioctl.h"
+#include "ring.h"
+#include "lbr.h"
+
+// cpp cross compile handler
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+//
+// Library constants
+
+// MSR related constants
+#ifndef DEBUGCTLMSR_FREEZE_LBRS_ON_PMI
+#define DEBUGCTLMSR_FREEZE_LBRS_ON_PMI  (1UL << 11)
+#endif
+
+#ifndef MSR_CORE_PERF_GLOBAL_STATUS_RESET
+#define MSR_CORE_PERF_GLOBAL_STATUS_RESET   0x00000390
+#endif
+
+// LBR frozen bit of the global status (architectural perfmon v4)
+#define GLOBAL_STATUS_LBR_FRZ           (1ULL << 58)
+
+// Number of LBR sample records kept per cpu
+#define SAMPLE_RING_SIZE                0x200
+
+// Default and minimum number of events between two samples
+#define SAMPLE_DEFAULT_PERIOD           0x100000
+#define SAMPLE_MIN_PERIOD               0x1000
+
+// Default (1 kHz) and minimum (100 kHz) timer period in nanoseconds
+#define SAMPLE_DEFAULT_TIMER_PERIOD     1000000
+#define SAMPLE_MIN_TIMER_PERIOD         10000
+
+//
+// Type definitions
+
+// Define per cpu sampling state
+struct sample_state
+{
+    u32 cpu;                            // CPU core id
+    u32 active;                         // Whether the cpu is sampled
+    void *counter;                      // PMU counter or timer of the cpu
+    struct ring_buffer *ring;           // LBR sample records
+    u64 lost;                           // Samples lost while draining
+    struct lbr_sample_record scratch;   // Record being built by the handler
+};
+
+//
+// Global Variables
+
+extern u32 sample_enabled;
+// Whether the LBR sampling is running.
+
+extern char sample_mutex[MAX_MUTEX_LEN];
+// The mutex serializing the sampling ioctls and exit.
+
+//
+// Function Prototypes
+
+void start_lbr_sampling(void);
+// Start the sampled LBR on the current cpu
+
+void stop_lbr_sampling(void);
+// Stop the sampled LBR on the current cpu
+
+void sample_overflow_handler(void *info, u64 ip);
+// Append the frozen LBR stack to the ring of the current cpu
+
+u32 sample_task_selected(u32 pid, u32 tgid);
+// Check if a task is selected by the sampling pid filter
+
+void free_sample_counters(void);
+// Release the PMU counters or timers of all cpus
+
+s32 enable_sampling(struct sample_ioctl_request *request);
+// Enable the LBR sampling
+
+s32 disable_sampling(struct sample_ioctl_request *request);
+// Disable the LBR sampling
+
+s32 dump_sampling(struct sample_ioctl_request *request);
+// Dump the LBR sample records of one cpu
+
+u32 sample_cpu_in_mask(u32 cpu);
+// Check if a cpu is selected by the sampling cpu mask
+
+void free_sample_states(void);
+// Free all per cpu sampling states
+
+s32 sample_ioctl_handler(struct xioctl_request *request);
+// Handle the LBR sampling ioctl request
+
+s32 sample_init(void);
+// Initialize the LBR sampling
+
+s32 sample_exit(void);
+// Exit the LBR sampling
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _COMMONS_SAMPLE_H
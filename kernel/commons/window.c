@@ -0,0 +1,378 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/window.c
+//  Description    : This is the implementation of the trace windows for the
+//                   libiht library. The start probe of a window enables (or
+//                   resumes) the trace of the thread hitting it, and the stop
+//                   probe freezes it, so only the branches inside the window
+//                   are recorded. The states enabled by a window are owned
+//                   by it, and freed when their thread exits or the window
+//                   is deleted.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "window.h"
+
+//
+// Global Variables
+
+char window_lock[MAX_LOCK_LEN];
+// The lock for window_table.
+
+struct window_entry window_table[MAX_TRACE_WINDOWS];
+// The trace window table, indexed by window id.
+
+//
+// Window table management
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_trace_window
+// Description  : Add the trace window of the request to the first free entry
+//                of the window table and install its probes. Without a stop
+//                offset, the window closes when the start function returns.
+//
+// Inputs       : request - the window ioctl request
+// Outputs      : s32 - the window id on success, -1 on failure
+
+s32 add_trace_window(struct window_ioctl_request *request)
+{
+    struct window_entry *entry = NULL;
+    void *start_probe, *stop_probe = NULL;
+    char irql_flag[MAX_IRQL_LEN];
+    s32 i;
+
+    if (request->window.features == 0 || request->window.path[0] == '\0')
+    {
+        xprintdbg("LIBIHT-COM: Empty trace window\n");
+        return -1;
+    }
+
+    // Paths from userspace may not be terminated
+    request->window.path[LIBIHT_WINDOW_PATH_LEN - 1] = '\0';
+
+    // Reserve the entry, probes are installed without the lock held
+    xacquire_lock(window_lock, irql_flag);
+    for (i = 0; i < MAX_TRACE_WINDOWS; i++)
+    {
+        if (!window_table[i].used)
+        {
+            entry = &window_table[i];
+            entry->used = TRUE;
+            entry->window = request->window;
+            entry->start_probe = NULL;
+            entry->stop_probe = NULL;
+            break;
+        }
+    }
+    xrelease_lock(window_lock, irql_flag);
+
+    if (entry == NULL)
+    {
+        xprintdbg("LIBIHT-COM: Trace window table full\n");
+        return -1;
+    }
+
+    start_probe = xregister_uprobe(entry->window.path,
+                                entry->window.start_offset,
+                                window_start_handler, entry,
+                                entry->window.stop_offset == 0);
+    if (start_probe && entry->window.stop_offset)
+        stop_probe = xregister_uprobe(entry->window.path,
+                                entry->window.stop_offset,
+                                window_stop_handler, entry, FALSE);
+
+    if (start_probe == NULL ||
+        (entry->window.stop_offset && stop_probe == NULL))
+    {
+        xprintdbg("LIBIHT-COM: Install trace window probes failed: %s\n",
+                    entry->window.path);
+        if (start_probe)
+            xunregister_uprobe(start_probe);
+        entry->used = FALSE;
+        return -1;
+    }
+
+    // Publish the probes, the window can be deleted from now on
+    xacquire_lock(window_lock, irql_flag);
+    entry->start_probe = start_probe;
+    entry->stop_probe = stop_probe;
+    xrelease_lock(window_lock, irql_flag);
+
+    xprintdbg("LIBIHT-COM: Trace window %d added: %s+0x%llx\n", i,
+                entry->window.path, entry->window.start_offset);
+    return i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : del_trace_window
+// Description  : Remove the probes of the trace window with the window id of
+//                the request and delete it. The LBR/BTS states enabled by the
+//                window are freed with it.
+//
+// Inputs       : request - the window ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 del_trace_window(struct window_ioctl_request *request)
+{
+    struct window_entry *entry;
+    void *start_probe, *stop_probe;
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (request->window_id >= MAX_TRACE_WINDOWS)
+        return -1;
+
+    // Take the probes under the lock, so the window is only deleted once
+    entry = &window_table[request->window_id];
+    xacquire_lock(window_lock, irql_flag);
+    start_probe = entry->used ? entry->start_probe : NULL;
+    stop_probe = entry->stop_probe;
+    if (start_probe)
+    {
+        entry->start_probe = NULL;
+        entry->stop_probe = NULL;
+    }
+    xrelease_lock(window_lock, irql_flag);
+
+    if (start_probe == NULL)
+        return -1;
+
+    // Unregistering waits for the running probe handlers
+    xunregister_uprobe(start_probe);
+    if (stop_probe)
+        xunregister_uprobe(stop_probe);
+    remove_lbr_owned_states(LBR_OWNER_WINDOW, request->window_id);
+    remove_bts_owned_states(BTS_OWNER_WINDOW, request->window_id);
+    entry->used = FALSE;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clear_trace_windows
+// Description  : Delete all trace windows of the window table.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success
+
+s32 clear_trace_windows(void)
+{
+    struct window_ioctl_request request;
+
+    for (request.window_id = 0; request.window_id < MAX_TRACE_WINDOWS;
+            request.window_id++)
+        del_trace_window(&request);
+
+    return 0;
+}
+
+//
+// Window trace control
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_window_trace
+// Description  : Start the features of a trace window for the current thread.
+//                The first hit enables the trace in thread scope, owned by
+//                the window, later hits only resume it.
+//
+// Inputs       : entry - the trace window entry
+// Outputs      : void
+
+void start_window_trace(struct window_entry *entry)
+{
+    struct lbr_ioctl_request lbr_request;
+    struct bts_ioctl_request bts_request;
+    struct lbr_state *lbr;
+    struct bts_state *bts;
+    u32 pid = xgetcurrent_pid();
+
+    if (entry->window.features & LIBIHT_WINDOW_LBR)
+    {
+        lbr = find_lbr_state(pid);
+        if (lbr)
+        {
+            pause_lbr_state(lbr, LBR_PAUSE_USER, FALSE);
+            sync_lbr_paused(lbr);
+        }
+        else
+        {
+            xmemset(&lbr_request, 0, sizeof(lbr_request));
+            lbr_request.lbr_config.pid = pid;
+            lbr_request.lbr_config.scope = LIBIHT_SCOPE_THREAD;
+            lbr_request.lbr_config.lbr_select = entry->window.lbr_select;
+            if (enable_lbr(&lbr_request) == 0 &&
+                (lbr = find_lbr_state(pid)) != NULL)
+                own_lbr_state(lbr, LBR_OWNER_WINDOW,
+                                (u32)(entry - window_table));
+        }
+    }
+
+    if (entry->window.features & LIBIHT_WINDOW_BTS)
+    {
+        bts = find_bts_state(pid);
+        if (bts)
+        {
+            pause_bts_state(bts, BTS_PAUSE_USER, FALSE);
+            sync_bts_paused(bts);
+        }
+        else
+        {
+            xmemset(&bts_request, 0, sizeof(bts_request));
+            bts_request.bts_config.pid = pid;
+            bts_request.bts_config.scope = LIBIHT_SCOPE_THREAD;
+            bts_request.bts_config.bts_config = entry->window.bts_config;
+            bts_request.bts_config.bts_buffer_size =
+                                        entry->window.bts_buffer_size;
+            if (enable_bts(&bts_request) == 0 &&
+                (bts = find_bts_state(pid)) != NULL)
+                own_bts_state(bts, BTS_OWNER_WINDOW,
+                                (u32)(entry - window_table));
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stop_window_trace
+// Description  : Freeze the features of a trace window for the current
+//                thread. The recorded branches are kept until the next start
+//                hit or a dump request.
+//
+// Inputs       : entry - the trace window entry
+// Outputs      : void
+
+void stop_window_trace(struct window_entry *entry)
+{
+    struct lbr_state *lbr;
+    struct bts_state *bts;
+    u32 pid = xgetcurrent_pid();
+
+    if (entry->window.features & LIBIHT_WINDOW_LBR)
+    {
+        lbr = find_lbr_state(pid);
+        if (lbr)
+        {
+            pause_lbr_state(lbr, LBR_PAUSE_USER, TRUE);
+            sync_lbr_paused(lbr);
+        }
+    }
+
+    if (entry->window.features & LIBIHT_WINDOW_BTS)
+    {
+        bts = find_bts_state(pid);
+        if (bts)
+        {
+            pause_bts_state(bts, BTS_PAUSE_USER, TRUE);
+            sync_bts_paused(bts);
+        }
+    }
+}
+
+//
+// Cross platform handlers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : window_start_handler
+// Description  : The probe handler of the start location of a trace window.
+//                When the window has no stop location, the return of the
+//                start function stops it.
+//
+// Inputs       : info - the trace window entry
+//                ret - TRUE on function return, FALSE on entry
+// Outputs      : void
+
+void window_start_handler(void *info, u32 ret)
+{
+    if (ret)
+        stop_window_trace((struct window_entry *)info);
+    else
+        start_window_trace((struct window_entry *)info);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : window_stop_handler
+// Description  : The probe handler of the stop location of a trace window.
+//
+// Inputs       : info - the trace window entry
+//                ret - unused
+// Outputs      : void
+
+void window_stop_handler(void *info, u32 ret)
+{
+    stop_window_trace((struct window_entry *)info);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : window_ioctl_handler
+// Description  : The ioctl handler for the trace windows.
+//
+// Inputs       : request - the window ioctl request
+// Outputs      : s32 - 0 (or window id) on success, -1 on failure
+
+s32 window_ioctl_handler(struct xioctl_request *request)
+{
+    s32 ret = 0;
+
+    xprintdbg("LIBIHT-COM: Trace window ioctl command %d.\n", request->cmd);
+    switch (request->cmd)
+    {
+        case LIBIHT_IOCTL_ADD_WINDOW:
+            ret = add_trace_window(&request->body.window);
+            break;
+        case LIBIHT_IOCTL_DEL_WINDOW:
+            xprintdbg("LIBIHT-COM: Delete trace window %d\n",
+                        request->body.window.window_id);
+            ret = del_trace_window(&request->body.window);
+            break;
+        case LIBIHT_IOCTL_CLEAR_WINDOWS:
+            xprintdbg("LIBIHT-COM: Clear trace windows\n");
+            ret = clear_trace_windows();
+            break;
+        default:
+            xprintdbg("LIBIHT-COM: Invalid trace window ioctl command\n");
+            ret = -1;
+            break;
+    }
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : window_init
+// Description  : Initialize the trace window table.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 window_init(void)
+{
+    xprintdbg("LIBIHT-COM: Init trace window table.\n");
+    xinit_lock(window_lock);
+    xmemset(window_table, 0, sizeof(window_table));
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : window_exit
+// Description  : Remove the probes of all trace windows and free the states
+//                they own.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 window_exit(void)
+{
+    return clear_trace_windows();
+}
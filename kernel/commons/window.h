@@ -0,0 +1,89 @@
+#ifndef _COMMONS_WINDOW_H
+#define _COMMONS_WINDOW_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/window.h
+//  Description    : This is the header file for the trace window module. A
+//                   trace window installs user probes on a start and a stop
+//                   location of a binary, and only lets the LBR/BTS trace of
+//                   a thread run between the two.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+// Include Files
+#include "types.h"
+#include "xplat.h"
+#include "xioctl.h"
+#include "lbr.h"
+#include "bts.h"
+
+// cpp cross compile handler
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+//
+// Library constants
+
+// Number of entries in the trace window table
+#define MAX_TRACE_WINDOWS       16
+
+//
+// Type definitions
+
+// Define trace window table entry
+struct window_entry
+{
+    u32 used;                           // Whether the entry holds a window
+    struct trace_window window;         // The trace window
+    void *start_probe;                  // Probe on the start location
+    void *stop_probe;                   // Probe on the stop location
+};
+
+//
+// Global Variables
+
+extern char window_lock[MAX_LOCK_LEN];
+// The lock for window_table.
+
+//
+// Function Prototypes
+
+s32 add_trace_window(struct window_ioctl_request *request);
+// Add a trace window and install its probes
+
+s32 del_trace_window(struct window_ioctl_request *request);
+// Remove the probes of a trace window and delete it
+
+s32 clear_trace_windows(void);
+// Delete all trace windows
+
+void start_window_trace(struct window_entry *entry);
+// Start or resume the window trace of the current thread
+
+void stop_window_trace(struct window_entry *entry);
+// Freeze the window trace of the current thread
+
+void window_start_handler(void *info, u32 ret);
+// Handle a hit of the start probe of a trace window
+
+void window_stop_handler(void *info, u32 ret);
+// Handle a hit of the stop probe of a trace window
+
+s32 window_ioctl_handler(struct xioctl_request *request);
+// Handle the trace window ioctl request
+
+s32 window_init(void);
+// Initialize the trace window table
+
+s32 window_exit(void);
+// Remove all trace windows
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _COMMONS_WINDOW_H
@@ -25,6 +25,10 @@ enum IOCTL {
     LIBIHT_IOCTL_DISABLE_LBR,
     LIBIHT_IOCTL_DUMP_LBR,
     LIBIHT_IOCTL_CONFIG_LBR,
+    LIBIHT_IOCTL_PAUSE_LBR,
+    LIBIHT_IOCTL_RESUME_LBR,
+    LIBIHT_IOCTL_DUMP_LBR_OFFCPU,
+    LIBIHT_IOCTL_DUMP_LBR_SYSCALL,
     LIBIHT_IOCTL_LBR_END,       // End of LBR
 
     // BTS
@@ -32,7 +36,56 @@ enum IOCTL {
     LIBIHT_IOCTL_DISABLE_BTS,
     LIBIHT_IOCTL_DUMP_BTS,
     LIBIHT_IOCTL_CONFIG_BTS,
+    LIBIHT_IOCTL_PAUSE_BTS,
+    LIBIHT_IOCTL_RESUME_BTS,
+    LIBIHT_IOCTL_DUMP_PEBS,
     LIBIHT_IOCTL_BTS_END,       // End of BTS
+
+    // CPU
+    LIBIHT_IOCTL_ENABLE_CPU,
+    LIBIHT_IOCTL_DISABLE_CPU,
+    LIBIHT_IOCTL_DUMP_CPU,
+    LIBIHT_IOCTL_CPU_END,       // End of CPU
+
+    // Exec rules
+    LIBIHT_IOCTL_ADD_RULE,
+    LIBIHT_IOCTL_DEL_RULE,
+    LIBIHT_IOCTL_CLEAR_RULES,
+    LIBIHT_IOCTL_RULE_END,      // End of exec rules
+
+    // Trace gates
+    LIBIHT_IOCTL_ATTACH_GATE,
+    LIBIHT_IOCTL_DETACH_GATE,
+    LIBIHT_IOCTL_DUMP_GATE,
+    LIBIHT_IOCTL_GATE_END,      // End of trace gates
+
+    // Trace windows
+    LIBIHT_IOCTL_ADD_WINDOW,
+    LIBIHT_IOCTL_DEL_WINDOW,
+    LIBIHT_IOCTL_CLEAR_WINDOWS,
+    LIBIHT_IOCTL_WINDOW_END,    // End of trace windows
+
+    // LBR sampling
+    LIBIHT_IOCTL_ENABLE_SAMPLE,
+    LIBIHT_IOCTL_DISABLE_SAMPLE,
+    LIBIHT_IOCTL_DUMP_SAMPLE,
+    LIBIHT_IOCTL_SAMPLE_END,    // End of LBR sampling
+
+    // Crash capture
+    LIBIHT_IOCTL_DUMP_CRASH,
+    LIBIHT_IOCTL_CRASH_END,     // End of crash capture
+
+    // Intel PT
+    LIBIHT_IOCTL_ENABLE_PT,
+    LIBIHT_IOCTL_DISABLE_PT,
+    LIBIHT_IOCTL_DUMP_PT,
+    LIBIHT_IOCTL_PT_END,        // End of Intel PT
+};
+
+// Trace scope of an enable request
+enum TRACE_SCOPE {
+    LIBIHT_SCOPE_THREAD,        // Trace the given thread (and its children)
+    LIBIHT_SCOPE_PROCESS,       // Trace all threads of the given process
 };
 
 //
@@ -45,11 +98,19 @@ struct lbr_stack_entry
     u64 to;     // Retrieve from MSR_LBR_NHM_TO + offset
 };
 
+// Number of u64 words in the syscall mask (512 syscalls)
+#define LIBIHT_SYSCALL_MASK_WORDS   8
+
 // Define LBR configuration
 struct lbr_config
 {
     u32 pid;                          // Process ID
+    u32 scope;                        // Trace scope (enum TRACE_SCOPE)
     u64 lbr_select;                   // MSR_LBR_SELECT
+    u32 offcpu_records;               // Off-cpu snapshot ring size, 0 = off
+    u32 syscall_records;              // Syscall snapshot ring size, 0 = off
+    u64 syscall_mask[LIBIHT_SYSCALL_MASK_WORDS]; // Snapshotted syscall
+                                      // numbers, all syscalls if zero
 };
 
 // Define LBR data
@@ -57,12 +118,47 @@ struct lbr_data
 {
     u64 lbr_tos;                      // MSR_LBR_TOS
     struct lbr_stack_entry *entries;  // LBR stack entries
+    u32 tid;                          // Thread ID of the LBR snapshot
+    u32 entry_count;                  // Entries in the buffer, valid entries
+                                      // after a dump (0: no bound check)
+};
+
+// Maximum number of LBR entries of any cpu
+#define LIBIHT_LBR_MAX_ENTRIES  32
+
+// Define off-cpu LBR record, the LBR stack of a thread when switched out
+struct lbr_offcpu_record
+{
+    u64 timestamp;                    // Switch time in nanoseconds
+    u32 pid;                          // Thread switched out
+    u32 prev_state;                   // Task state index, 0 if preempted
+    u32 next_pid;                     // Thread switched in
+    u32 cpu;                          // CPU core id
+    u64 lbr_tos;                      // MSR_LBR_TOS
+    struct lbr_stack_entry entries[LIBIHT_LBR_MAX_ENTRIES];
+};
+
+// Define syscall LBR record, the LBR stack of a thread entering a syscall
+struct lbr_syscall_record
+{
+    u64 timestamp;                    // Syscall entry time in nanoseconds
+    u32 pid;                          // Thread entering the syscall
+    u32 syscall;                      // Syscall number
+    u32 cpu;                          // CPU core id
+    u32 reserved;                     // Padding
+    u64 lbr_tos;                      // MSR_LBR_TOS
+    struct lbr_stack_entry entries[LIBIHT_LBR_MAX_ENTRIES];
 };
 
 // Define the lbr IOCTL structure
 struct lbr_ioctl_request{
     struct lbr_config lbr_config;
     struct lbr_data *buffer;
+    u32 buffer_count;                 // Number of buffers (process scope)
+    struct lbr_offcpu_record *offcpu; // Off-cpu records buffer
+    u32 offcpu_count;                 // Number of off-cpu records
+    struct lbr_syscall_record *syscall; // Syscall records buffer
+    u32 syscall_count;                // Number of syscall records
 };
 
 //
@@ -80,8 +176,26 @@ struct bts_record
 struct bts_config
 {
     u32 pid;                        // Process ID
+    u32 scope;                      // Trace scope (enum TRACE_SCOPE)
     u64 bts_config;                 // MSR_IA32_DEBUGCTLMSR
     u64 bts_buffer_size;            // BTS buffer size
+    u64 pebs_event;                 // PEBS event and umask, 0 disables PEBS
+    u64 pebs_period;                // Events between two PEBS records
+    u64 pebs_buffer_size;           // PEBS buffer size
+    u32 pebs_latency;               // Load latency threshold, 0 if unused
+    u32 reserved;
+};
+
+// Define PEBS record, normalized from the PEBS record format of the cpu
+struct pebs_record
+{
+    u64 ip;                         // Eventing instruction pointer
+    u64 data_addr;                  // Data linear address, 0 if unknown
+    u64 latency;                    // Load latency in cycles, 0 if unknown
+    u64 data_source;                // Data source encoding, 0 if unknown
+    u64 tsc;                        // Timestamp counter, 0 if unknown
+    u32 tid;                        // Thread ID of the record
+    u32 reserved;
 };
 
 // Define BTS data
@@ -91,12 +205,285 @@ struct bts_data
     struct bts_record *bts_buffer_base; // BTS buffer base
     struct bts_record *bts_index;       // BTS current index
     u64 bts_interrupt_threshold;        // BTS interrupt threshold
+    u32 tid;                            // Thread ID of the BTS records
+    u32 record_count;                   // Records in the buffer, valid records
+                                        // after a dump (0: whole BTS buffer)
 };
 
 // Define the bts IOCTL structure
 struct bts_ioctl_request{
     struct bts_config bts_config;
     struct bts_data *buffer;
+    u32 buffer_count;                   // Number of buffers (process scope)
+    struct pebs_record *pebs;           // PEBS records buffer
+    u32 pebs_count;                     // Number of PEBS records
+};
+
+//
+// CPU Type definitions
+
+// Features traced in CPU scope
+enum CPU_FEATURE {
+    LIBIHT_CPU_LBR = 0x1,       // Run LBR on the selected cpus
+    LIBIHT_CPU_BTS = 0x2,       // Run BTS on the selected cpus
+};
+
+// Number of u64 words in the cpu mask (256 cpus)
+#define LIBIHT_CPU_MASK_WORDS   4
+
+// Maximum number of cgroups in the cgroup filter
+#define LIBIHT_CGROUP_MAX       8
+
+// Define CPU trace configuration
+struct cpu_config
+{
+    u32 features;                       // Traced features (enum CPU_FEATURE)
+    u64 lbr_select;                     // MSR_LBR_SELECT
+    u64 bts_config;                     // MSR_IA32_DEBUGCTLMSR
+    u64 bts_buffer_size;                // Per cpu BTS buffer size
+    u64 cpu_mask[LIBIHT_CPU_MASK_WORDS]; // Traced cpus, all cpus if zero
+    u32 cgroup_count;                   // Number of cgroups, no filter if zero
+    u64 cgroup_ids[LIBIHT_CGROUP_MAX];  // Traced cgroup v2 ids (inode numbers)
+};
+
+// Define context switch sideband record
+struct cpu_sideband_record
+{
+    u64 timestamp;                      // Switch time in nanoseconds
+    u32 cpu;                            // CPU core id
+    u32 prev_pid;                       // Thread switched out
+    u32 prev_tgid;                      // Process switched out
+    u32 next_pid;                       // Thread switched in
+    u32 next_tgid;                      // Process switched in
+    u32 reserved;                       // Padding
+    u64 bts_offset;                     // BTS record index at the switch
+    u64 next_cgroup;                    // cgroup v2 id of the next thread
+};
+
+// Define the cpu IOCTL structure
+struct cpu_ioctl_request{
+    struct cpu_config cpu_config;
+    u32 cpu;                                // CPU core id to dump
+    struct lbr_data *lbr_buffer;            // LBR snapshot of the cpu
+    struct bts_data *bts_buffer;            // BTS records of the cpu
+    struct cpu_sideband_record *sideband;   // Sideband records of the cpu
+    u32 sideband_count;                     // Number of sideband records
+};
+
+//
+// Exec rule Type definitions
+
+// Field matched by an exec rule
+enum RULE_MATCH {
+    LIBIHT_RULE_COMM,           // Match the command name (basename)
+    LIBIHT_RULE_PATH,           // Match the full executable path
+};
+
+// Features attached by an exec rule
+enum RULE_FEATURE {
+    LIBIHT_RULE_LBR = 0x1,      // Enable LBR on match
+    LIBIHT_RULE_BTS = 0x2,      // Enable BTS on match
+};
+
+// Maximum length of an exec rule pattern (including '\0')
+#define LIBIHT_RULE_PATTERN_LEN 128
+
+// Define exec rule
+struct exec_rule
+{
+    u32 match;                          // Matched field (enum RULE_MATCH)
+    u32 features;                       // Attached features (enum RULE_FEATURE)
+    u32 scope;                          // Trace scope (enum TRACE_SCOPE)
+    u64 lbr_select;                     // MSR_LBR_SELECT
+    u64 bts_config;                     // MSR_IA32_DEBUGCTLMSR
+    u64 bts_buffer_size;                // BTS buffer size
+    char pattern[LIBIHT_RULE_PATTERN_LEN]; // Glob pattern ('*' and '?')
+};
+
+// Define the rule IOCTL structure
+struct rule_ioctl_request{
+    struct exec_rule rule;
+    u32 rule_id;                        // Rule id to delete
+};
+
+//
+// Trace gate Type definitions
+
+// Define trace gate, a control word in the memory of the traced thread that
+// the kernel reads at each context switch of the thread
+struct trace_gate
+{
+    volatile u32 wanted;                // Tracing wanted, 0 pauses LBR/BTS
+    volatile u32 region_id;             // Current region id of the thread
+};
+
+// Define trace gate region record
+struct gate_region_record
+{
+    u64 timestamp;                      // Observation time in nanoseconds
+    u32 pid;                            // Thread owning the gate
+    u32 region_id;                      // Region id observed
+    u32 wanted;                         // Wanted flag observed
+    u32 cpu;                            // CPU core id
+    u64 bts_offset;                     // BTS record index of the thread
+};
+
+// Define the gate IOCTL structure
+struct gate_ioctl_request{
+    struct trace_gate *gate;                // Trace gate to attach
+    struct gate_region_record *records;     // Region records buffer
+    u32 record_count;                       // Number of region records
+};
+
+//
+// Trace window Type definitions
+
+// Features traced inside a trace window
+enum WINDOW_FEATURE {
+    LIBIHT_WINDOW_LBR = 0x1,    // Run LBR inside the window
+    LIBIHT_WINDOW_BTS = 0x2,    // Run BTS inside the window
+};
+
+// Maximum length of a trace window binary path (including '\0')
+#define LIBIHT_WINDOW_PATH_LEN  256
+
+// Define trace window
+struct trace_window
+{
+    u32 features;                       // Traced features (enum WINDOW_FEATURE)
+    u64 lbr_select;                     // MSR_LBR_SELECT
+    u64 bts_config;                     // MSR_IA32_DEBUGCTLMSR
+    u64 bts_buffer_size;                // BTS buffer size
+    u64 start_offset;                   // File offset opening the window
+    u64 stop_offset;                    // File offset closing the window, the
+                                        // return of the start function if zero
+    char path[LIBIHT_WINDOW_PATH_LEN];  // Path of the probed binary
+};
+
+// Define the window IOCTL structure
+struct window_ioctl_request{
+    struct trace_window window;
+    u32 window_id;                      // Window id to delete
+};
+
+//
+// LBR sampling Type definitions
+
+// PMU events triggering an LBR sample
+enum SAMPLE_EVENT {
+    LIBIHT_SAMPLE_CYCLES,           // Unhalted core cycles
+    LIBIHT_SAMPLE_BRANCH_MISSES,    // Mispredicted branches
+    LIBIHT_SAMPLE_LLC_MISSES,       // Last level cache misses
+    LIBIHT_SAMPLE_TIMER,            // High resolution timer ticks
+};
+
+// Define LBR sampling configuration
+struct sample_config
+{
+    u32 event;                          // Counted event (enum SAMPLE_EVENT)
+    u32 pid;                            // Sampled thread or process, 0 = all
+    u64 period;                         // Events (ns for timer) between samples
+    u64 lbr_select;                     // MSR_LBR_SELECT
+    u64 cpu_mask[LIBIHT_CPU_MASK_WORDS]; // Sampled cpus, all cpus if zero
+};
+
+// Define LBR sample record
+struct lbr_sample_record
+{
+    u64 timestamp;                      // Sample time in nanoseconds
+    u64 ip;                             // Interrupted instruction pointer
+    u32 pid;                            // Interrupted thread
+    u32 tgid;                           // Interrupted process
+    u32 cpu;                            // CPU core id
+    u32 event;                          // Counted event (enum SAMPLE_EVENT)
+    u64 lbr_tos;                        // MSR_LBR_TOS
+    struct lbr_stack_entry entries[LIBIHT_LBR_MAX_ENTRIES];
+};
+
+// Define the sample IOCTL structure
+struct sample_ioctl_request{
+    struct sample_config sample_config;
+    u32 cpu;                            // CPU core id to dump
+    struct lbr_sample_record *records;  // LBR sample records buffer
+    u32 record_count;                   // Number of LBR sample records
+};
+
+//
+// Crash capture Type definitions
+
+// Number of BTS records kept in a crash record
+#define LIBIHT_CRASH_BTS_RECORDS    64
+
+// Define crash record, the last branches of a traced thread that took a fatal
+// signal or exited abnormally
+struct crash_record
+{
+    u64 timestamp;                      // Capture time in nanoseconds
+    u32 pid;                            // Crashed thread
+    u32 tgid;                           // Crashed process
+    u32 signal;                         // Fatal signal (exit status on Windows)
+    u32 code;                           // Signal code, 0 if taken at exit
+    u64 addr;                           // Faulting address, 0 if unknown
+    u32 cpu;                            // CPU core id
+    u32 bts_count;                      // Number of BTS records, 0 if no BTS
+    u64 lbr_tos;                        // MSR_LBR_TOS
+    struct lbr_stack_entry entries[LIBIHT_LBR_MAX_ENTRIES];
+    struct bts_record bts[LIBIHT_CRASH_BTS_RECORDS]; // BTS tail, oldest first
+};
+
+// Define the crash IOCTL structure
+struct crash_ioctl_request{
+    struct crash_record *records;       // Crash records buffer
+    u32 record_count;                   // Number of crash records
+};
+
+//
+// Intel PT Type definitions
+
+// Maximum number of PT address ranges
+#define LIBIHT_PT_MAX_RANGES        4
+
+// Use of a PT address range
+enum PT_RANGE_MODE {
+    LIBIHT_PT_RANGE_FILTER = 0x1,   // Trace only inside the range
+    LIBIHT_PT_RANGE_STOP = 0x2,     // Stop the trace when entering the range
+};
+
+// Define PT address range
+struct pt_range
+{
+    u64 start;                      // First address of the range
+    u64 end;                        // Last address of the range
+    u32 mode;                       // Range use (enum PT_RANGE_MODE)
+    u32 reserved;
+};
+
+// Define PT configuration
+struct pt_config
+{
+    u32 pid;                        // Process ID
+    u32 scope;                      // Trace scope (enum TRACE_SCOPE)
+    u64 pt_config;                  // MSR_IA32_RTIT_CTL packet enables
+    u64 pt_buffer_size;             // PT output buffer size
+    u32 cr3_filter;                 // Only trace the address space of the task
+    u32 range_count;                // Number of address ranges
+    struct pt_range ranges[LIBIHT_PT_MAX_RANGES];
+};
+
+// Define PT data, the packet stream of one thread
+struct pt_data
+{
+    u8 *buffer;                     // Packet buffer
+    u64 size;                       // Buffer size, bytes copied on return
+    u32 tid;                        // Thread ID of the packets
+    u32 wrapped;                    // Whether older packets were overwritten
+};
+
+// Define the pt IOCTL structure
+struct pt_ioctl_request{
+    struct pt_config pt_config;
+    struct pt_data *buffer;
+    u32 buffer_count;                   // Number of buffers (process scope)
 };
 
 //
@@ -108,6 +495,13 @@ struct xioctl_request{
     union {
         struct lbr_ioctl_request lbr;
         struct bts_ioctl_request bts;
+        struct cpu_ioctl_request cpu;
+        struct rule_ioctl_request rule;
+        struct gate_ioctl_request gate;
+        struct window_ioctl_request window;
+        struct sample_ioctl_request sample;
+        struct crash_ioctl_request crash;
+        struct pt_ioctl_request pt;
     } body;
 };
 
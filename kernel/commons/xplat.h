@@ -26,7 +26,10 @@ extern "C" {
 
 #define MAX_IRQL_LEN    0x10    // Maximum length of OS irql struct
 #define MAX_LOCK_LEN    0x20    // Maximum length of OS lock struct
+#define MAX_MUTEX_LEN   0x80    // Maximum length of OS sleeping lock struct
 #define MAX_LIST_LEN    0x20    // Maximum length of OS list struct
+#define MAX_PROC_THREADS 0x100  // Initial capacity for process thread ids
+#define MAX_PIN_LEN     0x10    // Maximum length of OS pinned page handle
 
 //
 // Function Prototypes
@@ -40,6 +43,12 @@ void *xmalloc(u64 size);
 void xfree(void *ptr);
 // Cross platform kernel free function.
 
+void *xvmalloc(u64 size);
+// Cross platform kernel large (not physically contiguous) malloc function.
+
+void xvfree(void *ptr);
+// Cross platform kernel large free function, safe with a lock held.
+
 u64 xcopy_from_user(void *dst, void *src, u64 cnt);
 // Cross platform kernel copy from user function.
 
@@ -52,6 +61,15 @@ void *xmemset(void *ptr, s32 c, u64 cnt);
 void *xmemcpy(void *dst, void *src, u64 cnt);
 // Cross platform kernel memcpy function.
 
+void *xpin_user_page(void *uaddr, void *pin);
+// Cross platform pin a user page of the current process function.
+
+void xunpin_user_page(void *pin);
+// Cross platform unpin a pinned user page function.
+
+u64 xvirt_to_phys(void *addr);
+// Cross platform get physical address of kernel memory function.
+
 //
 // CPU core, hardware, register read/write functions
 
@@ -73,12 +91,79 @@ u32  xcoreid(void);
 u32 xgetcurrent_pid(void);
 // Cross platform get current user process pid function.
 
+u32 xgetcurrent_tgid(void);
+// Cross platform get current user process thread group id function.
+
+u32 xget_thread_ids(u32 tgid, u32 *tids, u32 max_cnt);
+// Cross platform get thread ids of a process function.
+
+u64 xget_task_cr3(u32 pid);
+// Cross platform get user page table base of a process function.
+
 void xcpuid(u32 func_id, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx);
 // Cross platform cpuid function.
 
+void xcpuid_count(u32 func_id, u32 sub_id, u32 *eax, u32 *ebx, u32 *ecx,
+                    u32 *edx);
+// Cross platform cpuid with sub-leaf function.
+
 void xon_each_cpu(void (*func)(void));
 // Cross platform on each cpu dispatch function.
 
+void xon_cpu(u32 cpu, void (*func)(void *), void *info);
+// Cross platform on a specific cpu dispatch function.
+
+u32 xcpu_count(void);
+// Cross platform get number of possible cpu cores function.
+
+u64 xget_timestamp(void);
+// Cross platform get monotonic timestamp (nanoseconds) function.
+
+//
+// User probe functions
+
+void *xregister_uprobe(const char *path, u64 offset,
+                        void (*func)(void *, u32), void *info, u32 on_return);
+// Cross platform register a user probe on a binary offset function.
+
+void xunregister_uprobe(void *probe);
+// Cross platform unregister a user probe function.
+
+//
+// PMU counter functions
+
+void *xcreate_pmu_counter(u32 cpu, u32 event, u64 period,
+                            void (*func)(void *, u64), void *info);
+// Cross platform create a sampling PMU counter on a cpu function.
+
+void xfree_pmu_counter(void *counter);
+// Cross platform release a sampling PMU counter function.
+
+void *xcreate_cpu_timer(u32 cpu, u64 period, void (*func)(void *, u64),
+                        void *info);
+// Cross platform create a periodic timer pinned on a cpu function.
+
+void xfree_cpu_timer(void *timer);
+// Cross platform cancel and release a periodic cpu timer function.
+
+//
+// Deferred work functions
+
+s32 xqueue_work(void (*func)(void *), void *info, u64 size);
+// Cross platform run a function later in process context function.
+
+void xflush_work(void);
+// Cross platform wait for the queued work functions function.
+
+//
+// Syscall hook functions
+
+s32 xregister_syscall_hook(void (*func)(u32, u32));
+// Cross platform hook the syscall entry of all threads function.
+
+void xunregister_syscall_hook(void);
+// Cross platform remove the syscall entry hook function.
+
 //
 // Lock functions
 
@@ -88,9 +173,21 @@ void xinit_lock(void *lock);
 void xacquire_lock(void *lock, void *old_irql);
 // Cross platform acquire lock function.
 
+u32 xtry_acquire_lock(void *lock, void *old_irql);
+// Cross platform try acquire lock function.
+
 void xrelease_lock(void *lock, void *new_irql);
 // Cross platform release lock function.
 
+void xinit_mutex(void *mutex);
+// Cross platform init sleeping lock function.
+
+void xacquire_mutex(void *mutex);
+// Cross platform acquire sleeping lock function.
+
+void xrelease_mutex(void *mutex);
+// Cross platform release sleeping lock function.
+
 //
 // List functions
 
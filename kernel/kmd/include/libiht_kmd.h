@@ -14,6 +14,13 @@
 // Includes Files
 #include "../../commons/lbr.h"
 #include "../../commons/bts.h"
+#include "../../commons/cpu_trace.h"
+#include "../../commons/exec_rule.h"
+#include "../../commons/gate.h"
+#include "../../commons/window.h"
+#include "../../commons/sample.h"
+#include "../../commons/crash.h"
+#include "../../commons/pt.h"
 #include "../../commons/types.h"
 #include "../../commons/debug.h"
 #include "../infinity_hook/imports.hpp"
@@ -43,6 +50,9 @@ extern "C" {
 //
 // Function Prototypes
 
+NTSTATUS NTAPI PsGetProcessExitStatus(PEPROCESS proc);
+// Exported by the kernel, but not declared in the WDK headers
+
 // TODO: Determine if this function are necessary
 BOOLEAN bypass_check_sign(PDRIVER_OBJECT driver_obj);
 
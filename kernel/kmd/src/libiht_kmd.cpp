@@ -77,8 +77,9 @@ BOOLEAN bypass_check_sign(PDRIVER_OBJECT driver_obj)
 //                be called when a process is created or terminated. If the
 //                process is created by a parent in the `lbr_state_list`, the
 //                child will also be added to the `lbr_state_list`. If the
-//                process is terminated, it will be removed from the LBR
-//                monitor list.
+//                process image matches an exec rule, the rule trace is
+//                attached before the process runs. If the process is
+//                terminated, it will be removed from the LBR monitor list.
 //
 // Inputs       : proc - the process object
 //                proc_id - the process id
@@ -88,17 +89,43 @@ BOOLEAN bypass_check_sign(PDRIVER_OBJECT driver_obj)
 VOID create_proc_notify(PEPROCESS proc, HANDLE proc_id,
     PPS_CREATE_NOTIFY_INFO create_info)
 {
-    UNREFERENCED_PARAMETER(proc);
+    char image_path[LIBIHT_RULE_PATTERN_LEN << 1];
+    ANSI_STRING image_name;
+    NTSTATUS exit_status;
+
     if (create_info != NULL)
     {
         // Process is being created
-        lbr_newproc_handler((u32)(UINT_PTR)create_info->ParentProcessId, (u32)proc_id);
-        bts_newproc_handler((u32)(UINT_PTR)create_info->ParentProcessId, (u32)proc_id);
+        lbr_newproc_handler((u32)(UINT_PTR)create_info->ParentProcessId, (u32)proc_id, (u32)proc_id);
+        bts_newproc_handler((u32)(UINT_PTR)create_info->ParentProcessId, (u32)proc_id, (u32)proc_id);
+        pt_newproc_handler((u32)(UINT_PTR)create_info->ParentProcessId, (u32)proc_id, (u32)proc_id);
+
+        // Match exec rules against the image path
+        if (create_info->ImageFileName != NULL)
+        {
+            image_name.Buffer = image_path;
+            image_name.Length = 0;
+            image_name.MaximumLength = sizeof(image_path) - 1;
+            if (NT_SUCCESS(RtlUnicodeStringToAnsiString(&image_name,
+                            create_info->ImageFileName, FALSE)))
+            {
+                image_path[image_name.Length] = '\0';
+                exec_rule_exec_handler((u32)(UINT_PTR)proc_id, NULL, image_path);
+            }
+        }
     }
     else
     {
-        // Process is being terminated
-        // TODO: remove the process? But this feature not implemented on lkm
+        // Process is being terminated, a crash ends with an error status
+        exit_status = PsGetProcessExitStatus(proc);
+        crash_exitproc_handler((u32)(UINT_PTR)proc_id, (u32)(UINT_PTR)proc_id,
+                               NT_ERROR(exit_status) ? (u32)exit_status : 0);
+
+        // Only process scope traces are removed
+        lbr_exitproc_handler((u32)(UINT_PTR)proc_id);
+        bts_exitproc_handler((u32)(UINT_PTR)proc_id);
+        pt_exitproc_handler((u32)(UINT_PTR)proc_id);
+        gate_exitproc_handler((u32)(UINT_PTR)proc_id);
     }
 }
 
@@ -118,8 +145,11 @@ VOID create_proc_notify(PEPROCESS proc, HANDLE proc_id,
 
 void __fastcall cswitch_call_back(u32 new_proc, u32 old_proc)
 {
-    lbr_cswitch_handler(old_proc, new_proc);
+    gate_cswitch_handler(old_proc, new_proc);
+    lbr_cswitch_handler(old_proc, new_proc, 0);
     bts_cswitch_handler(old_proc, new_proc);
+    pt_cswitch_handler(old_proc, new_proc);
+    cpu_trace_cswitch_handler(old_proc, old_proc, new_proc, new_proc, 0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -268,14 +298,63 @@ NTSTATUS device_ioctl(PDEVICE_OBJECT device_obj, PIRP Irp)
     {
         // LBR request
         xprintdbg("LIBIHT-KMD: LBR request\n");
-        if (lbr_ioctl_handler(request) != 0)
+        if (lbr_ioctl_handler(request) < 0)
             status = STATUS_UNSUCCESSFUL;
     }
 	else if (request->cmd <= LIBIHT_IOCTL_BTS_END)
 	{
 		// BTS request
 		xprintdbg("LIBIHT-KMD: BTS request\n");
-		if (bts_ioctl_handler(request) != 0)
+		if (bts_ioctl_handler(request) < 0)
+			status = STATUS_UNSUCCESSFUL;
+	}
+	else if (request->cmd <= LIBIHT_IOCTL_CPU_END)
+	{
+		// CPU scope request
+		xprintdbg("LIBIHT-KMD: CPU request\n");
+		if (cpu_trace_ioctl_handler(request) < 0)
+			status = STATUS_UNSUCCESSFUL;
+	}
+	else if (request->cmd <= LIBIHT_IOCTL_RULE_END)
+	{
+		// Exec rule request
+		xprintdbg("LIBIHT-KMD: Exec rule request\n");
+		if (exec_rule_ioctl_handler(request) < 0)
+			status = STATUS_UNSUCCESSFUL;
+	}
+	else if (request->cmd <= LIBIHT_IOCTL_GATE_END)
+	{
+		// Trace gate request
+		xprintdbg("LIBIHT-KMD: Trace gate request\n");
+		if (gate_ioctl_handler(request) < 0)
+			status = STATUS_UNSUCCESSFUL;
+	}
+	else if (request->cmd <= LIBIHT_IOCTL_WINDOW_END)
+	{
+		// Trace window request
+		xprintdbg("LIBIHT-KMD: Trace window request\n");
+		if (window_ioctl_handler(request) < 0)
+			status = STATUS_UNSUCCESSFUL;
+	}
+	else if (request->cmd <= LIBIHT_IOCTL_SAMPLE_END)
+	{
+		// LBR sampling request
+		xprintdbg("LIBIHT-KMD: LBR sampling request\n");
+		if (sample_ioctl_handler(request) < 0)
+			status = STATUS_UNSUCCESSFUL;
+	}
+	else if (request->cmd <= LIBIHT_IOCTL_CRASH_END)
+	{
+		// Crash capture request
+		xprintdbg("LIBIHT-KMD: Crash capture request\n");
+		if (crash_ioctl_handler(request) < 0)
+			status = STATUS_UNSUCCESSFUL;
+	}
+	else if (request->cmd <= LIBIHT_IOCTL_PT_END)
+	{
+		// Intel PT request
+		xprintdbg("LIBIHT-KMD: PT request\n");
+		if (pt_ioctl_handler(request) < 0)
 			status = STATUS_UNSUCCESSFUL;
 	}
 	else
@@ -360,6 +439,27 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_obj, PUNICODE_STRING reg_path)
     // Init BTS
     bts_init();
 
+    // Init CPU scope tracing
+    cpu_trace_init();
+
+    // Init exec rules
+    exec_rule_init();
+
+    // Init trace gates
+    gate_init();
+
+    // Init trace windows
+    window_init();
+
+    // Init LBR sampling
+    sample_init();
+
+    // Init crash capture
+    crash_init();
+
+    // Init PT
+    pt_init();
+
     xprintdbg("LIBIHT-KMD: Initialized\n");
     return STATUS_SUCCESS;
 }
@@ -381,6 +481,27 @@ NTSTATUS DriverExit(PDRIVER_OBJECT driver_obj)
 
     xprintdbg("LIBIHT-KMD: Exiting...\n");
 
+    // Exit PT
+    pt_exit();
+
+    // Exit crash capture
+    crash_exit();
+
+    // Exit LBR sampling
+    sample_exit();
+
+    // Exit trace windows
+    window_exit();
+
+    // Exit trace gates
+    gate_exit();
+
+    // Exit exec rules
+    exec_rule_exit();
+
+    // Exit CPU scope tracing
+    cpu_trace_exit();
+
     // Exit BTS
     bts_exit();
 
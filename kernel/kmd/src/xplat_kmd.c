@@ -49,6 +49,35 @@ void xfree(void *ptr)
     ExFreePool(ptr);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xvmalloc
+// Description  : Cross platform kernel large malloc function. The non paged
+//                pool is not physically contiguous, so this is xmalloc.
+//
+// Inputs       : size - size of the memory to be allocated.
+// Outputs      : void* - pointer to the allocated memory.
+
+void* xvmalloc(u64 size)
+{
+    return xmalloc(size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xvfree
+// Description  : Cross platform kernel large free function. Free memory from
+//                xvmalloc, at or below DISPATCH_LEVEL.
+//
+// Inputs       : ptr - pointer to the memory to be freed.
+// Outputs      : void
+
+void xvfree(void *ptr)
+{
+    if (ptr != NULL)
+        xfree(ptr);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xcopy_from_user
@@ -138,6 +167,84 @@ void* xmemcpy(void* dst, void* src, u64 cnt)
     return memcpy(dst, src, cnt);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xpin_user_page
+// Description  : Cross platform pin user page function. Lock the user page
+//                holding an address of the current process and map it into
+//                system space, so it can be accessed at any IRQL.
+//
+// Inputs       : uaddr - user address inside the page to be pinned.
+//                pin - pointer to the pinned page handle (output).
+// Outputs      : void* - kernel address of `uaddr`, NULL on failure.
+
+void* xpin_user_page(void* uaddr, void* pin)
+{
+    PMDL mdl;
+    PVOID addr;
+
+    mdl = IoAllocateMdl(PAGE_ALIGN(uaddr), PAGE_SIZE, FALSE, FALSE, NULL);
+    if (mdl == NULL)
+        return NULL;
+
+    __try
+    {
+        MmProbeAndLockPages(mdl, UserMode, IoWriteAccess);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        IoFreeMdl(mdl);
+        return NULL;
+    }
+
+    addr = MmGetSystemAddressForMdlSafe(mdl,
+                NormalPagePriority | MdlMappingNoExecute);
+    if (addr == NULL)
+    {
+        MmUnlockPages(mdl);
+        IoFreeMdl(mdl);
+        return NULL;
+    }
+
+    *(PMDL*)pin = mdl;
+    return (char*)addr + BYTE_OFFSET(uaddr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xunpin_user_page
+// Description  : Cross platform unpin user page function. Unlock and unmap a
+//                page pinned by xpin_user_page.
+//
+// Inputs       : pin - pointer to the pinned page handle.
+// Outputs      : void
+
+void xunpin_user_page(void* pin)
+{
+    PMDL mdl = *(PMDL*)pin;
+
+    if (mdl == NULL)
+        return;
+
+    MmUnlockPages(mdl);
+    IoFreeMdl(mdl);
+    *(PMDL*)pin = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xvirt_to_phys
+// Description  : Cross platform get physical address function. Translate the
+//                address of memory from `xmalloc`.
+//
+// Inputs       : addr - kernel virtual address.
+// Outputs      : u64 - physical address.
+
+u64 xvirt_to_phys(void* addr)
+{
+    return MmGetPhysicalAddress(addr).QuadPart;
+}
+
 //
 // CPU core, hardware, register read/write functions
 
@@ -223,6 +330,75 @@ u32 xgetcurrent_pid(void)
     return (u32)(ULONG_PTR)PsGetCurrentProcessId();
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xgetcurrent_tgid
+// Description  : Cross platform get current tgid function. The driver traces
+//                on process granularity, so it is the current process pid.
+//
+// Inputs       : void
+// Outputs      : u32 - current user process pid.
+
+u32 xgetcurrent_tgid(void)
+{
+    return (u32)(ULONG_PTR)PsGetCurrentProcessId();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xget_thread_ids
+// Description  : Cross platform get thread ids function. The driver traces
+//                on process granularity, so a process is its only unit.
+//
+// Inputs       : tgid - user process pid.
+//                tids - array to be filled with the thread ids.
+//                max_cnt - capacity of the array.
+// Outputs      : u32 - number of traced units in the process.
+
+u32 xget_thread_ids(u32 tgid, u32 *tids, u32 max_cnt)
+{
+    if (max_cnt > 0)
+        tids[0] = tgid;
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xget_task_cr3
+// Description  : Cross platform get user page table base function. The
+//                directory table base is read while attached to the process.
+//                With PCID (used by KVA shadow), the user CR3 also holds an
+//                address space id and differs from the kernel one, so none
+//                is returned. Must be called at PASSIVE_LEVEL or APC_LEVEL.
+//
+// Inputs       : pid - process id.
+// Outputs      : u64 - page table base, 0 if the process is not found or
+//                PCID is enabled.
+
+u64 xget_task_cr3(u32 pid)
+{
+    PEPROCESS proc;
+    KAPC_STATE apc_state;
+    u64 cr3;
+
+    // CR4.PCIDE
+    if (__readcr4() & (1ULL << 17))
+    {
+        xprintdbg("LIBIHT-KMD: CR3 of pid %d unknown with PCID\n", pid);
+        return 0;
+    }
+
+    if (!NT_SUCCESS(PsLookupProcessByProcessId((HANDLE)(UINT_PTR)pid, &proc)))
+        return 0;
+
+    KeStackAttachProcess(proc, &apc_state);
+    cr3 = __readcr3();
+    KeUnstackDetachProcess(&apc_state);
+    ObDereferenceObject(proc);
+
+    return cr3 & ~0xFFFULL;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xcpuid
@@ -241,6 +417,26 @@ void xcpuid(u32 func_id, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
     *edx = regs[3];
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcpuid_count
+// Description  : Cross platform cpuid with sub-leaf function.
+//
+// Inputs       : func_id - cpuid function id.
+//                sub_id - cpuid sub-leaf id.
+// Outputs      : void
+
+void xcpuid_count(u32 func_id, u32 sub_id, u32 *eax, u32 *ebx, u32 *ecx,
+                    u32 *edx)
+{
+    s32 regs[4];
+    __cpuidex(regs, func_id, sub_id);
+    *eax = regs[0];
+    *ebx = regs[1];
+    *ecx = regs[2];
+    *edx = regs[3];
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xon_each_cpu
@@ -255,6 +451,369 @@ void xon_each_cpu(void (*func)(void))
     KeIpiGenericCall((PKIPI_BROADCAST_WORKER)func, 0);
 }
 
+// Context of a single cpu dispatch
+struct xon_cpu_context
+{
+    u32 cpu;
+    void (*func)(void *);
+    void *info;
+};
+
+static ULONG_PTR xon_cpu_worker(ULONG_PTR argument)
+{
+    struct xon_cpu_context *ctx = (struct xon_cpu_context *)argument;
+
+    if (xcoreid() == ctx->cpu)
+        ctx->func(ctx->info);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xon_cpu
+// Description  : Cross platform on cpu function. Run a function on the given
+//                cpu, the broadcast worker filters out the other cpus.
+//
+// Inputs       : cpu - cpu core id.
+//                func - function to be run.
+//                info - argument passed to the function.
+// Outputs      : void
+
+void xon_cpu(u32 cpu, void (*func)(void *), void *info)
+{
+    struct xon_cpu_context ctx;
+
+    ctx.cpu = cpu;
+    ctx.func = func;
+    ctx.info = info;
+    KeIpiGenericCall(xon_cpu_worker, (ULONG_PTR)&ctx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcpu_count
+// Description  : Cross platform cpu count function. Get the number of cpu
+//                cores in all processor groups.
+//
+// Inputs       : void
+// Outputs      : u32 - number of cpu cores.
+
+u32 xcpu_count(void)
+{
+    return KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xget_timestamp
+// Description  : Cross platform timestamp function. Get the interrupt time,
+//                which is monotonic and readable at any IRQL.
+//
+// Inputs       : void
+// Outputs      : u64 - timestamp in nanoseconds.
+
+u64 xget_timestamp(void)
+{
+    return KeQueryInterruptTimePrecise(NULL) * 100;
+}
+
+//
+// User probe functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xregister_uprobe
+// Description  : Cross platform register user probe function. Windows has no
+//                user probe facility for drivers, so probes are refused.
+//
+// Inputs       : path - path of the probed binary.
+//                offset - file offset of the probed instruction.
+//                func - callback, with TRUE as second argument on return.
+//                info - callback argument.
+//                on_return - whether to also probe the function return.
+// Outputs      : void* - always NULL.
+
+void* xregister_uprobe(const char* path, u64 offset,
+                        void (*func)(void*, u32), void* info, u32 on_return)
+{
+    UNREFERENCED_PARAMETER(path);
+    UNREFERENCED_PARAMETER(offset);
+    UNREFERENCED_PARAMETER(func);
+    UNREFERENCED_PARAMETER(info);
+    UNREFERENCED_PARAMETER(on_return);
+
+    xprintdbg("LIBIHT-KMD: User probes are not supported\n");
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xunregister_uprobe
+// Description  : Cross platform unregister user probe function.
+//
+// Inputs       : probe - the probe handle.
+// Outputs      : void
+
+void xunregister_uprobe(void* probe)
+{
+    UNREFERENCED_PARAMETER(probe);
+}
+
+//
+// PMU counter functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcreate_pmu_counter
+// Description  : Cross platform create PMU counter function. The counters are
+//                owned by the kernel profiling interfaces on Windows, so
+//                sampling counters are refused.
+//
+// Inputs       : cpu - the counting cpu.
+//                event - the counted event (enum SAMPLE_EVENT).
+//                period - number of events between two callbacks.
+//                func - callback, with the interrupted ip as second argument.
+//                info - callback argument.
+// Outputs      : void* - always NULL.
+
+void* xcreate_pmu_counter(u32 cpu, u32 event, u64 period,
+                            void (*func)(void*, u64), void* info)
+{
+    UNREFERENCED_PARAMETER(cpu);
+    UNREFERENCED_PARAMETER(event);
+    UNREFERENCED_PARAMETER(period);
+    UNREFERENCED_PARAMETER(func);
+    UNREFERENCED_PARAMETER(info);
+
+    xprintdbg("LIBIHT-KMD: PMU sampling counters are not supported\n");
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xfree_pmu_counter
+// Description  : Cross platform release PMU counter function.
+//
+// Inputs       : counter - the counter handle.
+// Outputs      : void
+
+void xfree_pmu_counter(void* counter)
+{
+    UNREFERENCED_PARAMETER(counter);
+}
+
+//
+// Timer functions
+
+// Periodic cpu timer with its callback
+struct xcpu_timer
+{
+    KTIMER timer;                       // Periodic kernel timer
+    KDPC dpc;                           // DPC targeted at the cpu
+    void (*func)(void*, u64);           // Callback on expiry
+    void* info;                         // Callback argument
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcpu_timer_dpc
+// Description  : The timer DPC routine, called on the target cpu at
+//                DISPATCH_LEVEL. The interrupted instruction is not known at
+//                this point, so the callback gets a zero ip.
+//
+// Inputs       : dpc - the DPC object.
+//                context - the cpu timer.
+//                arg1, arg2 - unused.
+// Outputs      : void
+
+static void xcpu_timer_dpc(PKDPC dpc, PVOID context, PVOID arg1, PVOID arg2)
+{
+    struct xcpu_timer* cpu_timer = (struct xcpu_timer*)context;
+
+    UNREFERENCED_PARAMETER(dpc);
+    UNREFERENCED_PARAMETER(arg1);
+    UNREFERENCED_PARAMETER(arg2);
+
+    cpu_timer->func(cpu_timer->info, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcreate_cpu_timer
+// Description  : Cross platform create cpu timer function. Start a periodic
+//                kernel timer whose DPC runs on a cpu. The period is rounded
+//                to milliseconds, the resolution of periodic kernel timers.
+//
+// Inputs       : cpu - the timer cpu.
+//                period - timer period in nanoseconds.
+//                func - callback, with the interrupted ip as second argument.
+//                info - callback argument.
+// Outputs      : void* - the timer handle, NULL on failure.
+
+void* xcreate_cpu_timer(u32 cpu, u64 period, void (*func)(void*, u64),
+                        void* info)
+{
+    struct xcpu_timer* cpu_timer;
+    LARGE_INTEGER due_time;
+    LONG period_ms;
+
+    cpu_timer = (struct xcpu_timer*)xmalloc(sizeof(struct xcpu_timer));
+    if (cpu_timer == NULL)
+        return NULL;
+
+    cpu_timer->func = func;
+    cpu_timer->info = info;
+    period_ms = (LONG)(period / 1000000);
+    if (period_ms == 0)
+        period_ms = 1;
+
+    KeInitializeTimerEx(&cpu_timer->timer, NotificationTimer);
+    KeInitializeDpc(&cpu_timer->dpc, xcpu_timer_dpc, cpu_timer);
+    KeSetTargetProcessorDpc(&cpu_timer->dpc, (CCHAR)cpu);
+
+    // Relative due time in 100ns units
+    due_time.QuadPart = -(LONGLONG)period_ms * 10000;
+    KeSetTimerEx(&cpu_timer->timer, due_time, period_ms, &cpu_timer->dpc);
+
+    return cpu_timer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xfree_cpu_timer
+// Description  : Cross platform release cpu timer function. Cancel a timer
+//                created by xcreate_cpu_timer, wait for its queued DPCs, and
+//                free it.
+//
+// Inputs       : timer - the timer handle.
+// Outputs      : void
+
+void xfree_cpu_timer(void* timer)
+{
+    struct xcpu_timer* cpu_timer = (struct xcpu_timer*)timer;
+
+    if (cpu_timer == NULL)
+        return;
+
+    KeCancelTimer(&cpu_timer->timer);
+    KeFlushQueuedDpcs();
+    xfree(cpu_timer);
+}
+
+//
+// Deferred work functions
+
+// Queued work function with a copy of its argument
+struct xwork_item
+{
+    WORK_QUEUE_ITEM item;               // System worker item
+    void (*func)(void*);                // Work function
+    u64 info[1];                        // Copy of the work argument
+};
+
+// Number of work items not finished yet
+static volatile LONG xwork_pending;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xwork_routine
+// Description  : The system worker routine, called at PASSIVE_LEVEL. Run and
+//                free a work item.
+//
+// Inputs       : parameter - the work item.
+// Outputs      : void
+
+static void xwork_routine(PVOID parameter)
+{
+    struct xwork_item* work = (struct xwork_item*)parameter;
+
+    work->func(work->info);
+    xfree(work);
+    InterlockedDecrement(&xwork_pending);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xqueue_work
+// Description  : Cross platform queue work function. Run `func` later on a
+//                system worker thread. The `size` bytes at `info` are copied,
+//                so the caller can pass a stack argument. Safe to call at
+//                DISPATCH_LEVEL.
+//
+// Inputs       : func - function to be run.
+//                info - argument copied for the function.
+//                size - size of the argument.
+// Outputs      : s32 - 0 on success, -1 on failure.
+
+s32 xqueue_work(void (*func)(void*), void* info, u64 size)
+{
+    struct xwork_item* work;
+
+    work = (struct xwork_item*)xmalloc(sizeof(struct xwork_item) + size);
+    if (work == NULL)
+        return -1;
+
+    work->func = func;
+    RtlCopyMemory(work->info, info, size);
+    InterlockedIncrement(&xwork_pending);
+    ExInitializeWorkItem(&work->item, xwork_routine, work);
+    ExQueueWorkItem(&work->item, DelayedWorkQueue);
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xflush_work
+// Description  : Cross platform flush work function. Wait until the work
+//                queued by xqueue_work so far has run.
+//
+// Inputs       : void
+// Outputs      : void
+
+void xflush_work(void)
+{
+    LARGE_INTEGER interval;
+
+    // Poll every millisecond, in 100ns units
+    interval.QuadPart = -10000;
+    while (InterlockedCompareExchange(&xwork_pending, 0, 0) != 0)
+        KeDelayExecutionThread(KernelMode, FALSE, &interval);
+}
+
+//
+// Syscall hook functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xregister_syscall_hook
+// Description  : Cross platform hook the syscall entry function. The syscall
+//                entry cannot be hooked by a supported driver interface on
+//                Windows, so hooks are refused.
+//
+// Inputs       : func - callback, called by the thread entering a syscall.
+// Outputs      : s32 - always -1.
+
+s32 xregister_syscall_hook(void (*func)(u32, u32))
+{
+    UNREFERENCED_PARAMETER(func);
+
+    xprintdbg("LIBIHT-KMD: Syscall hooks are not supported\n");
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xunregister_syscall_hook
+// Description  : Cross platform remove the syscall entry hook function.
+//
+// Inputs       : void
+// Outputs      : void
+
+void xunregister_syscall_hook(void)
+{
+}
+
 //
 // Lock functions
 
@@ -285,6 +844,26 @@ void xacquire_lock(void *lock, void *old_irql)
     KeAcquireSpinLock((PKSPIN_LOCK)lock, (PKIRQL)old_irql);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xtry_acquire_lock
+// Description  : Cross platform try acquire lock function. Acquire a lock
+//                only if it is free, raising to DISPATCH_LEVEL on success.
+//
+// Inputs       : lock     - pointer to the lock to be acquired.
+//                old_irql - pointer to the old IRQL.
+// Outputs      : u32 - TRUE if acquired, FALSE otherwise.
+
+u32 xtry_acquire_lock(void *lock, void *old_irql)
+{
+    KeRaiseIrql(DISPATCH_LEVEL, (PKIRQL)old_irql);
+    if (KeTryToAcquireSpinLockAtDpcLevel((PKSPIN_LOCK)lock))
+        return TRUE;
+
+    KeLowerIrql(*(PKIRQL)old_irql);
+    return FALSE;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xrelease_lock
@@ -299,6 +878,47 @@ void xrelease_lock(void *lock, void *new_irql)
     KeReleaseSpinLock((PKSPIN_LOCK)lock, *(PKIRQL)new_irql);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xinit_mutex
+// Description  : Cross platform init mutex function. Initialize a fast mutex,
+//                which may be held across copies to user space.
+//
+// Inputs       : mutex - pointer to the mutex to be initialized.
+// Outputs      : void
+
+void xinit_mutex(void *mutex)
+{
+    ExInitializeFastMutex((PFAST_MUTEX)mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xacquire_mutex
+// Description  : Cross platform acquire mutex function. Acquire a fast mutex,
+//                must be called below DISPATCH_LEVEL.
+//
+// Inputs       : mutex - pointer to the mutex to be acquired.
+// Outputs      : void
+
+void xacquire_mutex(void *mutex)
+{
+    ExAcquireFastMutex((PFAST_MUTEX)mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xrelease_mutex
+// Description  : Cross platform release mutex function. Release a fast mutex.
+//
+// Inputs       : mutex - pointer to the mutex to be released.
+// Outputs      : void
+
+void xrelease_mutex(void *mutex)
+{
+    ExReleaseFastMutex((PFAST_MUTEX)mutex);
+}
+
 //
 // List functions
 
@@ -16,23 +16,38 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 
+#include <linux/binfmts.h>
+#include <linux/cgroup.h>
+#include <linux/dcache.h>
 #include <linux/errno.h>
 #include <linux/fortify-string.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
 #include <linux/kprobes.h>
 #include <linux/list.h>
+#include <linux/llist.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/namei.h>
 #include <linux/notifier.h>
+#include <linux/perf_event.h>
 #include <linux/preempt.h>
 #include <linux/printk.h>
 #include <linux/proc_fs.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/signal.h>
 #include <linux/slab.h>
 #include <linux/smp.h>
 #include <linux/spinlock.h>
 #include <linux/tracepoint.h>
 #include <linux/uaccess.h>
+#include <linux/uprobes.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
+#include <asm/irq_regs.h>
 #include <asm/msr.h>
 #include <asm/msr-index.h>
 #include <asm/processor.h>
@@ -15,6 +15,13 @@
 #include "headers_lkm.h"
 #include "../../commons/lbr.h"
 #include "../../commons/bts.h"
+#include "../../commons/cpu_trace.h"
+#include "../../commons/exec_rule.h"
+#include "../../commons/gate.h"
+#include "../../commons/window.h"
+#include "../../commons/sample.h"
+#include "../../commons/crash.h"
+#include "../../commons/pt.h"
 #include "../../commons/types.h"
 #include "../../commons/debug.h"
 
@@ -26,6 +33,11 @@
 #define HAVE_PROC_OPS
 #endif
 
+// The kernel siginfo was split from the user siginfo in 4.20
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+#define kernel_siginfo siginfo
+#endif
+
 // Device name
 #define DEVICE_NAME "libiht-info"
 
@@ -61,6 +73,12 @@ void register_tracepoints(void);
 void unregister_tracepoints(void);
 // This function is used to unregister tracepoints.
 
+u64 task_cgroup_id(struct task_struct *task);
+// This function is used to get the cgroup v2 id of a task.
+
+u32 task_switch_state(bool preempt, struct task_struct *task);
+// This function is used to get the state index of a task being switched out.
+
 void tp_sched_switch_handler(void *data, bool preempt,
                                 struct task_struct *prev,
                                 struct task_struct *next);
@@ -69,6 +87,18 @@ void tp_sched_switch_handler(void *data, bool preempt,
 void tp_new_task_handler(void *data, struct task_struct *task);
 // This function is called when the task_newtask tracepoint is hit.
 
+void tp_process_exit_handler(void *data, struct task_struct *task);
+// This function is called when the sched_process_exit tracepoint is hit.
+
+void tp_process_exec_handler(void *data, struct task_struct *task,
+                                pid_t old_pid, struct linux_binprm *bprm);
+// This function is called when the sched_process_exec tracepoint is hit.
+
+void tp_signal_deliver_handler(void *data, int sig,
+                                struct kernel_siginfo *info,
+                                struct k_sigaction *ka);
+// This function is called when the signal_deliver tracepoint is hit.
+
 int device_open(struct inode *inode, struct file *file_ptr);
 // This function is used to open the device.
 
@@ -115,7 +145,10 @@ static struct file_operations libiht_ops = {
 // Structures for installing the tracepoint hooks.
 struct tracepoint_table traces[] = {
     {.name = "sched_switch", .func = tp_sched_switch_handler},
-    {.name = "task_newtask", .func = tp_new_task_handler}
+    {.name = "task_newtask", .func = tp_new_task_handler},
+    {.name = "sched_process_exit", .func = tp_process_exit_handler},
+    {.name = "sched_process_exec", .func = tp_process_exec_handler},
+    {.name = "signal_deliver", .func = tp_signal_deliver_handler}
 };
 
 
@@ -83,6 +83,44 @@ void unregister_tracepoints(void) {
     }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : task_cgroup_id
+// Description  : This function is used to get the cgroup v2 id of a task,
+//                which is the inode number of its cgroup directory. Called
+//                from the tracepoints, where the rcu read side is held.
+//
+// Inputs       : task - the task
+// Outputs      : u64 - the cgroup id, 0 if cgroups are not available
+
+u64 task_cgroup_id(struct task_struct *task)
+{
+#ifdef CONFIG_CGROUPS
+    return cgroup_id(task_dfl_cgroup(task));
+#else
+    return 0;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : task_switch_state
+// Description  : This function is used to get the state index of a task being
+//                switched out, as shown in the sched_switch trace event. A
+//                preempted task is still runnable.
+//
+// Inputs       : preempt - the preempt flag
+//                task - the task
+// Outputs      : u32 - the task state index, 0 if runnable
+
+u32 task_switch_state(bool preempt, struct task_struct *task)
+{
+    if (preempt)
+        return 0;
+
+    return task_state_index(task);
+}
+
 //
 // Tracepoint handlers
 
@@ -102,8 +140,14 @@ void tp_sched_switch_handler(void *data, bool preempt,
                                     struct task_struct *prev_task,
                                     struct task_struct *next_task)
 {
-    lbr_cswitch_handler(prev_task->pid, next_task->pid);
+    gate_cswitch_handler(prev_task->pid, next_task->pid);
+    lbr_cswitch_handler(prev_task->pid, next_task->pid,
+                        task_switch_state(preempt, prev_task));
     bts_cswitch_handler(prev_task->pid, next_task->pid);
+    pt_cswitch_handler(prev_task->pid, next_task->pid);
+    cpu_trace_cswitch_handler(prev_task->pid, prev_task->tgid,
+                                next_task->pid, next_task->tgid,
+                                task_cgroup_id(next_task));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -118,8 +162,94 @@ void tp_sched_switch_handler(void *data, bool preempt,
 
 void tp_new_task_handler(void *data, struct task_struct *task)
 {
-    lbr_newproc_handler(task->real_parent->pid, task->pid);
-    bts_newproc_handler(task->real_parent->pid, task->pid);
+    lbr_newproc_handler(task->real_parent->pid, task->pid, task->tgid);
+    bts_newproc_handler(task->real_parent->pid, task->pid, task->tgid);
+    pt_newproc_handler(task->real_parent->pid, task->pid, task->tgid);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tp_process_exit_handler
+// Description  : This function is the handler for the sched_process_exit
+//                event. It will be called when a thread exits.
+//
+// Inputs       : data - the data
+//                task - the exiting task
+// Outputs      : void
+
+void tp_process_exit_handler(void *data, struct task_struct *task)
+{
+    // Must run before the LBR handler drops process scope states
+    crash_exitproc_handler(task->pid, task->tgid, task->exit_code & 0x7f);
+    lbr_exitproc_handler(task->pid);
+    bts_exitproc_handler(task->pid);
+    pt_exitproc_handler(task->pid);
+    gate_exitproc_handler(task->pid);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tp_process_exec_handler
+// Description  : This function is the handler for the sched_process_exec
+//                event. It will be called in the context of a task that just
+//                loaded a new executable, before it returns to user space.
+//
+// Inputs       : data - the data
+//                task - the task
+//                old_pid - the pid before exec (differs for non-leader threads)
+//                bprm - the binary parameters of the new executable
+// Outputs      : void
+
+void tp_process_exec_handler(void *data, struct task_struct *task,
+                                pid_t old_pid, struct linux_binprm *bprm)
+{
+    char path_buf[LIBIHT_RULE_PATTERN_LEN << 1];
+    const char *path;
+
+    // Prefer the resolved absolute path over the name passed to execve
+    path = d_path(&bprm->file->f_path, path_buf, sizeof(path_buf));
+    if (IS_ERR(path))
+        path = bprm->filename;
+
+    exec_rule_exec_handler(task->pid, task->comm, path);
+    pt_exec_handler(task->pid);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tp_signal_deliver_handler
+// Description  : This function is the handler for the signal_deliver event. It
+//                will be called in the context of the task taking a signal,
+//                before its action runs. Only the signals whose default action
+//                kills the task are reported to the crash capture.
+//
+// Inputs       : data - the data
+//                sig - the signal number
+//                info - the signal information
+//                ka - the signal action
+// Outputs      : void
+
+void tp_signal_deliver_handler(void *data, int sig,
+                                struct kernel_siginfo *info,
+                                struct k_sigaction *ka)
+{
+    u64 addr = 0;
+    int code = 0;
+
+    if (ka->sa.sa_handler != SIG_DFL || sig_kernel_ignore(sig) ||
+        sig_kernel_stop(sig))
+        return;
+
+    // Group exits deliver SIGKILL without siginfo (SEND_SIG_NOINFO is NULL)
+    if (info != SEND_SIG_NOINFO && info != SEND_SIG_PRIV)
+        code = info->si_code;
+
+    // Only faults sent by the kernel carry a faulting address
+    if (code > 0 && (sig == SIGSEGV || sig == SIGBUS ||
+        sig == SIGILL || sig == SIGFPE || sig == SIGTRAP))
+        addr = (u64)info->si_addr;
+
+    crash_signal_handler(current->pid, current->tgid, sig, code, addr);
 }
 
 //
@@ -241,6 +371,48 @@ long device_ioctl(struct file *file_ptr, unsigned int ioctl_cmd,
         xprintdbg(KERN_INFO "LIBIHT-LKM: BTS request\n");
         ret_val = bts_ioctl_handler(&request);
     }
+    else if (request.cmd <= LIBIHT_IOCTL_CPU_END)
+    {
+        // CPU scope request
+        xprintdbg(KERN_INFO "LIBIHT-LKM: CPU request\n");
+        ret_val = cpu_trace_ioctl_handler(&request);
+    }
+    else if (request.cmd <= LIBIHT_IOCTL_RULE_END)
+    {
+        // Exec rule request
+        xprintdbg(KERN_INFO "LIBIHT-LKM: Exec rule request\n");
+        ret_val = exec_rule_ioctl_handler(&request);
+    }
+    else if (request.cmd <= LIBIHT_IOCTL_GATE_END)
+    {
+        // Trace gate request
+        xprintdbg(KERN_INFO "LIBIHT-LKM: Trace gate request\n");
+        ret_val = gate_ioctl_handler(&request);
+    }
+    else if (request.cmd <= LIBIHT_IOCTL_WINDOW_END)
+    {
+        // Trace window request
+        xprintdbg(KERN_INFO "LIBIHT-LKM: Trace window request\n");
+        ret_val = window_ioctl_handler(&request);
+    }
+    else if (request.cmd <= LIBIHT_IOCTL_SAMPLE_END)
+    {
+        // LBR sampling request
+        xprintdbg(KERN_INFO "LIBIHT-LKM: LBR sampling request\n");
+        ret_val = sample_ioctl_handler(&request);
+    }
+    else if (request.cmd <= LIBIHT_IOCTL_CRASH_END)
+    {
+        // Crash capture request
+        xprintdbg(KERN_INFO "LIBIHT-LKM: Crash capture request\n");
+        ret_val = crash_ioctl_handler(&request);
+    }
+    else if (request.cmd <= LIBIHT_IOCTL_PT_END)
+    {
+        // Intel PT request
+        xprintdbg(KERN_INFO "LIBIHT-LKM: PT request\n");
+        ret_val = pt_ioctl_handler(&request);
+    }
     else
     {
         // Unknown request
@@ -288,6 +460,34 @@ int __init libiht_lkm_init(void)
     xprintdbg(KERN_INFO "LIBIHT_LKM: Initilizing BTS...\n");
     bts_init();
 
+    // Init CPU scope tracing
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Initilizing CPU trace...\n");
+    cpu_trace_init();
+
+    // Init exec rules
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Initilizing exec rules...\n");
+    exec_rule_init();
+
+    // Init trace gates
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Initilizing trace gates...\n");
+    gate_init();
+
+    // Init trace windows
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Initilizing trace windows...\n");
+    window_init();
+
+    // Init LBR sampling
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Initilizing LBR sampling...\n");
+    sample_init();
+
+    // Init crash capture
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Initilizing crash capture...\n");
+    crash_init();
+
+    // Init PT
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Initilizing PT...\n");
+    pt_init();
+
     xprintdbg(KERN_INFO "LIBIHT_LKM: Initilized\n");
     return 0;
 }
@@ -306,6 +506,34 @@ void __exit libiht_lkm_exit(void)
 {
     xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting...\n");
 
+    // Exit PT
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting PT...\n");
+    pt_exit();
+
+    // Exit crash capture
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting crash capture...\n");
+    crash_exit();
+
+    // Exit LBR sampling
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting LBR sampling...\n");
+    sample_exit();
+
+    // Exit trace windows
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting trace windows...\n");
+    window_exit();
+
+    // Exit trace gates
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting trace gates...\n");
+    gate_exit();
+
+    // Exit exec rules
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting exec rules...\n");
+    exec_rule_exit();
+
+    // Exit CPU scope tracing
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting CPU trace...\n");
+    cpu_trace_exit();
+
     // Exit BTS
     xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting BTS...\n");
     bts_exit();
@@ -318,6 +546,9 @@ void __exit libiht_lkm_exit(void)
     xprintdbg(KERN_INFO "LIBIHT_LKM: Unregistering tracepoints...\n");
     unregister_tracepoints();
 
+    // Run the work deferred by the exits
+    xflush_work();
+
     // Remove the helper process if exist
     xprintdbg(KERN_INFO "LIBIHT_LKM: Removing helper process...\n");
     if (proc_entry != NULL)
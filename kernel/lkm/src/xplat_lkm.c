@@ -9,6 +9,7 @@
 //
 
 #include "../../commons/xplat.h"
+#include "../../commons/xioctl.h"
 #include "../include/headers_lkm.h"
 
 //
@@ -45,6 +46,67 @@ void xfree(void *ptr)
     kfree(ptr);
 }
 
+// Large blocks freed in atomic context, linked through their first bytes
+static LLIST_HEAD(xvfree_list);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xvfree_handler
+// Description  : The worker freeing the large blocks released in atomic
+//                context.
+//
+// Inputs       : work - the work struct
+// Outputs      : void
+
+static void xvfree_handler(struct work_struct *work)
+{
+    struct llist_node *node, *next;
+
+    llist_for_each_safe(node, next, llist_del_all(&xvfree_list))
+        vfree(node);
+}
+
+static DECLARE_WORK(xvfree_work, xvfree_handler);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xvmalloc
+// Description  : Cross platform kernel large malloc function. Allocate memory
+//                that does not need to be physically contiguous, from the
+//                kernel heap or from vmalloc space. Must be called from
+//                process context.
+//
+// Inputs       : size - size of the memory to be allocated.
+// Outputs      : void * - pointer to the allocated memory.
+
+void *xvmalloc(u64 size)
+{
+    return kvmalloc(size, GFP_KERNEL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xvfree
+// Description  : Cross platform kernel large free function. Free memory from
+//                xvmalloc. vfree may sleep, so from atomic context a vmalloc
+//                block is handed to a worker instead.
+//
+// Inputs       : ptr - pointer to the memory to be freed.
+// Outputs      : void
+
+void xvfree(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    if (!is_vmalloc_addr(ptr))
+        kfree(ptr);
+    else if (preemptible())
+        vfree(ptr);
+    else if (llist_add((struct llist_node *)ptr, &xvfree_list))
+        schedule_work(&xvfree_work);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xcopy_from_user
@@ -109,6 +171,73 @@ void *xmemcpy(void *dst, void *src, u64 cnt)
     return memcpy(dst, src, cnt);
 } 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xpin_user_page
+// Description  : Cross platform pin user page function. Pin the user page
+//                holding an address of the current process, so it stays
+//                resident and can be accessed from any context.
+//
+// Inputs       : uaddr - user address inside the page to be pinned.
+//                pin - pointer to the pinned page handle (output).
+// Outputs      : void* - kernel address of `uaddr`, NULL on failure.
+
+void *xpin_user_page(void *uaddr, void *pin)
+{
+    struct page *page;
+    unsigned long addr = (unsigned long)uaddr;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+    if (pin_user_pages_fast(addr & PAGE_MASK, 1,
+                            FOLL_WRITE | FOLL_LONGTERM, &page) != 1)
+        return NULL;
+#else
+    if (get_user_pages_fast(addr & PAGE_MASK, 1, FOLL_WRITE, &page) != 1)
+        return NULL;
+#endif
+
+    *(struct page **)pin = page;
+    return (char *)page_address(page) + offset_in_page(addr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xunpin_user_page
+// Description  : Cross platform unpin user page function. Release a page
+//                pinned by xpin_user_page.
+//
+// Inputs       : pin - pointer to the pinned page handle.
+// Outputs      : void
+
+void xunpin_user_page(void *pin)
+{
+    struct page *page = *(struct page **)pin;
+
+    if (page == NULL)
+        return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+    unpin_user_page(page);
+#else
+    put_page(page);
+#endif
+    *(struct page **)pin = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xvirt_to_phys
+// Description  : Cross platform get physical address function. Translate the
+//                address of memory from `xmalloc`.
+//
+// Inputs       : addr - kernel virtual address.
+// Outputs      : u64 - physical address.
+
+u64 xvirt_to_phys(void *addr)
+{
+    return virt_to_phys(addr);
+}
+
 //
 // CPU core, hardware, register read/write functions
 
@@ -194,6 +323,93 @@ u32 xgetcurrent_pid(void)
     return current->pid;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xgetcurrent_tgid
+// Description  : Cross platform get current tgid function. Get the thread
+//                group id (user process pid) of the current thread.
+//
+// Inputs       : void
+// Outputs      : u32 - current tgid.
+
+u32 xgetcurrent_tgid(void)
+{
+    return current->tgid;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xget_thread_ids
+// Description  : Cross platform get thread ids function. Collect the ids of
+//                all threads in the given thread group.
+//
+// Inputs       : tgid - thread group id (user process pid).
+//                tids - array to be filled with the thread ids.
+//                max_cnt - capacity of the array.
+// Outputs      : u32 - number of threads in the group (may exceed max_cnt).
+
+u32 xget_thread_ids(u32 tgid, u32 *tids, u32 max_cnt)
+{
+    struct task_struct *leader, *thread;
+    u32 cnt = 0;
+
+    rcu_read_lock();
+    leader = pid_task(find_vpid(tgid), PIDTYPE_PID);
+    if (leader)
+    {
+        for_each_thread(leader, thread)
+        {
+            if (cnt < max_cnt)
+                tids[cnt] = thread->pid;
+            cnt++;
+        }
+    }
+    rcu_read_unlock();
+
+    return cnt;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xget_task_cr3
+// Description  : Cross platform get user page table base function. Get the
+//                CR3 value the given thread runs its user code with. With
+//                PCID, CR3 also holds an address space id that the kernel
+//                assigns per cpu and may recycle at any switch, so the value
+//                cannot be known in advance and none is returned.
+//
+// Inputs       : pid - thread id.
+// Outputs      : u64 - page table base, 0 if the thread has no user memory
+//                or the kernel uses PCID.
+
+u64 xget_task_cr3(u32 pid)
+{
+    struct task_struct *task;
+    u64 cr3 = 0;
+
+    if (boot_cpu_has(X86_FEATURE_PCID))
+        return 0;
+
+    rcu_read_lock();
+    task = pid_task(find_vpid(pid), PIDTYPE_PID);
+    if (task)
+    {
+        task_lock(task);
+        if (task->mm)
+            cr3 = __pa(task->mm->pgd);
+        task_unlock(task);
+    }
+    rcu_read_unlock();
+
+#ifdef CONFIG_PAGE_TABLE_ISOLATION
+    // User code runs on the user copy of the page tables, the next page
+    if (cr3 && boot_cpu_has(X86_FEATURE_PTI))
+        cr3 |= PAGE_SIZE;
+#endif
+
+    return cr3;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xcpuid
@@ -207,6 +423,21 @@ void xcpuid(u32 func_id, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
     cpuid(func_id, eax, ebx, ecx, edx);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcpuid_count
+// Description  : Cross platform cpuid with sub-leaf function.
+//
+// Inputs       : func_id - function id.
+//                sub_id - sub-leaf id.
+// Outputs      : void
+
+void xcpuid_count(u32 func_id, u32 sub_id, u32 *eax, u32 *ebx, u32 *ecx,
+                    u32 *edx)
+{
+    cpuid_count(func_id, sub_id, eax, ebx, ecx, edx);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xon_each_cpu
@@ -221,6 +452,620 @@ void xon_each_cpu(void (*func)(void))
     on_each_cpu((void *)(void *)func, NULL, 1);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xon_cpu
+// Description  : Cross platform on cpu function. Run a function on the given
+//                cpu and wait for it to finish.
+//
+// Inputs       : cpu - cpu core id.
+//                func - function to be run.
+//                info - argument passed to the function.
+// Outputs      : void
+
+void xon_cpu(u32 cpu, void (*func)(void *), void *info)
+{
+    smp_call_function_single(cpu, func, info, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcpu_count
+// Description  : Cross platform cpu count function. Get the number of
+//                possible cpu core ids.
+//
+// Inputs       : void
+// Outputs      : u32 - number of cpu core ids.
+
+u32 xcpu_count(void)
+{
+    return nr_cpu_ids;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xget_timestamp
+// Description  : Cross platform timestamp function. Get a monotonic timestamp
+//                that is safe to read from any context.
+//
+// Inputs       : void
+// Outputs      : u64 - timestamp in nanoseconds.
+
+u64 xget_timestamp(void)
+{
+    return ktime_get_mono_fast_ns();
+}
+
+//
+// User probe functions
+
+#ifdef CONFIG_UPROBES
+
+// User probe with its callback
+struct xuprobe
+{
+    struct uprobe_consumer consumer;    // Consumer registered to uprobes
+    struct inode *inode;                // Inode of the probed binary
+    loff_t offset;                      // Probed file offset
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+    struct uprobe *uprobe;              // Registered uprobe
+#endif
+    void (*func)(void *, u32);          // Callback on hit
+    void *info;                         // Callback argument
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xuprobe_handler
+// Description  : The uprobe consumer handler, called in the context of the
+//                task hitting the probe.
+//
+// Inputs       : self - the uprobe consumer
+//                regs - the user registers
+// Outputs      : int - 0 to keep the probe
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+static int xuprobe_handler(struct uprobe_consumer *self, struct pt_regs *regs,
+                            __u64 *data)
+#else
+static int xuprobe_handler(struct uprobe_consumer *self, struct pt_regs *regs)
+#endif
+{
+    struct xuprobe *probe = container_of(self, struct xuprobe, consumer);
+
+    probe->func(probe->info, FALSE);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xuprobe_ret_handler
+// Description  : The uprobe consumer return handler, called in the context of
+//                the task returning from the probed function.
+//
+// Inputs       : self - the uprobe consumer
+//                func - the probed function address
+//                regs - the user registers
+// Outputs      : int - 0 to keep the probe
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+static int xuprobe_ret_handler(struct uprobe_consumer *self, unsigned long func,
+                                struct pt_regs *regs, __u64 *data)
+#else
+static int xuprobe_ret_handler(struct uprobe_consumer *self, unsigned long func,
+                                struct pt_regs *regs)
+#endif
+{
+    struct xuprobe *probe = container_of(self, struct xuprobe, consumer);
+
+    probe->func(probe->info, TRUE);
+    return 0;
+}
+
+#endif // CONFIG_UPROBES
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xregister_uprobe
+// Description  : Cross platform register user probe function. Install a
+//                uprobe on a file offset of a binary, `func` is called on
+//                every hit, and also on function return if `on_return`.
+//
+// Inputs       : path - path of the probed binary.
+//                offset - file offset of the probed instruction.
+//                func - callback, with TRUE as second argument on return.
+//                info - callback argument.
+//                on_return - whether to also probe the function return.
+// Outputs      : void* - the probe handle, NULL on failure.
+
+void *xregister_uprobe(const char *path, u64 offset,
+                        void (*func)(void *, u32), void *info, u32 on_return)
+{
+#ifdef CONFIG_UPROBES
+    struct xuprobe *probe;
+    struct path file_path;
+
+    probe = kzalloc(sizeof(struct xuprobe), GFP_KERNEL);
+    if (probe == NULL)
+        return NULL;
+
+    if (kern_path(path, LOOKUP_FOLLOW, &file_path))
+    {
+        kfree(probe);
+        return NULL;
+    }
+    probe->inode = igrab(d_real_inode(file_path.dentry));
+    path_put(&file_path);
+    if (probe->inode == NULL)
+    {
+        kfree(probe);
+        return NULL;
+    }
+
+    probe->offset = offset;
+    probe->func = func;
+    probe->info = info;
+    probe->consumer.handler = xuprobe_handler;
+    if (on_return)
+        probe->consumer.ret_handler = xuprobe_ret_handler;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+    probe->uprobe = uprobe_register(probe->inode, probe->offset, 0,
+                                    &probe->consumer);
+    if (IS_ERR(probe->uprobe))
+#else
+    if (uprobe_register(probe->inode, probe->offset, &probe->consumer))
+#endif
+    {
+        iput(probe->inode);
+        kfree(probe);
+        return NULL;
+    }
+
+    return probe;
+#else
+    return NULL;
+#endif // CONFIG_UPROBES
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xunregister_uprobe
+// Description  : Cross platform unregister user probe function. Remove a
+//                probe installed by xregister_uprobe, waiting for running
+//                handlers.
+//
+// Inputs       : probe - the probe handle.
+// Outputs      : void
+
+void xunregister_uprobe(void *probe)
+{
+#ifdef CONFIG_UPROBES
+    struct xuprobe *uprobe = (struct xuprobe *)probe;
+
+    if (uprobe == NULL)
+        return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+    uprobe_unregister_nosync(uprobe->uprobe, &uprobe->consumer);
+    uprobe_unregister_sync();
+#else
+    uprobe_unregister(uprobe->inode, uprobe->offset, &uprobe->consumer);
+#endif
+    iput(uprobe->inode);
+    kfree(uprobe);
+#endif // CONFIG_UPROBES
+}
+
+//
+// PMU counter functions
+
+// Sampling PMU counter with its callback
+struct xpmu_counter
+{
+    struct perf_event *event;           // Kernel perf event of the counter
+    void (*func)(void *, u64);          // Callback on overflow
+    void *info;                         // Callback argument
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xpmu_overflow_handler
+// Description  : The perf event overflow handler, called on the counting cpu
+//                in NMI context.
+//
+// Inputs       : event - the perf event
+//                data - the sample data
+//                regs - the interrupted registers
+// Outputs      : void
+
+static void xpmu_overflow_handler(struct perf_event *event,
+                                    struct perf_sample_data *data,
+                                    struct pt_regs *regs)
+{
+    struct xpmu_counter *counter = event->overflow_handler_context;
+
+    counter->func(counter->info, instruction_pointer(regs));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcreate_pmu_counter
+// Description  : Cross platform create PMU counter function. Create a pinned
+//                kernel perf event counting a hardware event on a cpu, `func`
+//                is called every `period` events.
+//
+// Inputs       : cpu - the counting cpu.
+//                event - the counted event (enum SAMPLE_EVENT).
+//                period - number of events between two callbacks.
+//                func - callback, with the interrupted ip as second argument.
+//                info - callback argument.
+// Outputs      : void* - the counter handle, NULL on failure.
+
+void *xcreate_pmu_counter(u32 cpu, u32 event, u64 period,
+                            void (*func)(void *, u64), void *info)
+{
+    struct xpmu_counter *counter;
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.sample_period = period;
+    attr.pinned = 1;
+    switch (event)
+    {
+        case LIBIHT_SAMPLE_CYCLES:
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case LIBIHT_SAMPLE_BRANCH_MISSES:
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        case LIBIHT_SAMPLE_LLC_MISSES:
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        default:
+            return NULL;
+    }
+
+    counter = kzalloc(sizeof(struct xpmu_counter), GFP_KERNEL);
+    if (counter == NULL)
+        return NULL;
+
+    counter->func = func;
+    counter->info = info;
+    counter->event = perf_event_create_kernel_counter(&attr, cpu, NULL,
+                                                xpmu_overflow_handler, counter);
+    if (IS_ERR(counter->event))
+    {
+        kfree(counter);
+        return NULL;
+    }
+
+    return counter;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xfree_pmu_counter
+// Description  : Cross platform release PMU counter function. Release a
+//                counter created by xcreate_pmu_counter, after which its
+//                callback is no longer called.
+//
+// Inputs       : counter - the counter handle.
+// Outputs      : void
+
+void xfree_pmu_counter(void *counter)
+{
+    struct xpmu_counter *pmu_counter = (struct xpmu_counter *)counter;
+
+    if (pmu_counter == NULL)
+        return;
+
+    perf_event_release_kernel(pmu_counter->event);
+    kfree(pmu_counter);
+}
+
+//
+// Timer functions
+
+// Periodic cpu timer with its callback
+struct xcpu_timer
+{
+    struct hrtimer timer;               // Pinned high resolution timer
+    ktime_t period;                     // Timer period
+    void (*func)(void *, u64);          // Callback on expiry
+    void *info;                         // Callback argument
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcpu_timer_handler
+// Description  : The hrtimer expiry handler, called on the pinned cpu in
+//                hard interrupt context. The timer is rearmed for the next
+//                period.
+//
+// Inputs       : timer - the expired hrtimer
+// Outputs      : enum hrtimer_restart - always HRTIMER_RESTART
+
+static enum hrtimer_restart xcpu_timer_handler(struct hrtimer *timer)
+{
+    struct xcpu_timer *cpu_timer = container_of(timer, struct xcpu_timer,
+                                                timer);
+    struct pt_regs *regs = get_irq_regs();
+
+    cpu_timer->func(cpu_timer->info, regs ? instruction_pointer(regs) : 0);
+    hrtimer_forward_now(timer, cpu_timer->period);
+    return HRTIMER_RESTART;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcpu_timer_start
+// Description  : Start a pinned hrtimer on the current cpu. Called on the
+//                target cpu through a cross-cpu call.
+//
+// Inputs       : info - the cpu timer
+// Outputs      : void
+
+static void xcpu_timer_start(void *info)
+{
+    struct xcpu_timer *cpu_timer = info;
+
+    hrtimer_start(&cpu_timer->timer, cpu_timer->period,
+                    HRTIMER_MODE_REL_PINNED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcreate_cpu_timer
+// Description  : Cross platform create cpu timer function. Start a periodic
+//                high resolution timer pinned on a cpu, `func` is called on
+//                that cpu every `period` nanoseconds.
+//
+// Inputs       : cpu - the timer cpu.
+//                period - timer period in nanoseconds.
+//                func - callback, with the interrupted ip as second argument.
+//                info - callback argument.
+// Outputs      : void* - the timer handle, NULL on failure.
+
+void *xcreate_cpu_timer(u32 cpu, u64 period, void (*func)(void *, u64),
+                        void *info)
+{
+    struct xcpu_timer *cpu_timer;
+
+    cpu_timer = kzalloc(sizeof(struct xcpu_timer), GFP_KERNEL);
+    if (cpu_timer == NULL)
+        return NULL;
+
+    cpu_timer->period = ns_to_ktime(period);
+    cpu_timer->func = func;
+    cpu_timer->info = info;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&cpu_timer->timer, xcpu_timer_handler, CLOCK_MONOTONIC,
+                    HRTIMER_MODE_REL_PINNED);
+#else
+    hrtimer_init(&cpu_timer->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+    cpu_timer->timer.function = xcpu_timer_handler;
+#endif
+
+    if (smp_call_function_single(cpu, xcpu_timer_start, cpu_timer, 1))
+    {
+        kfree(cpu_timer);
+        return NULL;
+    }
+
+    return cpu_timer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xfree_cpu_timer
+// Description  : Cross platform release cpu timer function. Cancel a timer
+//                created by xcreate_cpu_timer, waiting for a running
+//                callback, and free it.
+//
+// Inputs       : timer - the timer handle.
+// Outputs      : void
+
+void xfree_cpu_timer(void *timer)
+{
+    struct xcpu_timer *cpu_timer = (struct xcpu_timer *)timer;
+
+    if (cpu_timer == NULL)
+        return;
+
+    hrtimer_cancel(&cpu_timer->timer);
+    kfree(cpu_timer);
+}
+
+//
+// Deferred work functions
+
+// Queued work function with a copy of its argument
+struct xwork_item
+{
+    struct llist_node node;             // Pending list node
+    void (*func)(void *);               // Work function
+    u64 info[];                         // Copy of the work argument
+};
+
+// Work items waiting for the worker, run in queueing order
+static LLIST_HEAD(xwork_list);
+
+static void xwork_handler(struct work_struct *work);
+static DECLARE_WORK(xwork, xwork_handler);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xwork_handler
+// Description  : The worker of the deferred work, called in process context.
+//                Run and free every pending work item.
+//
+// Inputs       : work - the work struct
+// Outputs      : void
+
+static void xwork_handler(struct work_struct *work)
+{
+    struct llist_node *pending;
+    struct xwork_item *item, *next;
+
+    pending = llist_reverse_order(llist_del_all(&xwork_list));
+    llist_for_each_entry_safe(item, next, pending, node)
+    {
+        item->func(item->info);
+        kfree(item);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xqueue_work
+// Description  : Cross platform queue work function. Run `func` later on a
+//                kernel worker, where it may sleep. The `size` bytes at `info`
+//                are copied, so the caller can pass a stack argument. Safe to
+//                call from atomic context.
+//
+// Inputs       : func - function to be run.
+//                info - argument copied for the function.
+//                size - size of the argument.
+// Outputs      : s32 - 0 on success, -1 on failure.
+
+s32 xqueue_work(void (*func)(void *), void *info, u64 size)
+{
+    struct xwork_item *item;
+
+    item = kmalloc(sizeof(struct xwork_item) + size, GFP_ATOMIC);
+    if (item == NULL)
+        return -1;
+
+    item->func = func;
+    memcpy(item->info, info, size);
+    llist_add(&item->node, &xwork_list);
+    schedule_work(&xwork);
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xflush_work
+// Description  : Cross platform flush work function. Wait until the work
+//                queued by xqueue_work so far has run, and the large blocks
+//                released in atomic context are freed.
+//
+// Inputs       : void
+// Outputs      : void
+
+void xflush_work(void)
+{
+    flush_work(&xwork);
+    flush_work(&xvfree_work);
+}
+
+//
+// Syscall hook functions
+
+// The sys_enter tracepoint and the callback attached to it, once hooked
+static struct tracepoint *xsys_enter_tp;
+static void (*xsyscall_func)(u32, u32);
+
+// Serialize the hook and unhook requests
+static DEFINE_MUTEX(xsyscall_hook_mutex);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xlookup_sys_enter
+// Description  : Find the sys_enter tracepoint among the kernel tracepoints.
+//
+// Inputs       : tp - the tracepoint
+//                found - where to store the sys_enter tracepoint
+// Outputs      : void
+
+static void xlookup_sys_enter(struct tracepoint *tp, void *found)
+{
+    if (strcmp(tp->name, "sys_enter") == 0)
+        *(struct tracepoint **)found = tp;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xsys_enter_probe
+// Description  : The sys_enter tracepoint probe, called in the context of the
+//                task entering a syscall.
+//
+// Inputs       : data - the hook callback
+//                regs - the user registers
+//                id - the syscall number
+// Outputs      : void
+
+static void xsys_enter_probe(void *data, struct pt_regs *regs, long id)
+{
+    if (id < 0)
+        return;
+
+    ((void (*)(u32, u32))data)(current->pid, (u32)id);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xregister_syscall_hook
+// Description  : Cross platform hook the syscall entry function. Attach a
+//                probe to the raw sys_enter tracepoint, `func` is called with
+//                the thread id and the syscall number. Only one hook can be
+//                installed, hooking again succeeds without any change.
+//
+// Inputs       : func - callback, called by the thread entering a syscall.
+// Outputs      : s32 - 0 on success, -1 on failure.
+
+s32 xregister_syscall_hook(void (*func)(u32, u32))
+{
+    struct tracepoint *tp = NULL;
+    s32 ret = 0;
+
+    mutex_lock(&xsyscall_hook_mutex);
+    if (xsys_enter_tp == NULL)
+    {
+        for_each_kernel_tracepoint(xlookup_sys_enter, &tp);
+        if (tp == NULL || tracepoint_probe_register(tp, xsys_enter_probe,
+                                                    (void *)func))
+            ret = -1;
+        else
+        {
+            xsys_enter_tp = tp;
+            xsyscall_func = func;
+        }
+    }
+    mutex_unlock(&xsyscall_hook_mutex);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xunregister_syscall_hook
+// Description  : Cross platform remove the syscall entry hook function. Wait
+//                for the running probes before returning.
+//
+// Inputs       : void
+// Outputs      : void
+
+void xunregister_syscall_hook(void)
+{
+    struct tracepoint *tp;
+
+    mutex_lock(&xsyscall_hook_mutex);
+    tp = xsys_enter_tp;
+    xsys_enter_tp = NULL;
+    mutex_unlock(&xsyscall_hook_mutex);
+
+    if (tp == NULL)
+        return;
+
+    tracepoint_probe_unregister(tp, xsys_enter_probe, (void *)xsyscall_func);
+    tracepoint_synchronize_unregister();
+}
+
 //
 // Lock functions
 
@@ -251,6 +1096,22 @@ void xacquire_lock(void *lock, void *old_irql)
     spin_lock_irqsave((spinlock_t *)lock, *(unsigned long *)old_irql);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xtry_acquire_lock
+// Description  : Cross platform try acquire lock function. Acquire a lock
+//                only if it is free.
+//
+// Inputs       : lock - pointer to the lock to be acquired.
+//                old_irql - pointer to the old IRQL.
+// Outputs      : u32 - TRUE if acquired, FALSE otherwise.
+
+u32 xtry_acquire_lock(void *lock, void *old_irql)
+{
+    return spin_trylock_irqsave((spinlock_t *)lock,
+                                *(unsigned long *)old_irql) ? TRUE : FALSE;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xrelease_lock
@@ -265,6 +1126,49 @@ void xrelease_lock(void *lock, void *new_irql)
     spin_unlock_irqrestore((spinlock_t *)lock, *(unsigned long *)new_irql);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xinit_mutex
+// Description  : Cross platform init mutex function. Initialize a sleeping
+//                lock, which may be held across copies to user space.
+//
+// Inputs       : mutex - pointer to the mutex to be initialized.
+// Outputs      : void
+
+void xinit_mutex(void *mutex)
+{
+    BUILD_BUG_ON(sizeof(struct mutex) > MAX_MUTEX_LEN);
+    mutex_init((struct mutex *)mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xacquire_mutex
+// Description  : Cross platform acquire mutex function. Acquire a sleeping
+//                lock, must be called from process context.
+//
+// Inputs       : mutex - pointer to the mutex to be acquired.
+// Outputs      : void
+
+void xacquire_mutex(void *mutex)
+{
+    mutex_lock((struct mutex *)mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xrelease_mutex
+// Description  : Cross platform release mutex function. Release a sleeping
+//                lock.
+//
+// Inputs       : mutex - pointer to the mutex to be released.
+// Outputs      : void
+
+void xrelease_mutex(void *mutex)
+{
+    mutex_unlock((struct mutex *)mutex);
+}
+
 //
 // List functions
 
@@ -0,0 +1,203 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/bench/record_batch_bench.c
+//  Description    : This is the benchmark of the record batch filter. The same
+//                   batch is filtered by the scalar and by the AVX2 filter
+//                   for several range counts, the outputs are compared, and
+//                   the best time of each filter is reported. The filter
+//                   source is included so its static filters can be called.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#include "../commons/record_batch.c"
+#include <stdio.h>
+#include <time.h>
+
+//
+// Library constants
+
+// Records of the filtered batch
+#define BENCH_RECORDS       (1ULL << 20)
+
+// Timed runs of each filter, the best one is reported
+#define BENCH_RUNS          20
+
+// Range counts of the benchmark
+static const unsigned int bench_range_counts[] = { 1, 4, 16, 64 };
+
+//
+// Helper functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : next_random
+// Description  : Get the next value of a fixed seed generator
+//
+// Inputs       : None
+// Outputs      : unsigned long long : the next value
+
+static unsigned long long next_random(void) {
+    static unsigned long long state = 0x9e3779b97f4a7c15ULL;
+
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : now_ns
+// Description  : Get a monotonic timestamp
+//
+// Inputs       : None
+// Outputs      : unsigned long long : the timestamp in nanoseconds
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fill_batch
+// Description  : Fill a batch with branches spread over 64 modules of 1 MB,
+//                a quarter of them outside any module
+//
+// Inputs       : struct record_batch *batch : the batch
+//                struct record_range *ranges : the 64 module ranges
+// Outputs      : None
+
+static void fill_batch(struct record_batch *batch, struct record_range *ranges) {
+    unsigned long long i, r;
+    unsigned int m;
+
+    for (m = 0; m < FILTER_AVX2_MAX_RANGES; m++) {
+        ranges[m].start = 0x400000ULL + m * 0x1000000ULL;
+        ranges[m].end = ranges[m].start + 0x100000;
+    }
+
+    for (i = 0; i < BENCH_RECORDS; i++) {
+        r = next_random();
+        batch->from[i] = ranges[r % 64].start + (r >> 12 & 0xfffff);
+        r = next_random();
+        batch->to[i] = ranges[r % 64].start + (r >> 12 & 0xfffff);
+        if (r >> 60 < 4) {
+            batch->to[i] += 0x800000;
+        }
+        batch->flags[i] = 0;
+        batch->tid[i] = (unsigned int)(i & 7);
+    }
+    batch->count = BENCH_RECORDS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_filter
+// Description  : Time a filter on a batch
+//
+// Inputs       : int avx2 : whether to run the AVX2 filter
+//                const struct record_batch *in : the input batch
+//                const struct record_range *ranges : the ranges
+//                unsigned int range_count : number of ranges
+//                struct record_batch *out : the output batch
+//                unsigned char *edges : the edge classes
+// Outputs      : unsigned long long : the best time in nanoseconds
+
+static unsigned long long bench_filter(int avx2, const struct record_batch *in,
+                                        const struct record_range *ranges,
+                                        unsigned int range_count,
+                                        struct record_batch *out,
+                                        unsigned char *edges) {
+    unsigned long long best = ~0ULL, start, elapsed;
+    unsigned int run;
+
+    for (run = 0; run < BENCH_RUNS; run++) {
+        record_batch_clear(out);
+        start = now_ns();
+#ifdef RECORD_BATCH_AVX2
+        if (avx2) {
+            filter_avx2(in, ranges, range_count,
+                        RECORD_FILTER_FROM | RECORD_FILTER_TO, out, edges);
+        }
+        else
+#endif
+        {
+            filter_scalar(in, 0, ranges, range_count,
+                            RECORD_FILTER_FROM | RECORD_FILTER_TO, out, edges);
+        }
+        elapsed = now_ns() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return best;
+}
+
+int main(void) {
+    struct record_range ranges[FILTER_AVX2_MAX_RANGES];
+    struct record_batch *in, *scalar, *avx2;
+    unsigned char *scalar_edges, *avx2_edges;
+    unsigned long long scalar_ns, avx2_ns;
+    unsigned int i, range_count;
+    int res = 0;
+
+    in = record_batch_alloc(BENCH_RECORDS);
+    scalar = record_batch_alloc(BENCH_RECORDS);
+    avx2 = record_batch_alloc(BENCH_RECORDS);
+    scalar_edges = malloc(BENCH_RECORDS);
+    avx2_edges = malloc(BENCH_RECORDS);
+    if (!in || !scalar || !avx2 || !scalar_edges || !avx2_edges) {
+        fprintf(stderr, "record_batch_bench: out of memory\n");
+        return 1;
+    }
+
+#ifdef RECORD_BATCH_AVX2
+    if (!__builtin_cpu_supports("avx2")) {
+        fprintf(stderr, "record_batch_bench: the cpu has no AVX2\n");
+        return 1;
+    }
+#else
+    fprintf(stderr, "record_batch_bench: built without AVX2\n");
+    return 1;
+#endif
+
+    fill_batch(in, ranges);
+    printf("%llu records, best of %d runs, from or to in range, with edges\n",
+            BENCH_RECORDS, BENCH_RUNS);
+    printf("%8s %10s %12s %12s %12s %8s\n", "ranges", "kept",
+            "scalar ms", "avx2 ms", "avx2 ns/rec", "speedup");
+
+    for (i = 0; i < sizeof(bench_range_counts) / sizeof(bench_range_counts[0]); i++) {
+        range_count = bench_range_counts[i];
+        scalar_ns = bench_filter(0, in, ranges, range_count, scalar, scalar_edges);
+        avx2_ns = bench_filter(1, in, ranges, range_count, avx2, avx2_edges);
+
+        // Both filters must keep the same records with the same edges
+        if (scalar->count != avx2->count ||
+            memcmp(scalar->from, avx2->from, scalar->count * sizeof(*scalar->from)) ||
+            memcmp(scalar->to, avx2->to, scalar->count * sizeof(*scalar->to)) ||
+            memcmp(scalar->tid, avx2->tid, scalar->count * sizeof(*scalar->tid)) ||
+            memcmp(scalar_edges, avx2_edges, scalar->count)) {
+            fprintf(stderr, "record_batch_bench: filters differ for %u ranges\n",
+                    range_count);
+            res = 1;
+        }
+
+        printf("%8u %10llu %12.3f %12.3f %12.3f %7.2fx\n", range_count,
+                scalar->count, scalar_ns / 1e6, avx2_ns / 1e6,
+                (double)avx2_ns / BENCH_RECORDS, (double)scalar_ns / avx2_ns);
+    }
+
+    record_batch_free(in);
+    record_batch_free(scalar);
+    record_batch_free(avx2);
+    free(scalar_edges);
+    free(avx2_edges);
+    return res;
+}
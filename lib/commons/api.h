@@ -22,6 +22,22 @@ unsigned int MAX_BTS_LIST_LEN = 0x400;
 // The default maximum number of BTS entries is 1024
 // (may vary by the user request)
 
+unsigned int MAX_SIDEBAND_LIST_LEN = 0x1000;
+// The default maximum number of sideband records per cpu dump is 4096
+// (same as the kernel per cpu ring size)
+
+unsigned int MAX_SAMPLE_LIST_LEN = 0x200;
+// The default maximum number of LBR samples per cpu dump is 512
+// (same as the kernel per cpu ring size)
+
+unsigned int MAX_CRASH_LIST_LEN = 0x20;
+// The default maximum number of crash records per dump is 32
+// (same as the kernel crash ring size)
+
+unsigned long long MAX_PT_BUFFER_LEN = 0x100000;
+// The default maximum number of PT bytes per thread dump is 1M
+// (same as the kernel default PT buffer size)
+
 //
 // Library constants (copied from kernel/commons/xioctl.h)
 
@@ -32,56 +48,363 @@ enum IOCTL {
     LIBIHT_IOCTL_DISABLE_LBR,
     LIBIHT_IOCTL_DUMP_LBR,
     LIBIHT_IOCTL_CONFIG_LBR,
+    LIBIHT_IOCTL_PAUSE_LBR,
+    LIBIHT_IOCTL_RESUME_LBR,
+    LIBIHT_IOCTL_DUMP_LBR_OFFCPU,
+    LIBIHT_IOCTL_DUMP_LBR_SYSCALL,
     LIBIHT_IOCTL_LBR_END,
 
     LIBIHT_IOCTL_ENABLE_BTS,
     LIBIHT_IOCTL_DISABLE_BTS,
     LIBIHT_IOCTL_DUMP_BTS,
     LIBIHT_IOCTL_CONFIG_BTS,
+    LIBIHT_IOCTL_PAUSE_BTS,
+    LIBIHT_IOCTL_RESUME_BTS,
+    LIBIHT_IOCTL_DUMP_PEBS,
     LIBIHT_IOCTL_BTS_END,
+
+    LIBIHT_IOCTL_ENABLE_CPU,
+    LIBIHT_IOCTL_DISABLE_CPU,
+    LIBIHT_IOCTL_DUMP_CPU,
+    LIBIHT_IOCTL_CPU_END,
+
+    LIBIHT_IOCTL_ADD_RULE,
+    LIBIHT_IOCTL_DEL_RULE,
+    LIBIHT_IOCTL_CLEAR_RULES,
+    LIBIHT_IOCTL_RULE_END,
+
+    LIBIHT_IOCTL_ATTACH_GATE,
+    LIBIHT_IOCTL_DETACH_GATE,
+    LIBIHT_IOCTL_DUMP_GATE,
+    LIBIHT_IOCTL_GATE_END,
+
+    LIBIHT_IOCTL_ADD_WINDOW,
+    LIBIHT_IOCTL_DEL_WINDOW,
+    LIBIHT_IOCTL_CLEAR_WINDOWS,
+    LIBIHT_IOCTL_WINDOW_END,
+
+    LIBIHT_IOCTL_ENABLE_SAMPLE,
+    LIBIHT_IOCTL_DISABLE_SAMPLE,
+    LIBIHT_IOCTL_DUMP_SAMPLE,
+    LIBIHT_IOCTL_SAMPLE_END,
+
+    LIBIHT_IOCTL_DUMP_CRASH,
+    LIBIHT_IOCTL_CRASH_END,
+
+    LIBIHT_IOCTL_ENABLE_PT,
+    LIBIHT_IOCTL_DISABLE_PT,
+    LIBIHT_IOCTL_DUMP_PT,
+    LIBIHT_IOCTL_PT_END,
+};
+
+enum TRACE_SCOPE {
+    LIBIHT_SCOPE_THREAD,
+    LIBIHT_SCOPE_PROCESS,
 };
 
+#ifndef LIBIHT_LBR_STACK_ENTRY
+#define LIBIHT_LBR_STACK_ENTRY
 struct lbr_stack_entry {
     unsigned long long from;
     unsigned long long to;
 };
+#endif // LIBIHT_LBR_STACK_ENTRY
+
+#define LIBIHT_SYSCALL_MASK_WORDS 8
 
 struct lbr_config {
     unsigned int pid;
+    unsigned int scope;
     unsigned long long lbr_select;
+    unsigned int offcpu_records;
+    unsigned int syscall_records;
+    unsigned long long syscall_mask[LIBIHT_SYSCALL_MASK_WORDS];
 };
 
 struct lbr_data {
     unsigned long long lbr_tos;
     struct lbr_stack_entry* entries;
+    unsigned int tid;
+    unsigned int entry_count;
+};
+
+#define LIBIHT_LBR_MAX_ENTRIES 32
+
+struct lbr_offcpu_record {
+    unsigned long long timestamp;
+    unsigned int pid;
+    unsigned int prev_state;
+    unsigned int next_pid;
+    unsigned int cpu;
+    unsigned long long lbr_tos;
+    struct lbr_stack_entry entries[LIBIHT_LBR_MAX_ENTRIES];
+};
+
+struct lbr_syscall_record {
+    unsigned long long timestamp;
+    unsigned int pid;
+    unsigned int syscall;
+    unsigned int cpu;
+    unsigned int reserved;
+    unsigned long long lbr_tos;
+    struct lbr_stack_entry entries[LIBIHT_LBR_MAX_ENTRIES];
 };
 
 struct lbr_ioctl_request {
     struct lbr_config lbr_config;
     struct lbr_data* buffer;
+    unsigned int buffer_count;
+    struct lbr_offcpu_record* offcpu;
+    unsigned int offcpu_count;
+    struct lbr_syscall_record* syscall;
+    unsigned int syscall_count;
 };
 
 struct bts_config {
     unsigned int pid;
+    unsigned int scope;
     unsigned long long bts_config;
     unsigned long long bts_buffer_size;
+    unsigned long long pebs_event;
+    unsigned long long pebs_period;
+    unsigned long long pebs_buffer_size;
+    unsigned int pebs_latency;
+    unsigned int reserved;
+};
+
+struct pebs_record {
+    unsigned long long ip;
+    unsigned long long data_addr;
+    unsigned long long latency;
+    unsigned long long data_source;
+    unsigned long long tsc;
+    unsigned int tid;
+    unsigned int reserved;
 };
 
+#ifndef LIBIHT_BTS_RECORD
+#define LIBIHT_BTS_RECORD
 struct bts_record {
     unsigned long long from;
     unsigned long long to;
     unsigned long long misc;
 };
+#endif // LIBIHT_BTS_RECORD
 
 struct bts_data {
     struct bts_record* bts_buffer_base;
     struct bts_record* bts_index;
     unsigned long long bts_interrupt_threshold;
+    unsigned int tid;
+    unsigned int record_count;
 };
 
 struct bts_ioctl_request {
     struct bts_config bts_config;
     struct bts_data* buffer;
+    unsigned int buffer_count;
+    struct pebs_record* pebs;
+    unsigned int pebs_count;
+};
+
+enum CPU_FEATURE {
+    LIBIHT_CPU_LBR = 0x1,
+    LIBIHT_CPU_BTS = 0x2,
+};
+
+#define LIBIHT_CPU_MASK_WORDS   4
+
+#define LIBIHT_CGROUP_MAX       8
+
+struct cpu_config {
+    unsigned int features;
+    unsigned long long lbr_select;
+    unsigned long long bts_config;
+    unsigned long long bts_buffer_size;
+    unsigned long long cpu_mask[LIBIHT_CPU_MASK_WORDS];
+    unsigned int cgroup_count;
+    unsigned long long cgroup_ids[LIBIHT_CGROUP_MAX];
+};
+
+struct cpu_sideband_record {
+    unsigned long long timestamp;
+    unsigned int cpu;
+    unsigned int prev_pid;
+    unsigned int prev_tgid;
+    unsigned int next_pid;
+    unsigned int next_tgid;
+    unsigned int reserved;
+    unsigned long long bts_offset;
+    unsigned long long next_cgroup;
+};
+
+struct cpu_ioctl_request {
+    struct cpu_config cpu_config;
+    unsigned int cpu;
+    struct lbr_data* lbr_buffer;
+    struct bts_data* bts_buffer;
+    struct cpu_sideband_record* sideband;
+    unsigned int sideband_count;
+};
+
+enum RULE_MATCH {
+    LIBIHT_RULE_COMM,
+    LIBIHT_RULE_PATH,
+};
+
+enum RULE_FEATURE {
+    LIBIHT_RULE_LBR = 0x1,
+    LIBIHT_RULE_BTS = 0x2,
+};
+
+#define LIBIHT_RULE_PATTERN_LEN 128
+
+struct exec_rule {
+    unsigned int match;
+    unsigned int features;
+    unsigned int scope;
+    unsigned long long lbr_select;
+    unsigned long long bts_config;
+    unsigned long long bts_buffer_size;
+    char pattern[LIBIHT_RULE_PATTERN_LEN];
+};
+
+struct rule_ioctl_request {
+    struct exec_rule rule;
+    unsigned int rule_id;
+};
+
+struct trace_gate {
+    volatile unsigned int wanted;
+    volatile unsigned int region_id;
+};
+
+struct gate_region_record {
+    unsigned long long timestamp;
+    unsigned int pid;
+    unsigned int region_id;
+    unsigned int wanted;
+    unsigned int cpu;
+    unsigned long long bts_offset;
+};
+
+struct gate_ioctl_request {
+    struct trace_gate* gate;
+    struct gate_region_record* records;
+    unsigned int record_count;
+};
+
+enum WINDOW_FEATURE {
+    LIBIHT_WINDOW_LBR = 0x1,
+    LIBIHT_WINDOW_BTS = 0x2,
+};
+
+#define LIBIHT_WINDOW_PATH_LEN 256
+
+struct trace_window {
+    unsigned int features;
+    unsigned long long lbr_select;
+    unsigned long long bts_config;
+    unsigned long long bts_buffer_size;
+    unsigned long long start_offset;
+    unsigned long long stop_offset;
+    char path[LIBIHT_WINDOW_PATH_LEN];
+};
+
+struct window_ioctl_request {
+    struct trace_window window;
+    unsigned int window_id;
+};
+
+enum SAMPLE_EVENT {
+    LIBIHT_SAMPLE_CYCLES,
+    LIBIHT_SAMPLE_BRANCH_MISSES,
+    LIBIHT_SAMPLE_LLC_MISSES,
+    LIBIHT_SAMPLE_TIMER,
+};
+
+struct sample_config {
+    unsigned int event;
+    unsigned int pid;
+    unsigned long long period;
+    unsigned long long lbr_select;
+    unsigned long long cpu_mask[LIBIHT_CPU_MASK_WORDS];
+};
+
+struct lbr_sample_record {
+    unsigned long long timestamp;
+    unsigned long long ip;
+    unsigned int pid;
+    unsigned int tgid;
+    unsigned int cpu;
+    unsigned int event;
+    unsigned long long lbr_tos;
+    struct lbr_stack_entry entries[LIBIHT_LBR_MAX_ENTRIES];
+};
+
+struct sample_ioctl_request {
+    struct sample_config sample_config;
+    unsigned int cpu;
+    struct lbr_sample_record* records;
+    unsigned int record_count;
+};
+
+#define LIBIHT_CRASH_BTS_RECORDS    64
+
+struct crash_record {
+    unsigned long long timestamp;
+    unsigned int pid;
+    unsigned int tgid;
+    unsigned int signal;
+    unsigned int code;
+    unsigned long long addr;
+    unsigned int cpu;
+    unsigned int bts_count;
+    unsigned long long lbr_tos;
+    struct lbr_stack_entry entries[LIBIHT_LBR_MAX_ENTRIES];
+    struct bts_record bts[LIBIHT_CRASH_BTS_RECORDS];
+};
+
+struct crash_ioctl_request {
+    struct crash_record* records;
+    unsigned int record_count;
+};
+
+#define LIBIHT_PT_MAX_RANGES 4
+
+enum PT_RANGE_MODE {
+    LIBIHT_PT_RANGE_FILTER = 0x1,
+    LIBIHT_PT_RANGE_STOP = 0x2,
+};
+
+struct pt_range {
+    unsigned long long start;
+    unsigned long long end;
+    unsigned int mode;
+    unsigned int reserved;
+};
+
+struct pt_config {
+    unsigned int pid;
+    unsigned int scope;
+    unsigned long long pt_config;
+    unsigned long long pt_buffer_size;
+    unsigned int cr3_filter;
+    unsigned int range_count;
+    struct pt_range ranges[LIBIHT_PT_MAX_RANGES];
+};
+
+struct pt_data {
+    unsigned char* buffer;
+    unsigned long long size;
+    unsigned int tid;
+    unsigned int wrapped;
+};
+
+struct pt_ioctl_request {
+    struct pt_config pt_config;
+    struct pt_data* buffer;
+    unsigned int buffer_count;
 };
 
 struct xioctl_request {
@@ -89,6 +412,13 @@ struct xioctl_request {
     union {
         struct lbr_ioctl_request lbr;
         struct bts_ioctl_request bts;
+        struct cpu_ioctl_request cpu;
+        struct rule_ioctl_request rule;
+        struct gate_ioctl_request gate;
+        struct window_ioctl_request window;
+        struct sample_ioctl_request sample;
+        struct crash_ioctl_request crash;
+        struct pt_ioctl_request pt;
     }body;
 };
 
@@ -0,0 +1,1049 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/line_table.c
+//  Description    : This is the implementation of the DWARF line tables. The
+//                   line programs of DWARF 2 to 5 are run once when the table
+//                   is opened, only to record the address range of each
+//                   sequence. The rows and file names of a unit are decoded
+//                   on its first lookup, and published with an atomic pointer
+//                   so later lookups from any thread take no lock.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#include "line_table.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//
+// Library constants
+
+// Standard opcodes
+#define DW_LNS_copy                 1
+#define DW_LNS_advance_pc           2
+#define DW_LNS_advance_line         3
+#define DW_LNS_set_file             4
+#define DW_LNS_const_add_pc         8
+#define DW_LNS_fixed_advance_pc     9
+
+// Extended opcodes
+#define DW_LNE_end_sequence         1
+#define DW_LNE_set_address          2
+
+// Entry formats of DWARF 5 headers
+#define DW_LNCT_path                1
+#define DW_LNCT_directory_index     2
+
+// Attribute forms of DWARF 5 entry formats
+#define DW_FORM_block               0x09
+#define DW_FORM_data1               0x0b
+#define DW_FORM_data2               0x05
+#define DW_FORM_data4               0x06
+#define DW_FORM_data8               0x07
+#define DW_FORM_data16              0x1e
+#define DW_FORM_string              0x08
+#define DW_FORM_sdata               0x0d
+#define DW_FORM_strp                0x0e
+#define DW_FORM_udata               0x0f
+#define DW_FORM_line_strp           0x1f
+
+//
+// Type definitions
+
+// Define bounded reader, any overrun sets the error and reads zeros
+struct reader {
+    const unsigned char *pos;
+    const unsigned char *end;
+    int error;
+};
+
+// Define parsed line program header
+struct line_header {
+    unsigned int version;
+    unsigned int offset_size;   // 4 or 8 for 64-bit DWARF
+    unsigned int min_inst;      // Minimum instruction length
+    int line_base;
+    unsigned int line_range;
+    unsigned int opcode_base;
+    const unsigned char *opcode_lengths;
+    struct reader tables;       // Directory and file tables
+    struct reader program;      // Line program
+};
+
+// Define address range of a sequence
+struct line_seq {
+    unsigned long long lo;
+    unsigned long long hi;
+    unsigned int unit;
+};
+
+// Define decoded unit
+struct line_rows {
+    struct line_row *rows;      // Sorted by address
+    unsigned long long count;
+    const char **files;         // File names by index, NULL if unknown
+    unsigned int file_count;
+    char *names;                // Joined file names
+};
+
+// Define line program unit
+struct line_unit {
+    unsigned long long offset;  // Offset in .debug_line
+    struct line_rows *_Atomic rows; // Decoded on the first lookup
+};
+
+// Define line table
+struct line_table {
+    void *image;                // ELF file mapping
+    unsigned long long image_size;
+    const unsigned char *line;  // .debug_line
+    unsigned long long line_size;
+    const unsigned char *str;   // .debug_str
+    unsigned long long str_size;
+    const unsigned char *line_str; // .debug_line_str
+    unsigned long long line_str_size;
+    struct line_unit *units;
+    unsigned int unit_count;
+    struct line_seq *seqs;      // Sorted by start
+    unsigned long long seq_count;
+    pthread_mutex_t lock;       // Serializes the unit decoding
+};
+
+// Define output of a line program run, rows or sequences
+struct line_sink {
+    struct line_row *rows;
+    unsigned long long count;
+    unsigned long long cap;
+    struct line_seq *seqs;
+    unsigned long long seq_count;
+    unsigned long long seq_cap;
+    unsigned int unit;
+};
+
+//
+// Reader functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_fixed
+// Description  : Read a little endian integer of 1 to 8 bytes
+//
+// Inputs       : struct reader *r : the reader
+//                unsigned int size : the integer size
+// Outputs      : unsigned long long : the integer
+
+static unsigned long long read_fixed(struct reader *r, unsigned int size) {
+    unsigned long long value = 0;
+    unsigned int i;
+
+    if ((unsigned long long)(r->end - r->pos) < size) {
+        r->error = 1;
+        r->pos = r->end;
+        return 0;
+    }
+    for (i = 0; i < size && i < 8; i++) {
+        value |= (unsigned long long)r->pos[i] << (i * 8);
+    }
+    r->pos += size;
+
+    return value;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_uleb
+// Description  : Read an unsigned LEB128 integer
+//
+// Inputs       : struct reader *r : the reader
+// Outputs      : unsigned long long : the integer
+
+static unsigned long long read_uleb(struct reader *r) {
+    unsigned long long value = 0;
+    unsigned int shift = 0;
+    unsigned char byte;
+
+    do {
+        if (r->pos >= r->end) {
+            r->error = 1;
+            return 0;
+        }
+        byte = *r->pos++;
+        if (shift < 64) {
+            value |= (unsigned long long)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+
+    return value;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_sleb
+// Description  : Read a signed LEB128 integer
+//
+// Inputs       : struct reader *r : the reader
+// Outputs      : long long : the integer
+
+static long long read_sleb(struct reader *r) {
+    unsigned long long value = 0;
+    unsigned int shift = 0;
+    unsigned char byte;
+
+    do {
+        if (r->pos >= r->end) {
+            r->error = 1;
+            return 0;
+        }
+        byte = *r->pos++;
+        if (shift < 64) {
+            value |= (unsigned long long)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+
+    if (shift < 64 && (byte & 0x40)) {
+        value |= ~0ULL << shift;
+    }
+    return (long long)value;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_str
+// Description  : Read a NUL terminated string
+//
+// Inputs       : struct reader *r : the reader
+// Outputs      : const char* : the string, NULL on overrun
+
+static const char *read_str(struct reader *r) {
+    const unsigned char *nul;
+    const char *str;
+
+    nul = r->pos < r->end ? memchr(r->pos, 0, r->end - r->pos) : NULL;
+    if (nul == NULL) {
+        r->error = 1;
+        r->pos = r->end;
+        return NULL;
+    }
+    str = (const char *)r->pos;
+    r->pos = nul + 1;
+
+    return str;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : section_str
+// Description  : Get a string of a string section
+//
+// Inputs       : const unsigned char *section : the section
+//                unsigned long long size : the section size
+//                unsigned long long offset : the string offset
+// Outputs      : const char* : the string, NULL if invalid
+
+static const char *section_str(const unsigned char *section, unsigned long long size,
+                                unsigned long long offset) {
+    if (section == NULL || offset >= size ||
+        memchr(section + offset, 0, size - offset) == NULL) {
+        return NULL;
+    }
+    return (const char *)section + offset;
+}
+
+//
+// Line program functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parse_header
+// Description  : Parse the header of the line program unit at an offset
+//
+// Inputs       : const struct line_table *table : the line table
+//                unsigned long long offset : the unit offset
+//                struct line_header *header : the output header
+//                unsigned long long *next : the output next unit offset
+// Outputs      : int : 0 on success, -1 if the unit is invalid
+
+static int parse_header(const struct line_table *table, unsigned long long offset,
+                        struct line_header *header, unsigned long long *next) {
+    struct reader r = { table->line + offset, table->line + table->line_size, 0 };
+    unsigned long long length, header_length;
+    const unsigned char *unit_end;
+
+    *next = table->line_size;
+    length = read_fixed(&r, 4);
+    header->offset_size = 4;
+    if (length == 0xffffffff) {
+        length = read_fixed(&r, 8);
+        header->offset_size = 8;
+    }
+    if (r.error || length > (unsigned long long)(r.end - r.pos)) {
+        return -1;
+    }
+    unit_end = r.pos + length;
+    *next = unit_end - table->line;
+    r.end = unit_end;
+
+    header->version = read_fixed(&r, 2);
+    if (header->version < 2 || header->version > 5) {
+        return -1;
+    }
+    if (header->version >= 5) {
+        // Address and segment selector sizes
+        read_fixed(&r, 2);
+    }
+    header_length = read_fixed(&r, header->offset_size);
+    if (r.error || header_length > (unsigned long long)(r.end - r.pos)) {
+        return -1;
+    }
+    header->program.pos = r.pos + header_length;
+    header->program.end = unit_end;
+    header->program.error = 0;
+
+    header->min_inst = read_fixed(&r, 1);
+    if (header->version >= 4) {
+        // Maximum operations per instruction, for VLIW only
+        read_fixed(&r, 1);
+    }
+    read_fixed(&r, 1);
+    header->line_base = (signed char)read_fixed(&r, 1);
+    header->line_range = read_fixed(&r, 1);
+    header->opcode_base = read_fixed(&r, 1);
+    header->opcode_lengths = r.pos;
+    if (header->opcode_base == 0 ||
+        (unsigned long long)(r.end - r.pos) < header->opcode_base - 1) {
+        return -1;
+    }
+    r.pos += header->opcode_base - 1;
+    if (r.error || header->line_range == 0 || r.pos > header->program.pos) {
+        return -1;
+    }
+
+    header->tables.pos = r.pos;
+    header->tables.end = header->program.pos;
+    header->tables.error = 0;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : emit_row
+// Description  : Append a row to a sink collecting rows
+//
+// Inputs       : struct line_sink *sink : the sink
+//                unsigned long long addr : the row address
+//                unsigned int file : the file index
+//                unsigned int line : the line, 0 for a sequence end
+// Outputs      : int : 0 on success, -1 on failure
+
+static int emit_row(struct line_sink *sink, unsigned long long addr,
+                    unsigned int file, unsigned int line) {
+    struct line_row *rows;
+
+    if (sink->count == sink->cap) {
+        sink->cap = sink->cap ? sink->cap * 2 : 256;
+        rows = realloc(sink->rows, sink->cap * sizeof(*rows));
+        if (rows == NULL) {
+            return -1;
+        }
+        sink->rows = rows;
+    }
+    sink->rows[sink->count].addr = addr;
+    sink->rows[sink->count].file = file;
+    sink->rows[sink->count].line = line;
+    sink->count++;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : emit_seq
+// Description  : Append a sequence range to a sink collecting sequences
+//
+// Inputs       : struct line_sink *sink : the sink
+//                unsigned long long lo : the sequence start
+//                unsigned long long hi : the sequence end
+// Outputs      : int : 0 on success, -1 on failure
+
+static int emit_seq(struct line_sink *sink, unsigned long long lo,
+                    unsigned long long hi) {
+    struct line_seq *seqs;
+
+    if (sink->seq_count == sink->seq_cap) {
+        sink->seq_cap = sink->seq_cap ? sink->seq_cap * 2 : 256;
+        seqs = realloc(sink->seqs, sink->seq_cap * sizeof(*seqs));
+        if (seqs == NULL) {
+            return -1;
+        }
+        sink->seqs = seqs;
+    }
+    sink->seqs[sink->seq_count].lo = lo;
+    sink->seqs[sink->seq_count].hi = hi;
+    sink->seqs[sink->seq_count].unit = sink->unit;
+    sink->seq_count++;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : run_program
+// Description  : Run a line program, collecting its rows if the sink has
+//                rows enabled, and its sequence ranges otherwise. Sequences
+//                at address 0 belong to discarded code and are dropped.
+//
+// Inputs       : const struct line_header *header : the unit header
+//                struct line_sink *sink : the sink
+//                int rows : collect rows instead of sequences
+// Outputs      : int : 0 on success, -1 on failure
+
+static int run_program(const struct line_header *header, struct line_sink *sink,
+                        int rows) {
+    struct reader r = header->program, ext;
+    unsigned long long addr = 0, lo = 0, first = sink->count, length, i;
+    unsigned int file = 1, line = 1, op, adj, started = 0, emit;
+    long long delta;
+
+    while (r.pos < r.end && !r.error) {
+        op = *r.pos++;
+        emit = 0;
+
+        if (op >= header->opcode_base) {
+            // Special opcode, advance both and append a row
+            adj = op - header->opcode_base;
+            addr += (unsigned long long)(adj / header->line_range) * header->min_inst;
+            line += header->line_base + (int)(adj % header->line_range);
+            emit = 1;
+        }
+        else if (op == 0) {
+            length = read_uleb(&r);
+            if (r.error || length == 0 || length > (unsigned long long)(r.end - r.pos)) {
+                return -1;
+            }
+            ext.pos = r.pos + 1;
+            ext.end = r.pos + length;
+            ext.error = 0;
+            op = *r.pos;
+            r.pos += length;
+
+            if (op == DW_LNE_end_sequence) {
+                if (started && lo != 0) {
+                    if (rows ? emit_row(sink, addr, file, 0) : emit_seq(sink, lo, addr)) {
+                        return -1;
+                    }
+                }
+                else if (rows) {
+                    sink->count = first;
+                }
+                first = sink->count;
+                addr = 0;
+                file = 1;
+                line = 1;
+                started = 0;
+            }
+            else if (op == DW_LNE_set_address) {
+                addr = read_fixed(&ext, length - 1);
+            }
+        }
+        else if (op == DW_LNS_copy) {
+            emit = 1;
+        }
+        else if (op == DW_LNS_advance_pc) {
+            addr += read_uleb(&r) * header->min_inst;
+        }
+        else if (op == DW_LNS_advance_line) {
+            delta = read_sleb(&r);
+            line += (int)delta;
+        }
+        else if (op == DW_LNS_set_file) {
+            file = (unsigned int)read_uleb(&r);
+        }
+        else if (op == DW_LNS_const_add_pc) {
+            addr += (unsigned long long)((255 - header->opcode_base) / header->line_range) *
+                    header->min_inst;
+        }
+        else if (op == DW_LNS_fixed_advance_pc) {
+            addr += read_fixed(&r, 2);
+        }
+        else {
+            // Other standard opcodes only change unused registers
+            for (i = 0; i < header->opcode_lengths[op - 1]; i++) {
+                read_uleb(&r);
+            }
+        }
+
+        if (emit) {
+            if (!started) {
+                lo = addr;
+                started = 1;
+            }
+            if (rows && lo != 0 && emit_row(sink, addr, file, line)) {
+                return -1;
+            }
+        }
+    }
+
+    // Rows of an unterminated sequence have no end
+    if (rows) {
+        sink->count = first;
+    }
+    return r.error ? -1 : 0;
+}
+
+//
+// File table functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_form
+// Description  : Read a DWARF 5 entry attribute, returning the strings and
+//                integers and skipping the others
+//
+// Inputs       : const struct line_table *table : the line table
+//                const struct line_header *header : the unit header
+//                struct reader *r : the reader
+//                unsigned int form : the attribute form
+//                const char **str : the output string, NULL if not one
+// Outputs      : unsigned long long : the integer value, 0 if not one
+
+static unsigned long long read_form(const struct line_table *table,
+                                    const struct line_header *header,
+                                    struct reader *r, unsigned int form,
+                                    const char **str) {
+    unsigned long long value;
+
+    *str = NULL;
+    switch (form) {
+    case DW_FORM_string:
+        *str = read_str(r);
+        return 0;
+    case DW_FORM_strp:
+        value = read_fixed(r, header->offset_size);
+        *str = section_str(table->str, table->str_size, value);
+        return 0;
+    case DW_FORM_line_strp:
+        value = read_fixed(r, header->offset_size);
+        *str = section_str(table->line_str, table->line_str_size, value);
+        return 0;
+    case DW_FORM_data1:
+        return read_fixed(r, 1);
+    case DW_FORM_data2:
+        return read_fixed(r, 2);
+    case DW_FORM_data4:
+        return read_fixed(r, 4);
+    case DW_FORM_data8:
+        return read_fixed(r, 8);
+    case DW_FORM_data16:
+        read_fixed(r, 16);
+        return 0;
+    case DW_FORM_udata:
+        return read_uleb(r);
+    case DW_FORM_sdata:
+        return (unsigned long long)read_sleb(r);
+    case DW_FORM_block:
+        value = read_uleb(r);
+        if (value > (unsigned long long)(r->end - r->pos)) {
+            r->error = 1;
+            r->pos = r->end;
+            return 0;
+        }
+        r->pos += value;
+        return 0;
+    default:
+        r->error = 1;
+        return 0;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_entries
+// Description  : Read the directory or file entries of a DWARF 5 header
+//
+// Inputs       : const struct line_table *table : the line table
+//                const struct line_header *header : the unit header
+//                struct reader *r : the reader
+//                const char ***paths : the output paths, to free
+//                unsigned int **dirs : the output directory indexes, to free
+// Outputs      : unsigned int : the number of entries
+
+static unsigned int read_entries(const struct line_table *table,
+                                    const struct line_header *header,
+                                    struct reader *r, const char ***paths,
+                                    unsigned int **dirs) {
+    unsigned long long formats[32][2], format_count, count, i, j, value;
+    const char *str;
+
+    *paths = NULL;
+    *dirs = NULL;
+    format_count = read_fixed(r, 1);
+    if (format_count > 32) {
+        r->error = 1;
+        return 0;
+    }
+    for (i = 0; i < format_count; i++) {
+        formats[i][0] = read_uleb(r);
+        formats[i][1] = read_uleb(r);
+    }
+    count = read_uleb(r);
+    if (r->error || count > (unsigned long long)(r->end - r->pos)) {
+        r->error = 1;
+        return 0;
+    }
+
+    *paths = calloc(count + 1, sizeof(**paths));
+    *dirs = calloc(count + 1, sizeof(**dirs));
+    if (*paths == NULL || *dirs == NULL) {
+        r->error = 1;
+        return 0;
+    }
+    for (i = 0; i < count && !r->error; i++) {
+        for (j = 0; j < format_count; j++) {
+            value = read_form(table, header, r, (unsigned int)formats[j][1], &str);
+            if (formats[j][0] == DW_LNCT_path) {
+                (*paths)[i] = str;
+            }
+            else if (formats[j][0] == DW_LNCT_directory_index) {
+                (*dirs)[i] = (unsigned int)value;
+            }
+        }
+    }
+
+    return (unsigned int)count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_files
+// Description  : Read the file table of a unit, joining each file name with
+//                its directory. Files are numbered from 1 before DWARF 5.
+//
+// Inputs       : const struct line_table *table : the line table
+//                const struct line_header *header : the unit header
+//                struct line_rows *out : the output files
+// Outputs      : int : 0 on success, -1 on failure
+
+static int read_files(const struct line_table *table, const struct line_header *header,
+                        struct line_rows *out) {
+    struct reader r = header->tables;
+    const char **dir_paths = NULL, **file_paths = NULL, *dir, *name;
+    unsigned int *dir_dirs = NULL, *file_dirs = NULL, dir_count = 0, file_count = 0, i;
+    unsigned long long size = 0, pos, len;
+    int res = -1;
+
+    if (header->version >= 5) {
+        dir_count = read_entries(table, header, &r, &dir_paths, &dir_dirs);
+        if (!r.error) {
+            file_count = read_entries(table, header, &r, &file_paths, &file_dirs);
+        }
+    }
+    else {
+        // Directories from 1, then files from 1 until empty names
+        for (; r.pos < r.end && *r.pos; dir_count++) {
+            read_str(&r);
+        }
+        if (r.pos >= r.end) {
+            goto done;
+        }
+        r.pos++;
+        for (; r.pos < r.end && *r.pos && !r.error; file_count++) {
+            read_str(&r);
+            read_uleb(&r);
+            read_uleb(&r);
+            read_uleb(&r);
+        }
+        if (r.error || r.pos >= r.end) {
+            goto done;
+        }
+
+        dir_paths = calloc(dir_count + 1, sizeof(*dir_paths));
+        file_paths = calloc(file_count + 1, sizeof(*file_paths));
+        file_dirs = calloc(file_count + 1, sizeof(*file_dirs));
+        if (dir_paths == NULL || file_paths == NULL || file_dirs == NULL) {
+            goto done;
+        }
+        r = header->tables;
+        for (i = 1; i <= dir_count; i++) {
+            dir_paths[i] = read_str(&r);
+        }
+        r.pos++;
+        for (i = 1; i <= file_count; i++) {
+            file_paths[i] = read_str(&r);
+            file_dirs[i] = (unsigned int)read_uleb(&r);
+            read_uleb(&r);
+            read_uleb(&r);
+        }
+        dir_count++;
+        file_count++;
+    }
+    if (r.error) {
+        goto done;
+    }
+
+    // Join into one buffer, storing offsets until it stops moving
+    out->files = calloc(file_count + 1, sizeof(*out->files));
+    if (out->files == NULL) {
+        goto done;
+    }
+    for (i = 0; i < file_count; i++) {
+        if (file_paths[i] == NULL) {
+            continue;
+        }
+        dir = file_paths[i][0] != '/' && file_dirs[i] < dir_count ?
+                dir_paths[file_dirs[i]] : NULL;
+        size += strlen(file_paths[i]) + (dir ? strlen(dir) + 1 : 0) + 1;
+    }
+    out->names = malloc(size + 1);
+    if (out->names == NULL) {
+        free(out->files);
+        out->files = NULL;
+        goto done;
+    }
+    for (i = 0, pos = 0; i < file_count; i++) {
+        name = file_paths[i];
+        if (name == NULL) {
+            continue;
+        }
+        dir = name[0] != '/' && file_dirs[i] < dir_count ? dir_paths[file_dirs[i]] : NULL;
+        out->files[i] = out->names + pos;
+        if (dir) {
+            len = strlen(dir);
+            memcpy(out->names + pos, dir, len);
+            pos += len;
+            out->names[pos++] = '/';
+        }
+        len = strlen(name) + 1;
+        memcpy(out->names + pos, name, len);
+        pos += len;
+    }
+    out->file_count = file_count;
+    res = 0;
+
+done:
+    free(dir_paths);
+    free(dir_dirs);
+    free(file_paths);
+    free(file_dirs);
+    return res;
+}
+
+//
+// Unit functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_seqs
+// Description  : Order sequences by start
+//
+// Inputs       : const void *a : the first sequence
+//                const void *b : the second sequence
+// Outputs      : int : the order
+
+static int compare_seqs(const void *a, const void *b) {
+    const struct line_seq *x = a, *y = b;
+
+    if (x->lo != y->lo) {
+        return x->lo < y->lo ? -1 : 1;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : decode_unit
+// Description  : Decode the rows and files of a unit. Each sequence is
+//                sorted, so the rows are sorted by placing whole sequences
+//                in order, which keeps the end row of a sequence before the
+//                first row of the next one at the same address.
+//
+// Inputs       : const struct line_table *table : the line table
+//                unsigned int unit : the unit index
+// Outputs      : struct line_rows* : the rows, empty if the unit is invalid
+
+static struct line_rows *decode_unit(const struct line_table *table, unsigned int unit) {
+    struct line_sink sink = { 0 }, order = { 0 };
+    struct line_header header;
+    struct line_rows *out;
+    unsigned long long next, i, first;
+    struct line_row *sorted;
+
+    out = calloc(1, sizeof(*out));
+    if (out == NULL) {
+        return NULL;
+    }
+    if (parse_header(table, table->units[unit].offset, &header, &next) ||
+        read_files(table, &header, out) || run_program(&header, &sink, 1)) {
+        free(sink.rows);
+        return out;
+    }
+
+    // Runs of rows ending at a row of line 0, as sequences of row indexes
+    // with the unit field holding the first row
+    for (i = 0, first = 0; i < sink.count; i++) {
+        if (sink.rows[i].line == 0) {
+            order.unit = (unsigned int)first;
+            if (emit_seq(&order, sink.rows[first].addr, i + 1)) {
+                free(sink.rows);
+                free(order.seqs);
+                return out;
+            }
+            first = i + 1;
+        }
+    }
+    qsort(order.seqs, order.seq_count, sizeof(*order.seqs), compare_seqs);
+
+    sorted = malloc((sink.count + 1) * sizeof(*sorted));
+    if (sorted) {
+        for (i = 0, next = 0; i < order.seq_count; i++) {
+            first = order.seqs[i].unit;
+            memcpy(sorted + next, sink.rows + first,
+                    (order.seqs[i].hi - first) * sizeof(*sorted));
+            next += order.seqs[i].hi - first;
+        }
+        out->rows = sorted;
+        out->count = next;
+    }
+    free(sink.rows);
+    free(order.seqs);
+
+    return out;
+}
+
+//
+// Line table functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : line_table_open
+// Description  : Open the line table of an ELF object, and index the
+//                address ranges of its sequences. Compressed debug sections
+//                are not supported.
+//
+// Inputs       : const char *path : the ELF object path
+// Outputs      : struct line_table* : the line table, NULL if it has none
+
+struct line_table *line_table_open(const char *path) {
+    const Elf64_Ehdr *ehdr;
+    const Elf64_Shdr *shdr, *shstr;
+    struct line_sink sink = { 0 };
+    struct line_header header;
+    struct line_table *table;
+    struct line_unit *units;
+    unsigned long long offset, next, i, cap = 0;
+    const unsigned char *image;
+    const char *name;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) || (unsigned long long)st.st_size < sizeof(*ehdr)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    table = calloc(1, sizeof(*table));
+    if (table == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    table->image = map;
+    table->image_size = st.st_size;
+    pthread_mutex_init(&table->lock, NULL);
+
+    // Find the line sections by name
+    image = map;
+    ehdr = map;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_shoff + (unsigned long long)ehdr->e_shnum * sizeof(*shdr) > table->image_size ||
+        ehdr->e_shstrndx >= ehdr->e_shnum) {
+        goto fail;
+    }
+    shdr = (const Elf64_Shdr *)(image + ehdr->e_shoff);
+    shstr = &shdr[ehdr->e_shstrndx];
+    if (shstr->sh_offset + shstr->sh_size > table->image_size) {
+        goto fail;
+    }
+    for (i = 0; i < ehdr->e_shnum; i++) {
+        name = section_str(image + shstr->sh_offset, shstr->sh_size, shdr[i].sh_name);
+        if (name == NULL || shdr[i].sh_type == SHT_NOBITS ||
+            (shdr[i].sh_flags & SHF_COMPRESSED) ||
+            shdr[i].sh_offset + shdr[i].sh_size > table->image_size) {
+            continue;
+        }
+        if (!strcmp(name, ".debug_line")) {
+            table->line = image + shdr[i].sh_offset;
+            table->line_size = shdr[i].sh_size;
+        }
+        else if (!strcmp(name, ".debug_str")) {
+            table->str = image + shdr[i].sh_offset;
+            table->str_size = shdr[i].sh_size;
+        }
+        else if (!strcmp(name, ".debug_line_str")) {
+            table->line_str = image + shdr[i].sh_offset;
+            table->line_str_size = shdr[i].sh_size;
+        }
+    }
+    if (table->line == NULL) {
+        goto fail;
+    }
+
+    // Index the sequences of all units, skipping the invalid ones
+    for (offset = 0; offset < table->line_size; offset = next) {
+        if (parse_header(table, offset, &header, &next)) {
+            if (next <= offset) {
+                break;
+            }
+            continue;
+        }
+        if (table->unit_count == cap) {
+            cap = cap ? cap * 2 : 64;
+            units = realloc(table->units, cap * sizeof(*units));
+            if (units == NULL) {
+                goto fail;
+            }
+            table->units = units;
+        }
+        table->units[table->unit_count].offset = offset;
+        atomic_init(&table->units[table->unit_count].rows, NULL);
+        sink.unit = table->unit_count++;
+        run_program(&header, &sink, 0);
+    }
+    if (sink.seq_count == 0) {
+        goto fail;
+    }
+
+    qsort(sink.seqs, sink.seq_count, sizeof(*sink.seqs), compare_seqs);
+    table->seqs = sink.seqs;
+    table->seq_count = sink.seq_count;
+
+    return table;
+
+fail:
+    free(sink.seqs);
+    line_table_close(table);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : line_table_close
+// Description  : Close a line table and free its decoded units
+//
+// Inputs       : struct line_table *table : the line table
+// Outputs      : None
+
+void line_table_close(struct line_table *table) {
+    struct line_rows *rows;
+    unsigned int i;
+
+    if (table == NULL) {
+        return;
+    }
+
+    for (i = 0; i < table->unit_count; i++) {
+        rows = atomic_load_explicit(&table->units[i].rows, memory_order_relaxed);
+        if (rows) {
+            free(rows->rows);
+            free(rows->files);
+            free(rows->names);
+            free(rows);
+        }
+    }
+    free(table->units);
+    free(table->seqs);
+    pthread_mutex_destroy(&table->lock);
+    munmap(table->image, table->image_size);
+    free(table);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : line_table_lookup
+// Description  : Resolve a link time address to its source line, decoding
+//                its unit on the first lookup
+//
+// Inputs       : struct line_table *table : the line table
+//                unsigned long long addr : the link time address
+//                const char **file : the output file, NULL if unknown
+//                unsigned int *line : the output line
+// Outputs      : int : 0 if the line is known, -1 otherwise
+
+int line_table_lookup(struct line_table *table, unsigned long long addr,
+                        const char **file, unsigned int *line) {
+    const struct line_seq *seq = table->seqs;
+    unsigned long long n = table->seq_count, half;
+    const struct line_row *row;
+    struct line_unit *unit;
+    struct line_rows *rows;
+
+    *file = NULL;
+    *line = 0;
+
+    // Last sequence starting at or before the address
+    if (seq[0].lo > addr) {
+        return -1;
+    }
+    while (n > 1) {
+        half = n / 2;
+        seq = seq[half].lo <= addr ? seq + half : seq;
+        n -= half;
+    }
+    if (addr >= seq->hi) {
+        return -1;
+    }
+
+    unit = &table->units[seq->unit];
+    rows = atomic_load_explicit(&unit->rows, memory_order_acquire);
+    if (rows == NULL) {
+        pthread_mutex_lock(&table->lock);
+        rows = atomic_load_explicit(&unit->rows, memory_order_relaxed);
+        if (rows == NULL) {
+            rows = decode_unit(table, seq->unit);
+            atomic_store_explicit(&unit->rows, rows, memory_order_release);
+        }
+        pthread_mutex_unlock(&table->lock);
+        if (rows == NULL) {
+            return -1;
+        }
+    }
+
+    // Last row at or before the address
+    if (rows->count == 0 || rows->rows[0].addr > addr) {
+        return -1;
+    }
+    row = rows->rows;
+    n = rows->count;
+    while (n > 1) {
+        half = n / 2;
+        row = row[half].addr <= addr ? row + half : row;
+        n -= half;
+    }
+    if (row->line == 0) {
+        return -1;
+    }
+
+    *line = row->line;
+    if (row->file < rows->file_count) {
+        *file = rows->files[row->file];
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef LIBIHT_LINE_TABLE_H
+#define LIBIHT_LINE_TABLE_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/line_table.h
+//  Description    : This is the header file for the DWARF line tables. A line
+//                   table indexes the address ranges of the .debug_line
+//                   sequences of an ELF object when opened, and decodes the
+//                   rows of a compilation unit on its first lookup.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+//
+// Type definitions
+
+// Define row of a decoded line program
+struct line_row {
+    unsigned long long addr;    // First address of the row
+    unsigned int file;          // File index in the unit
+    unsigned int line;          // Source line, 0 past a sequence end
+};
+
+// Define line table
+struct line_table;
+
+//
+// Function prototypes
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+struct line_table *line_table_open(const char *path);
+// Open the line table of an ELF object, NULL if it has none
+
+void line_table_close(struct line_table *table);
+// Close a line table
+
+int line_table_lookup(struct line_table *table, unsigned long long addr,
+                        const char **file, unsigned int *line);
+// Resolve a link time address to its source line, returns 0 if known
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // LIBIHT_LINE_TABLE_H
@@ -0,0 +1,1264 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/pt_decoder.c
+//  Description    : This is the implementation of the Intel PT packet decoder.
+//                   Conditional branches and compressed returns are resolved
+//                   with TNT bits, indirect branches with TIP packets, and
+//                   direct branches from the code itself. Basic blocks are
+//                   decoded once and cached, so hot loops only cost a cache
+//                   lookup per branch.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#include "pt_decoder.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Library constants
+
+// Instruction length flags of the one-byte opcode map
+#define INSN_MODRM      0x01    // ModRM byte follows
+#define INSN_IMM8       0x02    // 8-bit immediate
+#define INSN_IMMZ       0x04    // 16/32-bit immediate (operand size)
+#define INSN_IMM16      0x08    // 16-bit immediate
+#define INSN_IMMV       0x10    // 16/32/64-bit immediate (REX.W)
+#define INSN_MOFFS      0x20    // 32/64-bit offset (address size)
+#define INSN_INVALID    0x40    // Invalid in 64-bit mode
+
+// Longest x86 instruction
+#define INSN_MAX_LEN    15
+
+#define M   INSN_MODRM
+#define B   INSN_IMM8
+#define Z   INSN_IMMZ
+#define W   INSN_IMM16
+#define V   INSN_IMMV
+#define O   INSN_MOFFS
+#define X   INSN_INVALID
+
+static const unsigned char one_byte_flags[256] = {
+    /* 00 */ M, M, M, M, B, Z, X, X, M, M, M, M, B, Z, X, 0,
+    /* 10 */ M, M, M, M, B, Z, X, X, M, M, M, M, B, Z, X, X,
+    /* 20 */ M, M, M, M, B, Z, 0, X, M, M, M, M, B, Z, 0, X,
+    /* 30 */ M, M, M, M, B, Z, 0, X, M, M, M, M, B, Z, 0, X,
+    /* 40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 60 */ X, X, 0, M, 0, 0, 0, 0, Z, M|Z, B, M|B, 0, 0, 0, 0,
+    /* 70 */ B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+    /* 80 */ M|B, M|Z, X, M|B, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, X, 0, 0, 0, 0, 0,
+    /* A0 */ O, O, O, O, 0, 0, 0, 0, B, Z, 0, 0, 0, 0, 0, 0,
+    /* B0 */ B, B, B, B, B, B, B, B, V, V, V, V, V, V, V, V,
+    /* C0 */ M|B, M|B, W, 0, 0, 0, M|B, M|Z, W|B, 0, W, 0, 0, B, X, 0,
+    /* D0 */ M, M, M, M, X, X, X, 0, M, M, M, M, M, M, M, M,
+    /* E0 */ B, B, B, B, B, B, B, B, Z, Z, X, B, 0, 0, 0, 0,
+    /* F0 */ 0, 0, 0, 0, 0, 0, M, M, 0, 0, 0, 0, 0, 0, M, M,
+};
+
+#undef M
+#undef B
+#undef Z
+#undef W
+#undef V
+#undef O
+#undef X
+
+// IP payload bytes by IP compression, 0xff if reserved
+static const unsigned char ip_payload_bytes[8] = {
+    0, 2, 4, 6, 6, 0xff, 8, 0xff
+};
+
+//
+// Packet decoding functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_le
+// Description  : Read a little endian value of up to 8 bytes
+//
+// Inputs       : const unsigned char *buffer : the value bytes
+//                unsigned int bytes : the value size
+// Outputs      : unsigned long long : the value
+
+static unsigned long long read_le(const unsigned char *buffer, unsigned int bytes) {
+    unsigned long long value = 0;
+    while (bytes--) {
+        value = (value << 8) | buffer[bytes];
+    }
+    return value;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : decode_ext_packet
+// Description  : Decode a packet with the 0x02 extended opcode
+//
+// Inputs       : const unsigned char *buffer : the packet bytes
+//                unsigned long long size : bytes left in the buffer
+//                struct pt_packet *packet : the decoded packet
+// Outputs      : int : packet size, 0 if truncated, -1 if invalid
+
+static int decode_ext_packet(const unsigned char *buffer, unsigned long long size,
+                                struct pt_packet *packet) {
+    unsigned int i, len;
+
+    if (size < 2) {
+        return 0;
+    }
+
+    switch (buffer[1]) {
+    case 0xa3:
+        packet->type = PT_PACKET_TNT;
+        len = 8;
+        break;
+    case 0x43:
+        packet->type = PT_PACKET_PIP;
+        len = 8;
+        break;
+    case 0x83:
+        packet->type = PT_PACKET_TRACESTOP;
+        len = 2;
+        break;
+    case 0x03:
+        packet->type = PT_PACKET_CBR;
+        len = 4;
+        break;
+    case 0x73:
+        packet->type = PT_PACKET_TMA;
+        len = 7;
+        break;
+    case 0xc8:
+        packet->type = PT_PACKET_VMCS;
+        len = 7;
+        break;
+    case 0xf3:
+        packet->type = PT_PACKET_OVF;
+        len = 2;
+        break;
+    case 0x82:
+        packet->type = PT_PACKET_PSB;
+        len = 16;
+        break;
+    case 0x23:
+        packet->type = PT_PACKET_PSBEND;
+        len = 2;
+        break;
+    case 0xc3:
+        packet->type = PT_PACKET_MNT;
+        len = 11;
+        break;
+    case 0x62:
+    case 0xe2:
+        packet->type = PT_PACKET_EXSTOP;
+        len = 2;
+        break;
+    case 0xc2:
+        packet->type = PT_PACKET_MWAIT;
+        len = 10;
+        break;
+    case 0x22:
+        packet->type = PT_PACKET_PWRE;
+        len = 4;
+        break;
+    case 0xa2:
+        packet->type = PT_PACKET_PWRX;
+        len = 7;
+        break;
+    default:
+        // PTWRITE with a 4 or 8 byte payload
+        if ((buffer[1] & 0x1f) != 0x12 || (buffer[1] & 0x40)) {
+            return -1;
+        }
+        packet->type = PT_PACKET_PTW;
+        len = (buffer[1] & 0x20) ? 10 : 6;
+        break;
+    }
+
+    if (size < len) {
+        return 0;
+    }
+    packet->size = len;
+
+    switch (packet->type) {
+    case PT_PACKET_TNT:
+        // The highest set bit stops the TNT bits, oldest bit first
+        packet->payload = read_le(buffer + 2, 6);
+        if (packet->payload == 0) {
+            return -1;
+        }
+        for (i = 47; !(packet->payload & (1ULL << i)); i--);
+        packet->count = i;
+        packet->payload &= (1ULL << i) - 1;
+        break;
+    case PT_PACKET_PSB:
+        for (i = 2; i < 16; i += 2) {
+            if (buffer[i] != 0x02 || buffer[i + 1] != 0x82) {
+                return -1;
+            }
+        }
+        break;
+    case PT_PACKET_MNT:
+        if (buffer[2] != 0x88) {
+            return -1;
+        }
+        packet->payload = read_le(buffer + 3, 8);
+        break;
+    case PT_PACKET_PTW:
+        packet->payload = read_le(buffer + 2, len - 2);
+        break;
+    case PT_PACKET_PIP:
+    case PT_PACKET_TMA:
+    case PT_PACKET_VMCS:
+    case PT_PACKET_CBR:
+        packet->payload = read_le(buffer + 2, len - 2 > 6 ? 6 : len - 2);
+        break;
+    default:
+        break;
+    }
+
+    return (int)len;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_packet_decode
+// Description  : Decode the packet at the start of a buffer. IP packets keep
+//                their compressed payload, the IP compression is in count.
+//
+// Inputs       : const unsigned char *buffer : the packet bytes
+//                unsigned long long size : bytes left in the buffer
+//                struct pt_packet *packet : the decoded packet
+// Outputs      : int : packet size, 0 if truncated, -1 if invalid
+
+int pt_packet_decode(const unsigned char *buffer, unsigned long long size,
+                        struct pt_packet *packet) {
+    unsigned char header;
+    unsigned int i, len;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    header = buffer[0];
+    packet->payload = 0;
+    packet->count = 0;
+
+    if (header == 0x00) {
+        packet->type = PT_PACKET_PAD;
+        packet->size = 1;
+        return 1;
+    }
+
+    if (header == 0x02) {
+        return decode_ext_packet(buffer, size, packet);
+    }
+
+    // Short TNT, the highest set bit stops the TNT bits
+    if (!(header & 0x01)) {
+        for (i = 7; !(header & (1 << i)); i--);
+        packet->type = PT_PACKET_TNT;
+        packet->size = 1;
+        packet->count = i - 1;
+        packet->payload = (header >> 1) & ((1 << (i - 1)) - 1);
+        return 1;
+    }
+
+    // CYC, continued while the low bit of the next byte is set
+    if ((header & 0x03) == 0x03) {
+        len = 1;
+        if (header & 0x04) {
+            do {
+                if (len >= size) {
+                    return 0;
+                }
+            } while (buffer[len++] & 0x01);
+        }
+        packet->type = PT_PACKET_CYC;
+        packet->size = len;
+        packet->payload = header >> 3;
+        return (int)len;
+    }
+
+    switch (header) {
+    case 0x99:
+        packet->type = PT_PACKET_MODE;
+        len = 2;
+        break;
+    case 0x19:
+        packet->type = PT_PACKET_TSC;
+        len = 8;
+        break;
+    case 0x59:
+        packet->type = PT_PACKET_MTC;
+        len = 2;
+        break;
+    default:
+        switch (header & 0x1f) {
+        case 0x0d:
+            packet->type = PT_PACKET_TIP;
+            break;
+        case 0x11:
+            packet->type = PT_PACKET_TIP_PGE;
+            break;
+        case 0x01:
+            packet->type = PT_PACKET_TIP_PGD;
+            break;
+        case 0x1d:
+            packet->type = PT_PACKET_FUP;
+            break;
+        default:
+            return -1;
+        }
+
+        packet->count = header >> 5;
+        if (ip_payload_bytes[packet->count] == 0xff) {
+            return -1;
+        }
+        len = 1 + ip_payload_bytes[packet->count];
+        break;
+    }
+
+    if (size < len) {
+        return 0;
+    }
+    packet->size = len;
+    packet->payload = read_le(buffer + 1, len - 1);
+
+    return (int)len;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_sync_forward
+// Description  : Find the first PSB packet at or after an offset, the stream
+//                can only be decoded from there
+//
+// Inputs       : const unsigned char *buffer : the packet stream
+//                unsigned long long size : the packet stream size
+//                unsigned long long offset : the offset to search from
+// Outputs      : unsigned long long : offset of the PSB packet, size if none
+
+unsigned long long pt_sync_forward(const unsigned char *buffer,
+                                    unsigned long long size,
+                                    unsigned long long offset) {
+    static const unsigned char psb[16] = {
+        0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+        0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+    };
+    const unsigned char *curr;
+
+    while (offset + sizeof(psb) <= size) {
+        curr = memchr(buffer + offset, 0x02, size - offset - sizeof(psb) + 1);
+        if (curr == NULL) {
+            break;
+        }
+        offset = curr - buffer;
+        if (memcmp(curr, psb, sizeof(psb)) == 0) {
+            return offset;
+        }
+        offset++;
+    }
+
+    return size;
+}
+
+//
+// Instruction decoding functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : modrm_size
+// Description  : Compute the size of the ModRM, SIB and displacement bytes
+//
+// Inputs       : const unsigned char *code : the ModRM byte
+//                unsigned int size : bytes left in the instruction
+// Outputs      : int : the ModRM size, 0 if truncated
+
+static int modrm_size(const unsigned char *code, unsigned int size) {
+    unsigned int mod, rm, len = 1;
+
+    if (size < 1) {
+        return 0;
+    }
+
+    mod = code[0] >> 6;
+    rm = code[0] & 0x07;
+    if (mod != 3) {
+        if (rm == 4) {
+            if (size < 2) {
+                return 0;
+            }
+            len++;
+            // No base register, a 32-bit displacement instead
+            if (mod == 0 && (code[1] & 0x07) == 5) {
+                len += 4;
+            }
+        }
+        else if (mod == 0 && rm == 5) {
+            // RIP relative
+            len += 4;
+        }
+        if (mod == 1) {
+            len += 1;
+        }
+        else if (mod == 2) {
+            len += 4;
+        }
+    }
+
+    return len <= size ? (int)len : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : vex_imm_size
+// Description  : Get the immediate size of an instruction in the VEX and
+//                EVEX opcode maps
+//
+// Inputs       : unsigned int map : the opcode map (1: 0F, 2: 0F38, 3: 0F3A)
+//                unsigned char op : the opcode
+// Outputs      : unsigned int : the immediate size
+
+static unsigned int vex_imm_size(unsigned int map, unsigned char op) {
+    if (map == 3) {
+        return 1;
+    }
+    if (map == 1) {
+        switch (op) {
+        case 0x70: case 0x71: case 0x72: case 0x73:
+        case 0xc2: case 0xc4: case 0xc5: case 0xc6:
+            return 1;
+        }
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_insn_decode
+// Description  : Decode the length and branch kind of a 64-bit mode x86
+//                instruction. Only what is needed to walk the code is
+//                decoded: prefixes, opcode maps, ModRM, SIB, displacement and
+//                immediates.
+//
+// Inputs       : const unsigned char *code : the instruction bytes
+//                unsigned int size : bytes available
+//                unsigned long long ip : the instruction address
+//                unsigned int *kind : the branch kind (enum PT_BRANCH_KIND)
+//                unsigned long long *target : the direct branch target
+// Outputs      : int : instruction length, 0 if invalid or truncated
+
+int pt_insn_decode(const unsigned char *code, unsigned int size,
+                    unsigned long long ip, unsigned int *kind,
+                    unsigned long long *target) {
+    unsigned int i = 0, opsize16 = 0, adsize32 = 0, rex_w = 0;
+    unsigned int flags, imm = 0, map, reg;
+    unsigned char op;
+    int len;
+
+    *kind = PT_BRANCH_NONE;
+    *target = 0;
+    if (size > INSN_MAX_LEN) {
+        size = INSN_MAX_LEN;
+    }
+
+    // Legacy prefixes
+    for (;; i++) {
+        if (i >= size) {
+            return 0;
+        }
+        switch (code[i]) {
+        case 0x66:
+            opsize16 = 1;
+            continue;
+        case 0x67:
+            adsize32 = 1;
+            continue;
+        case 0xf0: case 0xf2: case 0xf3:
+        case 0x26: case 0x2e: case 0x36: case 0x3e: case 0x64: case 0x65:
+            continue;
+        }
+        break;
+    }
+
+    // REX prefix
+    if ((code[i] & 0xf0) == 0x40) {
+        rex_w = (code[i] >> 3) & 0x01;
+        if (++i >= size) {
+            return 0;
+        }
+    }
+
+    op = code[i++];
+
+    // VEX and EVEX, always followed by an opcode and ModRM in 64-bit mode
+    if (op == 0xc4 || op == 0xc5 || op == 0x62) {
+        if (op == 0xc5) {
+            map = 1;
+            i += 1;
+        }
+        else if (op == 0xc4) {
+            if (i >= size) {
+                return 0;
+            }
+            map = code[i] & 0x1f;
+            i += 2;
+        }
+        else {
+            if (i >= size) {
+                return 0;
+            }
+            map = code[i] & 0x07;
+            i += 3;
+        }
+        if (i >= size) {
+            return 0;
+        }
+        op = code[i++];
+
+        // VZEROUPPER and VZEROALL have no ModRM
+        if (!(map == 1 && op == 0x77)) {
+            len = modrm_size(code + i, size - i);
+            if (len == 0) {
+                return 0;
+            }
+            i += len;
+        }
+        i += vex_imm_size(map, op);
+        return i <= size ? (int)i : 0;
+    }
+
+    // Two and three byte opcode maps
+    if (op == 0x0f) {
+        if (i >= size) {
+            return 0;
+        }
+        op = code[i++];
+
+        if (op == 0x38 || op == 0x3a) {
+            imm = op == 0x3a ? 1 : 0;
+            if (++i > size) {
+                return 0;
+            }
+            len = modrm_size(code + i, size - i);
+            if (len == 0) {
+                return 0;
+            }
+            i += len + imm;
+            return i <= size ? (int)i : 0;
+        }
+
+        if (op >= 0x80 && op <= 0x8f) {
+            // Jcc rel32
+            if (i + 4 > size) {
+                return 0;
+            }
+            i += 4;
+            *kind = PT_BRANCH_COND;
+            *target = ip + i + (long long)(int)read_le(code + i - 4, 4);
+            return (int)i;
+        }
+
+        switch (op) {
+        case 0x05: case 0x07: case 0x34: case 0x35: case 0xaa: case 0x0b:
+            // SYSCALL, SYSRET, SYSENTER, SYSEXIT, RSM, UD2
+            *kind = PT_BRANCH_FAR;
+            return (int)i;
+        case 0x06: case 0x08: case 0x09: case 0x0e:
+        case 0x30: case 0x31: case 0x32: case 0x33: case 0x37:
+        case 0x77: case 0xa0: case 0xa1: case 0xa2: case 0xa8: case 0xa9:
+        case 0xc8: case 0xc9: case 0xca: case 0xcb:
+        case 0xcc: case 0xcd: case 0xce: case 0xcf:
+            return (int)i;
+        case 0x70: case 0x71: case 0x72: case 0x73: case 0xa4: case 0xac:
+        case 0xba: case 0xc2: case 0xc4: case 0xc5: case 0xc6: case 0x0f:
+            imm = 1;
+            break;
+        }
+
+        len = modrm_size(code + i, size - i);
+        if (len == 0) {
+            return 0;
+        }
+
+        // VMCALL, VMLAUNCH, VMRESUME
+        if (op == 0x01 && (code[i] == 0xc1 || code[i] == 0xc2 ||
+                            code[i] == 0xc3)) {
+            *kind = PT_BRANCH_FAR;
+        }
+
+        i += len + imm;
+        return i <= size ? (int)i : 0;
+    }
+
+    // One byte opcode map
+    flags = one_byte_flags[op];
+    if (flags & INSN_INVALID) {
+        return 0;
+    }
+
+    reg = 0;
+    if (flags & INSN_MODRM) {
+        if (i >= size) {
+            return 0;
+        }
+        reg = (code[i] >> 3) & 0x07;
+        len = modrm_size(code + i, size - i);
+        if (len == 0) {
+            return 0;
+        }
+        i += len;
+
+        // TEST has an immediate, the other group 3 instructions have none
+        if ((op == 0xf6 || op == 0xf7) && reg <= 1) {
+            flags |= op == 0xf6 ? INSN_IMM8 : INSN_IMMZ;
+        }
+    }
+
+    if (flags & INSN_IMM8) {
+        imm += 1;
+    }
+    if (flags & INSN_IMM16) {
+        imm += 2;
+    }
+    if (flags & INSN_IMMZ) {
+        // Near branches always take a 32-bit displacement in 64-bit mode
+        imm += (opsize16 && op != 0xe8 && op != 0xe9) ? 2 : 4;
+    }
+    if (flags & INSN_IMMV) {
+        imm += rex_w ? 8 : (opsize16 ? 2 : 4);
+    }
+    if (flags & INSN_MOFFS) {
+        imm += adsize32 ? 4 : 8;
+    }
+
+    i += imm;
+    if (i > size) {
+        return 0;
+    }
+
+    // Branch kinds
+    if ((op >= 0x70 && op <= 0x7f) || (op >= 0xe0 && op <= 0xe3)) {
+        *kind = PT_BRANCH_COND;
+        *target = ip + i + (long long)(signed char)code[i - 1];
+    }
+    else if (op == 0xeb) {
+        *kind = PT_BRANCH_JUMP;
+        *target = ip + i + (long long)(signed char)code[i - 1];
+    }
+    else if (op == 0xe8 || op == 0xe9) {
+        *kind = op == 0xe8 ? PT_BRANCH_CALL : PT_BRANCH_JUMP;
+        *target = ip + i + (long long)(int)read_le(code + i - 4, 4);
+    }
+    else if (op == 0xc2 || op == 0xc3) {
+        *kind = PT_BRANCH_RET;
+    }
+    else if (op == 0xca || op == 0xcb || op == 0xcc || op == 0xcd ||
+                op == 0xcf || op == 0xf1) {
+        *kind = PT_BRANCH_FAR;
+    }
+    else if (op == 0xff) {
+        if (reg == 2) {
+            *kind = PT_BRANCH_IND_CALL;
+        }
+        else if (reg == 4) {
+            *kind = PT_BRANCH_IND_JUMP;
+        }
+        else if (reg == 3 || reg == 5) {
+            *kind = PT_BRANCH_FAR;
+        }
+    }
+
+    return (int)i;
+}
+
+//
+// Flow reconstruction functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_code
+// Description  : Find the code bytes of an address in the decoder sections
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+//                unsigned long long ip : the code address
+//                unsigned int *avail : bytes available, at most 15
+// Outputs      : const unsigned char * : the code bytes, NULL if not found
+
+static const unsigned char *read_code(struct pt_decoder *decoder,
+                                        unsigned long long ip,
+                                        unsigned int *avail) {
+    struct pt_image_section *section;
+    unsigned long long offset;
+    unsigned int i;
+
+    if (decoder->section_count == 0) {
+        return NULL;
+    }
+
+    // Code runs mostly in the same section
+    section = &decoder->sections[decoder->last_section];
+    if (ip - section->vaddr >= section->size) {
+        for (i = 0; i < decoder->section_count; i++) {
+            section = &decoder->sections[i];
+            if (ip - section->vaddr < section->size) {
+                decoder->last_section = i;
+                break;
+            }
+        }
+        if (i == decoder->section_count) {
+            return NULL;
+        }
+    }
+
+    offset = ip - section->vaddr;
+    *avail = section->size - offset > INSN_MAX_LEN ?
+                INSN_MAX_LEN : (unsigned int)(section->size - offset);
+    return section->data + offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_block
+// Description  : Get the basic block starting at an address, decoding it on
+//                a cache miss
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+//                unsigned long long ip : the block address
+// Outputs      : struct pt_block * : the basic block
+
+static struct pt_block *get_block(struct pt_decoder *decoder,
+                                    unsigned long long ip) {
+    struct pt_block *block;
+    const unsigned char *code;
+    unsigned long long target, last;
+    unsigned int avail, kind, n;
+    int len;
+
+    block = &decoder->cache[(ip ^ (ip >> 12)) & (PT_BLOCK_CACHE_SIZE - 1)];
+    if (block->valid && block->start == ip) {
+        return block;
+    }
+
+    block->start = ip;
+    block->target = 0;
+    block->valid = 1;
+    last = ip;
+    for (n = 0; n < PT_BLOCK_MAX_INSNS; n++) {
+        code = read_code(decoder, ip, &avail);
+        len = code ? pt_insn_decode(code, avail, ip, &kind, &target) : 0;
+        if (len == 0) {
+            block->branch_ip = ip;
+            block->next_ip = ip;
+            block->kind = PT_BRANCH_UNKNOWN;
+            return block;
+        }
+
+        if (kind != PT_BRANCH_NONE) {
+            block->branch_ip = ip;
+            block->next_ip = ip + len;
+            block->target = target;
+            block->kind = kind;
+            return block;
+        }
+
+        last = ip;
+        ip += len;
+    }
+
+    // Long straight code is split, the walk continues at the next block
+    block->branch_ip = last;
+    block->next_ip = ip;
+    block->kind = PT_BRANCH_NONE;
+    return block;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : desync
+// Description  : Drop the flow after a mismatch between the code and the
+//                packets, the decoder waits for the next known address
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+// Outputs      : void
+
+static void desync(struct pt_decoder *decoder) {
+    decoder->ip_valid = 0;
+    decoder->tnt_count = 0;
+    decoder->ret_count = 0;
+    decoder->stats.desyncs++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fetch_flow
+// Description  : Decode packets up to the next one affecting the flow. TNT
+//                bits go to the TNT queue, IP packets to the pending packet
+//                with their IP resolved. Status FUPs of PSB+ headers and
+//                overflows set the current address instead.
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+// Outputs      : unsigned int : the flow packet type, PT_PACKET_END if none
+
+static unsigned int fetch_flow(struct pt_decoder *decoder) {
+    struct pt_packet packet;
+    unsigned long long ip;
+    int size;
+
+    while (decoder->pos < decoder->size) {
+        size = pt_packet_decode(decoder->buffer + decoder->pos,
+                                decoder->size - decoder->pos, &packet);
+        if (size == 0) {
+            decoder->pos = decoder->size;
+            break;
+        }
+        if (size < 0) {
+            desync(decoder);
+            decoder->pos = pt_sync_forward(decoder->buffer, decoder->size,
+                                            decoder->pos + 1);
+            continue;
+        }
+        decoder->pos += size;
+        decoder->stats.packets++;
+
+        switch (packet.type) {
+        case PT_PACKET_TNT:
+            if (packet.count == 0) {
+                break;
+            }
+            decoder->tnt_bits = packet.payload;
+            decoder->tnt_count = packet.count;
+            return PT_PACKET_TNT;
+
+        case PT_PACKET_TIP:
+        case PT_PACKET_TIP_PGE:
+        case PT_PACKET_TIP_PGD:
+        case PT_PACKET_FUP:
+            // Resolve the IP against the last one
+            if (packet.count) {
+                switch (packet.count) {
+                case 1:
+                    ip = (decoder->last_ip & ~0xffffULL) | packet.payload;
+                    break;
+                case 2:
+                    ip = (decoder->last_ip & ~0xffffffffULL) | packet.payload;
+                    break;
+                case 3:
+                    ip = packet.payload & (1ULL << 47) ?
+                            packet.payload | 0xffff000000000000ULL :
+                            packet.payload;
+                    break;
+                case 4:
+                    ip = (decoder->last_ip & ~0xffffffffffffULL) |
+                            packet.payload;
+                    break;
+                default:
+                    ip = packet.payload;
+                    break;
+                }
+                decoder->last_ip = ip;
+                packet.payload = ip;
+            }
+
+            if (packet.type == PT_PACKET_FUP) {
+                if (decoder->in_psb || decoder->overflow) {
+                    if (packet.count && !decoder->ip_valid &&
+                        decoder->exec_mode) {
+                        decoder->ip = packet.payload;
+                        decoder->ip_valid = 1;
+                    }
+                    decoder->overflow = 0;
+                    break;
+                }
+                if (packet.count == 0) {
+                    break;
+                }
+            }
+            if (packet.type == PT_PACKET_TIP_PGE) {
+                decoder->overflow = 0;
+            }
+
+            decoder->pending = packet;
+            decoder->has_pending = 1;
+            return packet.type;
+
+        case PT_PACKET_PSB:
+            decoder->in_psb = 1;
+            decoder->last_ip = 0;
+            break;
+
+        case PT_PACKET_PSBEND:
+            decoder->in_psb = 0;
+            break;
+
+        case PT_PACKET_OVF:
+            // Packets were lost, the flow resumes at the next FUP or TIP.PGE
+            decoder->ip_valid = 0;
+            decoder->tnt_count = 0;
+            decoder->ret_count = 0;
+            decoder->has_pending = 0;
+            decoder->overflow = 1;
+            decoder->stats.overflows++;
+            break;
+
+        case PT_PACKET_MODE:
+            // MODE.Exec, only 64-bit code is walked
+            if (!(packet.payload & 0xe0)) {
+                decoder->exec_mode = packet.payload & 0x01;
+                if (!decoder->exec_mode) {
+                    decoder->ip_valid = 0;
+                }
+            }
+            break;
+
+        case PT_PACKET_TSC:
+            decoder->tsc = packet.payload;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return PT_PACKET_END;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : push_ret
+// Description  : Push a return address to the decoder return stack, the
+//                oldest entry is overwritten when it is full
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+//                unsigned long long addr : the return address
+// Outputs      : void
+
+static void push_ret(struct pt_decoder *decoder, unsigned long long addr) {
+    decoder->ret_stack[decoder->ret_top] = addr;
+    decoder->ret_top = (decoder->ret_top + 1) % PT_RET_STACK_SIZE;
+    if (decoder->ret_count < PT_RET_STACK_SIZE) {
+        decoder->ret_count++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pop_ret
+// Description  : Pop a return address from the decoder return stack, caller
+//                should check it is not empty
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+// Outputs      : unsigned long long : the return address
+
+static unsigned long long pop_ret(struct pt_decoder *decoder) {
+    decoder->ret_top = (decoder->ret_top + PT_RET_STACK_SIZE - 1) %
+                        PT_RET_STACK_SIZE;
+    decoder->ret_count--;
+    return decoder->ret_stack[decoder->ret_top];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : take_tnt
+// Description  : Take the oldest pending TNT bit, caller should check one is
+//                pending
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+// Outputs      : unsigned int : 1 if taken, 0 if not taken
+
+static unsigned int take_tnt(struct pt_decoder *decoder) {
+    decoder->tnt_count--;
+    return (decoder->tnt_bits >> decoder->tnt_count) & 0x01;
+}
+
+//
+// Decoder management functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_decoder_alloc
+// Description  : Allocate a PT decoder without code sections
+//
+// Inputs       : void
+// Outputs      : struct pt_decoder * : the PT decoder, NULL on failure
+
+struct pt_decoder *pt_decoder_alloc(void) {
+    struct pt_decoder *decoder;
+
+    decoder = malloc(sizeof(struct pt_decoder));
+    if (decoder == NULL) {
+        return NULL;
+    }
+    memset(decoder, 0, sizeof(struct pt_decoder));
+    decoder->exec_mode = 1;
+
+    return decoder;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_decoder_free
+// Description  : Free a PT decoder, the code sections stay owned by the
+//                caller
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+// Outputs      : void
+
+void pt_decoder_free(struct pt_decoder *decoder) {
+    free(decoder);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_decoder_add_section
+// Description  : Add a code section of the traced program. The code must be
+//                the one that ran during the trace, and stay valid while the
+//                decoder uses it. Tracing the calling process, the section
+//                may be its own mapped code.
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+//                unsigned long long vaddr : the code address when traced
+//                const void *data : the code bytes
+//                unsigned long long size : the code size
+// Outputs      : int : 0 on success, -1 if the section table is full
+
+int pt_decoder_add_section(struct pt_decoder *decoder, unsigned long long vaddr,
+                            const void *data, unsigned long long size) {
+    struct pt_image_section *section;
+
+    if (decoder->section_count >= PT_DECODER_MAX_SECTIONS) {
+        return -1;
+    }
+
+    section = &decoder->sections[decoder->section_count++];
+    section->vaddr = vaddr;
+    section->data = data;
+    section->size = size;
+
+    // Cached blocks may have ended on missing code
+    memset(decoder->cache, 0, sizeof(decoder->cache));
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_decoder_reset
+// Description  : Start decoding a packet stream. Decoding starts at the first
+//                PSB packet, the bytes before it cannot be decoded.
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+//                const unsigned char *buffer : the packet stream
+//                unsigned long long size : the packet stream size
+// Outputs      : void
+
+void pt_decoder_reset(struct pt_decoder *decoder, const unsigned char *buffer,
+                        unsigned long long size) {
+    decoder->buffer = buffer;
+    decoder->size = size;
+    decoder->pos = pt_sync_forward(buffer, size, 0);
+    decoder->ip = 0;
+    decoder->last_ip = 0;
+    decoder->tsc = 0;
+    decoder->ip_valid = 0;
+    decoder->in_psb = 0;
+    decoder->overflow = 0;
+    decoder->exec_mode = 1;
+    decoder->tnt_bits = 0;
+    decoder->tnt_count = 0;
+    decoder->has_pending = 0;
+    decoder->ret_top = 0;
+    decoder->ret_count = 0;
+    memset(&decoder->stats, 0, sizeof(decoder->stats));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_decode
+// Description  : Walk the code along the packet stream and emit its taken
+//                branches, oldest first, in the BTS record format with the
+//                branch kind in misc. Decoding stops when the records buffer
+//                is full and resumes on the next call. Transitions to code
+//                out of the trace (kernel, filtered ranges) are not emitted.
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+//                struct bts_record *records : the records buffer
+//                unsigned long long record_count : the records buffer size
+// Outputs      : long long : number of records, 0 at the end of the stream
+
+long long pt_decode(struct pt_decoder *decoder, struct bts_record *records,
+                    unsigned long long record_count) {
+    struct pt_block *block;
+    unsigned long long n = 0, from, to;
+    unsigned int flow, kind;
+
+    while (n < record_count) {
+        if (!decoder->ip_valid) {
+            // Wait for a flow packet with a known address
+            flow = decoder->has_pending ?
+                    decoder->pending.type : fetch_flow(decoder);
+            if (flow == PT_PACKET_END) {
+                break;
+            }
+            // A PSB+ or overflow FUP set the address, the flow packet
+            // applies from there
+            if (decoder->ip_valid && flow != PT_PACKET_TIP_PGE) {
+                continue;
+            }
+            decoder->has_pending = 0;
+            decoder->tnt_count = 0;
+            if ((flow == PT_PACKET_TIP || flow == PT_PACKET_TIP_PGE) &&
+                decoder->pending.count && decoder->exec_mode) {
+                decoder->ip = decoder->pending.payload;
+                decoder->ip_valid = 1;
+            }
+            continue;
+        }
+
+        block = get_block(decoder, decoder->ip);
+
+        // An event may hit anywhere in the block, look ahead once the TNT
+        // bits are used up
+        if (!decoder->tnt_count && !decoder->has_pending) {
+            if (fetch_flow(decoder) == PT_PACKET_END) {
+                break;
+            }
+            if (!decoder->ip_valid) {
+                continue;
+            }
+        }
+
+        // Asynchronous event in the block, followed by its target
+        if (decoder->has_pending && decoder->pending.type == PT_PACKET_FUP &&
+            decoder->pending.payload >= block->start &&
+            decoder->pending.payload <= block->branch_ip) {
+            from = decoder->pending.payload;
+            decoder->has_pending = 0;
+            decoder->ip = from;
+
+            flow = fetch_flow(decoder);
+            if (flow == PT_PACKET_TIP) {
+                decoder->has_pending = 0;
+                if (decoder->pending.count) {
+                    decoder->ip = decoder->pending.payload;
+                    records[n].from = from;
+                    records[n].to = decoder->ip;
+                    records[n].misc = PT_BRANCH_ASYNC;
+                    n++;
+                }
+                else {
+                    decoder->ip_valid = 0;
+                }
+            }
+            else if (flow == PT_PACKET_TIP_PGD) {
+                decoder->has_pending = 0;
+                decoder->ip_valid = 0;
+            }
+            else if (flow == PT_PACKET_END) {
+                break;
+            }
+            // Other packets follow a standalone FUP, the walk goes on
+            continue;
+        }
+
+        kind = block->kind;
+        switch (kind) {
+        case PT_BRANCH_NONE:
+            decoder->ip = block->next_ip;
+            continue;
+
+        case PT_BRANCH_COND:
+            if (!decoder->tnt_count) {
+                // Leaving a filtered range, or lost
+                if (decoder->has_pending &&
+                    decoder->pending.type == PT_PACKET_TIP_PGD) {
+                    decoder->has_pending = 0;
+                    decoder->ip_valid = 0;
+                }
+                else {
+                    desync(decoder);
+                }
+                continue;
+            }
+            if (!take_tnt(decoder)) {
+                decoder->ip = block->next_ip;
+                continue;
+            }
+            to = block->target;
+            break;
+
+        case PT_BRANCH_JUMP:
+        case PT_BRANCH_CALL:
+            if (decoder->has_pending &&
+                decoder->pending.type == PT_PACKET_TIP_PGD &&
+                decoder->pending.payload == block->target) {
+                decoder->has_pending = 0;
+                decoder->ip_valid = 0;
+                continue;
+            }
+            if (kind == PT_BRANCH_CALL) {
+                push_ret(decoder, block->next_ip);
+            }
+            to = block->target;
+            break;
+
+        case PT_BRANCH_RET:
+            // Compressed return, a taken TNT bit
+            if (decoder->tnt_count) {
+                if (!take_tnt(decoder) || decoder->ret_count == 0) {
+                    desync(decoder);
+                    continue;
+                }
+                to = pop_ret(decoder);
+                break;
+            }
+            // fall through
+
+        case PT_BRANCH_IND_JUMP:
+        case PT_BRANCH_IND_CALL:
+        case PT_BRANCH_FAR:
+            if (decoder->tnt_count || !decoder->has_pending) {
+                desync(decoder);
+                continue;
+            }
+            if (decoder->pending.type == PT_PACKET_TIP_PGD) {
+                decoder->has_pending = 0;
+                decoder->ip_valid = 0;
+                continue;
+            }
+            if (decoder->pending.type != PT_PACKET_TIP) {
+                desync(decoder);
+                continue;
+            }
+
+            decoder->has_pending = 0;
+            if (!decoder->pending.count) {
+                decoder->ip_valid = 0;
+                continue;
+            }
+            if (kind == PT_BRANCH_RET && decoder->ret_count) {
+                pop_ret(decoder);
+            }
+            else if (kind == PT_BRANCH_IND_CALL) {
+                push_ret(decoder, block->next_ip);
+            }
+            to = decoder->pending.payload;
+            break;
+
+        default:
+            desync(decoder);
+            continue;
+        }
+
+        records[n].from = block->branch_ip;
+        records[n].to = to;
+        records[n].misc = kind;
+        n++;
+        decoder->ip = to;
+    }
+
+    decoder->stats.records += n;
+    return (long long)n;
+}
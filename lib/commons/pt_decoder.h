@@ -0,0 +1,190 @@
+#ifndef LIBIHT_PT_DECODER_H
+#define LIBIHT_PT_DECODER_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/pt_decoder.h
+//  Description    : This is the header file for the Intel PT packet decoder.
+//                   The decoder walks the code of the traced program along
+//                   a recorded 64-bit packet stream and emits the taken
+//                   branches in the same from/to record format as BTS.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+//
+// Library constants
+
+// Maximum number of code sections of a decoder
+#define PT_DECODER_MAX_SECTIONS     64
+
+// Number of cached basic blocks (power of 2)
+#define PT_BLOCK_CACHE_SIZE         0x1000
+
+// Maximum number of instructions of a cached basic block
+#define PT_BLOCK_MAX_INSNS          0x100
+
+// Depth of the return stack, same as the cpu return compression
+#define PT_RET_STACK_SIZE           64
+
+// Packet types
+enum PT_PACKET_TYPE {
+    PT_PACKET_PAD,
+    PT_PACKET_TNT,
+    PT_PACKET_TIP,
+    PT_PACKET_TIP_PGE,
+    PT_PACKET_TIP_PGD,
+    PT_PACKET_FUP,
+    PT_PACKET_MODE,
+    PT_PACKET_TSC,
+    PT_PACKET_MTC,
+    PT_PACKET_CYC,
+    PT_PACKET_PSB,
+    PT_PACKET_PSBEND,
+    PT_PACKET_CBR,
+    PT_PACKET_PIP,
+    PT_PACKET_TMA,
+    PT_PACKET_VMCS,
+    PT_PACKET_OVF,
+    PT_PACKET_TRACESTOP,
+    PT_PACKET_MNT,
+    PT_PACKET_PTW,
+    PT_PACKET_EXSTOP,
+    PT_PACKET_MWAIT,
+    PT_PACKET_PWRE,
+    PT_PACKET_PWRX,
+    PT_PACKET_END,              // End of the packet stream
+};
+
+// Branch kinds, stored in the misc field of the decoded records
+enum PT_BRANCH_KIND {
+    PT_BRANCH_NONE,             // Not a branch
+    PT_BRANCH_COND,             // Conditional branch
+    PT_BRANCH_JUMP,             // Direct jump
+    PT_BRANCH_CALL,             // Direct call
+    PT_BRANCH_RET,              // Near return
+    PT_BRANCH_IND_JUMP,         // Indirect jump
+    PT_BRANCH_IND_CALL,         // Indirect call
+    PT_BRANCH_FAR,              // Far transfer (syscall, interrupt, iret...)
+    PT_BRANCH_ASYNC,            // Asynchronous event (interrupt, exception)
+    PT_BRANCH_UNKNOWN,          // Code not in the image or not decodable
+};
+
+//
+// Type definitions
+
+// Define BTS record, same layout as the kernel one
+#ifndef LIBIHT_BTS_RECORD
+#define LIBIHT_BTS_RECORD
+struct bts_record {
+    unsigned long long from;
+    unsigned long long to;
+    unsigned long long misc;
+};
+#endif // LIBIHT_BTS_RECORD
+
+// Define decoded packet
+struct pt_packet {
+    unsigned int type;          // Packet type (enum PT_PACKET_TYPE)
+    unsigned int size;          // Packet size in bytes
+    unsigned long long payload; // Raw payload (TNT bits, compressed IP...)
+    unsigned int count;         // TNT bit count, or IP compression of an IP
+                                // packet (0 if the IP is suppressed)
+};
+
+// Define code section of the traced program
+struct pt_image_section {
+    unsigned long long vaddr;   // Address of the code in the traced program
+    const unsigned char *data;  // Copy of the code
+    unsigned long long size;    // Size of the code
+};
+
+// Define cached basic block, ending at its first branch
+struct pt_block {
+    unsigned long long start;   // Address of the first instruction
+    unsigned long long branch_ip; // Address of the branch instruction
+    unsigned long long next_ip; // Address after the branch instruction
+    unsigned long long target;  // Target of a direct branch
+    unsigned int kind;          // Branch kind (enum PT_BRANCH_KIND)
+    unsigned int valid;         // Whether the entry holds a block
+};
+
+// Define decoder statistics
+struct pt_decoder_stats {
+    unsigned long long packets; // Packets decoded
+    unsigned long long records; // Branch records emitted
+    unsigned long long desyncs; // Times the decoder lost the flow
+    unsigned long long overflows; // Internal buffer overflows of the cpu
+};
+
+// Define PT decoder
+struct pt_decoder {
+    struct pt_image_section sections[PT_DECODER_MAX_SECTIONS];
+    unsigned int section_count;
+    unsigned int last_section;  // Section of the last code read
+    const unsigned char *buffer; // Packet stream
+    unsigned long long size;    // Packet stream size
+    unsigned long long pos;     // Offset of the next packet
+    unsigned long long ip;      // Current instruction address
+    unsigned long long last_ip; // Last IP for IP compression
+    unsigned long long tsc;     // Last TSC packet value
+    unsigned int ip_valid;      // Whether the current address is known
+    unsigned int in_psb;        // Inside a PSB+ header
+    unsigned int overflow;      // Waiting for the FUP after an overflow
+    unsigned int exec_mode;     // Whether the code runs in 64-bit mode
+    unsigned long long tnt_bits; // Pending TNT bits, oldest first
+    unsigned int tnt_count;     // Number of pending TNT bits
+    unsigned int has_pending;   // Whether pending holds a flow packet
+    struct pt_packet pending;   // Next flow packet, IP resolved in payload
+    unsigned long long ret_stack[PT_RET_STACK_SIZE];
+    unsigned int ret_top;       // Next free return stack slot
+    unsigned int ret_count;     // Valid return stack entries
+    struct pt_decoder_stats stats;
+    struct pt_block cache[PT_BLOCK_CACHE_SIZE];
+};
+
+//
+// Function prototypes
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+int pt_packet_decode(const unsigned char *buffer, unsigned long long size,
+                        struct pt_packet *packet);
+// Decode the packet at the start of a buffer, returns its size
+
+unsigned long long pt_sync_forward(const unsigned char *buffer,
+                                    unsigned long long size,
+                                    unsigned long long offset);
+// Find the first PSB packet from an offset, returns size if none
+
+int pt_insn_decode(const unsigned char *code, unsigned int size,
+                    unsigned long long ip, unsigned int *kind,
+                    unsigned long long *target);
+// Decode the length and branch kind of an x86-64 instruction
+
+struct pt_decoder *pt_decoder_alloc(void);
+// Allocate a PT decoder without code sections
+
+void pt_decoder_free(struct pt_decoder *decoder);
+// Free a PT decoder
+
+int pt_decoder_add_section(struct pt_decoder *decoder, unsigned long long vaddr,
+                            const void *data, unsigned long long size);
+// Add a code section of the traced program to a PT decoder
+
+void pt_decoder_reset(struct pt_decoder *decoder, const unsigned char *buffer,
+                        unsigned long long size);
+// Start decoding a packet stream from its first PSB packet
+
+long long pt_decode(struct pt_decoder *decoder, struct bts_record *records,
+                    unsigned long long record_count);
+// Decode the next taken branches of the packet stream, returns their number
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // LIBIHT_PT_DECODER_H
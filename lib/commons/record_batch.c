@@ -0,0 +1,496 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/record_batch.c
+//  Description    : This is the implementation of the columnar record
+//                   batches. BTS records are transposed four at a time with
+//                   AVX2 when the cpu has it: three loads of 12 qwords, then
+//                   blends and lane permutes per column. The range filter
+//                   also checks four records at a time with AVX2, and
+//                   compacts the kept ones with a permute table.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#include "record_batch.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define RECORD_BATCH_AVX2
+#endif
+
+//
+// Library constants
+
+// Most ranges checked by the AVX2 filter, more use the scalar filter
+#define FILTER_AVX2_MAX_RANGES  64
+
+// Sign bit, to compare unsigned qwords with signed compares
+#define SIGN_BIT    0x8000000000000000ULL
+
+// Edge class by source in range, target in range and same range bits
+static const unsigned char edge_classes[8] = {
+    RECORD_EDGE_NONE, RECORD_EDGE_OUT, RECORD_EDGE_IN, RECORD_EDGE_INTER,
+    RECORD_EDGE_NONE, RECORD_EDGE_OUT, RECORD_EDGE_IN, RECORD_EDGE_INTRA,
+};
+
+#ifdef RECORD_BATCH_AVX2
+// Dword indexes moving the qword lanes of a mask to the front of a vector
+static const int compact_lanes[16][8] = {
+    { 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 1, 0, 0, 0, 0, 0, 0 },
+    { 2, 3, 0, 0, 0, 0, 0, 0 },
+    { 0, 1, 2, 3, 0, 0, 0, 0 },
+    { 4, 5, 0, 0, 0, 0, 0, 0 },
+    { 0, 1, 4, 5, 0, 0, 0, 0 },
+    { 2, 3, 4, 5, 0, 0, 0, 0 },
+    { 0, 1, 2, 3, 4, 5, 0, 0 },
+    { 6, 7, 0, 0, 0, 0, 0, 0 },
+    { 0, 1, 6, 7, 0, 0, 0, 0 },
+    { 2, 3, 6, 7, 0, 0, 0, 0 },
+    { 0, 1, 2, 3, 6, 7, 0, 0 },
+    { 4, 5, 6, 7, 0, 0, 0, 0 },
+    { 0, 1, 4, 5, 6, 7, 0, 0 },
+    { 2, 3, 4, 5, 6, 7, 0, 0 },
+    { 0, 1, 2, 3, 4, 5, 6, 7 },
+};
+
+// Dword indexes moving the dword lanes of a mask to the front of a vector
+static const int compact_dwords[16][4] = {
+    { 0, 0, 0, 0 }, { 0, 0, 0, 0 }, { 1, 0, 0, 0 }, { 0, 1, 0, 0 },
+    { 2, 0, 0, 0 }, { 0, 2, 0, 0 }, { 1, 2, 0, 0 }, { 0, 1, 2, 0 },
+    { 3, 0, 0, 0 }, { 0, 3, 0, 0 }, { 1, 3, 0, 0 }, { 0, 1, 3, 0 },
+    { 2, 3, 0, 0 }, { 0, 2, 3, 0 }, { 1, 2, 3, 0 }, { 0, 1, 2, 3 },
+};
+#endif // RECORD_BATCH_AVX2
+
+//
+// Transposition functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transpose_bts_scalar
+// Description  : Transpose BTS records into the from, to and flags columns
+//
+// Inputs       : const struct bts_record *records : the records
+//                unsigned long long count : number of records
+//                unsigned long long *from : the from column
+//                unsigned long long *to : the to column
+//                unsigned long long *flags : the flags column
+// Outputs      : None
+
+static void transpose_bts_scalar(const struct bts_record *restrict records,
+                                    unsigned long long count,
+                                    unsigned long long *restrict from,
+                                    unsigned long long *restrict to,
+                                    unsigned long long *restrict flags) {
+    unsigned long long i;
+
+    for (i = 0; i < count; i++) {
+        from[i] = records[i].from;
+        to[i] = records[i].to;
+        flags[i] = records[i].misc;
+    }
+}
+
+#ifdef RECORD_BATCH_AVX2
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transpose_bts_avx2
+// Description  : Transpose BTS records into the from, to and flags columns,
+//                four records per iteration
+//
+// Inputs       : const struct bts_record *records : the records
+//                unsigned long long count : number of records
+//                unsigned long long *from : the from column
+//                unsigned long long *to : the to column
+//                unsigned long long *flags : the flags column
+// Outputs      : None
+
+__attribute__((target("avx2")))
+static void transpose_bts_avx2(const struct bts_record *restrict records,
+                                unsigned long long count,
+                                unsigned long long *restrict from,
+                                unsigned long long *restrict to,
+                                unsigned long long *restrict flags) {
+    const __m256i *src = (const __m256i *)records;
+    __m256i r0, r1, r2, v;
+    unsigned long long i;
+
+    for (i = 0; i + 4 <= count; i += 4, src += 3) {
+        // r0 = f0 t0 m0 f1, r1 = t1 m1 f2 t2, r2 = m2 f3 t3 m3
+        r0 = _mm256_loadu_si256(src);
+        r1 = _mm256_loadu_si256(src + 1);
+        r2 = _mm256_loadu_si256(src + 2);
+
+        // f0 f3 f2 f1
+        v = _mm256_blend_epi32(_mm256_blend_epi32(r0, r1, 0x30), r2, 0x0c);
+        _mm256_storeu_si256((__m256i *)(from + i), _mm256_permute4x64_epi64(v, 0x6c));
+
+        // t1 t0 t3 t2
+        v = _mm256_blend_epi32(_mm256_blend_epi32(r0, r1, 0xc3), r2, 0x30);
+        _mm256_storeu_si256((__m256i *)(to + i), _mm256_permute4x64_epi64(v, 0xb1));
+
+        // m2 m1 m0 m3
+        v = _mm256_blend_epi32(_mm256_blend_epi32(r0, r1, 0x0c), r2, 0xc3);
+        _mm256_storeu_si256((__m256i *)(flags + i), _mm256_permute4x64_epi64(v, 0xc6));
+    }
+
+    transpose_bts_scalar(records + i, count - i, from + i, to + i, flags + i);
+}
+#endif // RECORD_BATCH_AVX2
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fill_tid
+// Description  : Fill the tid column of appended records
+//
+// Inputs       : unsigned int *tid : the tid column
+//                unsigned long long count : number of records
+//                unsigned int value : the thread ID
+// Outputs      : None
+
+static void fill_tid(unsigned int *restrict tid, unsigned long long count,
+                        unsigned int value) {
+    unsigned long long i;
+
+    for (i = 0; i < count; i++) {
+        tid[i] = value;
+    }
+}
+
+//
+// Batch functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : record_batch_alloc
+// Description  : Allocate a record batch. The capacity is rounded up so that
+//                every column is a whole number of 64-byte lines.
+//
+// Inputs       : unsigned long long capacity : records of each column
+// Outputs      : struct record_batch* : the batch, NULL on failure
+
+struct record_batch *record_batch_alloc(unsigned long long capacity) {
+    struct record_batch *batch;
+
+    batch = calloc(1, sizeof(struct record_batch));
+    if (batch == NULL) {
+        return NULL;
+    }
+
+    capacity = (capacity + 15) & ~15ULL;
+    batch->capacity = capacity;
+    batch->from = aligned_alloc(RECORD_BATCH_ALIGN, capacity * sizeof(*batch->from));
+    batch->to = aligned_alloc(RECORD_BATCH_ALIGN, capacity * sizeof(*batch->to));
+    batch->flags = aligned_alloc(RECORD_BATCH_ALIGN, capacity * sizeof(*batch->flags));
+    batch->tid = aligned_alloc(RECORD_BATCH_ALIGN, capacity * sizeof(*batch->tid));
+    if (capacity && (!batch->from || !batch->to || !batch->flags || !batch->tid)) {
+        record_batch_free(batch);
+        return NULL;
+    }
+
+    return batch;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : record_batch_free
+// Description  : Free a record batch and its columns
+//
+// Inputs       : struct record_batch *batch : the batch
+// Outputs      : None
+
+void record_batch_free(struct record_batch *batch) {
+    if (batch == NULL) {
+        return;
+    }
+
+    free(batch->from);
+    free(batch->to);
+    free(batch->flags);
+    free(batch->tid);
+    free(batch);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : record_batch_clear
+// Description  : Drop all records of a record batch
+//
+// Inputs       : struct record_batch *batch : the batch
+// Outputs      : None
+
+void record_batch_clear(struct record_batch *batch) {
+    batch->count = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : record_batch_append_bts
+// Description  : Transpose BTS records at the end of a record batch, as many
+//                as it has room for
+//
+// Inputs       : struct record_batch *batch : the batch
+//                const struct bts_record *records : the records
+//                unsigned long long count : number of records
+//                unsigned int tid : the thread ID of the records
+// Outputs      : unsigned long long : the number of records appended
+
+unsigned long long record_batch_append_bts(struct record_batch *batch,
+                                            const struct bts_record *records,
+                                            unsigned long long count,
+                                            unsigned int tid) {
+    unsigned long long base = batch->count;
+
+    if (count > batch->capacity - base) {
+        count = batch->capacity - base;
+    }
+
+#ifdef RECORD_BATCH_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        transpose_bts_avx2(records, count, batch->from + base, batch->to + base,
+                            batch->flags + base);
+    }
+    else
+#endif
+    {
+        transpose_bts_scalar(records, count, batch->from + base, batch->to + base,
+                                batch->flags + base);
+    }
+    fill_tid(batch->tid + base, count, tid);
+
+    batch->count += count;
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : record_batch_append_lbr
+// Description  : Transpose LBR stack entries at the end of a record batch,
+//                as many as it has room for
+//
+// Inputs       : struct record_batch *batch : the batch
+//                const struct lbr_stack_entry *entries : entries from the
+//                                                        oldest
+//                unsigned long long count : number of entries
+//                unsigned int tid : the thread ID of the entries
+// Outputs      : unsigned long long : the number of entries appended
+
+unsigned long long record_batch_append_lbr(struct record_batch *batch,
+                                            const struct lbr_stack_entry *entries,
+                                            unsigned long long count,
+                                            unsigned int tid) {
+    unsigned long long base = batch->count, i;
+    unsigned long long *restrict from = batch->from + base;
+    unsigned long long *restrict to = batch->to + base;
+
+    if (count > batch->capacity - base) {
+        count = batch->capacity - base;
+    }
+
+    for (i = 0; i < count; i++) {
+        from[i] = entries[i].from;
+        to[i] = entries[i].to;
+    }
+    memset(batch->flags + base, 0, count * sizeof(*batch->flags));
+    fill_tid(batch->tid + base, count, tid);
+
+    batch->count += count;
+    return count;
+}
+
+//
+// Filter functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_range
+// Description  : Find the first range holding an address
+//
+// Inputs       : unsigned long long addr : the address
+//                const struct record_range *ranges : the ranges
+//                unsigned int range_count : number of ranges
+// Outputs      : int : the range index, -1 if none holds it
+
+static int find_range(unsigned long long addr, const struct record_range *ranges,
+                        unsigned int range_count) {
+    unsigned int r;
+
+    for (r = 0; r < range_count; r++) {
+        if (addr - ranges[r].start < ranges[r].end - ranges[r].start) {
+            return (int)r;
+        }
+    }
+
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : filter_scalar
+// Description  : Append the records of a batch in address ranges to another,
+//                from a record index
+//
+// Inputs       : const struct record_batch *in : the input batch
+//                unsigned long long i : the first record to check
+//                const struct record_range *ranges : the ranges
+//                unsigned int range_count : number of ranges
+//                unsigned int mode : the filter mode
+//                struct record_batch *out : the output batch
+//                unsigned char *edges : the edge classes of out, or NULL
+// Outputs      : None
+
+static void filter_scalar(const struct record_batch *in, unsigned long long i,
+                            const struct record_range *ranges,
+                            unsigned int range_count, unsigned int mode,
+                            struct record_batch *out, unsigned char *edges) {
+    unsigned long long o = out->count;
+    int f, t;
+
+    for (; i < in->count && o < out->capacity; i++) {
+        f = find_range(in->from[i], ranges, range_count);
+        t = find_range(in->to[i], ranges, range_count);
+        if (!(((mode & RECORD_FILTER_FROM) && f >= 0) ||
+                ((mode & RECORD_FILTER_TO) && t >= 0))) {
+            continue;
+        }
+
+        out->from[o] = in->from[i];
+        out->to[o] = in->to[i];
+        out->flags[o] = in->flags[i];
+        out->tid[o] = in->tid[i];
+        if (edges) {
+            edges[o] = edge_classes[(f >= 0) | (t >= 0) << 1 | (f == t) << 2];
+        }
+        o++;
+    }
+
+    out->count = o;
+}
+
+#ifdef RECORD_BATCH_AVX2
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : filter_avx2
+// Description  : Append the records of a batch in address ranges to another,
+//                four records per iteration, the tail with the scalar filter
+//
+// Inputs       : const struct record_batch *in : the input batch
+//                const struct record_range *ranges : the ranges
+//                unsigned int range_count : number of ranges
+//                unsigned int mode : the filter mode
+//                struct record_batch *out : the output batch
+//                unsigned char *edges : the edge classes of out, or NULL
+// Outputs      : None
+
+__attribute__((target("avx2,popcnt")))
+static void filter_avx2(const struct record_batch *in,
+                        const struct record_range *ranges,
+                        unsigned int range_count, unsigned int mode,
+                        struct record_batch *out, unsigned char *edges) {
+    __m256i starts[FILTER_AVX2_MAX_RANGES], lens[FILTER_AVX2_MAX_RANGES];
+    __m256i sign = _mm256_set1_epi64x((long long)SIGN_BIT);
+    __m256i none = _mm256_set1_epi64x(-1);
+    __m256i from, to, fidx, tidx, index, in_range, perm;
+    __m128 tid;
+    unsigned long long i, o = out->count;
+    unsigned int r, lane, fin, tin, same, keep, k;
+
+    // Check a - start < end - start unsigned, as a signed compare
+    for (r = 0; r < range_count; r++) {
+        starts[r] = _mm256_set1_epi64x((long long)ranges[r].start);
+        lens[r] = _mm256_set1_epi64x((long long)((ranges[r].end - ranges[r].start) ^ SIGN_BIT));
+    }
+
+    for (i = 0; i + 4 <= in->count && o + 4 <= out->capacity; i += 4) {
+        from = _mm256_load_si256((const __m256i *)(in->from + i));
+        to = _mm256_load_si256((const __m256i *)(in->to + i));
+
+        // Backwards, so that the first range holding an address wins
+        fidx = none;
+        tidx = none;
+        for (r = range_count; r-- > 0;) {
+            index = _mm256_set1_epi64x(r);
+            in_range = _mm256_cmpgt_epi64(lens[r],
+                            _mm256_xor_si256(_mm256_sub_epi64(from, starts[r]), sign));
+            fidx = _mm256_blendv_epi8(fidx, index, in_range);
+            in_range = _mm256_cmpgt_epi64(lens[r],
+                            _mm256_xor_si256(_mm256_sub_epi64(to, starts[r]), sign));
+            tidx = _mm256_blendv_epi8(tidx, index, in_range);
+        }
+
+        fin = ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(fidx, none))) & 0xf;
+        tin = ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(tidx, none))) & 0xf;
+        keep = ((mode & RECORD_FILTER_FROM) ? fin : 0) | ((mode & RECORD_FILTER_TO) ? tin : 0);
+        if (!keep) {
+            continue;
+        }
+
+        // Move the kept lanes to the front, the stores past them are
+        // overwritten by the next ones
+        perm = _mm256_loadu_si256((const __m256i *)compact_lanes[keep]);
+        _mm256_storeu_si256((__m256i *)(out->from + o), _mm256_permutevar8x32_epi32(from, perm));
+        _mm256_storeu_si256((__m256i *)(out->to + o), _mm256_permutevar8x32_epi32(to, perm));
+        _mm256_storeu_si256((__m256i *)(out->flags + o),
+            _mm256_permutevar8x32_epi32(_mm256_load_si256((const __m256i *)(in->flags + i)), perm));
+
+        tid = _mm_permutevar_ps(_mm_load_ps((const float *)(in->tid + i)),
+                                _mm_loadu_si128((const __m128i *)compact_dwords[keep]));
+        _mm_storeu_ps((float *)(out->tid + o), tid);
+
+        if (edges) {
+            same = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(fidx, tidx)));
+            for (k = 0, lane = 0; lane < 4; lane++) {
+                if (keep >> lane & 1) {
+                    edges[o + k++] = edge_classes[(fin >> lane & 1) | (tin >> lane & 1) << 1 |
+                                                    (same >> lane & 1) << 2];
+                }
+            }
+        }
+        o += _mm_popcnt_u32(keep);
+    }
+
+    out->count = o;
+    filter_scalar(in, i, ranges, range_count, mode, out, edges);
+}
+#endif // RECORD_BATCH_AVX2
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : record_batch_filter
+// Description  : Append the records of a batch with a source or target in
+//                address ranges to another batch, as many as it has room
+//                for, and classify their edges. With AVX2, up to 64 ranges
+//                are checked four records at a time.
+//
+// Inputs       : const struct record_batch *in : the input batch
+//                const struct record_range *ranges : the ranges, checked in
+//                                                    order
+//                unsigned int range_count : number of ranges
+//                unsigned int mode : RECORD_FILTER_FROM and/or
+//                                    RECORD_FILTER_TO
+//                struct record_batch *out : the output batch
+//                unsigned char *edges : the edge classes (enum RECORD_EDGE)
+//                                       of the out records, or NULL
+// Outputs      : unsigned long long : the number of records appended
+
+unsigned long long record_batch_filter(const struct record_batch *in,
+                                        const struct record_range *ranges,
+                                        unsigned int range_count,
+                                        unsigned int mode,
+                                        struct record_batch *out,
+                                        unsigned char *edges) {
+    unsigned long long base = out->count;
+
+#ifdef RECORD_BATCH_AVX2
+    if (range_count <= FILTER_AVX2_MAX_RANGES && __builtin_cpu_supports("avx2")) {
+        filter_avx2(in, ranges, range_count, mode, out, edges);
+        return out->count - base;
+    }
+#endif
+
+    filter_scalar(in, 0, ranges, range_count, mode, out, edges);
+    return out->count - base;
+}
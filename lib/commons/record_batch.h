@@ -0,0 +1,114 @@
+#ifndef LIBIHT_RECORD_BATCH_H
+#define LIBIHT_RECORD_BATCH_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/record_batch.h
+//  Description    : This is the header file for the columnar record batches.
+//                   A batch keeps the decoded branches in separate, 64-byte
+//                   aligned from, to, flags and tid arrays, so that analysis
+//                   loops only load the columns they use and vectorize.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+//
+// Library constants
+
+// Alignment of the columns, and granularity of their capacity
+#define RECORD_BATCH_ALIGN      64
+
+// Filter modes, a record is kept if any selected address is in a range
+#define RECORD_FILTER_FROM      0x1     // Match the branch source
+#define RECORD_FILTER_TO        0x2     // Match the branch target
+
+// Edge classes of filtered records
+enum RECORD_EDGE {
+    RECORD_EDGE_NONE,           // Neither address in a range
+    RECORD_EDGE_INTRA,          // Both addresses in the same range
+    RECORD_EDGE_INTER,          // Addresses in two different ranges
+    RECORD_EDGE_IN,             // Only the target in a range
+    RECORD_EDGE_OUT,            // Only the source in a range
+};
+
+//
+// Type definitions
+
+// Define LBR stack entry, same layout as the kernel one
+#ifndef LIBIHT_LBR_STACK_ENTRY
+#define LIBIHT_LBR_STACK_ENTRY
+struct lbr_stack_entry {
+    unsigned long long from;
+    unsigned long long to;
+};
+#endif // LIBIHT_LBR_STACK_ENTRY
+
+// Define BTS record, same layout as the kernel one
+#ifndef LIBIHT_BTS_RECORD
+#define LIBIHT_BTS_RECORD
+struct bts_record {
+    unsigned long long from;
+    unsigned long long to;
+    unsigned long long misc;
+};
+#endif // LIBIHT_BTS_RECORD
+
+// Define columnar record batch
+struct record_batch {
+    unsigned long long *from;   // Branch sources
+    unsigned long long *to;     // Branch targets
+    unsigned long long *flags;  // BTS misc field, 0 for LBR entries
+    unsigned int *tid;          // Thread ID of each branch
+    unsigned long long count;   // Valid records
+    unsigned long long capacity; // Records of each column
+};
+
+// Define address range, for instance the text of a module
+struct record_range {
+    unsigned long long start;   // First address
+    unsigned long long end;     // Address past the range
+};
+
+//
+// Function prototypes
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+struct record_batch *record_batch_alloc(unsigned long long capacity);
+// Allocate a record batch with aligned columns
+
+void record_batch_free(struct record_batch *batch);
+// Free a record batch
+
+void record_batch_clear(struct record_batch *batch);
+// Drop all records of a record batch, keeping its columns
+
+unsigned long long record_batch_append_bts(struct record_batch *batch,
+                                            const struct bts_record *records,
+                                            unsigned long long count,
+                                            unsigned int tid);
+// Transpose BTS records into a batch, returns the number appended
+
+unsigned long long record_batch_append_lbr(struct record_batch *batch,
+                                            const struct lbr_stack_entry *entries,
+                                            unsigned long long count,
+                                            unsigned int tid);
+// Transpose LBR stack entries into a batch, returns the number appended
+
+unsigned long long record_batch_filter(const struct record_batch *in,
+                                        const struct record_range *ranges,
+                                        unsigned int range_count,
+                                        unsigned int mode,
+                                        struct record_batch *out,
+                                        unsigned char *edges);
+// Append the records of a batch in address ranges to another, returns the
+// number appended
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // LIBIHT_RECORD_BATCH_H
@@ -0,0 +1,236 @@
+#ifndef LIBIHT_RECORDS_HPP
+#define LIBIHT_RECORDS_HPP
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/records.hpp
+//  Description    : This is the header only C++17 record views of the user
+//                   library. A view walks the LBR stack or the BTS records
+//                   of a dump from the oldest to the newest branch, without
+//                   copying them, so that the TOS rotation and the BTS
+//                   wrap are handled in one place.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#include "api.h"
+
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+
+namespace libiht {
+
+//
+// Type definitions
+
+// Define view over the records of a ring buffer, from the oldest record
+template <typename T>
+class ring_view {
+public:
+    // Define random access iterator over a ring view
+    class iterator {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = std::remove_cv_t<T>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T *;
+        using reference = T &;
+
+        constexpr iterator() noexcept = default;
+        constexpr iterator(T *base, std::size_t capacity, std::size_t start,
+                            std::size_t pos) noexcept
+            : base_(base), capacity_(capacity), start_(start), pos_(pos) {}
+
+        constexpr reference operator*() const noexcept { return base_[slot(pos_)]; }
+        constexpr pointer operator->() const noexcept { return base_ + slot(pos_); }
+        constexpr reference operator[](difference_type n) const noexcept
+        {
+            return base_[slot(pos_ + n)];
+        }
+
+        constexpr iterator &operator++() noexcept { ++pos_; return *this; }
+        constexpr iterator &operator--() noexcept { --pos_; return *this; }
+        constexpr iterator operator++(int) noexcept { iterator it = *this; ++pos_; return it; }
+        constexpr iterator operator--(int) noexcept { iterator it = *this; --pos_; return it; }
+        constexpr iterator &operator+=(difference_type n) noexcept { pos_ += n; return *this; }
+        constexpr iterator &operator-=(difference_type n) noexcept { pos_ -= n; return *this; }
+
+        friend constexpr iterator operator+(iterator it, difference_type n) noexcept { return it += n; }
+        friend constexpr iterator operator+(difference_type n, iterator it) noexcept { return it += n; }
+        friend constexpr iterator operator-(iterator it, difference_type n) noexcept { return it -= n; }
+        friend constexpr difference_type operator-(const iterator &a, const iterator &b) noexcept
+        {
+            return (difference_type)a.pos_ - (difference_type)b.pos_;
+        }
+
+        friend constexpr bool operator==(const iterator &a, const iterator &b) noexcept { return a.pos_ == b.pos_; }
+        friend constexpr bool operator!=(const iterator &a, const iterator &b) noexcept { return a.pos_ != b.pos_; }
+        friend constexpr bool operator<(const iterator &a, const iterator &b) noexcept { return a.pos_ < b.pos_; }
+        friend constexpr bool operator>(const iterator &a, const iterator &b) noexcept { return a.pos_ > b.pos_; }
+        friend constexpr bool operator<=(const iterator &a, const iterator &b) noexcept { return a.pos_ <= b.pos_; }
+        friend constexpr bool operator>=(const iterator &a, const iterator &b) noexcept { return a.pos_ >= b.pos_; }
+
+    private:
+        // Slot of a position, start is below capacity and pos at most size
+        constexpr std::size_t slot(std::size_t pos) const noexcept
+        {
+            std::size_t index = start_ + pos;
+            return index >= capacity_ ? index - capacity_ : index;
+        }
+
+        T *base_ = nullptr;
+        std::size_t capacity_ = 0;  // Records in the ring
+        std::size_t start_ = 0;     // Slot of the oldest record
+        std::size_t pos_ = 0;       // Position from the oldest record
+    };
+
+    using value_type = std::remove_cv_t<T>;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = T &;
+    using const_iterator = iterator;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+
+    constexpr ring_view() noexcept = default;
+    constexpr ring_view(T *base, std::size_t capacity, std::size_t start,
+                        std::size_t size) noexcept
+        : base_(base), capacity_(capacity), start_(start), size_(size) {}
+
+    constexpr iterator begin() const noexcept { return iterator(base_, capacity_, start_, 0); }
+    constexpr iterator end() const noexcept { return iterator(base_, capacity_, start_, size_); }
+    constexpr reverse_iterator rbegin() const noexcept { return reverse_iterator(end()); }
+    constexpr reverse_iterator rend() const noexcept { return reverse_iterator(begin()); }
+
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr reference operator[](std::size_t n) const noexcept { return begin()[n]; }
+    constexpr reference front() const noexcept { return begin()[0]; }
+    constexpr reference back() const noexcept { return begin()[size_ - 1]; }
+
+private:
+    T *base_ = nullptr;
+    std::size_t capacity_ = 0;
+    std::size_t start_ = 0;
+    std::size_t size_ = 0;
+};
+
+// Oldest to newest LBR stack entries
+using lbr_view = ring_view<const lbr_stack_entry>;
+
+// Oldest to newest BTS records
+using bts_view = ring_view<const bts_record>;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_records
+// Description  : View an LBR stack from the oldest to the newest entry. The
+//                newest entry is at the TOS. Never written entries are left
+//                out, and so are the zeroed entries past the LBR capacity
+//                when count is only an upper bound of it.
+//
+// Inputs       : const lbr_stack_entry *entries : the LBR stack entries
+//                std::size_t count : number of entries
+//                unsigned long long tos : the MSR_LBR_TOS value
+// Outputs      : lbr_view : the view of the entries
+
+inline lbr_view lbr_records(const lbr_stack_entry *entries, std::size_t count,
+                            unsigned long long tos) noexcept
+{
+    std::size_t top, start, size;
+
+    if (count == 0)
+        return lbr_view();
+
+    top = (std::size_t)(tos % count);
+    while (count > top + 1 && !entries[count - 1].from && !entries[count - 1].to)
+        count--;
+
+    start = top + 1 == count ? 0 : top + 1;
+    size = count;
+    while (size && !entries[start].from && !entries[start].to)
+    {
+        start = start + 1 == count ? 0 : start + 1;
+        size--;
+    }
+
+    return lbr_view(entries, count, start, size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_records
+// Description  : View the LBR stack of an LBR data buffer. Its entry_count
+//                is the LBR capacity after a dump, all the stack otherwise.
+//
+// Inputs       : const lbr_data &data : the LBR data buffer
+// Outputs      : lbr_view : the view of the entries
+
+inline lbr_view lbr_records(const lbr_data &data) noexcept
+{
+    return lbr_records(data.entries,
+                        data.entry_count ? data.entry_count : LIBIHT_LBR_MAX_ENTRIES,
+                        data.lbr_tos);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_records
+// Description  : View the LBR stack of a snapshot record (off-cpu, syscall,
+//                sample or crash record).
+//
+// Inputs       : const R &record : the snapshot record
+// Outputs      : lbr_view : the view of the entries
+
+template <typename R>
+inline auto lbr_records(const R &record) noexcept
+    -> decltype(std::size(record.entries), lbr_view())
+{
+    return lbr_records(record.entries, std::size(record.entries), record.lbr_tos);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_records
+// Description  : View the records of a BTS data buffer from the oldest to the
+//                newest branch. When the BTS buffer wrapped, the oldest
+//                record is at bts_index. Without a record count from the
+//                dump, the records are counted up to the first empty one.
+//
+// Inputs       : const bts_data &data : the BTS data buffer
+//                std::size_t capacity : number of records of the buffer
+// Outputs      : bts_view : the view of the records
+
+inline bts_view bts_records(const bts_data &data, std::size_t capacity) noexcept
+{
+    const bts_record *base = data.bts_buffer_base;
+    std::size_t offset, size;
+
+    if (!base || capacity == 0)
+        return bts_view();
+
+    offset = data.bts_index ? (std::size_t)(data.bts_index - base) : capacity;
+    if (data.record_count)
+        size = data.record_count < capacity ? data.record_count : capacity;
+    else if (offset < capacity && base[offset].from)
+        size = capacity;
+    else
+    {
+        size = 0;
+        while (size < capacity && base[size].from)
+            size++;
+    }
+
+    if (size < capacity || offset >= capacity)
+        offset = 0;
+
+    return bts_view(base, capacity, offset, size);
+}
+
+} // namespace libiht
+
+#endif // LIBIHT_RECORDS_HPP
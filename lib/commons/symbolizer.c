@@ -0,0 +1,1199 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/symbolizer.c
+//  Description    : This is the implementation of the native symbolizer. The
+//                   function symbols of .symtab and .dynsym are relocated to
+//                   their runtime addresses and kept sorted by start, with
+//                   the starts in their own array for a branchless binary
+//                   search. Lookups first check a small set associative LRU
+//                   cache of the calling thread.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#include "symbolizer.h"
+#include "line_table.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//
+// Library constants
+
+// Empty slot of the thread cache
+#define CACHE_EMPTY     (~0ULL)
+
+// Symbol cache files, named by the hex build ID of their object
+#define SYMBOL_CACHE_MAGIC      "IHTSYMS"
+#define SYMBOL_CACHE_VERSION    1
+#define SYMBOL_CACHE_MAX_ID     64      // Largest build ID in bytes
+
+//
+// Type definitions
+
+// Define function symbol, relocated
+struct sym_entry {
+    unsigned long long start;   // First address
+    unsigned long long end;     // Address past the function
+    const char *name;           // Name, in one of the tables
+    unsigned int module;        // Module index
+};
+
+// Define function symbol of an ELF object, at its link time address
+struct sym_record {
+    unsigned long long value;   // Symbol value
+    unsigned long long size;    // Symbol size, 0 if unknown
+    unsigned int name;          // Name offset in the table names
+    unsigned int reserved;
+};
+
+// Define symbol table of an ELF object, as stored in the symbol cache
+struct sym_table {
+    struct sym_record *records;
+    unsigned long long count;
+    char *names;                // NUL terminated names
+    unsigned long long names_size;
+};
+
+// Define names of the symbols, in a cache file mapping or on heap
+struct sym_source {
+    void *map;                  // Cache file mapping, NULL for heap names
+    unsigned long long map_size;
+    char *names;                // Heap names
+};
+
+// Define symbol cache file header, followed by the records and names
+struct sym_file_header {
+    char magic[8];              // SYMBOL_CACHE_MAGIC
+    unsigned int version;       // SYMBOL_CACHE_VERSION
+    unsigned int build_id_size;
+    unsigned char build_id[SYMBOL_CACHE_MAX_ID];
+    unsigned long long count;   // Number of records
+    unsigned long long names_size;
+};
+
+// Define mapped module
+struct sym_module {
+    char *path;
+    unsigned long long start;
+    unsigned long long end;
+    unsigned long long offset;  // File offset of the mapping
+    unsigned long long bias;    // Load bias, valid if its symbols were read
+    int loaded;                 // Symbols read
+    unsigned int build_id_size;
+    unsigned char build_id[SYMBOL_CACHE_MAX_ID];
+    struct line_table *lines;   // Line table, once lines_state is set
+    atomic_int lines_state;     // Line table opened, or found missing
+};
+
+// Define symbolizer
+struct symbolizer {
+    unsigned long long id;      // Changes with each added module
+    struct sym_module *modules; // Sorted by start
+    unsigned int module_count;
+    struct sym_entry *entries;  // Sorted by start
+    unsigned long long *starts; // Start of each entry, for the search
+    unsigned long long entry_count;
+    unsigned long long entry_cap;
+    struct sym_source *sources; // Tables holding the names
+    unsigned int source_count;
+    char *cache_dir;            // Symbol cache directory, NULL if disabled
+    pthread_mutex_t lock;       // Serializes the line table opening
+};
+
+// Define per thread cache of resolved addresses
+struct sym_cache {
+    unsigned long long id;      // Symbolizer the cache belongs to
+    unsigned long long addr[SYMBOLIZER_CACHE_SETS][SYMBOLIZER_CACHE_WAYS];
+    int entry[SYMBOLIZER_CACHE_SETS][SYMBOLIZER_CACHE_WAYS];
+    int module[SYMBOLIZER_CACHE_SETS][SYMBOLIZER_CACHE_WAYS];
+};
+
+//
+// Global variables
+
+// Last symbolizer id given
+static atomic_ullong last_id;
+
+// Cache of the calling thread, ways ordered from the most recent
+static __thread struct sym_cache thread_cache;
+
+//
+// Index functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_entries
+// Description  : Order symbols by start, then the sized ones first
+//
+// Inputs       : const void *a : the first symbol
+//                const void *b : the second symbol
+// Outputs      : int : the order
+
+static int compare_entries(const void *a, const void *b) {
+    const struct sym_entry *x = a, *y = b;
+
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return (y->end - y->start > 0) - (x->end - x->start > 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : build_index
+// Description  : Merge the symbols added since the last build, drop the
+//                duplicated starts, extend the unsized symbols to the next
+//                one, and rebuild the starts
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                unsigned long long first : the first added symbol, the
+//                added ones being sorted
+// Outputs      : None
+
+static void build_index(struct symbolizer *symbolizer, unsigned long long first) {
+    struct sym_entry *entries = symbolizer->entries, *added;
+    unsigned long long i, j, k, n = 0, limit;
+
+    // Merge from the back, with only the added run moved aside
+    added = malloc((symbolizer->entry_count - first + 1) * sizeof(*added));
+    if (added == NULL) {
+        qsort(entries, symbolizer->entry_count, sizeof(*entries), compare_entries);
+    }
+    else {
+        memcpy(added, entries + first, (symbolizer->entry_count - first) * sizeof(*added));
+        i = first;
+        j = symbolizer->entry_count - first;
+        k = symbolizer->entry_count;
+        while (j > 0) {
+            if (i > 0 && compare_entries(&entries[i - 1], &added[j - 1]) > 0) {
+                entries[--k] = entries[--i];
+            }
+            else {
+                entries[--k] = added[--j];
+            }
+        }
+        free(added);
+    }
+
+    for (i = 0; i < symbolizer->entry_count; i++) {
+        if (n && entries[n - 1].start == entries[i].start) {
+            continue;
+        }
+        entries[n++] = entries[i];
+    }
+    symbolizer->entry_count = n;
+
+    for (i = 0; i < n; i++) {
+        if (entries[i].end > entries[i].start) {
+            continue;
+        }
+        limit = symbolizer->modules[entries[i].module].end;
+        if (i + 1 < n && entries[i + 1].start < limit) {
+            limit = entries[i + 1].start;
+        }
+        entries[i].end = limit;
+    }
+
+    for (i = 0; i < n; i++) {
+        symbolizer->starts[i] = entries[i].start;
+    }
+    symbolizer->id = atomic_fetch_add(&last_id, 1) + 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_symbol
+// Description  : Append a relocated symbol
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                unsigned long long start : the first address
+//                unsigned long long size : the symbol size
+//                const char *name : the symbol name
+//                unsigned int module : the module index
+// Outputs      : int : 0 on success, -1 on failure
+
+static int add_symbol(struct symbolizer *symbolizer, unsigned long long start,
+                        unsigned long long size, const char *name,
+                        unsigned int module) {
+    struct sym_entry *entries;
+    unsigned long long *starts;
+    unsigned long long cap;
+
+    if (symbolizer->entry_count == symbolizer->entry_cap) {
+        cap = symbolizer->entry_cap ? symbolizer->entry_cap * 2 : 1024;
+        entries = realloc(symbolizer->entries, cap * sizeof(*entries));
+        if (entries == NULL) {
+            return -1;
+        }
+        symbolizer->entries = entries;
+        starts = realloc(symbolizer->starts, cap * sizeof(*starts));
+        if (starts == NULL) {
+            return -1;
+        }
+        symbolizer->starts = starts;
+        symbolizer->entry_cap = cap;
+    }
+
+    symbolizer->entries[symbolizer->entry_count].start = start;
+    symbolizer->entries[symbolizer->entry_count].end = start + size;
+    symbolizer->entries[symbolizer->entry_count].name = name;
+    symbolizer->entries[symbolizer->entry_count].module = module;
+    symbolizer->entry_count++;
+
+    return 0;
+}
+
+//
+// ELF functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_records
+// Description  : Order symbol records by value, then the sized ones first
+//
+// Inputs       : const void *a : the first record
+//                const void *b : the second record
+// Outputs      : int : the order
+
+static int compare_records(const void *a, const void *b) {
+    const struct sym_record *x = a, *y = b;
+
+    if (x->value != y->value) {
+        return x->value < y->value ? -1 : 1;
+    }
+    return (y->size > 0) - (x->size > 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : elf_build_id
+// Description  : Find the GNU build ID note of an ELF object
+//
+// Inputs       : const unsigned char *image : the ELF file
+//                unsigned long long size : the file size
+//                unsigned char *id : the output build ID
+// Outputs      : unsigned int : the build ID size, 0 if it has none
+
+static unsigned int elf_build_id(const unsigned char *image, unsigned long long size,
+                                    unsigned char *id) {
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+    const Elf64_Phdr *phdr = (const Elf64_Phdr *)(image + ehdr->e_phoff);
+    const Elf64_Nhdr *note;
+    unsigned long long pos, end, i;
+
+    for (i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type != PT_NOTE || phdr[i].p_offset + phdr[i].p_filesz > size) {
+            continue;
+        }
+
+        // Notes are 4-byte aligned name and descriptor after the header
+        pos = phdr[i].p_offset;
+        end = phdr[i].p_offset + phdr[i].p_filesz;
+        while (pos + sizeof(*note) <= end) {
+            note = (const Elf64_Nhdr *)(image + pos);
+            pos += sizeof(*note) + ((note->n_namesz + 3ULL) & ~3ULL);
+            if (pos + note->n_descsz > end) {
+                break;
+            }
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+                !memcmp(note + 1, "GNU", 4) && note->n_descsz > 0 &&
+                note->n_descsz <= SYMBOL_CACHE_MAX_ID) {
+                memcpy(id, image + pos, note->n_descsz);
+                return note->n_descsz;
+            }
+            pos += (note->n_descsz + 3ULL) & ~3ULL;
+        }
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : elf_read_table
+// Description  : Read the function symbols of .symtab and .dynsym at their
+//                link time addresses
+//
+// Inputs       : const unsigned char *image : the ELF file
+//                unsigned long long size : the file size
+//                struct sym_table *table : the output table, to free
+// Outputs      : int : 0 on success, -1 on failure
+
+static int elf_read_table(const unsigned char *image, unsigned long long size,
+                            struct sym_table *table) {
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+    const Elf64_Shdr *shdr = (const Elf64_Shdr *)(image + ehdr->e_shoff), *strtab;
+    const Elf64_Sym *sym;
+    struct sym_record *records = NULL, *grown;
+    unsigned long long count, cap = 0, names_cap = 0, n = 0, names_size = 0, len, i, j;
+    char *names = NULL, *more;
+    const char *name;
+    unsigned int type;
+
+    for (i = 0; i < ehdr->e_shnum; i++) {
+        if ((shdr[i].sh_type != SHT_SYMTAB && shdr[i].sh_type != SHT_DYNSYM) ||
+            shdr[i].sh_link >= ehdr->e_shnum ||
+            shdr[i].sh_offset + shdr[i].sh_size > size) {
+            continue;
+        }
+        strtab = &shdr[shdr[i].sh_link];
+        if (strtab->sh_offset + strtab->sh_size > size || strtab->sh_size == 0) {
+            continue;
+        }
+
+        sym = (const Elf64_Sym *)(image + shdr[i].sh_offset);
+        count = shdr[i].sh_size / sizeof(*sym);
+        for (j = 0; j < count; j++) {
+            type = ELF64_ST_TYPE(sym[j].st_info);
+            if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+                sym[j].st_shndx == SHN_UNDEF || sym[j].st_value == 0 ||
+                sym[j].st_name >= strtab->sh_size) {
+                continue;
+            }
+            name = (const char *)image + strtab->sh_offset + sym[j].st_name;
+            if (memchr(name, 0, strtab->sh_size - sym[j].st_name) == NULL) {
+                continue;
+            }
+            len = strlen(name) + 1;
+
+            if (n == cap) {
+                cap = cap ? cap * 2 : 1024;
+                grown = realloc(records, cap * sizeof(*records));
+                if (grown == NULL) {
+                    goto fail;
+                }
+                records = grown;
+            }
+            if (names_size + len > names_cap) {
+                names_cap = names_cap ? names_cap * 2 : 0x10000;
+                while (names_cap < names_size + len) {
+                    names_cap *= 2;
+                }
+                more = realloc(names, names_cap);
+                if (more == NULL) {
+                    goto fail;
+                }
+                names = more;
+            }
+
+            memcpy(names + names_size, name, len);
+            records[n].value = sym[j].st_value;
+            records[n].size = sym[j].st_size;
+            records[n].name = (unsigned int)names_size;
+            records[n].reserved = 0;
+            names_size += len;
+            n++;
+        }
+    }
+
+    // Sorted by value like the index, keeping the sized of equal values
+    if (n) {
+        qsort(records, n, sizeof(*records), compare_records);
+        for (i = 1, j = 1; i < n; i++) {
+            if (records[i].value != records[j - 1].value) {
+                records[j++] = records[i];
+            }
+        }
+        n = j;
+    }
+
+    table->records = records;
+    table->count = n;
+    table->names = names;
+    table->names_size = names_size;
+    return 0;
+
+fail:
+    free(records);
+    free(names);
+    return -1;
+}
+
+//
+// Symbol cache functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_path
+// Description  : Format the cache file path of a build ID
+//
+// Inputs       : char *path : the output path
+//                unsigned long long len : size of the path buffer
+//                const char *dir : the cache directory
+//                const unsigned char *id : the build ID
+//                unsigned int id_size : the build ID size
+// Outputs      : int : 0 on success, -1 if the path is too long
+
+static int cache_path(char *path, unsigned long long len, const char *dir,
+                        const unsigned char *id, unsigned int id_size) {
+    unsigned long long pos;
+    unsigned int i;
+
+    pos = snprintf(path, len, "%s/", dir);
+    if (pos + id_size * 2 + sizeof(".sym") > len) {
+        return -1;
+    }
+    for (i = 0; i < id_size; i++) {
+        pos += sprintf(path + pos, "%02x", id[i]);
+    }
+    strcpy(path + pos, ".sym");
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_load
+// Description  : Map the cached symbol table of a build ID
+//
+// Inputs       : const char *dir : the cache directory
+//                const unsigned char *id : the build ID
+//                unsigned int id_size : the build ID size
+//                struct sym_table *table : the output table, in the mapping
+//                unsigned long long *map_size : the output mapping size
+// Outputs      : void* : the mapping to unmap, NULL if not cached
+
+static void *cache_load(const char *dir, const unsigned char *id,
+                        unsigned int id_size, struct sym_table *table,
+                        unsigned long long *map_size) {
+    const struct sym_file_header *header;
+    char path[4096];
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (cache_path(path, sizeof(path), dir, id, id_size)) {
+        return NULL;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) || (unsigned long long)st.st_size < sizeof(*header)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Reject other versions, truncated files and unterminated names
+    header = map;
+    if (memcmp(header->magic, SYMBOL_CACHE_MAGIC, sizeof(header->magic)) ||
+        header->version != SYMBOL_CACHE_VERSION || header->build_id_size != id_size ||
+        memcmp(header->build_id, id, id_size) ||
+        header->count > (unsigned long long)st.st_size / sizeof(struct sym_record) ||
+        sizeof(*header) + header->count * sizeof(struct sym_record) +
+            header->names_size != (unsigned long long)st.st_size ||
+        (header->names_size && ((const char *)map)[st.st_size - 1] != '\0')) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    table->records = (struct sym_record *)(header + 1);
+    table->count = header->count;
+    table->names = (char *)(table->records + header->count);
+    table->names_size = header->names_size;
+    *map_size = st.st_size;
+
+    return map;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_store
+// Description  : Write the symbol table of a build ID to the cache. The file
+//                is written under a temporary name then renamed, so readers
+//                never see a partial file.
+//
+// Inputs       : const char *dir : the cache directory
+//                const unsigned char *id : the build ID
+//                unsigned int id_size : the build ID size
+//                const struct sym_table *table : the table
+// Outputs      : int : 0 on success, -1 on failure
+
+static int cache_store(const char *dir, const unsigned char *id,
+                        unsigned int id_size, const struct sym_table *table) {
+    struct sym_file_header header;
+    char path[4096], temp[4096 + 32], *slash;
+    FILE *file;
+    int ok;
+
+    if (cache_path(path, sizeof(path), dir, id, id_size)) {
+        return -1;
+    }
+
+    // Create the directory and its missing parents
+    snprintf(temp, sizeof(temp), "%s", dir);
+    for (slash = strchr(temp + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(temp, 0755);
+        *slash = '/';
+    }
+    mkdir(temp, 0755);
+
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+    file = fopen(temp, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SYMBOL_CACHE_MAGIC, sizeof(header.magic));
+    header.version = SYMBOL_CACHE_VERSION;
+    header.build_id_size = id_size;
+    memcpy(header.build_id, id, id_size);
+    header.count = table->count;
+    header.names_size = table->names_size;
+
+    ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(table->records, sizeof(*table->records), table->count, file) == table->count &&
+            fwrite(table->names, 1, table->names_size, file) == table->names_size;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp, path)) {
+        unlink(temp);
+        return -1;
+    }
+
+    return 0;
+}
+
+//
+// Module functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_source
+// Description  : Keep the names of a symbol table until the symbolizer is
+//                freed
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                void *map : the cache file mapping, NULL if none
+//                unsigned long long map_size : the mapping size
+//                char *names : the heap names, NULL if mapped
+// Outputs      : int : 0 on success, -1 on failure
+
+static int add_source(struct symbolizer *symbolizer, void *map,
+                        unsigned long long map_size, char *names) {
+    struct sym_source *sources;
+
+    sources = realloc(symbolizer->sources,
+                        (symbolizer->source_count + 1) * sizeof(*sources));
+    if (sources == NULL) {
+        return -1;
+    }
+    symbolizer->sources = sources;
+    sources[symbolizer->source_count].map = map;
+    sources[symbolizer->source_count].map_size = map_size;
+    sources[symbolizer->source_count].names = names;
+    symbolizer->source_count++;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_table
+// Description  : Add the symbols of a table inside the mapping of a module,
+//                relocated by the load bias of the mapping
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                const struct sym_table *table : the symbol table
+//                unsigned long long bias : the load bias
+//                unsigned int module : the module index
+// Outputs      : int : 0 on success, -1 on failure
+
+static int add_table(struct symbolizer *symbolizer, const struct sym_table *table,
+                        unsigned long long bias, unsigned int module) {
+    const struct sym_module *mod = &symbolizer->modules[module];
+    unsigned long long addr, i;
+
+    for (i = 0; i < table->count; i++) {
+        addr = table->records[i].value + bias;
+        if (addr < mod->start || addr >= mod->end ||
+            table->records[i].name >= table->names_size) {
+            continue;
+        }
+        if (add_symbol(symbolizer, addr, table->records[i].size,
+                        table->names + table->records[i].name, module)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_elf_symbols
+// Description  : Add the function symbols of a mapped ELF object inside its
+//                mapping. Objects with a build ID are read from the symbol
+//                cache if there, and stored to it otherwise.
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                const unsigned char *image : the ELF file
+//                unsigned long long size : the file size
+//                unsigned int module : the module index
+// Outputs      : int : 0 on success, -1 if it is not a 64-bit ELF object
+
+static int read_elf_symbols(struct symbolizer *symbolizer,
+                            const unsigned char *image, unsigned long long size,
+                            unsigned int module) {
+    struct sym_module *mod = &symbolizer->modules[module];
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+    const Elf64_Phdr *phdr;
+    unsigned char *id = mod->build_id;
+    unsigned long long bias = 0, map_size = 0, i;
+    unsigned int id_size = 0, found = 0;
+    struct sym_table table;
+    void *map = NULL;
+    int res;
+
+    if (size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_phoff + (unsigned long long)ehdr->e_phnum * sizeof(*phdr) > size ||
+        ehdr->e_shoff + (unsigned long long)ehdr->e_shnum * sizeof(Elf64_Shdr) > size) {
+        return -1;
+    }
+
+    // Bias of the loaded segment holding the mapped file offset
+    phdr = (const Elf64_Phdr *)(image + ehdr->e_phoff);
+    for (i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD &&
+            (phdr[i].p_offset & ~0xfffULL) <= mod->offset &&
+            mod->offset < phdr[i].p_offset + phdr[i].p_filesz) {
+            bias = mod->start - mod->offset + phdr[i].p_offset - phdr[i].p_vaddr;
+            found = 1;
+            break;
+        }
+    }
+    if (!found) {
+        return -1;
+    }
+    mod->bias = bias;
+    mod->loaded = 1;
+
+    // The build ID also finds the separate debug file of the lines
+    id_size = elf_build_id(image, size, id);
+    mod->build_id_size = id_size;
+    if (!symbolizer->cache_dir) {
+        id_size = 0;
+    }
+    if (id_size) {
+        map = cache_load(symbolizer->cache_dir, id, id_size, &table, &map_size);
+    }
+    if (map) {
+        // The entries point to the names of the mapping
+        if (add_source(symbolizer, map, map_size, NULL)) {
+            munmap(map, map_size);
+            return -1;
+        }
+        return add_table(symbolizer, &table, bias, module);
+    }
+
+    if (elf_read_table(image, size, &table)) {
+        return -1;
+    }
+    if (id_size) {
+        cache_store(symbolizer->cache_dir, id, id_size, &table);
+    }
+    if (add_source(symbolizer, NULL, 0, table.names)) {
+        free(table.records);
+        free(table.names);
+        return -1;
+    }
+    res = add_table(symbolizer, &table, bias, module);
+    free(table.records);
+
+    return res;
+}
+
+//
+// Symbolizer functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : symbolizer_alloc
+// Description  : Allocate a symbolizer without modules
+//
+// Inputs       : None
+// Outputs      : struct symbolizer* : the symbolizer, NULL on failure
+
+struct symbolizer *symbolizer_alloc(void) {
+    struct symbolizer *symbolizer;
+    const char *env;
+    char dir[4096];
+
+    symbolizer = calloc(1, sizeof(struct symbolizer));
+    if (symbolizer == NULL) {
+        return NULL;
+    }
+    symbolizer->id = atomic_fetch_add(&last_id, 1) + 1;
+
+    // Default symbol cache, an empty LIBIHT_SYMBOL_CACHE disables it
+    dir[0] = '\0';
+    if ((env = getenv("LIBIHT_SYMBOL_CACHE")) != NULL) {
+        snprintf(dir, sizeof(dir), "%s", env);
+    }
+    else if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/libiht", env);
+    }
+    else if ((env = getenv("HOME")) != NULL && env[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/.cache/libiht", env);
+    }
+    if (dir[0]) {
+        symbolizer->cache_dir = strdup(dir);
+    }
+    pthread_mutex_init(&symbolizer->lock, NULL);
+
+    return symbolizer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : symbolizer_free
+// Description  : Free a symbolizer
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+// Outputs      : None
+
+void symbolizer_free(struct symbolizer *symbolizer) {
+    unsigned int i;
+
+    if (symbolizer == NULL) {
+        return;
+    }
+
+    for (i = 0; i < symbolizer->module_count; i++) {
+        free(symbolizer->modules[i].path);
+        line_table_close(symbolizer->modules[i].lines);
+    }
+    free(symbolizer->modules);
+    free(symbolizer->entries);
+    free(symbolizer->starts);
+    for (i = 0; i < symbolizer->source_count; i++) {
+        if (symbolizer->sources[i].map) {
+            munmap(symbolizer->sources[i].map, symbolizer->sources[i].map_size);
+        }
+        free(symbolizer->sources[i].names);
+    }
+    free(symbolizer->sources);
+    free(symbolizer->cache_dir);
+    pthread_mutex_destroy(&symbolizer->lock);
+    free(symbolizer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : symbolizer_set_cache_dir
+// Description  : Set the directory of the symbol cache, for the modules
+//                added after
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                const char *dir : the cache directory, NULL to disable
+// Outputs      : int : 0 on success, -1 on failure
+
+int symbolizer_set_cache_dir(struct symbolizer *symbolizer, const char *dir) {
+    char *copy = NULL;
+
+    if (dir && dir[0] && (copy = strdup(dir)) == NULL) {
+        return -1;
+    }
+    free(symbolizer->cache_dir);
+    symbolizer->cache_dir = copy;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : symbolizer_add_module
+// Description  : Add the function symbols of a mapped ELF object. Modules
+//                must be added before any lookup from another thread.
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                const char *path : the ELF object path
+//                unsigned long long start : start address of the mapping
+//                unsigned long long end : end address of the mapping
+//                unsigned long long offset : file offset of the mapping
+// Outputs      : int : 0 on success, -1 on failure
+
+int symbolizer_add_module(struct symbolizer *symbolizer, const char *path,
+                            unsigned long long start, unsigned long long end,
+                            unsigned long long offset) {
+    struct sym_module *modules, *mod;
+    unsigned long long count;
+    unsigned int i, index;
+    struct stat st;
+    void *image;
+    int fd, res;
+
+    if (symbolizer->module_count >= 0x7fffffff) {
+        return -1;
+    }
+    modules = realloc(symbolizer->modules,
+                        (symbolizer->module_count + 1) * sizeof(*modules));
+    if (modules == NULL) {
+        return -1;
+    }
+    symbolizer->modules = modules;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return -1;
+    }
+
+    // Keep the modules sorted, moving the symbols of the later ones
+    for (index = symbolizer->module_count; index > 0; index--) {
+        if (modules[index - 1].start < start) {
+            break;
+        }
+    }
+    memmove(&modules[index + 1], &modules[index],
+            (symbolizer->module_count - index) * sizeof(*modules));
+    for (count = 0; count < symbolizer->entry_count; count++) {
+        if (symbolizer->entries[count].module >= index) {
+            symbolizer->entries[count].module++;
+        }
+    }
+
+    mod = &modules[index];
+    mod->path = strdup(path);
+    mod->start = start;
+    mod->end = end;
+    mod->offset = offset;
+    mod->bias = 0;
+    mod->loaded = 0;
+    mod->build_id_size = 0;
+    mod->lines = NULL;
+    atomic_init(&mod->lines_state, 0);
+    symbolizer->module_count++;
+
+    count = symbolizer->entry_count;
+    res = mod->path ? read_elf_symbols(symbolizer, image, st.st_size, index) : -1;
+    munmap(image, st.st_size);
+
+    if (res) {
+        // Keep the module for module lookups, without its symbols
+        symbolizer->entry_count = count;
+        if (mod->path == NULL) {
+            for (i = 0; i < symbolizer->entry_count; i++) {
+                if (symbolizer->entries[i].module > index) {
+                    symbolizer->entries[i].module--;
+                }
+            }
+            memmove(&modules[index], &modules[index + 1],
+                    (symbolizer->module_count - index - 1) * sizeof(*modules));
+            symbolizer->module_count--;
+            return -1;
+        }
+    }
+
+    build_index(symbolizer, count);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : symbolizer_load_process
+// Description  : Add the executable file mappings of a process
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                unsigned int pid : the process ID (0 for the caller)
+// Outputs      : int : the number of modules added, -1 on failure
+
+int symbolizer_load_process(struct symbolizer *symbolizer, unsigned int pid) {
+    char path[64], line[4096 + 128], perms[8];
+    unsigned long long start, end, offset;
+    int pos, n = 0;
+    FILE *maps;
+
+    if (pid) {
+        snprintf(path, sizeof(path), "/proc/%u/maps", pid);
+    }
+    else {
+        snprintf(path, sizeof(path), "/proc/self/maps");
+    }
+    maps = fopen(path, "r");
+    if (maps == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), maps)) {
+        // start-end perms offset dev inode path
+        if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &start, &end, perms,
+                    &offset, &pos) != 4 || perms[2] != 'x' || line[pos] != '/') {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+
+        if (symbolizer_add_module(symbolizer, line + pos, start, end, offset) == 0) {
+            n++;
+        }
+    }
+
+    fclose(maps);
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_entry
+// Description  : Find the symbol holding an address, with a branchless
+//                binary search of the last start at or before it
+//
+// Inputs       : const struct symbolizer *symbolizer : the symbolizer
+//                unsigned long long addr : the address
+// Outputs      : int : the symbol index, -1 if none holds it
+
+static int find_entry(const struct symbolizer *symbolizer, unsigned long long addr) {
+    const unsigned long long *base = symbolizer->starts;
+    unsigned long long n = symbolizer->entry_count, half;
+
+    if (n == 0 || base[0] > addr) {
+        return -1;
+    }
+    while (n > 1) {
+        half = n / 2;
+        base = base[half] <= addr ? base + half : base;
+        n -= half;
+    }
+
+    n = base - symbolizer->starts;
+    return addr < symbolizer->entries[n].end ? (int)n : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_module
+// Description  : Find the module mapping an address
+//
+// Inputs       : const struct symbolizer *symbolizer : the symbolizer
+//                unsigned long long addr : the address
+// Outputs      : int : the module index, -1 if none maps it
+
+static int find_module(const struct symbolizer *symbolizer, unsigned long long addr) {
+    unsigned int lo = 0, hi = symbolizer->module_count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (symbolizer->modules[mid].start <= addr) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if (lo && addr < symbolizer->modules[lo - 1].end) {
+        return (int)lo - 1;
+    }
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : symbolizer_lookup
+// Description  : Resolve an address to its function and module
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                unsigned long long addr : the address
+//                struct symbol_info *info : the output symbol
+// Outputs      : int : 0 if the function is known, -1 otherwise
+
+int symbolizer_lookup(struct symbolizer *symbolizer, unsigned long long addr,
+                        struct symbol_info *info) {
+    struct sym_cache *cache = &thread_cache;
+    unsigned int set, way;
+    int entry, module;
+
+    if (cache->id != symbolizer->id) {
+        memset(cache->addr, 0xff, sizeof(cache->addr));
+        cache->id = symbolizer->id;
+    }
+
+    // Most recent way first, a hit moves to the front
+    set = (unsigned int)((addr * 0x9e3779b97f4a7c15ULL) >> 56) & (SYMBOLIZER_CACHE_SETS - 1);
+    for (way = 0; way < SYMBOLIZER_CACHE_WAYS; way++) {
+        if (cache->addr[set][way] == addr) {
+            break;
+        }
+    }
+    if (way < SYMBOLIZER_CACHE_WAYS) {
+        entry = cache->entry[set][way];
+        module = cache->module[set][way];
+    }
+    else {
+        entry = find_entry(symbolizer, addr);
+        module = entry >= 0 ? (int)symbolizer->entries[entry].module :
+                                find_module(symbolizer, addr);
+        way = SYMBOLIZER_CACHE_WAYS - 1;
+    }
+    for (; way > 0; way--) {
+        cache->addr[set][way] = cache->addr[set][way - 1];
+        cache->entry[set][way] = cache->entry[set][way - 1];
+        cache->module[set][way] = cache->module[set][way - 1];
+    }
+    cache->addr[set][0] = addr;
+    cache->entry[set][0] = entry;
+    cache->module[set][0] = module;
+
+    memset(info, 0, sizeof(*info));
+    if (module >= 0) {
+        info->module = symbolizer->modules[module].path;
+        info->module_offset = addr - symbolizer->modules[module].start +
+                                symbolizer->modules[module].offset;
+    }
+    if (entry < 0) {
+        return -1;
+    }
+    info->name = symbolizer->entries[entry].name;
+    info->offset = addr - symbolizer->entries[entry].start;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : symbolizer_lookup_batch
+// Description  : Resolve a batch of addresses
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                const unsigned long long *addrs : the addresses
+//                unsigned long long count : number of addresses
+//                struct symbol_info *infos : the output symbols
+// Outputs      : unsigned long long : the number of known functions
+
+unsigned long long symbolizer_lookup_batch(struct symbolizer *symbolizer,
+                                            const unsigned long long *addrs,
+                                            unsigned long long count,
+                                            struct symbol_info *infos) {
+    unsigned long long i, n = 0;
+
+    for (i = 0; i < count; i++) {
+        if (symbolizer_lookup(symbolizer, addrs[i], &infos[i]) == 0) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+//
+// Line functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : module_lines
+// Description  : Get the line table of a module, opening it on first use
+//                from the object or from its separate debug file
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                struct sym_module *mod : the module
+// Outputs      : struct line_table* : the line table, NULL if none
+
+static struct line_table *module_lines(struct symbolizer *symbolizer,
+                                        struct sym_module *mod) {
+    char path[128];
+    unsigned int i, pos;
+
+    if (atomic_load_explicit(&mod->lines_state, memory_order_acquire)) {
+        return mod->lines;
+    }
+
+    pthread_mutex_lock(&symbolizer->lock);
+    if (!atomic_load_explicit(&mod->lines_state, memory_order_relaxed)) {
+        mod->lines = mod->loaded ? line_table_open(mod->path) : NULL;
+        if (mod->lines == NULL && mod->loaded && mod->build_id_size > 1) {
+            pos = snprintf(path, sizeof(path), "/usr/lib/debug/.build-id/%02x/",
+                            mod->build_id[0]);
+            for (i = 1; i < mod->build_id_size; i++) {
+                pos += snprintf(path + pos, sizeof(path) - pos, "%02x", mod->build_id[i]);
+            }
+            snprintf(path + pos, sizeof(path) - pos, ".debug");
+            mod->lines = line_table_open(path);
+        }
+        atomic_store_explicit(&mod->lines_state, 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&symbolizer->lock);
+
+    return mod->lines;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : symbolizer_lookup_line
+// Description  : Resolve an address to its source file and line
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                unsigned long long addr : the address
+//                struct line_info *info : the output line
+// Outputs      : int : 0 if the line is known, -1 otherwise
+
+int symbolizer_lookup_line(struct symbolizer *symbolizer, unsigned long long addr,
+                            struct line_info *info) {
+    struct line_table *lines;
+    struct sym_module *mod;
+    int module;
+
+    info->file = NULL;
+    info->line = 0;
+
+    module = find_module(symbolizer, addr);
+    if (module < 0) {
+        return -1;
+    }
+    mod = &symbolizer->modules[module];
+    lines = module_lines(symbolizer, mod);
+    if (lines == NULL) {
+        return -1;
+    }
+
+    return line_table_lookup(lines, addr - mod->bias, &info->file, &info->line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : symbolizer_lookup_line_batch
+// Description  : Resolve a batch of addresses to their source lines
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                const unsigned long long *addrs : the addresses
+//                unsigned long long count : number of addresses
+//                struct line_info *infos : the output lines
+// Outputs      : unsigned long long : the number of known lines
+
+unsigned long long symbolizer_lookup_line_batch(struct symbolizer *symbolizer,
+                                                const unsigned long long *addrs,
+                                                unsigned long long count,
+                                                struct line_info *infos) {
+    unsigned long long i, n = 0;
+
+    for (i = 0; i < count; i++) {
+        if (symbolizer_lookup_line(symbolizer, addrs[i], &infos[i]) == 0) {
+            n++;
+        }
+    }
+
+    return n;
+}
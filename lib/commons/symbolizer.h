@@ -0,0 +1,95 @@
+#ifndef LIBIHT_SYMBOLIZER_H
+#define LIBIHT_SYMBOLIZER_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/symbolizer.h
+//  Description    : This is the header file for the native symbolizer. The
+//                   symbolizer reads the function symbols of the mapped ELF
+//                   objects of a process once, and resolves addresses with
+//                   a sorted interval index and a per thread cache of the
+//                   recently resolved addresses. The symbol tables of objects
+//                   with a build ID are kept in an on-disk cache shared by
+//                   later sessions. Source lines come from the DWARF line
+//                   tables, decoded on demand.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+//
+// Library constants
+
+// Sets and ways of the per thread cache of resolved addresses
+#define SYMBOLIZER_CACHE_SETS   256
+#define SYMBOLIZER_CACHE_WAYS   4
+
+//
+// Type definitions
+
+// Define resolved address
+struct symbol_info {
+    const char *name;           // Function name, NULL if unknown
+    const char *module;         // Module path, NULL if not in a module
+    unsigned long long offset;  // Offset in the function
+    unsigned long long module_offset; // File offset in the module
+};
+
+// Define resolved source line
+struct line_info {
+    const char *file;           // Source file, NULL if unknown
+    unsigned int line;          // Source line, 0 if unknown
+};
+
+// Define symbolizer
+struct symbolizer;
+
+//
+// Function prototypes
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+struct symbolizer *symbolizer_alloc(void);
+// Allocate a symbolizer without modules
+
+void symbolizer_free(struct symbolizer *symbolizer);
+// Free a symbolizer
+
+int symbolizer_set_cache_dir(struct symbolizer *symbolizer, const char *dir);
+// Set the symbol cache directory, NULL to disable the cache
+
+int symbolizer_add_module(struct symbolizer *symbolizer, const char *path,
+                            unsigned long long start, unsigned long long end,
+                            unsigned long long offset);
+// Add the function symbols of a mapped ELF object
+
+int symbolizer_load_process(struct symbolizer *symbolizer, unsigned int pid);
+// Add the executable mappings of a process, returns their number
+
+int symbolizer_lookup(struct symbolizer *symbolizer, unsigned long long addr,
+                        struct symbol_info *info);
+// Resolve an address, returns 0 if its function is known
+
+unsigned long long symbolizer_lookup_batch(struct symbolizer *symbolizer,
+                                            const unsigned long long *addrs,
+                                            unsigned long long count,
+                                            struct symbol_info *infos);
+// Resolve addresses, returns the number of known functions
+
+int symbolizer_lookup_line(struct symbolizer *symbolizer, unsigned long long addr,
+                            struct line_info *info);
+// Resolve an address to its source line, returns 0 if known
+
+unsigned long long symbolizer_lookup_line_batch(struct symbolizer *symbolizer,
+                                                const unsigned long long *addrs,
+                                                unsigned long long count,
+                                                struct line_info *infos);
+// Resolve addresses to source lines, returns the number known
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // LIBIHT_SYMBOLIZER_H
@@ -0,0 +1,768 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/trace_file.c
+//  Description    : This is the implementation of the on-disk trace format.
+//                   Records are grouped by timestamp inside a chunk, each
+//                   group holds the timestamp delta, the record count and
+//                   the records. Addresses are encoded as zigzag varint
+//                   deltas: the source from the previous target, the target
+//                   from the source. The deltas restart at each chunk.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#include "trace_file.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+//
+// Library constants
+
+// Longest varint of a 64-bit value
+#define VARINT_MAX_LEN      10
+
+// Longest encoded group head (timestamp delta and record count)
+#define GROUP_HEAD_MAX_LEN  (VARINT_MAX_LEN * 2)
+
+// Longest encoded BTS record and LBR entry
+#define BTS_RECORD_MAX_LEN  (VARINT_MAX_LEN * 3)
+#define LBR_ENTRY_MAX_LEN   (VARINT_MAX_LEN * 2)
+
+// Smallest chunk size, an LBR snapshot always fits in a chunk
+#define TRACE_CHUNK_MIN_SIZE 0x1000
+
+//
+// Type definitions
+
+// Define trace writer
+struct trace_writer {
+    FILE *file;
+    struct trace_file_header header;
+    unsigned char *chunk;       // Chunk being filled, header first
+    unsigned int used;          // Encoded bytes of the chunk
+    unsigned int open;          // Whether the chunk holds records
+    unsigned long long prev_time; // Timestamp of the last group
+    unsigned long long prev_addr; // Last branch target
+};
+
+//
+// Encoding functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_varint
+// Description  : Encode an unsigned LEB128 varint
+//
+// Inputs       : unsigned char *out : the output, VARINT_MAX_LEN bytes
+//                unsigned long long value : the value
+// Outputs      : unsigned int : the encoded size
+
+static unsigned int put_varint(unsigned char *out, unsigned long long value) {
+    unsigned int n = 0;
+
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_delta
+// Description  : Encode the signed difference of two values as a zigzag
+//                varint
+//
+// Inputs       : unsigned char *out : the output, VARINT_MAX_LEN bytes
+//                unsigned long long value : the value
+//                unsigned long long base : the value it is relative to
+// Outputs      : unsigned int : the encoded size
+
+static unsigned int put_delta(unsigned char *out, unsigned long long value,
+                                unsigned long long base) {
+    long long delta = (long long)(value - base);
+
+    return put_varint(out, ((unsigned long long)delta << 1) ^ (unsigned long long)(delta >> 63));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_varint
+// Description  : Decode an unsigned LEB128 varint
+//
+// Inputs       : const unsigned char **pos : the input, moved past the value
+//                const unsigned char *end : the end of the input
+//                unsigned long long *value : the output value
+// Outputs      : int : 0 on success, -1 if the input is truncated
+
+static int get_varint(const unsigned char **pos, const unsigned char *end,
+                        unsigned long long *value) {
+    const unsigned char *p = *pos;
+    unsigned long long v = 0;
+    unsigned int shift = 0;
+
+    while (p < end && shift < 64) {
+        v |= (unsigned long long)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *pos = p;
+            *value = v;
+            return 0;
+        }
+        shift += 7;
+    }
+
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_delta
+// Description  : Decode a zigzag varint difference and add it to a base
+//
+// Inputs       : const unsigned char **pos : the input, moved past the value
+//                const unsigned char *end : the end of the input
+//                unsigned long long base : the base value
+//                unsigned long long *value : the output value
+// Outputs      : int : 0 on success, -1 if the input is truncated
+
+static int get_delta(const unsigned char **pos, const unsigned char *end,
+                        unsigned long long base, unsigned long long *value) {
+    unsigned long long zz;
+
+    if (get_varint(pos, end, &zz)) {
+        return -1;
+    }
+    *value = base + ((zz >> 1) ^ (0ULL - (zz & 1)));
+
+    return 0;
+}
+
+//
+// Writer functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_chunk
+// Description  : Write the chunk being filled, padded to the chunk size
+//
+// Inputs       : struct trace_writer *writer : the writer
+// Outputs      : int : 0 on success, -1 on failure
+
+static int flush_chunk(struct trace_writer *writer) {
+    struct trace_chunk_header *chunk = (struct trace_chunk_header *)writer->chunk;
+    unsigned int chunk_size = writer->header.info.chunk_size;
+
+    if (!writer->open) {
+        return 0;
+    }
+
+    chunk->size = writer->used;
+    memset(writer->chunk + sizeof(*chunk) + writer->used, 0,
+            chunk_size - sizeof(*chunk) - writer->used);
+    if (fwrite(writer->chunk, chunk_size, 1, writer->file) != 1) {
+        return -1;
+    }
+
+    writer->header.chunk_count++;
+    writer->open = 0;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_group
+// Description  : Get room for a group of records in the chunk of a thread,
+//                flushing the chunk being filled if it belongs to another
+//                thread or record type, or if it has no room left.
+//
+// Inputs       : struct trace_writer *writer : the writer
+//                unsigned int type : the record type
+//                unsigned long long timestamp : the group timestamp
+//                unsigned int pid : the process ID
+//                unsigned int tid : the thread ID
+//                unsigned int room : the smallest room needed
+// Outputs      : int : the room of the chunk, -1 on failure
+
+static int start_group(struct trace_writer *writer, unsigned int type,
+                        unsigned long long timestamp, unsigned int pid,
+                        unsigned int tid, unsigned int room) {
+    struct trace_chunk_header *chunk = (struct trace_chunk_header *)writer->chunk;
+    unsigned int capacity = writer->header.info.chunk_size - sizeof(*chunk);
+
+    if (writer->open && (chunk->type != type || chunk->pid != pid ||
+                            chunk->tid != tid || capacity - writer->used < room)) {
+        if (flush_chunk(writer)) {
+            return -1;
+        }
+    }
+
+    if (!writer->open) {
+        memset(chunk, 0, sizeof(*chunk));
+        chunk->magic = TRACE_CHUNK_MAGIC;
+        chunk->type = type;
+        chunk->time_start = timestamp;
+        chunk->pid = pid;
+        chunk->tid = tid;
+        writer->used = 0;
+        writer->open = 1;
+        writer->prev_time = timestamp;
+        writer->prev_addr = 0;
+    }
+
+    return (int)(capacity - writer->used);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : end_group
+// Description  : Append an encoded group to the chunk being filled
+//
+// Inputs       : struct trace_writer *writer : the writer
+//                unsigned long long timestamp : the group timestamp
+//                unsigned long long count : the records of the group
+//                const unsigned char *records : the encoded records
+//                unsigned int size : the encoded size of the records
+// Outputs      : None
+
+static void end_group(struct trace_writer *writer, unsigned long long timestamp,
+                        unsigned long long count, const unsigned char *records,
+                        unsigned int size) {
+    struct trace_chunk_header *chunk = (struct trace_chunk_header *)writer->chunk;
+    unsigned char *out = writer->chunk + sizeof(*chunk) + writer->used;
+    unsigned int n;
+
+    n = put_delta(out, timestamp, writer->prev_time);
+    n += put_varint(out + n, count);
+    memmove(out + n, records, size);
+
+    writer->used += n + size;
+    writer->prev_time = timestamp;
+    chunk->time_end = timestamp;
+    chunk->record_count += (unsigned int)count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_writer_create
+// Description  : Create a trace file and write its header and modules
+//
+// Inputs       : const char *path : the file path
+//                const struct trace_info *info : the cpu and chunk size
+//                const struct trace_module *modules : the module maps
+//                unsigned int module_count : number of modules
+// Outputs      : struct trace_writer* : the writer, NULL on failure
+
+struct trace_writer *trace_writer_create(const char *path,
+                                        const struct trace_info *info,
+                                        const struct trace_module *modules,
+                                        unsigned int module_count) {
+    struct trace_writer *writer;
+    unsigned int chunk_size;
+
+    chunk_size = info->chunk_size ? info->chunk_size : TRACE_CHUNK_SIZE;
+    if (chunk_size < TRACE_CHUNK_MIN_SIZE || chunk_size % 64) {
+        return NULL;
+    }
+
+    writer = calloc(1, sizeof(struct trace_writer));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->chunk = malloc(chunk_size * 2);
+    writer->file = fopen(path, "wb");
+    if (writer->chunk == NULL || writer->file == NULL) {
+        goto fail;
+    }
+
+    memcpy(writer->header.magic, TRACE_FILE_MAGIC, sizeof(writer->header.magic));
+    writer->header.version = TRACE_FILE_VERSION;
+    writer->header.module_count = module_count;
+    writer->header.info = *info;
+    writer->header.info.chunk_size = chunk_size;
+    writer->header.data_offset = sizeof(struct trace_file_header) +
+                                    module_count * sizeof(struct trace_module);
+
+    if (fwrite(&writer->header, sizeof(writer->header), 1, writer->file) != 1 ||
+        (module_count &&
+            fwrite(modules, sizeof(struct trace_module), module_count, writer->file) != module_count)) {
+        goto fail;
+    }
+
+    return writer;
+
+fail:
+    if (writer->file) {
+        fclose(writer->file);
+    }
+    free(writer->chunk);
+    free(writer);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_writer_write_lbr
+// Description  : Append an LBR snapshot to the trace file
+//
+// Inputs       : struct trace_writer *writer : the writer
+//                unsigned long long timestamp : the snapshot timestamp
+//                unsigned int pid : the process ID
+//                unsigned int tid : the thread ID
+//                const struct lbr_stack_entry *entries : entries from the
+//                                                        oldest
+//                unsigned int count : number of entries
+// Outputs      : int : 0 on success, -1 on failure
+
+int trace_writer_write_lbr(struct trace_writer *writer,
+                            unsigned long long timestamp,
+                            unsigned int pid, unsigned int tid,
+                            const struct lbr_stack_entry *entries,
+                            unsigned int count) {
+    unsigned char *scratch = writer->chunk + writer->header.info.chunk_size;
+    unsigned long long prev;
+    unsigned int i, n = 0;
+
+    if (count > TRACE_LBR_MAX_ENTRIES) {
+        return -1;
+    }
+    if (start_group(writer, TRACE_RECORD_LBR, timestamp, pid, tid,
+                    GROUP_HEAD_MAX_LEN + VARINT_MAX_LEN +
+                    count * LBR_ENTRY_MAX_LEN) < 0) {
+        return -1;
+    }
+
+    // A snapshot is one record: its entry count, then its entries
+    prev = writer->prev_addr;
+    n += put_varint(scratch, count);
+    for (i = 0; i < count; i++) {
+        n += put_delta(scratch + n, entries[i].from, prev);
+        n += put_delta(scratch + n, entries[i].to, entries[i].from);
+        prev = entries[i].to;
+    }
+
+    writer->prev_addr = prev;
+    end_group(writer, timestamp, 1, scratch, n);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_writer_write_bts
+// Description  : Append BTS records to the trace file, split over as many
+//                chunks as needed
+//
+// Inputs       : struct trace_writer *writer : the writer
+//                unsigned long long timestamp : the records timestamp
+//                unsigned int pid : the process ID
+//                unsigned int tid : the thread ID
+//                const struct bts_record *records : records from the oldest
+//                unsigned long long count : number of records
+// Outputs      : int : 0 on success, -1 on failure
+
+int trace_writer_write_bts(struct trace_writer *writer,
+                            unsigned long long timestamp,
+                            unsigned int pid, unsigned int tid,
+                            const struct bts_record *records,
+                            unsigned long long count) {
+    unsigned char *scratch = writer->chunk + writer->header.info.chunk_size;
+    unsigned long long prev, done = 0, group;
+    unsigned int n;
+    int room;
+
+    while (done < count) {
+        room = start_group(writer, TRACE_RECORD_BTS, timestamp, pid, tid,
+                            GROUP_HEAD_MAX_LEN + BTS_RECORD_MAX_LEN);
+        if (room < 0) {
+            return -1;
+        }
+
+        // Take the records that surely fit with the group head
+        prev = writer->prev_addr;
+        n = 0;
+        group = 0;
+        while (done + group < count &&
+                n + BTS_RECORD_MAX_LEN + GROUP_HEAD_MAX_LEN <= (unsigned int)room) {
+            const struct bts_record *record = &records[done + group];
+
+            n += put_delta(scratch + n, record->from, prev);
+            n += put_delta(scratch + n, record->to, record->from);
+            n += put_varint(scratch + n, record->misc);
+            prev = record->to;
+            group++;
+        }
+
+        writer->prev_addr = prev;
+        end_group(writer, timestamp, group, scratch, n);
+        done += group;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_writer_close
+// Description  : Flush the last chunk, write the chunk count in the header
+//                and close the trace file
+//
+// Inputs       : struct trace_writer *writer : the writer
+// Outputs      : int : 0 on success, -1 on failure
+
+int trace_writer_close(struct trace_writer *writer) {
+    int res = 0;
+
+    if (flush_chunk(writer) ||
+        fseek(writer->file, 0, SEEK_SET) ||
+        fwrite(&writer->header, sizeof(writer->header), 1, writer->file) != 1) {
+        res = -1;
+    }
+    if (fclose(writer->file)) {
+        res = -1;
+    }
+
+    free(writer->chunk);
+    free(writer);
+    return res;
+}
+
+//
+// Reader functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_reader_open
+// Description  : Map a trace file and check its header. Without a chunk
+//                count (the writer was not closed), all complete chunks of
+//                the file are used.
+//
+// Inputs       : struct trace_reader *reader : the reader to fill
+//                const char *path : the file path
+// Outputs      : int : 0 on success, -1 on failure
+
+int trace_reader_open(struct trace_reader *reader, const char *path) {
+    const struct trace_file_header *header;
+    unsigned long long chunks;
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset(reader, 0, sizeof(*reader));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) || (unsigned long long)st.st_size < sizeof(struct trace_file_header)) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    reader->map = map;
+    reader->size = st.st_size;
+    header = map;
+    if (memcmp(header->magic, TRACE_FILE_MAGIC, sizeof(header->magic)) ||
+        header->version != TRACE_FILE_VERSION ||
+        header->info.chunk_size < TRACE_CHUNK_MIN_SIZE ||
+        header->info.chunk_size % 64 ||
+        header->data_offset != sizeof(struct trace_file_header) +
+                                header->module_count * sizeof(struct trace_module) ||
+        header->data_offset > reader->size) {
+        trace_reader_close(reader);
+        return -1;
+    }
+
+    chunks = (reader->size - header->data_offset) / header->info.chunk_size;
+    reader->header = header;
+    reader->modules = (const struct trace_module *)(header + 1);
+    reader->chunk_count = header->chunk_count && header->chunk_count < chunks ?
+                            header->chunk_count : chunks;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_reader_close
+// Description  : Unmap a trace file
+//
+// Inputs       : struct trace_reader *reader : the reader
+// Outputs      : None
+
+void trace_reader_close(struct trace_reader *reader) {
+    if (reader->map) {
+        munmap((void *)reader->map, reader->size);
+    }
+    memset(reader, 0, sizeof(*reader));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_reader_chunk
+// Description  : Get the header of a chunk, with its encoded records after it
+//
+// Inputs       : const struct trace_reader *reader : the reader
+//                unsigned long long index : the chunk index
+// Outputs      : const struct trace_chunk_header* : the chunk, NULL past the
+//                last chunk or if it is corrupted
+
+const struct trace_chunk_header *trace_reader_chunk(const struct trace_reader *reader,
+                                                    unsigned long long index) {
+    const struct trace_chunk_header *chunk;
+    unsigned int chunk_size;
+
+    if (index >= reader->chunk_count) {
+        return NULL;
+    }
+
+    chunk_size = reader->header->info.chunk_size;
+    chunk = (const struct trace_chunk_header *)
+                (reader->map + reader->header->data_offset + index * chunk_size);
+    if (chunk->magic != TRACE_CHUNK_MAGIC ||
+        chunk->size > chunk_size - sizeof(*chunk)) {
+        return NULL;
+    }
+
+    return chunk;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_reader_seek
+// Description  : Binary search the first chunk ending at or after a
+//                timestamp. Chunks are in time order when the records were
+//                written in time order.
+//
+// Inputs       : const struct trace_reader *reader : the reader
+//                unsigned long long timestamp : the timestamp
+// Outputs      : unsigned long long : the chunk index, the chunk count if
+//                all chunks end before the timestamp
+
+unsigned long long trace_reader_seek(const struct trace_reader *reader,
+                                        unsigned long long timestamp) {
+    const struct trace_chunk_header *chunk;
+    unsigned long long lo = 0, hi = reader->chunk_count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        chunk = trace_reader_chunk(reader, mid);
+        if (chunk && chunk->time_end < timestamp) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_chunk_decode_bts
+// Description  : Decode the BTS records of a chunk
+//
+// Inputs       : const struct trace_chunk_header *chunk : the chunk
+//                struct bts_record *records : the output records
+//                unsigned long long *timestamps : the output timestamps of
+//                                                 the records, or NULL
+//                unsigned long long count : the output size, the chunk
+//                                           record_count is enough
+// Outputs      : long long : the number of records, -1 if the chunk is
+//                corrupted or holds no BTS records
+
+long long trace_chunk_decode_bts(const struct trace_chunk_header *chunk,
+                                    struct bts_record *records,
+                                    unsigned long long *timestamps,
+                                    unsigned long long count) {
+    const unsigned char *pos = (const unsigned char *)(chunk + 1);
+    const unsigned char *end = pos + chunk->size;
+    unsigned long long time = chunk->time_start, prev = 0, group, i, n = 0;
+    struct bts_record record;
+
+    if (chunk->type != TRACE_RECORD_BTS) {
+        return -1;
+    }
+
+    while (pos < end && n < count) {
+        if (get_delta(&pos, end, time, &time) || get_varint(&pos, end, &group)) {
+            return -1;
+        }
+        for (i = 0; i < group && n < count; i++) {
+            if (get_delta(&pos, end, prev, &record.from) ||
+                get_delta(&pos, end, record.from, &record.to) ||
+                get_varint(&pos, end, &record.misc)) {
+                return -1;
+            }
+            prev = record.to;
+            records[n] = record;
+            if (timestamps) {
+                timestamps[n] = time;
+            }
+            n++;
+        }
+    }
+
+    return (long long)n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_chunk_decode_lbr
+// Description  : Decode the LBR snapshots of a chunk
+//
+// Inputs       : const struct trace_chunk_header *chunk : the chunk
+//                struct trace_lbr_snapshot *snapshots : the output snapshots
+//                unsigned long long count : the output size, the chunk
+//                                           record_count is enough
+// Outputs      : long long : the number of snapshots, -1 if the chunk is
+//                corrupted or holds no LBR snapshots
+
+long long trace_chunk_decode_lbr(const struct trace_chunk_header *chunk,
+                                    struct trace_lbr_snapshot *snapshots,
+                                    unsigned long long count) {
+    const unsigned char *pos = (const unsigned char *)(chunk + 1);
+    const unsigned char *end = pos + chunk->size;
+    unsigned long long time = chunk->time_start, prev = 0, group, entries, i, j, n = 0;
+    struct trace_lbr_snapshot *snapshot;
+
+    if (chunk->type != TRACE_RECORD_LBR) {
+        return -1;
+    }
+
+    while (pos < end && n < count) {
+        if (get_delta(&pos, end, time, &time) || get_varint(&pos, end, &group)) {
+            return -1;
+        }
+        for (i = 0; i < group && n < count; i++) {
+            if (get_varint(&pos, end, &entries) || entries > TRACE_LBR_MAX_ENTRIES) {
+                return -1;
+            }
+            snapshot = &snapshots[n++];
+            snapshot->timestamp = time;
+            snapshot->count = (unsigned int)entries;
+            snapshot->reserved = 0;
+            for (j = 0; j < entries; j++) {
+                if (get_delta(&pos, end, prev, &snapshot->entries[j].from) ||
+                    get_delta(&pos, end, snapshot->entries[j].from,
+                                &snapshot->entries[j].to)) {
+                    return -1;
+                }
+                prev = snapshot->entries[j].to;
+            }
+        }
+    }
+
+    return (long long)n;
+}
+
+//
+// System functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_read_cpu_info
+// Description  : Fill the cpu family, model and stepping of a trace info
+//                from cpuid, and its LBR depth from the perf cpu caps
+//
+// Inputs       : struct trace_info *info : the trace info
+// Outputs      : int : 0 on success, -1 on failure
+
+int trace_read_cpu_info(struct trace_info *info) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx, family;
+    FILE *caps;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return -1;
+    }
+
+    family = (eax >> 8) & 0xf;
+    info->cpu_model = (eax >> 4) & 0xf;
+    if (family == 0x6 || family == 0xf) {
+        info->cpu_model |= ((eax >> 16) & 0xf) << 4;
+    }
+    if (family == 0xf) {
+        family += (eax >> 20) & 0xff;
+    }
+    info->cpu_family = family;
+    info->cpu_stepping = eax & 0xf;
+
+    info->lbr_depth = 0;
+    caps = fopen("/sys/bus/event_source/devices/cpu/caps/branches", "r");
+    if (caps) {
+        if (fscanf(caps, "%u", &info->lbr_depth) != 1) {
+            info->lbr_depth = 0;
+        }
+        fclose(caps);
+    }
+
+    return 0;
+#else
+    (void)info;
+    return -1;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_read_modules
+// Description  : Read the executable mappings of a process from its maps
+//
+// Inputs       : unsigned int pid : the process ID (0 for the caller)
+//                struct trace_module *modules : the output modules
+//                unsigned int module_count : the output size
+// Outputs      : int : the number of modules, -1 on failure
+
+int trace_read_modules(unsigned int pid, struct trace_module *modules,
+                        unsigned int module_count) {
+    char path[64], line[512], perms[8];
+    unsigned long long start, end, offset;
+    unsigned int n = 0;
+    int pos;
+    FILE *maps;
+
+    if (pid) {
+        snprintf(path, sizeof(path), "/proc/%u/maps", pid);
+    }
+    else {
+        snprintf(path, sizeof(path), "/proc/self/maps");
+    }
+    maps = fopen(path, "r");
+    if (maps == NULL) {
+        return -1;
+    }
+
+    while (n < module_count && fgets(line, sizeof(line), maps)) {
+        // start-end perms offset dev inode path
+        if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &start, &end, perms,
+                    &offset, &pos) != 4 || perms[2] != 'x') {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+
+        modules[n].start = start;
+        modules[n].end = end;
+        modules[n].offset = offset;
+        snprintf(modules[n].path, sizeof(modules[n].path), "%s", line + pos);
+        n++;
+    }
+
+    fclose(maps);
+    return (int)n;
+}
@@ -0,0 +1,192 @@
+#ifndef LIBIHT_TRACE_FILE_H
+#define LIBIHT_TRACE_FILE_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/trace_file.h
+//  Description    : This is the header file for the on-disk trace format. A
+//                   trace file holds LBR snapshots and BTS records in fixed
+//                   size chunks after a header with the cpu model, the LBR
+//                   depth and the module maps. Each chunk starts with its own
+//                   index entry and is delta and varint encoded on its own,
+//                   so a reader can mmap the file, binary search the chunks
+//                   by time and decode only the chunks it needs.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+//
+// Library constants
+
+// File magic and version
+#define TRACE_FILE_MAGIC        "LIBIHTTR"
+#define TRACE_FILE_VERSION      1
+
+// Chunk magic ("CHNK")
+#define TRACE_CHUNK_MAGIC       0x4b4e4843
+
+// Default chunk size, chunk sizes are multiples of 64 bytes
+#define TRACE_CHUNK_SIZE        0x10000
+
+// Length of a module path, with its terminating zero
+#define TRACE_MODULE_PATH_LEN   232
+
+// Maximum number of entries of a decoded LBR snapshot
+#define TRACE_LBR_MAX_ENTRIES   32
+
+// Chunk record types
+enum TRACE_RECORD_TYPE {
+    TRACE_RECORD_LBR = 1,       // LBR snapshots
+    TRACE_RECORD_BTS,           // BTS records
+};
+
+//
+// Type definitions
+
+// Define LBR stack entry, same layout as the kernel one
+#ifndef LIBIHT_LBR_STACK_ENTRY
+#define LIBIHT_LBR_STACK_ENTRY
+struct lbr_stack_entry {
+    unsigned long long from;
+    unsigned long long to;
+};
+#endif // LIBIHT_LBR_STACK_ENTRY
+
+// Define BTS record, same layout as the kernel one
+#ifndef LIBIHT_BTS_RECORD
+#define LIBIHT_BTS_RECORD
+struct bts_record {
+    unsigned long long from;
+    unsigned long long to;
+    unsigned long long misc;
+};
+#endif // LIBIHT_BTS_RECORD
+
+// Define traced cpu and file layout, given to the writer
+struct trace_info {
+    unsigned int cpu_family;
+    unsigned int cpu_model;
+    unsigned int cpu_stepping;
+    unsigned int lbr_depth;     // LBR entries of the cpu
+    unsigned int chunk_size;    // Chunk size (0 for TRACE_CHUNK_SIZE)
+};
+
+// Define executable mapping of a traced process
+struct trace_module {
+    unsigned long long start;   // Start address of the mapping
+    unsigned long long end;     // End address of the mapping
+    unsigned long long offset;  // File offset of the mapping
+    char path[TRACE_MODULE_PATH_LEN];
+};
+
+// Define file header, followed by the modules and then the chunks
+struct trace_file_header {
+    char magic[8];              // TRACE_FILE_MAGIC
+    unsigned int version;       // TRACE_FILE_VERSION
+    unsigned int module_count;  // Modules after the header
+    struct trace_info info;
+    unsigned int reserved;
+    unsigned long long data_offset; // File offset of the first chunk
+    unsigned long long chunk_count; // Chunks, 0 until the writer is closed
+};
+
+// Define chunk header, the index entry of a chunk
+struct trace_chunk_header {
+    unsigned int magic;         // TRACE_CHUNK_MAGIC
+    unsigned int type;          // Record type (enum TRACE_RECORD_TYPE)
+    unsigned long long time_start; // Timestamp of the first record
+    unsigned long long time_end; // Timestamp of the last record
+    unsigned int pid;
+    unsigned int tid;
+    unsigned int record_count;  // BTS records or LBR snapshots
+    unsigned int size;          // Encoded bytes after the header
+};
+
+// Define decoded LBR snapshot, entries from the oldest
+struct trace_lbr_snapshot {
+    unsigned long long timestamp;
+    unsigned int count;         // Valid entries
+    unsigned int reserved;
+    struct lbr_stack_entry entries[TRACE_LBR_MAX_ENTRIES];
+};
+
+// Define trace writer
+struct trace_writer;
+
+// Define trace reader, the file is mapped read only
+struct trace_reader {
+    const unsigned char *map;   // Mapped file
+    unsigned long long size;    // Mapped size
+    const struct trace_file_header *header;
+    const struct trace_module *modules;
+    unsigned long long chunk_count; // Complete chunks in the file
+};
+
+//
+// Function prototypes
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+int trace_read_cpu_info(struct trace_info *info);
+// Fill the cpu fields of a trace info from the current cpu
+
+int trace_read_modules(unsigned int pid, struct trace_module *modules,
+                        unsigned int module_count);
+// Read the executable mappings of a process, returns their number
+
+struct trace_writer *trace_writer_create(const char *path,
+                                        const struct trace_info *info,
+                                        const struct trace_module *modules,
+                                        unsigned int module_count);
+// Create a trace file and write its header
+
+int trace_writer_write_lbr(struct trace_writer *writer,
+                            unsigned long long timestamp,
+                            unsigned int pid, unsigned int tid,
+                            const struct lbr_stack_entry *entries,
+                            unsigned int count);
+// Append an LBR snapshot, entries from the oldest
+
+int trace_writer_write_bts(struct trace_writer *writer,
+                            unsigned long long timestamp,
+                            unsigned int pid, unsigned int tid,
+                            const struct bts_record *records,
+                            unsigned long long count);
+// Append BTS records, from the oldest
+
+int trace_writer_close(struct trace_writer *writer);
+// Flush the last chunk, finish the header and close the file
+
+int trace_reader_open(struct trace_reader *reader, const char *path);
+// Map a trace file and check its header
+
+void trace_reader_close(struct trace_reader *reader);
+// Unmap a trace file
+
+const struct trace_chunk_header *trace_reader_chunk(const struct trace_reader *reader,
+                                                    unsigned long long index);
+// Get the header of a chunk, NULL past the last chunk
+
+unsigned long long trace_reader_seek(const struct trace_reader *reader,
+                                        unsigned long long timestamp);
+// Find the first chunk ending at or after a timestamp
+
+long long trace_chunk_decode_bts(const struct trace_chunk_header *chunk,
+                                    struct bts_record *records,
+                                    unsigned long long *timestamps,
+                                    unsigned long long count);
+// Decode the BTS records of a chunk, returns their number
+
+long long trace_chunk_decode_lbr(const struct trace_chunk_header *chunk,
+                                    struct trace_lbr_snapshot *snapshots,
+                                    unsigned long long count);
+// Decode the LBR snapshots of a chunk, returns their number
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // LIBIHT_TRACE_FILE_H
@@ -79,11 +79,20 @@ int main(int argc, char* argv[]){
     disable_lbr(query);
 
     // Print LBR buffer
+    struct symbolizer *sym = symbolizer_alloc();
+    struct symbol_info from, to;
+    symbolizer_load_process(sym, 0);
+
     printf("LBR TOS: %lld\n", query.buffer->lbr_tos);
     for (int i = 0; i < 32; i++)
     {
-        printf("LBR[%d]: 0x%llx -> 0x%llx\n", i, query.buffer->entries[i].from, query.buffer->entries[i].to);
+        symbolizer_lookup(sym, query.buffer->entries[i].from, &from);
+        symbolizer_lookup(sym, query.buffer->entries[i].to, &to);
+        printf("LBR[%d]: 0x%llx (%s+0x%llx) -> 0x%llx (%s+0x%llx)\n", i,
+                query.buffer->entries[i].from, from.name ? from.name : "?", from.offset,
+                query.buffer->entries[i].to, to.name ? to.name : "?", to.offset);
     }
+    symbolizer_free(sym);
 #endif
 #ifdef ENABLE_BTS
     // Enable BTS
@@ -102,10 +111,20 @@ int main(int argc, char* argv[]){
     while (bts_tos < 1024 && (query.buffer->bts_buffer_base[bts_tos].from !=0 || query.buffer->bts_buffer_base[bts_tos].to != 0)) {
         bts_tos ++;
     }
+    struct symbolizer *sym = symbolizer_alloc();
+    struct symbol_info from, to;
+    symbolizer_load_process(sym, 0);
+
     printf("BTS TOS: %d\n", bts_tos);
     for (int i = 0; i < bts_tos; i++) {
-        printf("BTS[%d]: 0x%llx -> 0x%llx %llu\n", i, query.buffer->bts_buffer_base[i].from, query.buffer->bts_buffer_base[i].to, query.buffer->bts_buffer_base[i].misc);
+        symbolizer_lookup(sym, query.buffer->bts_buffer_base[i].from, &from);
+        symbolizer_lookup(sym, query.buffer->bts_buffer_base[i].to, &to);
+        printf("BTS[%d]: 0x%llx (%s+0x%llx) -> 0x%llx (%s+0x%llx) %llu\n", i,
+                query.buffer->bts_buffer_base[i].from, from.name ? from.name : "?", from.offset,
+                query.buffer->bts_buffer_base[i].to, to.name ? to.name : "?", to.offset,
+                query.buffer->bts_buffer_base[i].misc);
     }
+    symbolizer_free(sym);
     printf("\n");
 #endif
     return 0;
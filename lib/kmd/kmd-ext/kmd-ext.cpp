@@ -1,6 +1,7 @@
 #include "pch.h"
 #include "kmd-ext.h"
 #include "kmd.h"
+#include "../../commons/records.hpp"
 
 WINDBG_EXTENSION_APIS ExtensionApis;
 
@@ -110,10 +111,9 @@ DumpLBR() {
 	}
 	dprintf("LIBIHT-WINDBG: dump lbr for pid : %d\n", lbr_req.lbr_config.pid);
 	dump_lbr(lbr_req);
-	unsigned long long lbr_tos = lbr_req.buffer->lbr_tos;
-	for (int i = 0; i < (int)lbr_tos; i++) {
-		dprintf("MSR_LBR_NHM_FROM[ %d ]: %llx\n", i, lbr_req.buffer->entries[i].from);
-		dprintf("MSR_LBR_NHM_FROM[ %d ]: %llx\n", i, lbr_req.buffer->entries[i].to);
+	int i = 0;
+	for (const lbr_stack_entry& entry : libiht::lbr_records(*lbr_req.buffer)) {
+		dprintf("LBR[ %d ]: 0x%llx -> 0x%llx\n", i++, entry.from, entry.to);
 	}
 }
 
@@ -166,10 +166,10 @@ DumpBTS() {
 	}
 	dprintf("LIBIHT-WINDBG: dump lbr for pid : %d\n", bts_req.bts_config.pid);
 	dump_bts(bts_req);
-	int bts_tos = 32;
-	dprintf("%d\n", bts_tos);
-	for (int i = 0; i < bts_tos; i++) {
-		dprintf("0x%llx 0x%llx %llu\n", bts_req.buffer->bts_buffer_base[i].from, bts_req.buffer->bts_buffer_base[i].to, bts_req.buffer->bts_buffer_base[i].misc);
+	libiht::bts_view records = libiht::bts_records(*bts_req.buffer, MAX_BTS_LIST_LEN);
+	dprintf("%zu\n", records.size());
+	for (const bts_record& record : records) {
+		dprintf("0x%llx 0x%llx %llu\n", record.from, record.to, record.misc);
 	}
 	dprintf("\n");
 }
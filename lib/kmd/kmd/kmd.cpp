@@ -11,6 +11,7 @@
 #include "pch.h" // use stdafx.h in Visual Studio 2017 and earlier
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <windows.h>
 #include <winioctl.h>
 #include "kmd.h"
@@ -36,6 +37,7 @@ struct xioctl_request lbr_send_request;
 // Outputs      : struct lbr_ioctl_request - the LBR configuration request 
 struct lbr_ioctl_request enable_lbr(unsigned int pid) {
     struct lbr_ioctl_request usr_request;
+    memset(&usr_request, 0, sizeof(usr_request));
     if (pid == 0) {
         usr_request.lbr_config.pid = GetCurrentProcessId();
     }
@@ -49,6 +51,8 @@ struct lbr_ioctl_request enable_lbr(unsigned int pid) {
     usr_request.buffer = (struct lbr_data*)malloc(sizeof(struct lbr_data));
     usr_request.buffer->lbr_tos = 0;
     usr_request.buffer->entries = (struct lbr_stack_entry*)malloc(sizeof(struct lbr_stack_entry) * MAX_LBR_LIST_LEN);
+    usr_request.buffer->tid = 0;
+    usr_request.buffer->entry_count = MAX_LBR_LIST_LEN;
 
     lbr_hDevice = CreateFileA("\\\\.\\libiht-info", GENERIC_READ |
         GENERIC_WRITE, 0,
@@ -130,6 +134,7 @@ struct xioctl_request bts_send_request;
 // Outputs      : struct bts_ioctl_request - the BTS configuration request structure
 struct bts_ioctl_request enable_bts(unsigned int pid) {
     struct bts_ioctl_request usr_request;
+    memset(&usr_request, 0, sizeof(usr_request));
     if (pid == 0) {
         usr_request.bts_config.pid = GetCurrentProcessId();
     }
@@ -143,7 +148,9 @@ struct bts_ioctl_request enable_bts(unsigned int pid) {
     usr_request.bts_config.bts_buffer_size = 0;
     usr_request.buffer = (struct bts_data*)malloc(sizeof(struct bts_data));
     usr_request.buffer->bts_buffer_base = (struct bts_record*)malloc(sizeof(struct bts_record) * MAX_BTS_LIST_LEN);
-    usr_request.buffer->bts_index = (struct bts_record*)malloc(sizeof(struct bts_record) * MAX_BTS_LIST_LEN);
+    usr_request.buffer->bts_index = NULL;
+    usr_request.buffer->tid = 0;
+    usr_request.buffer->record_count = 0;
 
     bts_hDevice = CreateFileA("\\\\.\\libiht-info", GENERIC_READ |
         GENERIC_WRITE, 0,
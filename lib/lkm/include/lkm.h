@@ -12,10 +12,80 @@
 //
 
 #include "../../commons/api.h"
+#include "../../commons/pt_decoder.h"
+#include "../../commons/trace_file.h"
+#include "../../commons/record_batch.h"
+#include "../../commons/symbolizer.h"
+
+//
+// Type definitions
+
+// Features of a tracee
+enum IHT_FEATURE {
+    IHT_FEATURE_LBR,
+    IHT_FEATURE_BTS,
+    IHT_FEATURE_PT,
+};
+
+// Define library handle, owning a device file descriptor
+struct iht_handle {
+    int fd;
+};
+
+// Define tracee, one enabled feature of a thread or process on a handle
+struct iht_tracee {
+    struct iht_handle *handle;  // Handle the feature was enabled on
+    unsigned int feature;       // Traced feature (enum IHT_FEATURE)
+    unsigned long long capacity; // Elements of the tracee dump buffer
+    union {
+        struct lbr_ioctl_request lbr;
+        struct bts_ioctl_request bts;
+        struct pt_ioctl_request pt;
+    } request;                  // Request and dump buffers of the feature
+};
+
+// What the collector does when the ring of a consumer is full
+enum IHT_RING_POLICY {
+    IHT_RING_DROP,              // Drop the new batch
+    IHT_RING_WAIT,              // Wait for the consumer, then drop
+};
+
+// Batch flags
+#define IHT_BATCH_WRAPPED   0x1 // The PT buffer wrapped, older packets lost
+
+// Define batch, the records of one dumped thread published by a collector
+struct iht_batch {
+    unsigned int tracee_id;     // Tracee id given by iht_collector_add
+    unsigned int feature;       // Traced feature (enum IHT_FEATURE)
+    unsigned int tid;           // Thread ID of the records
+    unsigned int flags;         // Batch flags
+    unsigned long long seq;     // Sequence number of the batch in its ring
+    unsigned long long timestamp; // CLOCK_MONOTONIC time of the dump in ns
+    unsigned long long count;   // Number of records (PT: packet bytes)
+    void *records;              // Records from the oldest: lbr_stack_entry,
+                                // bts_record or PT packet bytes
+};
+
+// Define ring counters
+struct iht_ring_stats {
+    unsigned long long published; // Batches published
+    unsigned long long dropped; // Batches dropped on a full ring
+    unsigned long long dropped_records; // Records of the dropped batches
+    unsigned long long waits;   // Times the collector waited for the consumer
+    unsigned long long errors;  // Failed dumps of the ring tracees
+};
+
+// Collector and ring, opaque
+struct iht_collector;
+struct iht_ring;
 
 //
 // Function prototypes
 
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
 // TODO: Redefine the functions, current design is bad architected :(
 
 // For LBR
@@ -32,6 +102,26 @@ void dump_lbr(struct lbr_ioctl_request usr_request);
 void config_lbr(struct lbr_ioctl_request usr_request);
 // Configure LBR for a user request
 
+void pause_lbr(struct lbr_ioctl_request usr_request);
+// Pause LBR for a user request, keeping its state
+
+void resume_lbr(struct lbr_ioctl_request usr_request);
+// Resume LBR for a user request
+
+struct lbr_ioctl_request enable_lbr_offcpu(unsigned int pid, unsigned int records);
+// Enable LBR with an off-cpu snapshot ring for a given process ID
+
+int dump_lbr_offcpu(struct lbr_ioctl_request usr_request);
+// Dump the off-cpu LBR snapshots for a user request
+
+struct lbr_ioctl_request enable_lbr_syscall(unsigned int pid, unsigned int records,
+                                    const unsigned int *syscalls,
+                                    unsigned int syscall_count);
+// Enable LBR with a syscall snapshot ring for a given process ID
+
+int dump_lbr_syscall(struct lbr_ioctl_request usr_request);
+// Dump the syscall LBR snapshots for a user request
+
 // For BTS
 
 struct bts_ioctl_request enable_bts(unsigned int pid);
@@ -46,4 +136,186 @@ void dump_bts(struct bts_ioctl_request usr_request);
 void config_bts(struct bts_ioctl_request usr_request);
 // Configure BTS for a user request
 
+void pause_bts(struct bts_ioctl_request usr_request);
+// Pause BTS for a user request, keeping its state and buffer
+
+void resume_bts(struct bts_ioctl_request usr_request);
+// Resume BTS for a user request
+
+struct bts_ioctl_request enable_bts_pebs(unsigned int pid, unsigned int event,
+                                    unsigned long long period,
+                                    unsigned int latency, unsigned int records);
+// Enable BTS with PEBS records of a PMU event for a given process ID
+
+int dump_pebs(struct bts_ioctl_request usr_request);
+// Dump the PEBS records for a user request
+
+// For CPU scope tracing
+
+struct cpu_ioctl_request enable_cpu_trace(unsigned int features,
+                                    const unsigned long long *cpu_mask);
+// Enable CPU scope tracing on the cpus of a mask (NULL for all cpus)
+
+void disable_cpu_trace(struct cpu_ioctl_request usr_request);
+// Disable CPU scope tracing for a user request
+
+int dump_cpu_trace(struct cpu_ioctl_request usr_request, unsigned int cpu);
+// Dump CPU scope trace of a cpu for a user request
+
+struct cpu_ioctl_request enable_cgroup_trace(unsigned int features,
+                                    const char **cgroup_paths,
+                                    unsigned int cgroup_count);
+// Enable CPU scope tracing for the tasks of cgroup v2 directories
+
+unsigned long long cgroup_id_from_path(const char *cgroup_path);
+// Get the cgroup v2 id of a cgroup directory
+
+// For exec rules
+
+int add_exec_rule(struct exec_rule rule);
+// Add an exec rule, returns the rule id
+
+void del_exec_rule(unsigned int rule_id);
+// Delete an exec rule by its id
+
+void clear_exec_rules(void);
+// Delete all exec rules
+
+// For trace gates
+
+struct trace_gate *attach_trace_gate(void);
+// Map a trace gate and attach it to the calling thread
+
+void detach_trace_gate(struct trace_gate *gate);
+// Detach and unmap the trace gate of the calling thread
+
+int dump_trace_gate(struct gate_region_record *records, unsigned int record_count);
+// Dump the region records of all trace gates
+
+// For trace windows
+
+int add_trace_window(struct trace_window window);
+// Add a trace window on a binary, returns the window id
+
+void del_trace_window(unsigned int window_id);
+// Delete a trace window by its id
+
+void clear_trace_windows(void);
+// Delete all trace windows
+
+// For LBR sampling
+
+struct sample_ioctl_request enable_lbr_sampling(unsigned int event,
+                                    unsigned long long period,
+                                    const unsigned long long *cpu_mask);
+// Enable LBR sampling on a PMU event on the cpus of a mask (NULL for all cpus)
+
+struct sample_ioctl_request enable_lbr_timer_sampling(unsigned int pid,
+                                    unsigned int frequency,
+                                    const unsigned long long *cpu_mask);
+// Enable timer driven LBR sampling of a task (0 for all) at a frequency in Hz
+
+void disable_lbr_sampling(struct sample_ioctl_request usr_request);
+// Disable LBR sampling for a user request
+
+int dump_lbr_sampling(struct sample_ioctl_request usr_request, unsigned int cpu);
+// Dump the LBR samples of a cpu for a user request
+
+// For crash capture
+
+int dump_crash_records(struct crash_record *records, unsigned int record_count);
+// Dump the crash records of all traced threads
+
+// For Intel PT
+
+struct pt_ioctl_request enable_pt(unsigned int pid);
+// Enable Intel PT for a given process ID
+
+struct pt_ioctl_request enable_pt_ranges(unsigned int pid,
+                                    const struct pt_range *ranges,
+                                    unsigned int range_count,
+                                    unsigned int cr3_filter);
+// Enable Intel PT for a given process ID, filtered by address ranges
+
+void disable_pt(struct pt_ioctl_request usr_request);
+// Disable Intel PT for a user request
+
+int dump_pt(struct pt_ioctl_request usr_request);
+// Dump the Intel PT packets for a user request
+
+// For handles
+
+struct iht_handle *iht_open(void);
+// Open a library handle with its own device file descriptor
+
+void iht_close(struct iht_handle *handle);
+// Close a library handle
+
+struct iht_tracee *iht_enable_lbr(struct iht_handle *handle, struct lbr_config config);
+// Enable LBR on a handle, returns the tracee
+
+struct iht_tracee *iht_enable_bts(struct iht_handle *handle, struct bts_config config);
+// Enable BTS on a handle, returns the tracee
+
+struct iht_tracee *iht_enable_pt(struct iht_handle *handle, struct pt_config config);
+// Enable Intel PT on a handle, returns the tracee
+
+int iht_send(struct iht_tracee *tracee, enum IOCTL cmd);
+// Send a command of the tracee feature with the tracee request
+
+int iht_dump(struct iht_tracee *tracee);
+// Dump the trace of a tracee into its buffers
+
+unsigned long long iht_buffer_size(struct iht_tracee *tracee);
+// Get the number of elements a dump buffer of a tracee must hold
+
+int iht_dump_lbr(struct iht_tracee *tracee, struct lbr_data *data, unsigned int count);
+// Dump the LBR stack of a tracee into caller owned buffers
+
+int iht_dump_bts(struct iht_tracee *tracee, struct bts_data *data, unsigned int count);
+// Dump the BTS records of a tracee into caller owned buffers
+
+int iht_dump_pt(struct iht_tracee *tracee, struct pt_data *data, unsigned int count);
+// Dump the PT packets of a tracee into caller owned buffers
+
+int iht_disable(struct iht_tracee *tracee);
+// Disable the trace of a tracee and free it
+
+// For collectors
+
+struct iht_collector *iht_collector_create(unsigned int interval_us);
+// Create a collector draining its tracees every interval
+
+struct iht_ring *iht_collector_add_ring(struct iht_collector *collector,
+                                        unsigned int slots,
+                                        enum IHT_RING_POLICY policy,
+                                        unsigned int wait_us);
+// Add the batch ring of a consumer to a collector
+
+int iht_collector_add(struct iht_collector *collector, struct iht_tracee *tracee,
+                        struct iht_ring *ring, unsigned int threads);
+// Add a tracee to a collector, publishing on a ring, returns the tracee id
+
+int iht_collector_start(struct iht_collector *collector);
+// Start the collector thread
+
+void iht_collector_stop(struct iht_collector *collector);
+// Stop the collector thread after a last drain
+
+void iht_collector_free(struct iht_collector *collector);
+// Stop and free a collector with its rings
+
+struct iht_batch *iht_ring_peek(struct iht_ring *ring);
+// Get the oldest batch of a ring, NULL if it is empty
+
+void iht_ring_release(struct iht_ring *ring);
+// Release the oldest batch of a ring
+
+void iht_ring_stats(struct iht_ring *ring, struct iht_ring_stats *stats);
+// Get the counters of a ring
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
 #endif // LIBIHT_LKM_H
\ No newline at end of file
@@ -0,0 +1,227 @@
+#ifndef LIBIHT_LKM_HPP
+#define LIBIHT_LKM_HPP
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/lkm/include/lkm.hpp
+//  Description    : This is the header only C++17 layer over the handle APIs
+//                   of the Linux kernel module (LKM) library. Sessions and
+//                   tracees release their handle and trace when destroyed,
+//                   buffers own their dump memory and are move only, and
+//                   dumps are read through the record views.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#include "lkm.h"
+#include "../../commons/records.hpp"
+
+#include <cerrno>
+#include <cstddef>
+#include <memory>
+#include <system_error>
+#include <utility>
+
+namespace libiht {
+
+class tracee;
+
+//
+// Type definitions
+
+// Define LBR dump buffers, one per traced thread
+class lbr_buffer {
+public:
+    explicit lbr_buffer(std::size_t count = 1)
+        : data_(new lbr_data[count]()),
+          entries_(new lbr_stack_entry[count * LIBIHT_LBR_MAX_ENTRIES]()),
+          count_(count)
+    {
+        for (std::size_t i = 0; i < count; i++)
+            data_[i].entries = &entries_[i * LIBIHT_LBR_MAX_ENTRIES];
+    }
+
+    lbr_buffer(lbr_buffer &&) noexcept = default;
+    lbr_buffer &operator=(lbr_buffer &&) noexcept = default;
+    lbr_buffer(const lbr_buffer &) = delete;
+    lbr_buffer &operator=(const lbr_buffer &) = delete;
+
+    lbr_data *data() noexcept { return data_.get(); }
+    std::size_t count() const noexcept { return count_; }
+    const lbr_data &operator[](std::size_t i) const noexcept { return data_[i]; }
+    lbr_view records(std::size_t i = 0) const noexcept { return lbr_records(data_[i]); }
+
+private:
+    std::unique_ptr<lbr_data[]> data_;
+    std::unique_ptr<lbr_stack_entry[]> entries_;
+    std::size_t count_;
+};
+
+// Define BTS dump buffers, one per traced thread
+class bts_buffer {
+public:
+    inline explicit bts_buffer(tracee &owner, std::size_t count = 1);
+
+    bts_buffer(bts_buffer &&) noexcept = default;
+    bts_buffer &operator=(bts_buffer &&) noexcept = default;
+    bts_buffer(const bts_buffer &) = delete;
+    bts_buffer &operator=(const bts_buffer &) = delete;
+
+    bts_data *data() noexcept { return data_.get(); }
+    std::size_t count() const noexcept { return count_; }
+    std::size_t capacity() const noexcept { return capacity_; }
+    const bts_data &operator[](std::size_t i) const noexcept { return data_[i]; }
+    bts_view records(std::size_t i = 0) const noexcept { return bts_records(data_[i], capacity_); }
+
+private:
+    std::unique_ptr<bts_data[]> data_;
+    std::unique_ptr<bts_record[]> records_;
+    std::size_t count_;
+    std::size_t capacity_;      // Records of each buffer
+};
+
+// Define PT dump buffers, one per traced thread
+class pt_buffer {
+public:
+    inline explicit pt_buffer(tracee &owner, std::size_t count = 1);
+
+    pt_buffer(pt_buffer &&) noexcept = default;
+    pt_buffer &operator=(pt_buffer &&) noexcept = default;
+    pt_buffer(const pt_buffer &) = delete;
+    pt_buffer &operator=(const pt_buffer &) = delete;
+
+    pt_data *data() noexcept { return data_.get(); }
+    std::size_t count() const noexcept { return count_; }
+    std::size_t capacity() const noexcept { return capacity_; }
+    const pt_data &operator[](std::size_t i) const noexcept { return data_[i]; }
+
+private:
+    std::unique_ptr<pt_data[]> data_;
+    std::unique_ptr<unsigned char[]> bytes_;
+    std::size_t count_;
+    std::size_t capacity_;      // Packet bytes of each buffer
+};
+
+// Define tracee, disables its trace when destroyed
+class tracee {
+public:
+    explicit tracee(iht_tracee *t) : t_(t)
+    {
+        if (!t_)
+            throw std::system_error(errno ? errno : EINVAL, std::generic_category(),
+                                    "libiht: enable trace failed");
+    }
+
+    ~tracee() { reset(); }
+
+    tracee(tracee &&other) noexcept : t_(std::exchange(other.t_, nullptr)) {}
+    tracee &operator=(tracee &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            t_ = std::exchange(other.t_, nullptr);
+        }
+        return *this;
+    }
+    tracee(const tracee &) = delete;
+    tracee &operator=(const tracee &) = delete;
+
+    iht_tracee *get() const noexcept { return t_; }
+    std::size_t buffer_size() const noexcept { return (std::size_t)iht_buffer_size(t_); }
+
+    int send(enum IOCTL cmd) noexcept { return iht_send(t_, cmd); }
+
+    // Dump into caller buffers, returns the number of buffers filled or -1
+    int dump(lbr_buffer &buf) noexcept
+    {
+        return iht_dump_lbr(t_, buf.data(), (unsigned int)buf.count());
+    }
+    int dump(bts_buffer &buf) noexcept
+    {
+        return iht_dump_bts(t_, buf.data(), (unsigned int)buf.count());
+    }
+    int dump(pt_buffer &buf) noexcept
+    {
+        return iht_dump_pt(t_, buf.data(), (unsigned int)buf.count());
+    }
+
+    // Disable the trace now, returns the disable result
+    int reset() noexcept
+    {
+        int res = 0;
+        if (t_)
+            res = iht_disable(std::exchange(t_, nullptr));
+        return res;
+    }
+
+private:
+    iht_tracee *t_;
+};
+
+// Define session, owning a library handle
+class session {
+public:
+    session() : h_(iht_open())
+    {
+        if (!h_)
+            throw std::system_error(errno, std::generic_category(),
+                                    "libiht: open device failed");
+    }
+
+    ~session()
+    {
+        if (h_)
+            iht_close(h_);
+    }
+
+    session(session &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+    session &operator=(session &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (h_)
+                iht_close(h_);
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+    session(const session &) = delete;
+    session &operator=(const session &) = delete;
+
+    iht_handle *get() const noexcept { return h_; }
+
+    // Tracees must be destroyed before their session
+    tracee enable_lbr(const lbr_config &config) { return tracee(iht_enable_lbr(h_, config)); }
+    tracee enable_bts(const bts_config &config) { return tracee(iht_enable_bts(h_, config)); }
+    tracee enable_pt(const pt_config &config) { return tracee(iht_enable_pt(h_, config)); }
+
+private:
+    iht_handle *h_;
+};
+
+//
+// Buffer constructors, sized by the tracee configuration
+
+inline bts_buffer::bts_buffer(tracee &owner, std::size_t count)
+    : count_(count), capacity_(owner.buffer_size())
+{
+    data_.reset(new bts_data[count]());
+    records_.reset(new bts_record[count * capacity_]());
+    for (std::size_t i = 0; i < count; i++)
+        data_[i].bts_buffer_base = &records_[i * capacity_];
+}
+
+inline pt_buffer::pt_buffer(tracee &owner, std::size_t count)
+    : count_(count), capacity_(owner.buffer_size())
+{
+    data_.reset(new pt_data[count]());
+    bytes_.reset(new unsigned char[count * capacity_]);
+    for (std::size_t i = 0; i < count; i++)
+        data_[i].buffer = &bytes_[i * capacity_];
+}
+
+} // namespace libiht
+
+#endif // LIBIHT_LKM_HPP
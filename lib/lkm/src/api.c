@@ -13,9 +13,15 @@
 #include "../../commons/api.h"
 #include "../include/lkm.h"
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 #define DEVICE_NAME "libiht-info"
@@ -23,25 +29,128 @@
 #define LIBIHT_LKM_IOCTL_MAGIC 'l'
 #define LIBIHT_LKM_IOCTL_BASE       _IO(LIBIHT_LKM_IOCTL_MAGIC, 0)
 
+// Same as the kernel default BTS buffer size
+#define DEFAULT_BTS_BUFFER_SIZE     (0x3000 << 1)
+
+//
+// Request functions
+
+////////////////////////////////////////////////////////////////////////////////
 //
-// Global Variables
+// Function     : send_request
+// Description  : Send a request to the kernel module. Without a file
+//                descriptor, the device is opened for this request only.
+//
+// Inputs       : int fd : the device file descriptor, -1 for none
+//                struct xioctl_request *request : the request
+// Outputs      : int : the result of the ioctl
 
-int lbr_fd;
-// File descriptor for opened LBR
+static int send_request(int fd, struct xioctl_request *request) {
+    int res;
 
-struct xioctl_request lbr_send_request;
-// Request for sending to LBR
+    if (fd >= 0) {
+        return ioctl(fd, LIBIHT_LKM_IOCTL_BASE, request);
+    }
 
-int bts_fd;
-// File descriptor for opened BTS
+    fd = open("/proc/" DEVICE_NAME, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "LIBIHT-API: failed to open " DEVICE_NAME "\n");
+        return -1;
+    }
 
-struct xioctl_request bts_send_request;
-// Request for sending to BTS
+    res = ioctl(fd, LIBIHT_LKM_IOCTL_BASE, request);
+    close(fd);
 
+    return res;
+}
 
 //
 // LBR management functions
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_lbr_request
+// Description  : Send an LBR request to the kernel module
+//
+// Inputs       : int fd : the device file descriptor, -1 for none
+//                enum IOCTL cmd : the LBR command
+//                struct lbr_ioctl_request usr_request : the request for LBR
+// Outputs      : int : the result of the ioctl
+
+static int send_lbr_request(int fd, enum IOCTL cmd, struct lbr_ioctl_request usr_request) {
+    struct xioctl_request lbr_send_request;
+
+    memset(&lbr_send_request, 0, sizeof(lbr_send_request));
+    lbr_send_request.cmd = cmd;
+    lbr_send_request.body.lbr = usr_request;
+
+    return send_request(fd, &lbr_send_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_enable_lbr
+// Description  : Allocate the dump buffers and send the enable request of LBR
+//
+// Inputs       : int fd : the device file descriptor, -1 for none
+//                struct lbr_config config : the LBR configuration
+//                struct lbr_ioctl_request *usr_request : the request for LBR
+// Outputs      : int : the result of the ioctl
+
+static int send_enable_lbr(int fd, struct lbr_config config,
+                            struct lbr_ioctl_request *usr_request) {
+    int res;
+
+    memset(usr_request, 0, sizeof(*usr_request));
+    usr_request->lbr_config = config;
+    if (config.pid == 0) {
+        usr_request->lbr_config.pid = getpid();
+    }
+
+    fprintf(stderr, "LIBIHT-API: starting enable LBR on pid : %u\n", usr_request->lbr_config.pid);
+
+    usr_request->buffer = malloc(sizeof(struct lbr_data));
+    usr_request->buffer->lbr_tos = 0;
+    usr_request->buffer->entries = malloc(sizeof(struct lbr_stack_entry) * MAX_LBR_LIST_LEN);
+    usr_request->buffer->tid = 0;
+    usr_request->buffer->entry_count = MAX_LBR_LIST_LEN;
+
+    if (config.offcpu_records) {
+        usr_request->offcpu = malloc(sizeof(struct lbr_offcpu_record) * config.offcpu_records);
+        usr_request->offcpu_count = config.offcpu_records;
+    }
+    if (config.syscall_records) {
+        usr_request->syscall = malloc(sizeof(struct lbr_syscall_record) * config.syscall_records);
+        usr_request->syscall_count = config.syscall_records;
+    }
+
+    res = send_lbr_request(fd, LIBIHT_IOCTL_ENABLE_LBR, *usr_request);
+
+    if (res == 0) {
+        fprintf(stderr, "LIBIHT-API: enable LBR for pid %u\n", usr_request->lbr_config.pid);
+    }
+    else {
+        fprintf(stderr, "LIBIHT-API: failed to enable LBR for pid %u\n", usr_request->lbr_config.pid);
+    }
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_lbr_request
+// Description  : Free the dump buffers of an LBR request
+//
+// Inputs       : struct lbr_ioctl_request *usr_request : the request for LBR
+// Outputs      : void
+
+static void free_lbr_request(struct lbr_ioctl_request *usr_request) {
+    free(usr_request->buffer->entries);
+    free(usr_request->buffer);
+    free(usr_request->offcpu);
+    free(usr_request->syscall);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : enable_lbr
@@ -51,37 +160,66 @@ struct xioctl_request bts_send_request;
 // Outputs      : struct lbr_ioctl_request : the request for LBR
 
 struct lbr_ioctl_request enable_lbr(unsigned int pid) {
+    struct lbr_config config;
     struct lbr_ioctl_request usr_request;
-    if (pid == 0) {
-        usr_request.lbr_config.pid = getpid();
-    }
-    else {
-        usr_request.lbr_config.pid = pid;
-    }
-
-    fprintf(stderr, "LIBIHT-API: starting enable LBR on pid : %u\n", usr_request.lbr_config.pid);
+    memset(&config, 0, sizeof(config));
+    config.pid = pid;
 
-    usr_request.lbr_config.lbr_select = 0;
+    send_enable_lbr(-1, config, &usr_request);
+    return usr_request;
+}
 
-    usr_request.buffer = NULL;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_lbr_offcpu
+// Description  : Enable LBR for a given process ID, also keeping the LBR stack
+//                of each of its switch outs in an off-cpu ring
+//
+// Inputs       : unsigned int pid : the process ID
+//                unsigned int records : the off-cpu ring size
+// Outputs      : struct lbr_ioctl_request : the request for LBR
 
-    usr_request.buffer = malloc(sizeof(struct lbr_data));
-    usr_request.buffer->lbr_tos = 0;
-    usr_request.buffer->entries = malloc(sizeof(struct lbr_stack_entry) * MAX_LBR_LIST_LEN);
+struct lbr_ioctl_request enable_lbr_offcpu(unsigned int pid, unsigned int records) {
+    struct lbr_config config;
+    struct lbr_ioctl_request usr_request;
+    memset(&config, 0, sizeof(config));
+    config.pid = pid;
+    config.offcpu_records = records;
 
-    lbr_fd = open("/proc/" DEVICE_NAME, O_RDWR);
+    send_enable_lbr(-1, config, &usr_request);
+    return usr_request;
+}
 
-    lbr_send_request.cmd = LIBIHT_IOCTL_ENABLE_LBR;
-    lbr_send_request.body.lbr = usr_request;
-    int res = ioctl(lbr_fd, LIBIHT_LKM_IOCTL_BASE, &lbr_send_request);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_lbr_syscall
+// Description  : Enable LBR for a given process ID, also keeping the LBR stack
+//                of each of its entries in the selected syscalls in a syscall
+//                ring
+//
+// Inputs       : unsigned int pid : the process ID
+//                unsigned int records : the syscall ring size
+//                const unsigned int *syscalls : the selected syscall numbers,
+//                                               NULL for all syscalls
+//                unsigned int syscall_count : number of selected syscalls
+// Outputs      : struct lbr_ioctl_request : the request for LBR
 
-    if (res == 0) {
-        fprintf(stderr, "LIBIHT-API: enable LBR for pid %u\n", usr_request.lbr_config.pid);
-    }
-    else {
-        fprintf(stderr, "LIBIHT-API: failed to enable LBR for pid %u\n", usr_request.lbr_config.pid);
+struct lbr_ioctl_request enable_lbr_syscall(unsigned int pid, unsigned int records,
+                                    const unsigned int *syscalls,
+                                    unsigned int syscall_count) {
+    struct lbr_config config;
+    struct lbr_ioctl_request usr_request;
+    unsigned int i;
+    memset(&config, 0, sizeof(config));
+    config.pid = pid;
+    config.syscall_records = records;
+    for (i = 0; syscalls != NULL && i < syscall_count; i++) {
+        if (syscalls[i] < LIBIHT_SYSCALL_MASK_WORDS * 64) {
+            config.syscall_mask[syscalls[i] / 64] |= 1ULL << (syscalls[i] % 64);
+        }
     }
 
+    send_enable_lbr(-1, config, &usr_request);
     return usr_request;
 }
 
@@ -94,11 +232,8 @@ struct lbr_ioctl_request enable_lbr(unsigned int pid) {
 // Outputs      : void
 
 void disable_lbr(struct lbr_ioctl_request usr_request) {
-    lbr_send_request.cmd = LIBIHT_IOCTL_DISABLE_LBR;
-    lbr_send_request.body.lbr = usr_request;
-    ioctl(lbr_fd, LIBIHT_LKM_IOCTL_BASE, &lbr_send_request);
+    send_lbr_request(-1, LIBIHT_IOCTL_DISABLE_LBR, usr_request);
     fprintf(stderr, "LIBIHT-API: disable LBR for pid %u\n", usr_request.lbr_config.pid);
-    lbr_fd = 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -110,9 +245,7 @@ void disable_lbr(struct lbr_ioctl_request usr_request) {
 // Outputs      : void
 
 void dump_lbr(struct lbr_ioctl_request usr_request) {
-    lbr_send_request.cmd = LIBIHT_IOCTL_DUMP_LBR;
-    lbr_send_request.body.lbr = usr_request;
-    ioctl(lbr_fd, LIBIHT_LKM_IOCTL_BASE, &lbr_send_request);
+    send_lbr_request(-1, LIBIHT_IOCTL_DUMP_LBR, usr_request);
     fprintf(stderr, "LIBIHT-API: dump LBR for pid %u\n", usr_request.lbr_config.pid);
 }
 
@@ -125,53 +258,215 @@ void dump_lbr(struct lbr_ioctl_request usr_request) {
 // Outputs      : void
 
 void config_lbr(struct lbr_ioctl_request usr_request) {
-    lbr_send_request.cmd = LIBIHT_IOCTL_CONFIG_LBR;
-    lbr_send_request.body.lbr = usr_request;
-    ioctl(lbr_fd, LIBIHT_LKM_IOCTL_BASE, &lbr_send_request);
+    send_lbr_request(-1, LIBIHT_IOCTL_CONFIG_LBR, usr_request);
     fprintf(stderr, "LIBIHT-API: config LBR for pid %u\n", usr_request.lbr_config.pid);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pause_lbr
+// Description  : Pause LBR for a user request, the kernel keeps its state
+//
+// Inputs       : struct lbr_ioctl_request usr_request : the request for LBR
+// Outputs      : void
+
+void pause_lbr(struct lbr_ioctl_request usr_request) {
+    send_lbr_request(-1, LIBIHT_IOCTL_PAUSE_LBR, usr_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : resume_lbr
+// Description  : Resume LBR for a user request
+//
+// Inputs       : struct lbr_ioctl_request usr_request : the request for LBR
+// Outputs      : void
+
+void resume_lbr(struct lbr_ioctl_request usr_request) {
+    send_lbr_request(-1, LIBIHT_IOCTL_RESUME_LBR, usr_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_lbr_offcpu
+// Description  : Move the pending off-cpu records of a user request to its
+//                off-cpu buffer
+//
+// Inputs       : struct lbr_ioctl_request usr_request : the request for LBR
+// Outputs      : int : number of records copied, -1 on failure
+
+int dump_lbr_offcpu(struct lbr_ioctl_request usr_request) {
+    int res = send_lbr_request(-1, LIBIHT_IOCTL_DUMP_LBR_OFFCPU, usr_request);
+    fprintf(stderr, "LIBIHT-API: dump %d LBR off-cpu records for pid %u\n", res, usr_request.lbr_config.pid);
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_lbr_syscall
+// Description  : Move the pending syscall records of a user request to its
+//                syscall buffer
+//
+// Inputs       : struct lbr_ioctl_request usr_request : the request for LBR
+// Outputs      : int : number of records copied, -1 on failure
+
+int dump_lbr_syscall(struct lbr_ioctl_request usr_request) {
+    int res = send_lbr_request(-1, LIBIHT_IOCTL_DUMP_LBR_SYSCALL, usr_request);
+    fprintf(stderr, "LIBIHT-API: dump %d LBR syscall records for pid %u\n", res, usr_request.lbr_config.pid);
+
+    return res;
+}
+
 //
 // BTS management functions
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : enable_bts
-// Description  : Enable BTS for a given process ID
+// Function     : bts_record_count
+// Description  : Get the number of records of a kernel BTS buffer, which a
+//                dump buffer must hold
 //
-// Inputs       : unsigned int pid : the process ID
-// Outputs      : struct bts_ioctl_request : the request for BTS
+// Inputs       : unsigned long long bts_buffer_size : the configured BTS buffer
+//                                                     size, 0 for the default
+// Outputs      : unsigned int : the number of records
 
-struct bts_ioctl_request enable_bts(unsigned int pid) {
-    struct bts_ioctl_request usr_request;
-    if (pid == 0) {
-        usr_request.bts_config.pid = getpid();
-    }
-    else {
-        usr_request.bts_config.pid = pid;
+static unsigned int bts_record_count(unsigned long long bts_buffer_size) {
+    if (bts_buffer_size == 0) {
+        bts_buffer_size = DEFAULT_BTS_BUFFER_SIZE;
     }
 
-    fprintf(stderr, "LIBIHT-API: starting enable BTS on pid : %u\n", usr_request.bts_config.pid);
+    return (unsigned int)(bts_buffer_size / sizeof(struct bts_record));
+}
 
-    usr_request.bts_config.bts_config = 0;
-    usr_request.bts_config.bts_buffer_size = 0;
-    usr_request.buffer = malloc(sizeof(struct bts_data));
-    usr_request.buffer->bts_buffer_base = malloc(sizeof(struct bts_record) * MAX_BTS_LIST_LEN);
-    usr_request.buffer->bts_index = malloc(sizeof(struct bts_record) * MAX_BTS_LIST_LEN);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_bts_request
+// Description  : Send a BTS request to the kernel module
+//
+// Inputs       : int fd : the device file descriptor, -1 for none
+//                enum IOCTL cmd : the BTS command
+//                struct bts_ioctl_request usr_request : the request for BTS
+// Outputs      : int : the result of the ioctl
 
-    bts_fd = open("/proc/" DEVICE_NAME, O_RDWR);
+static int send_bts_request(int fd, enum IOCTL cmd, struct bts_ioctl_request usr_request) {
+    struct xioctl_request bts_send_request;
 
+    memset(&bts_send_request, 0, sizeof(bts_send_request));
+    bts_send_request.cmd = cmd;
     bts_send_request.body.bts = usr_request;
-    bts_send_request.cmd = LIBIHT_IOCTL_ENABLE_BTS;
-    int res = ioctl(bts_fd, LIBIHT_LKM_IOCTL_BASE, &bts_send_request);
+
+    return send_request(fd, &bts_send_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_enable_bts
+// Description  : Allocate the dump buffers and send the enable request of BTS
+//
+// Inputs       : int fd : the device file descriptor, -1 for none
+//                struct bts_config config : the BTS configuration
+//                unsigned int pebs_records : the PEBS records buffer size
+//                struct bts_ioctl_request *usr_request : the request for BTS
+// Outputs      : int : the result of the ioctl
+
+static int send_enable_bts(int fd, struct bts_config config,
+                            unsigned int pebs_records,
+                            struct bts_ioctl_request *usr_request) {
+    int res;
+
+    memset(usr_request, 0, sizeof(*usr_request));
+    usr_request->bts_config = config;
+    if (config.pid == 0) {
+        usr_request->bts_config.pid = getpid();
+    }
+
+    fprintf(stderr, "LIBIHT-API: starting enable BTS on pid : %u\n", usr_request->bts_config.pid);
+
+    usr_request->buffer = malloc(sizeof(struct bts_data));
+    // The kernel sets bts_index into the records buffer on dump
+    usr_request->buffer->bts_buffer_base = malloc(sizeof(struct bts_record) *
+                                            bts_record_count(config.bts_buffer_size));
+    usr_request->buffer->bts_index = NULL;
+    usr_request->buffer->tid = 0;
+    usr_request->buffer->record_count = 0;
+
+    if (config.pebs_event) {
+        usr_request->pebs = malloc(sizeof(struct pebs_record) * pebs_records);
+        usr_request->pebs_count = pebs_records;
+    }
+
+    res = send_bts_request(fd, LIBIHT_IOCTL_ENABLE_BTS, *usr_request);
 
     if (res == 0) {
-        fprintf(stderr, "LIBIHT-API: enable BTS for pid %u\n", usr_request.bts_config.pid);
+        fprintf(stderr, "LIBIHT-API: enable BTS for pid %u\n", usr_request->bts_config.pid);
     }
     else {
-        fprintf(stderr, "LIBIHT-API: failed to enable BTS for pid %u\n", usr_request.bts_config.pid);
+        fprintf(stderr, "LIBIHT-API: failed to enable BTS for pid %u\n", usr_request->bts_config.pid);
     }
 
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_bts_request
+// Description  : Free the dump buffers of a BTS request
+//
+// Inputs       : struct bts_ioctl_request *usr_request : the request for BTS
+// Outputs      : void
+
+static void free_bts_request(struct bts_ioctl_request *usr_request) {
+    free(usr_request->buffer->bts_buffer_base);
+    free(usr_request->buffer);
+    free(usr_request->pebs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_bts
+// Description  : Enable BTS for a given process ID
+//
+// Inputs       : unsigned int pid : the process ID
+// Outputs      : struct bts_ioctl_request : the request for BTS
+
+struct bts_ioctl_request enable_bts(unsigned int pid) {
+    struct bts_config config;
+    struct bts_ioctl_request usr_request;
+    memset(&config, 0, sizeof(config));
+    config.pid = pid;
+
+    send_enable_bts(-1, config, 0, &usr_request);
+    return usr_request;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_bts_pebs
+// Description  : Enable BTS for a given process ID, also recording a PEBS
+//                record every period occurrences of a PMU event
+//
+// Inputs       : unsigned int pid : the process ID
+//                unsigned int event : the event select and umask (bits 15:0)
+//                unsigned long long period : events between two records, 0
+//                                            for the default
+//                unsigned int latency : the load latency threshold, 0 if
+//                                       unused
+//                unsigned int records : the PEBS records buffer size
+// Outputs      : struct bts_ioctl_request : the request for BTS
+
+struct bts_ioctl_request enable_bts_pebs(unsigned int pid, unsigned int event,
+                                    unsigned long long period,
+                                    unsigned int latency, unsigned int records) {
+    struct bts_config config;
+    struct bts_ioctl_request usr_request;
+    memset(&config, 0, sizeof(config));
+    config.pid = pid;
+    config.pebs_event = event;
+    config.pebs_period = period;
+    config.pebs_latency = latency;
+
+    send_enable_bts(-1, config, records, &usr_request);
     return usr_request;
 }
 
@@ -184,11 +479,8 @@ struct bts_ioctl_request enable_bts(unsigned int pid) {
 // Outputs      : void
 
 void disable_bts(struct bts_ioctl_request usr_request) {
-    bts_send_request.cmd = LIBIHT_IOCTL_DISABLE_BTS;
-    bts_send_request.body.bts = usr_request;
-    ioctl(bts_fd, LIBIHT_LKM_IOCTL_BASE, &bts_send_request);
+    send_bts_request(-1, LIBIHT_IOCTL_DISABLE_BTS, usr_request);
     fprintf(stderr, "LIBIHT-API: disable BTS for pid : %u\n", usr_request.bts_config.pid);
-    bts_fd = 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -200,9 +492,7 @@ void disable_bts(struct bts_ioctl_request usr_request) {
 // Outputs      : void
 
 void dump_bts(struct bts_ioctl_request usr_request) {
-    bts_send_request.cmd = LIBIHT_IOCTL_DUMP_BTS;
-    bts_send_request.body.bts = usr_request;
-    ioctl(bts_fd, LIBIHT_LKM_IOCTL_BASE, &bts_send_request);
+    send_bts_request(-1, LIBIHT_IOCTL_DUMP_BTS, usr_request);
     fprintf(stderr, "LIBIHT-API: dump BTS for pid : %u\n", usr_request.bts_config.pid);
 }
 
@@ -215,8 +505,1763 @@ void dump_bts(struct bts_ioctl_request usr_request) {
 // Outputs      : void
 
 void config_bts(struct bts_ioctl_request usr_request) {
-    bts_send_request.cmd = LIBIHT_IOCTL_CONFIG_BTS;
-    bts_send_request.body.bts = usr_request;
-    ioctl(bts_fd, LIBIHT_LKM_IOCTL_BASE, &bts_send_request);
+    send_bts_request(-1, LIBIHT_IOCTL_CONFIG_BTS, usr_request);
     fprintf(stderr, "LIBIHT-API: config BTS for pid : %u\n", usr_request.bts_config.pid);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pause_bts
+// Description  : Pause BTS for a user request, the kernel keeps its state and
+//                buffer
+//
+// Inputs       : struct bts_ioctl_request usr_request : the request for BTS
+// Outputs      : void
+
+void pause_bts(struct bts_ioctl_request usr_request) {
+    send_bts_request(-1, LIBIHT_IOCTL_PAUSE_BTS, usr_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : resume_bts
+// Description  : Resume BTS for a user request
+//
+// Inputs       : struct bts_ioctl_request usr_request : the request for BTS
+// Outputs      : void
+
+void resume_bts(struct bts_ioctl_request usr_request) {
+    send_bts_request(-1, LIBIHT_IOCTL_RESUME_BTS, usr_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_pebs
+// Description  : Move the pending PEBS records of a user request to its PEBS
+//                buffer
+//
+// Inputs       : struct bts_ioctl_request usr_request : the request for BTS
+// Outputs      : int : number of records copied, -1 on failure
+
+int dump_pebs(struct bts_ioctl_request usr_request) {
+    int res = send_bts_request(-1, LIBIHT_IOCTL_DUMP_PEBS, usr_request);
+    fprintf(stderr, "LIBIHT-API: dump %d PEBS records for pid %u\n", res, usr_request.bts_config.pid);
+
+    return res;
+}
+
+//
+// CPU scope tracing management functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_cpu_request
+// Description  : Send a CPU scope tracing request to the kernel module
+//
+// Inputs       : int fd : the device file descriptor, -1 for none
+//                enum IOCTL cmd : the CPU scope tracing command
+//                struct cpu_ioctl_request usr_request : the request for CPU
+//                                                       scope tracing
+// Outputs      : int : the result of the ioctl
+
+static int send_cpu_request(int fd, enum IOCTL cmd, struct cpu_ioctl_request usr_request) {
+    struct xioctl_request cpu_send_request;
+
+    memset(&cpu_send_request, 0, sizeof(cpu_send_request));
+    cpu_send_request.cmd = cmd;
+    cpu_send_request.body.cpu = usr_request;
+
+    return send_request(fd, &cpu_send_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_enable_cpu_trace
+// Description  : Allocate the dump buffers and send the enable request of the
+//                CPU scope tracing
+//
+// Inputs       : struct cpu_config config : the CPU scope configuration
+// Outputs      : struct cpu_ioctl_request : the request for CPU scope tracing
+
+static struct cpu_ioctl_request send_enable_cpu_trace(struct cpu_config config) {
+    struct cpu_ioctl_request usr_request;
+    memset(&usr_request, 0, sizeof(usr_request));
+    usr_request.cpu_config = config;
+
+    fprintf(stderr, "LIBIHT-API: starting enable CPU trace, features : %u\n", config.features);
+
+    usr_request.lbr_buffer = malloc(sizeof(struct lbr_data));
+    usr_request.lbr_buffer->lbr_tos = 0;
+    usr_request.lbr_buffer->entries = malloc(sizeof(struct lbr_stack_entry) * MAX_LBR_LIST_LEN);
+    usr_request.lbr_buffer->entry_count = MAX_LBR_LIST_LEN;
+    usr_request.lbr_buffer->tid = 0;
+
+    usr_request.bts_buffer = malloc(sizeof(struct bts_data));
+    usr_request.bts_buffer->bts_buffer_base = malloc(sizeof(struct bts_record) *
+                                            bts_record_count(config.bts_buffer_size));
+    usr_request.bts_buffer->bts_index = NULL;
+    usr_request.bts_buffer->record_count = 0;
+    usr_request.bts_buffer->tid = 0;
+
+    usr_request.sideband = malloc(sizeof(struct cpu_sideband_record) * MAX_SIDEBAND_LIST_LEN);
+    usr_request.sideband_count = MAX_SIDEBAND_LIST_LEN;
+
+    int res = send_cpu_request(-1, LIBIHT_IOCTL_ENABLE_CPU, usr_request);
+
+    if (res == 0) {
+        fprintf(stderr, "LIBIHT-API: enable CPU trace\n");
+    }
+    else {
+        fprintf(stderr, "LIBIHT-API: failed to enable CPU trace\n");
+    }
+
+    return usr_request;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_cpu_trace
+// Description  : Enable CPU scope tracing on the cpus of a mask
+//
+// Inputs       : unsigned int features : LIBIHT_CPU_LBR and/or LIBIHT_CPU_BTS
+//                const unsigned long long *cpu_mask : LIBIHT_CPU_MASK_WORDS
+//                                          words of cpu bits, NULL for all
+// Outputs      : struct cpu_ioctl_request : the request for CPU scope tracing
+
+struct cpu_ioctl_request enable_cpu_trace(unsigned int features,
+                                    const unsigned long long *cpu_mask) {
+    struct cpu_config config;
+    memset(&config, 0, sizeof(config));
+
+    config.features = features;
+    if (cpu_mask != NULL) {
+        memcpy(config.cpu_mask, cpu_mask, sizeof(config.cpu_mask));
+    }
+
+    return send_enable_cpu_trace(config);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_cgroup_trace
+// Description  : Enable CPU scope tracing on all cpus, running only while a
+//                task of the given cgroups is on the cpu
+//
+// Inputs       : unsigned int features : LIBIHT_CPU_LBR and/or LIBIHT_CPU_BTS
+//                const char **cgroup_paths : cgroup v2 directories
+//                unsigned int cgroup_count : number of cgroup directories
+// Outputs      : struct cpu_ioctl_request : the request for CPU scope tracing
+
+struct cpu_ioctl_request enable_cgroup_trace(unsigned int features,
+                                    const char **cgroup_paths,
+                                    unsigned int cgroup_count) {
+    struct cpu_config config;
+    unsigned int i;
+    memset(&config, 0, sizeof(config));
+
+    if (cgroup_count > LIBIHT_CGROUP_MAX) {
+        fprintf(stderr, "LIBIHT-API: only %u cgroups can be traced\n", LIBIHT_CGROUP_MAX);
+        cgroup_count = LIBIHT_CGROUP_MAX;
+    }
+
+    config.features = features;
+    config.cgroup_count = cgroup_count;
+    for (i = 0; i < cgroup_count; i++) {
+        config.cgroup_ids[i] = cgroup_id_from_path(cgroup_paths[i]);
+        fprintf(stderr, "LIBIHT-API: trace cgroup %s (id %llu)\n", cgroup_paths[i], config.cgroup_ids[i]);
+    }
+
+    return send_enable_cpu_trace(config);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disable_cpu_trace
+// Description  : Disable CPU scope tracing for a user request
+//
+// Inputs       : struct cpu_ioctl_request usr_request : the request for CPU
+//                                                       scope tracing
+// Outputs      : void
+
+void disable_cpu_trace(struct cpu_ioctl_request usr_request) {
+    send_cpu_request(-1, LIBIHT_IOCTL_DISABLE_CPU, usr_request);
+    fprintf(stderr, "LIBIHT-API: disable CPU trace\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_cpu_trace
+// Description  : Dump the LBR, BTS and context switch sideband records of a
+//                cpu into the buffers of a user request
+//
+// Inputs       : struct cpu_ioctl_request usr_request : the request for CPU
+//                                                       scope tracing
+//                unsigned int cpu : the cpu core id
+// Outputs      : int : number of sideband records dumped, -1 on failure
+
+int dump_cpu_trace(struct cpu_ioctl_request usr_request, unsigned int cpu) {
+    int res;
+
+    usr_request.cpu = cpu;
+    res = send_cpu_request(-1, LIBIHT_IOCTL_DUMP_CPU, usr_request);
+    fprintf(stderr, "LIBIHT-API: dump CPU trace for cpu : %u\n", cpu);
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cgroup_id_from_path
+// Description  : Get the cgroup v2 id of a cgroup directory, which is the
+//                inode number of the directory
+//
+// Inputs       : const char *cgroup_path : the cgroup v2 directory, e.g.
+//                                          /sys/fs/cgroup/system.slice
+// Outputs      : unsigned long long : the cgroup id, 0 on failure
+
+unsigned long long cgroup_id_from_path(const char *cgroup_path) {
+    struct stat st;
+
+    if (stat(cgroup_path, &st) != 0) {
+        fprintf(stderr, "LIBIHT-API: failed to stat cgroup %s\n", cgroup_path);
+        return 0;
+    }
+
+    return (unsigned long long)st.st_ino;
+}
+
+//
+// Exec rule management functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_rule_request
+// Description  : Send an exec rule request to the kernel module
+//
+// Inputs       : enum IOCTL cmd : the exec rule command
+//                struct rule_ioctl_request usr_request : the request for rules
+// Outputs      : int : the result of the ioctl
+
+static int send_rule_request(enum IOCTL cmd, struct rule_ioctl_request usr_request) {
+    struct xioctl_request rule_send_request;
+
+    memset(&rule_send_request, 0, sizeof(rule_send_request));
+    rule_send_request.cmd = cmd;
+    rule_send_request.body.rule = usr_request;
+
+    return send_request(-1, &rule_send_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_exec_rule
+// Description  : Add an exec rule, matching processes are traced from their
+//                first instruction
+//
+// Inputs       : struct exec_rule rule : the exec rule
+// Outputs      : int : the rule id, -1 on failure
+
+int add_exec_rule(struct exec_rule rule) {
+    struct rule_ioctl_request usr_request;
+    int res;
+
+    memset(&usr_request, 0, sizeof(usr_request));
+    usr_request.rule = rule;
+    res = send_rule_request(LIBIHT_IOCTL_ADD_RULE, usr_request);
+
+    if (res >= 0) {
+        fprintf(stderr, "LIBIHT-API: add exec rule %d : %s\n", res, rule.pattern);
+    }
+    else {
+        fprintf(stderr, "LIBIHT-API: failed to add exec rule : %s\n", rule.pattern);
+    }
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : del_exec_rule
+// Description  : Delete an exec rule by its id
+//
+// Inputs       : unsigned int rule_id : the rule id
+// Outputs      : void
+
+void del_exec_rule(unsigned int rule_id) {
+    struct rule_ioctl_request usr_request;
+
+    memset(&usr_request, 0, sizeof(usr_request));
+    usr_request.rule_id = rule_id;
+    send_rule_request(LIBIHT_IOCTL_DEL_RULE, usr_request);
+    fprintf(stderr, "LIBIHT-API: delete exec rule %u\n", rule_id);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clear_exec_rules
+// Description  : Delete all exec rules
+//
+// Inputs       : void
+// Outputs      : void
+
+void clear_exec_rules(void) {
+    struct rule_ioctl_request usr_request;
+
+    memset(&usr_request, 0, sizeof(usr_request));
+    send_rule_request(LIBIHT_IOCTL_CLEAR_RULES, usr_request);
+    fprintf(stderr, "LIBIHT-API: clear exec rules\n");
+}
+
+//
+// Trace gate functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_gate_request
+// Description  : Send a trace gate request to the kernel module
+//
+// Inputs       : enum IOCTL cmd : the trace gate command
+//                struct gate_ioctl_request usr_request : the request for gates
+// Outputs      : int : the result of the ioctl
+
+static int send_gate_request(enum IOCTL cmd, struct gate_ioctl_request usr_request) {
+    struct xioctl_request gate_send_request;
+
+    memset(&gate_send_request, 0, sizeof(gate_send_request));
+    gate_send_request.cmd = cmd;
+    gate_send_request.body.gate = usr_request;
+
+    return send_request(-1, &gate_send_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : attach_trace_gate
+// Description  : Map a page for a trace gate and attach it to the calling
+//                thread. The thread then pauses/resumes its LBR/BTS trace
+//                and tags regions by writing the gate, which the kernel
+//                honors at the next context switch of the thread, not at
+//                the time of the store
+//
+// Inputs       : void
+// Outputs      : struct trace_gate* : the trace gate, NULL on failure
+
+struct trace_gate *attach_trace_gate(void) {
+    struct gate_ioctl_request usr_request;
+    struct trace_gate *gate;
+
+    gate = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (gate == MAP_FAILED) {
+        fprintf(stderr, "LIBIHT-API: failed to map trace gate\n");
+        return NULL;
+    }
+    gate->wanted = 1;
+    gate->region_id = 0;
+
+    memset(&usr_request, 0, sizeof(usr_request));
+    usr_request.gate = gate;
+    if (send_gate_request(LIBIHT_IOCTL_ATTACH_GATE, usr_request) < 0) {
+        fprintf(stderr, "LIBIHT-API: failed to attach trace gate\n");
+        munmap(gate, sysconf(_SC_PAGESIZE));
+        return NULL;
+    }
+
+    fprintf(stderr, "LIBIHT-API: attach trace gate\n");
+    return gate;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : detach_trace_gate
+// Description  : Detach the trace gate of the calling thread and unmap it
+//
+// Inputs       : struct trace_gate *gate : the trace gate
+// Outputs      : void
+
+void detach_trace_gate(struct trace_gate *gate) {
+    struct gate_ioctl_request usr_request;
+
+    memset(&usr_request, 0, sizeof(usr_request));
+    send_gate_request(LIBIHT_IOCTL_DETACH_GATE, usr_request);
+    munmap(gate, sysconf(_SC_PAGESIZE));
+    fprintf(stderr, "LIBIHT-API: detach trace gate\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_trace_gate
+// Description  : Dump the pending region records of all trace gates
+//
+// Inputs       : struct gate_region_record *records : the records buffer
+//                unsigned int record_count : number of records in the buffer
+// Outputs      : int : number of records dumped, -1 on failure
+
+int dump_trace_gate(struct gate_region_record *records, unsigned int record_count) {
+    struct gate_ioctl_request usr_request;
+
+    memset(&usr_request, 0, sizeof(usr_request));
+    usr_request.records = records;
+    usr_request.record_count = record_count;
+
+    return send_gate_request(LIBIHT_IOCTL_DUMP_GATE, usr_request);
+}
+
+//
+// Trace window functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_window_request
+// Description  : Send a trace window request to the kernel module
+//
+// Inputs       : enum IOCTL cmd : the trace window command
+//                struct window_ioctl_request usr_request : the request for
+//                                                          windows
+// Outputs      : int : the result of the ioctl
+
+static int send_window_request(enum IOCTL cmd, struct window_ioctl_request usr_request) {
+    struct xioctl_request window_send_request;
+
+    memset(&window_send_request, 0, sizeof(window_send_request));
+    window_send_request.cmd = cmd;
+    window_send_request.body.window = usr_request;
+
+    return send_request(-1, &window_send_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_trace_window
+// Description  : Add a trace window, the features run for a thread only
+//                between a start and a stop offset of a binary
+//
+// Inputs       : struct trace_window window : the trace window
+// Outputs      : int : the window id, -1 on failure
+
+int add_trace_window(struct trace_window window) {
+    struct window_ioctl_request usr_request;
+    int res;
+
+    memset(&usr_request, 0, sizeof(usr_request));
+    usr_request.window = window;
+    res = send_window_request(LIBIHT_IOCTL_ADD_WINDOW, usr_request);
+
+    if (res >= 0) {
+        fprintf(stderr, "LIBIHT-API: add trace window %d : %s+0x%llx\n", res,
+                window.path, window.start_offset);
+    }
+    else {
+        fprintf(stderr, "LIBIHT-API: failed to add trace window : %s\n", window.path);
+    }
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : del_trace_window
+// Description  : Delete a trace window by its id
+//
+// Inputs       : unsigned int window_id : the window id
+// Outputs      : void
+
+void del_trace_window(unsigned int window_id) {
+    struct window_ioctl_request usr_request;
+
+    memset(&usr_request, 0, sizeof(usr_request));
+    usr_request.window_id = window_id;
+    send_window_request(LIBIHT_IOCTL_DEL_WINDOW, usr_request);
+    fprintf(stderr, "LIBIHT-API: delete trace window %u\n", window_id);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clear_trace_windows
+// Description  : Delete all trace windows
+//
+// Inputs       : void
+// Outputs      : void
+
+void clear_trace_windows(void) {
+    struct window_ioctl_request usr_request;
+
+    memset(&usr_request, 0, sizeof(usr_request));
+    send_window_request(LIBIHT_IOCTL_CLEAR_WINDOWS, usr_request);
+    fprintf(stderr, "LIBIHT-API: clear trace windows\n");
+}
+
+//
+// LBR sampling functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_sample_request
+// Description  : Send an LBR sampling request to the kernel module
+//
+// Inputs       : enum IOCTL cmd : the LBR sampling command
+//                struct sample_ioctl_request usr_request : the request for
+//                                                          LBR sampling
+// Outputs      : int : the result of the ioctl
+
+static int send_sample_request(enum IOCTL cmd, struct sample_ioctl_request usr_request) {
+    struct xioctl_request sample_send_request;
+
+    memset(&sample_send_request, 0, sizeof(sample_send_request));
+    sample_send_request.cmd = cmd;
+    sample_send_request.body.sample = usr_request;
+
+    return send_request(-1, &sample_send_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_enable_sampling
+// Description  : Allocate the records buffer and send the enable request of
+//                the LBR sampling
+//
+// Inputs       : struct sample_config config : the LBR sampling configuration
+//                const unsigned long long *cpu_mask : LIBIHT_CPU_MASK_WORDS
+//                                                     words, NULL for all
+// Outputs      : struct sample_ioctl_request : the request for LBR sampling
+
+static struct sample_ioctl_request send_enable_sampling(struct sample_config config,
+                                    const unsigned long long *cpu_mask) {
+    struct sample_ioctl_request usr_request;
+    memset(&usr_request, 0, sizeof(usr_request));
+    usr_request.sample_config = config;
+    if (cpu_mask != NULL) {
+        memcpy(usr_request.sample_config.cpu_mask, cpu_mask,
+               sizeof(usr_request.sample_config.cpu_mask));
+    }
+
+    usr_request.records = malloc(sizeof(struct lbr_sample_record) * MAX_SAMPLE_LIST_LEN);
+    usr_request.record_count = MAX_SAMPLE_LIST_LEN;
+
+    if (send_sample_request(LIBIHT_IOCTL_ENABLE_SAMPLE, usr_request) == 0) {
+        fprintf(stderr, "LIBIHT-API: enable LBR sampling, event : %u\n", config.event);
+    }
+    else {
+        fprintf(stderr, "LIBIHT-API: failed to enable LBR sampling\n");
+    }
+
+    return usr_request;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_lbr_sampling
+// Description  : Enable LBR sampling, a snapshot of the LBR is taken every
+//                `period` occurrences of a PMU event on the cpus of a mask
+//
+// Inputs       : unsigned int event : the PMU event (enum SAMPLE_EVENT)
+//                unsigned long long period : events between two samples, 0
+//                                            for the default period
+//                const unsigned long long *cpu_mask : LIBIHT_CPU_MASK_WORDS
+//                                                     words, NULL for all
+// Outputs      : struct sample_ioctl_request : the request for LBR sampling
+
+struct sample_ioctl_request enable_lbr_sampling(unsigned int event,
+                                    unsigned long long period,
+                                    const unsigned long long *cpu_mask) {
+    struct sample_config config;
+    memset(&config, 0, sizeof(config));
+    config.event = event;
+    config.period = period;
+
+    return send_enable_sampling(config, cpu_mask);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_lbr_timer_sampling
+// Description  : Enable timer driven LBR sampling, a snapshot of the LBR is
+//                taken `frequency` times per second on the cpus of a mask
+//
+// Inputs       : unsigned int pid : the sampled thread or process, 0 for all
+//                unsigned int frequency : samples per second per cpu, 0 for
+//                                         the default frequency
+//                const unsigned long long *cpu_mask : LIBIHT_CPU_MASK_WORDS
+//                                                     words, NULL for all
+// Outputs      : struct sample_ioctl_request : the request for LBR sampling
+
+struct sample_ioctl_request enable_lbr_timer_sampling(unsigned int pid,
+                                    unsigned int frequency,
+                                    const unsigned long long *cpu_mask) {
+    struct sample_config config;
+    memset(&config, 0, sizeof(config));
+    config.event = LIBIHT_SAMPLE_TIMER;
+    config.pid = pid;
+    if (frequency != 0) {
+        config.period = 1000000000ULL / frequency;
+    }
+
+    return send_enable_sampling(config, cpu_mask);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disable_lbr_sampling
+// Description  : Disable LBR sampling and free the records buffer
+//
+// Inputs       : struct sample_ioctl_request usr_request : the request for
+//                                                          LBR sampling
+// Outputs      : void
+
+void disable_lbr_sampling(struct sample_ioctl_request usr_request) {
+    send_sample_request(LIBIHT_IOCTL_DISABLE_SAMPLE, usr_request);
+    fprintf(stderr, "LIBIHT-API: disable LBR sampling\n");
+    free(usr_request.records);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_lbr_sampling
+// Description  : Move the pending LBR samples of a cpu to the records buffer
+//
+// Inputs       : struct sample_ioctl_request usr_request : the request for
+//                                                          LBR sampling
+//                unsigned int cpu : the cpu to dump
+// Outputs      : int : number of samples dumped, -1 on failure
+
+int dump_lbr_sampling(struct sample_ioctl_request usr_request, unsigned int cpu) {
+    usr_request.cpu = cpu;
+    return send_sample_request(LIBIHT_IOCTL_DUMP_SAMPLE, usr_request);
+}
+
+//
+// Crash capture functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_crash_records
+// Description  : Move the pending crash records to the records buffer, the
+//                records are kept by the kernel after the crashed process is
+//                gone
+//
+// Inputs       : struct crash_record *records : the records buffer
+//                unsigned int record_count : number of records in the buffer
+// Outputs      : int : number of records dumped, -1 on failure
+
+int dump_crash_records(struct crash_record *records, unsigned int record_count) {
+    struct xioctl_request crash_send_request;
+
+    memset(&crash_send_request, 0, sizeof(crash_send_request));
+    crash_send_request.cmd = LIBIHT_IOCTL_DUMP_CRASH;
+    crash_send_request.body.crash.records = records;
+    crash_send_request.body.crash.record_count = record_count;
+
+    return send_request(-1, &crash_send_request);
+}
+
+//
+// Intel PT management functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_pt_request
+// Description  : Send an Intel PT request to the kernel module
+//
+// Inputs       : int fd : the device file descriptor, -1 for none
+//                enum IOCTL cmd : the Intel PT command
+//                struct pt_ioctl_request usr_request : the request for PT
+// Outputs      : int : the result of the ioctl
+
+static int send_pt_request(int fd, enum IOCTL cmd, struct pt_ioctl_request usr_request) {
+    struct xioctl_request pt_send_request;
+
+    memset(&pt_send_request, 0, sizeof(pt_send_request));
+    pt_send_request.cmd = cmd;
+    pt_send_request.body.pt = usr_request;
+
+    return send_request(fd, &pt_send_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_enable_pt
+// Description  : Allocate the dump buffer and send the enable request of PT.
+//                The dump buffer is as large as the kernel buffer.
+//
+// Inputs       : int fd : the device file descriptor, -1 for none
+//                struct pt_config config : the PT configuration
+//                struct pt_ioctl_request *usr_request : the request for PT
+// Outputs      : int : the result of the ioctl
+
+static int send_enable_pt(int fd, struct pt_config config,
+                            struct pt_ioctl_request *usr_request) {
+    int res;
+
+    memset(usr_request, 0, sizeof(*usr_request));
+    usr_request->pt_config = config;
+    if (config.pid == 0) {
+        usr_request->pt_config.pid = getpid();
+    }
+    if (config.pt_buffer_size == 0) {
+        usr_request->pt_config.pt_buffer_size = MAX_PT_BUFFER_LEN;
+    }
+
+    fprintf(stderr, "LIBIHT-API: starting enable PT on pid : %u\n", usr_request->pt_config.pid);
+
+    usr_request->buffer = malloc(sizeof(struct pt_data));
+    usr_request->buffer->buffer = malloc(usr_request->pt_config.pt_buffer_size);
+    usr_request->buffer->size = usr_request->pt_config.pt_buffer_size;
+    usr_request->buffer->tid = 0;
+    usr_request->buffer->wrapped = 0;
+    usr_request->buffer_count = 1;
+
+    res = send_pt_request(fd, LIBIHT_IOCTL_ENABLE_PT, *usr_request);
+
+    if (res == 0) {
+        fprintf(stderr, "LIBIHT-API: enable PT for pid %u\n", usr_request->pt_config.pid);
+    }
+    else {
+        fprintf(stderr, "LIBIHT-API: failed to enable PT for pid %u\n", usr_request->pt_config.pid);
+    }
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_pt_request
+// Description  : Free the dump buffer of a PT request
+//
+// Inputs       : struct pt_ioctl_request *usr_request : the request for PT
+// Outputs      : void
+
+static void free_pt_request(struct pt_ioctl_request *usr_request) {
+    free(usr_request->buffer->buffer);
+    free(usr_request->buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_pt
+// Description  : Enable Intel PT for a given process ID, tracing its user mode
+//                branches with the default configuration
+//
+// Inputs       : unsigned int pid : the process ID
+// Outputs      : struct pt_ioctl_request : the request for PT
+
+struct pt_ioctl_request enable_pt(unsigned int pid) {
+    struct pt_config config;
+    struct pt_ioctl_request usr_request;
+    memset(&config, 0, sizeof(config));
+    config.pid = pid;
+
+    send_enable_pt(-1, config, &usr_request);
+    return usr_request;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_pt_ranges
+// Description  : Enable Intel PT for a given process ID, only tracing inside
+//                (or stopping at) address ranges
+//
+// Inputs       : unsigned int pid : the process ID
+//                const struct pt_range *ranges : the address ranges
+//                unsigned int range_count : number of ranges, at most
+//                                           LIBIHT_PT_MAX_RANGES
+//                unsigned int cr3_filter : whether to only trace the address
+//                                          space of the process
+// Outputs      : struct pt_ioctl_request : the request for PT
+
+struct pt_ioctl_request enable_pt_ranges(unsigned int pid,
+                                    const struct pt_range *ranges,
+                                    unsigned int range_count,
+                                    unsigned int cr3_filter) {
+    struct pt_config config;
+    struct pt_ioctl_request usr_request;
+    memset(&config, 0, sizeof(config));
+    config.pid = pid;
+    config.cr3_filter = cr3_filter;
+    if (range_count > LIBIHT_PT_MAX_RANGES) {
+        range_count = LIBIHT_PT_MAX_RANGES;
+    }
+    config.range_count = range_count;
+    if (range_count) {
+        memcpy(config.ranges, ranges, sizeof(struct pt_range) * range_count);
+    }
+
+    send_enable_pt(-1, config, &usr_request);
+    return usr_request;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disable_pt
+// Description  : Disable Intel PT and free the dump buffer
+//
+// Inputs       : struct pt_ioctl_request usr_request : the request for PT
+// Outputs      : void
+
+void disable_pt(struct pt_ioctl_request usr_request) {
+    send_pt_request(-1, LIBIHT_IOCTL_DISABLE_PT, usr_request);
+    fprintf(stderr, "LIBIHT-API: disable PT for pid : %u\n", usr_request.pt_config.pid);
+    free_pt_request(&usr_request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_pt
+// Description  : Copy the newest packets of the traced thread to the dump
+//                buffer, oldest first. The packet stream can be decoded with
+//                pt_decoder_reset and pt_decode.
+//
+// Inputs       : struct pt_ioctl_request usr_request : the request for PT
+// Outputs      : int : 0 on success, -1 on failure
+
+int dump_pt(struct pt_ioctl_request usr_request) {
+    usr_request.buffer->size = usr_request.pt_config.pt_buffer_size;
+    return send_pt_request(-1, LIBIHT_IOCTL_DUMP_PT, usr_request);
+}
+
+//
+// Handle management functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_open
+// Description  : Open a library handle. Each handle owns its device file
+//                descriptor and the library keeps no other state, so threads
+//                using different handles never contend, and a handle can be
+//                shared by threads driving different tracees.
+//
+// Inputs       : void
+// Outputs      : struct iht_handle* : the handle, NULL on failure
+
+struct iht_handle *iht_open(void) {
+    struct iht_handle *handle;
+
+    handle = malloc(sizeof(struct iht_handle));
+    if (handle == NULL) {
+        return NULL;
+    }
+
+    handle->fd = open("/proc/" DEVICE_NAME, O_RDWR);
+    if (handle->fd < 0) {
+        fprintf(stderr, "LIBIHT-API: failed to open " DEVICE_NAME "\n");
+        free(handle);
+        return NULL;
+    }
+
+    return handle;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_close
+// Description  : Close a library handle, its tracees should be disabled first
+//
+// Inputs       : struct iht_handle *handle : the handle
+// Outputs      : void
+
+void iht_close(struct iht_handle *handle) {
+    close(handle->fd);
+    free(handle);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_enable_lbr
+// Description  : Enable LBR on a handle, with the dump buffers sized by the
+//                configuration (off-cpu and syscall rings included)
+//
+// Inputs       : struct iht_handle *handle : the handle
+//                struct lbr_config config : the LBR configuration
+// Outputs      : struct iht_tracee* : the tracee, NULL on failure
+
+struct iht_tracee *iht_enable_lbr(struct iht_handle *handle, struct lbr_config config) {
+    struct iht_tracee *tracee;
+
+    tracee = malloc(sizeof(struct iht_tracee));
+    if (tracee == NULL) {
+        return NULL;
+    }
+    tracee->handle = handle;
+    tracee->feature = IHT_FEATURE_LBR;
+    tracee->capacity = MAX_LBR_LIST_LEN;
+
+    if (send_enable_lbr(handle->fd, config, &tracee->request.lbr) != 0) {
+        free_lbr_request(&tracee->request.lbr);
+        free(tracee);
+        return NULL;
+    }
+
+    return tracee;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_enable_bts
+// Description  : Enable BTS on a handle. With a PEBS event, the PEBS records
+//                buffer holds MAX_BTS_LIST_LEN records.
+//
+// Inputs       : struct iht_handle *handle : the handle
+//                struct bts_config config : the BTS configuration
+// Outputs      : struct iht_tracee* : the tracee, NULL on failure
+
+struct iht_tracee *iht_enable_bts(struct iht_handle *handle, struct bts_config config) {
+    struct iht_tracee *tracee;
+
+    tracee = malloc(sizeof(struct iht_tracee));
+    if (tracee == NULL) {
+        return NULL;
+    }
+    tracee->handle = handle;
+    tracee->feature = IHT_FEATURE_BTS;
+    tracee->capacity = bts_record_count(config.bts_buffer_size);
+
+    if (send_enable_bts(handle->fd, config, MAX_BTS_LIST_LEN,
+                        &tracee->request.bts) != 0) {
+        free_bts_request(&tracee->request.bts);
+        free(tracee);
+        return NULL;
+    }
+
+    return tracee;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_enable_pt
+// Description  : Enable Intel PT on a handle, the packet buffer is as large
+//                as the kernel buffer
+//
+// Inputs       : struct iht_handle *handle : the handle
+//                struct pt_config config : the PT configuration
+// Outputs      : struct iht_tracee* : the tracee, NULL on failure
+
+struct iht_tracee *iht_enable_pt(struct iht_handle *handle, struct pt_config config) {
+    struct iht_tracee *tracee;
+
+    tracee = malloc(sizeof(struct iht_tracee));
+    if (tracee == NULL) {
+        return NULL;
+    }
+    tracee->handle = handle;
+    tracee->feature = IHT_FEATURE_PT;
+
+    if (send_enable_pt(handle->fd, config, &tracee->request.pt) != 0) {
+        free_pt_request(&tracee->request.pt);
+        free(tracee);
+        return NULL;
+    }
+    tracee->capacity = tracee->request.pt.pt_config.pt_buffer_size;
+
+    return tracee;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_send
+// Description  : Send a command of the tracee feature with the tracee request,
+//                e.g. LIBIHT_IOCTL_PAUSE_LBR or LIBIHT_IOCTL_DUMP_PEBS. The
+//                request is not changed, only its buffers.
+//
+// Inputs       : struct iht_tracee *tracee : the tracee
+//                enum IOCTL cmd : the command
+// Outputs      : int : the result of the ioctl
+
+int iht_send(struct iht_tracee *tracee, enum IOCTL cmd) {
+    switch (tracee->feature) {
+    case IHT_FEATURE_LBR:
+        return send_lbr_request(tracee->handle->fd, cmd, tracee->request.lbr);
+    case IHT_FEATURE_BTS:
+        return send_bts_request(tracee->handle->fd, cmd, tracee->request.bts);
+    case IHT_FEATURE_PT:
+        return send_pt_request(tracee->handle->fd, cmd, tracee->request.pt);
+    }
+
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_dump
+// Description  : Dump the trace of a tracee into its buffers
+//
+// Inputs       : struct iht_tracee *tracee : the tracee
+// Outputs      : int : the result of the ioctl
+
+int iht_dump(struct iht_tracee *tracee) {
+    switch (tracee->feature) {
+    case IHT_FEATURE_LBR:
+        return iht_dump_lbr(tracee, tracee->request.lbr.buffer, 1);
+    case IHT_FEATURE_BTS:
+        return iht_dump_bts(tracee, tracee->request.bts.buffer, 1);
+    case IHT_FEATURE_PT:
+        return iht_dump_pt(tracee, tracee->request.pt.buffer, 1);
+    }
+
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_buffer_size
+// Description  : Get the size a dump buffer of a tracee must have: LBR stack
+//                entries, BTS records or PT packet bytes
+//
+// Inputs       : struct iht_tracee *tracee : the tracee
+// Outputs      : unsigned long long : the number of elements
+
+unsigned long long iht_buffer_size(struct iht_tracee *tracee) {
+    switch (tracee->feature) {
+    case IHT_FEATURE_LBR:
+        return LIBIHT_LBR_MAX_ENTRIES;
+    case IHT_FEATURE_BTS:
+        return bts_record_count(tracee->request.bts.bts_config.bts_buffer_size);
+    case IHT_FEATURE_PT:
+        return tracee->request.pt.pt_config.pt_buffer_size;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_dump_lbr
+// Description  : Dump the LBR stack of a tracee into caller owned buffers,
+//                without any allocation. Each buffer must point to
+//                iht_buffer_size() entries, one buffer per thread for the
+//                process scope. The valid entries are returned in
+//                entry_count.
+//
+// Inputs       : struct iht_tracee *tracee : the tracee
+//                struct lbr_data *data : the LBR data buffers
+//                unsigned int count : number of buffers
+// Outputs      : int : number of buffers filled, -1 on failure
+
+int iht_dump_lbr(struct iht_tracee *tracee, struct lbr_data *data, unsigned int count) {
+    struct lbr_ioctl_request usr_request;
+    unsigned int i, capacity;
+    int res;
+
+    if (tracee->feature != IHT_FEATURE_LBR || count == 0) {
+        return -1;
+    }
+
+    capacity = data == tracee->request.lbr.buffer ?
+                (unsigned int)tracee->capacity : LIBIHT_LBR_MAX_ENTRIES;
+    for (i = 0; i < count; i++) {
+        data[i].entry_count = capacity;
+    }
+
+    usr_request = tracee->request.lbr;
+    usr_request.buffer = data;
+    usr_request.buffer_count = count;
+    res = send_lbr_request(tracee->handle->fd, LIBIHT_IOCTL_DUMP_LBR, usr_request);
+    if (res == 0 && usr_request.lbr_config.scope != LIBIHT_SCOPE_PROCESS) {
+        res = 1;
+    }
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_dump_bts
+// Description  : Dump the BTS records of a tracee into caller owned buffers,
+//                without any allocation. Each buffer must point to
+//                iht_buffer_size() records, one buffer per thread for the
+//                process scope. Only the valid records are copied, their
+//                number is returned in record_count. They start at bts_index
+//                when the BTS buffer wrapped, at bts_buffer_base otherwise.
+//
+// Inputs       : struct iht_tracee *tracee : the tracee
+//                struct bts_data *data : the BTS data buffers
+//                unsigned int count : number of buffers
+// Outputs      : int : number of buffers filled, -1 on failure
+
+int iht_dump_bts(struct iht_tracee *tracee, struct bts_data *data, unsigned int count) {
+    struct bts_ioctl_request usr_request;
+    unsigned int i, capacity;
+    int res;
+
+    if (tracee->feature != IHT_FEATURE_BTS || count == 0) {
+        return -1;
+    }
+
+    capacity = data == tracee->request.bts.buffer ?
+                (unsigned int)tracee->capacity : (unsigned int)iht_buffer_size(tracee);
+    for (i = 0; i < count; i++) {
+        data[i].record_count = capacity;
+    }
+
+    usr_request = tracee->request.bts;
+    usr_request.buffer = data;
+    usr_request.buffer_count = count;
+    res = send_bts_request(tracee->handle->fd, LIBIHT_IOCTL_DUMP_BTS, usr_request);
+    if (res == 0 && usr_request.bts_config.scope != LIBIHT_SCOPE_PROCESS) {
+        res = 1;
+    }
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_dump_pt
+// Description  : Dump the PT packets of a tracee into caller owned buffers,
+//                without any allocation. Each buffer must point to
+//                iht_buffer_size() bytes, one buffer per thread for the
+//                process scope. The packet bytes are returned in size.
+//
+// Inputs       : struct iht_tracee *tracee : the tracee
+//                struct pt_data *data : the PT data buffers
+//                unsigned int count : number of buffers
+// Outputs      : int : number of buffers filled, -1 on failure
+
+int iht_dump_pt(struct iht_tracee *tracee, struct pt_data *data, unsigned int count) {
+    struct pt_ioctl_request usr_request;
+    unsigned long long capacity;
+    unsigned int i;
+    int res;
+
+    if (tracee->feature != IHT_FEATURE_PT || count == 0) {
+        return -1;
+    }
+
+    capacity = data == tracee->request.pt.buffer ?
+                tracee->capacity : iht_buffer_size(tracee);
+    for (i = 0; i < count; i++) {
+        data[i].size = capacity;
+    }
+
+    usr_request = tracee->request.pt;
+    usr_request.buffer = data;
+    usr_request.buffer_count = count;
+    res = send_pt_request(tracee->handle->fd, LIBIHT_IOCTL_DUMP_PT, usr_request);
+    if (res == 0 && usr_request.pt_config.scope != LIBIHT_SCOPE_PROCESS) {
+        res = 1;
+    }
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_disable
+// Description  : Disable the trace of a tracee and free it with its buffers
+//
+// Inputs       : struct iht_tracee *tracee : the tracee
+// Outputs      : int : the result of the ioctl
+
+int iht_disable(struct iht_tracee *tracee) {
+    int res = -1;
+
+    switch (tracee->feature) {
+    case IHT_FEATURE_LBR:
+        res = iht_send(tracee, LIBIHT_IOCTL_DISABLE_LBR);
+        free_lbr_request(&tracee->request.lbr);
+        break;
+    case IHT_FEATURE_BTS:
+        res = iht_send(tracee, LIBIHT_IOCTL_DISABLE_BTS);
+        free_bts_request(&tracee->request.bts);
+        break;
+    case IHT_FEATURE_PT:
+        res = iht_send(tracee, LIBIHT_IOCTL_DISABLE_PT);
+        free_pt_request(&tracee->request.pt);
+        break;
+    }
+
+    free(tracee);
+    return res;
+}
+
+//
+// Collector definitions
+
+// Cache line size, the ring indexes are kept on their own lines
+#define IHT_CACHE_LINE      64
+
+// Sleep between two checks of a full ring with the wait policy
+#define IHT_RING_WAIT_STEP_US   50
+
+// Define SPSC ring of batches
+struct iht_ring {
+    _Alignas(IHT_CACHE_LINE) atomic_ullong head;    // Next slot to publish
+    unsigned long long tail_cache;                  // Producer copy of tail
+    unsigned long long seq;                         // Next batch sequence
+    _Alignas(IHT_CACHE_LINE) atomic_ullong tail;    // Next slot to release
+    unsigned long long head_cache;                  // Consumer copy of head
+    _Alignas(IHT_CACHE_LINE) struct iht_batch *slots;
+    unsigned char *storage;         // Records of the slots
+    unsigned long long slot_size;   // Record bytes of a slot
+    unsigned int slot_count;        // Number of slots (power of 2)
+    unsigned int policy;            // Full ring policy (enum IHT_RING_POLICY)
+    unsigned int wait_us;           // Longest wait of the wait policy
+    atomic_ullong published;
+    atomic_ullong dropped;
+    atomic_ullong dropped_records;
+    atomic_ullong waits;
+    atomic_ullong errors;
+};
+
+// Define collected tracee with its dump buffers
+struct collector_tracee {
+    struct iht_tracee *tracee;
+    struct iht_ring *ring;          // Ring of the tracee consumer
+    unsigned int count;             // Number of dump buffers
+    unsigned long long capacity;    // Elements of each dump buffer
+    unsigned long long elem_size;   // Bytes of an element
+    void *data;                     // Dump buffers (lbr/bts/pt data array)
+    unsigned char *storage;         // Elements of the dump buffers
+};
+
+// Define collector
+struct iht_collector {
+    pthread_t thread;
+    atomic_int running;
+    int started;
+    unsigned int interval_us;       // Sleep between two drains
+    struct collector_tracee *tracees;
+    unsigned int tracee_count;
+    struct iht_ring **rings;
+    unsigned int ring_count;
+};
+
+//
+// Ring functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_acquire
+// Description  : Get the next free slot of a ring for the producer, waiting
+//                for the consumer with the wait policy.
+//
+// Inputs       : struct iht_ring *ring : the ring
+// Outputs      : struct iht_batch* : the free slot, NULL if the ring is full
+
+static struct iht_batch *ring_acquire(struct iht_ring *ring) {
+    unsigned long long head, waited = 0;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (head - ring->tail_cache >= ring->slot_count) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->tail_cache < ring->slot_count) {
+            break;
+        }
+
+        if (ring->policy != IHT_RING_WAIT ||
+            (ring->wait_us && waited >= ring->wait_us)) {
+            return NULL;
+        }
+        if (waited == 0) {
+            atomic_fetch_add_explicit(&ring->waits, 1, memory_order_relaxed);
+        }
+        usleep(IHT_RING_WAIT_STEP_US);
+        waited += IHT_RING_WAIT_STEP_US;
+    }
+
+    return &ring->slots[head & (ring->slot_count - 1)];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_publish
+// Description  : Publish the slot returned by ring_acquire to the consumer.
+//
+// Inputs       : struct iht_ring *ring : the ring
+// Outputs      : None
+
+static void ring_publish(struct iht_ring *ring) {
+    unsigned long long head;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    atomic_fetch_add_explicit(&ring->published, 1, memory_order_relaxed);
+}
+
+//
+// Copy functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : copy_lbr
+// Description  : Copy an LBR stack from the oldest to the newest entry,
+//                leaving out the never written entries.
+//
+// Inputs       : const struct lbr_data *data : the dumped LBR stack
+//                struct lbr_stack_entry *out : the output entries
+// Outputs      : unsigned long long : the number of entries copied
+
+static unsigned long long copy_lbr(const struct lbr_data *data,
+                                    struct lbr_stack_entry *out) {
+    unsigned long long count, top, pos, i, n = 0;
+
+    count = data->entry_count ? data->entry_count : LIBIHT_LBR_MAX_ENTRIES;
+    top = data->lbr_tos % count;
+    for (i = 1; i <= count; i++) {
+        pos = (top + i) % count;
+        if (data->entries[pos].from == 0 && data->entries[pos].to == 0) {
+            continue;
+        }
+        out[n++] = data->entries[pos];
+    }
+
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : copy_bts
+// Description  : Copy the valid BTS records of a dump from the oldest one.
+//
+// Inputs       : const struct bts_data *data : the dumped BTS records
+//                unsigned long long capacity : the records of the buffer
+//                struct bts_record *out : the output records
+// Outputs      : unsigned long long : the number of records copied
+
+static unsigned long long copy_bts(const struct bts_data *data,
+                                    unsigned long long capacity,
+                                    struct bts_record *out) {
+    unsigned long long valid, start = 0;
+
+    valid = data->record_count < capacity ? data->record_count : capacity;
+    if (valid == capacity && data->bts_index) {
+        start = (unsigned long long)(data->bts_index - data->bts_buffer_base) % capacity;
+    }
+
+    memcpy(out, data->bts_buffer_base + start, (valid - start) * sizeof(struct bts_record));
+    memcpy(out + (valid - start), data->bts_buffer_base, start * sizeof(struct bts_record));
+
+    return valid;
+}
+
+//
+// Drain functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drain_tracee
+// Description  : Dump a tracee and publish one batch per dumped buffer on
+//                the ring of its consumer.
+//
+// Inputs       : struct collector_tracee *ct : the collected tracee
+//                unsigned int id : the tracee id in the collector
+// Outputs      : None
+
+static void drain_tracee(struct collector_tracee *ct, unsigned int id) {
+    struct iht_ring *ring = ct->ring;
+    struct iht_batch *batch;
+    struct timespec now;
+    unsigned long long valid = 0;
+    unsigned int tid = 0, flags = 0;
+    int i, res = -1;
+
+    switch (ct->tracee->feature) {
+    case IHT_FEATURE_LBR:
+        res = iht_dump_lbr(ct->tracee, ct->data, ct->count);
+        break;
+    case IHT_FEATURE_BTS:
+        res = iht_dump_bts(ct->tracee, ct->data, ct->count);
+        break;
+    case IHT_FEATURE_PT:
+        res = iht_dump_pt(ct->tracee, ct->data, ct->count);
+        break;
+    }
+    if (res < 0) {
+        atomic_fetch_add_explicit(&ring->errors, 1, memory_order_relaxed);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < res && (unsigned int)i < ct->count; i++) {
+        switch (ct->tracee->feature) {
+        case IHT_FEATURE_LBR:
+            valid = ((struct lbr_data *)ct->data)[i].entry_count;
+            tid = ((struct lbr_data *)ct->data)[i].tid;
+            break;
+        case IHT_FEATURE_BTS:
+            valid = ((struct bts_data *)ct->data)[i].record_count;
+            tid = ((struct bts_data *)ct->data)[i].tid;
+            break;
+        case IHT_FEATURE_PT:
+            valid = ((struct pt_data *)ct->data)[i].size;
+            tid = ((struct pt_data *)ct->data)[i].tid;
+            flags = ((struct pt_data *)ct->data)[i].wrapped ? IHT_BATCH_WRAPPED : 0;
+            break;
+        }
+
+        batch = ring_acquire(ring);
+        if (batch == NULL) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&ring->dropped_records, valid, memory_order_relaxed);
+            continue;
+        }
+
+        switch (ct->tracee->feature) {
+        case IHT_FEATURE_LBR:
+            valid = copy_lbr(&((struct lbr_data *)ct->data)[i], batch->records);
+            break;
+        case IHT_FEATURE_BTS:
+            valid = copy_bts(&((struct bts_data *)ct->data)[i], ct->capacity,
+                                batch->records);
+            break;
+        case IHT_FEATURE_PT:
+            memcpy(batch->records, ((struct pt_data *)ct->data)[i].buffer, valid);
+            break;
+        }
+
+        batch->tracee_id = id;
+        batch->feature = ct->tracee->feature;
+        batch->tid = tid;
+        batch->flags = flags;
+        batch->seq = ring->seq++;
+        batch->timestamp = (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+        batch->count = valid;
+        ring_publish(ring);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : collector_thread
+// Description  : Drain all tracees of a collector until it is stopped, then
+//                drain them a last time.
+//
+// Inputs       : void *arg : the collector
+// Outputs      : void* : NULL
+
+static void *collector_thread(void *arg) {
+    struct iht_collector *collector = arg;
+    unsigned int i;
+
+    while (atomic_load_explicit(&collector->running, memory_order_acquire)) {
+        for (i = 0; i < collector->tracee_count; i++) {
+            drain_tracee(&collector->tracees[i], i);
+        }
+        if (collector->interval_us) {
+            usleep(collector->interval_us);
+        }
+    }
+
+    for (i = 0; i < collector->tracee_count; i++) {
+        drain_tracee(&collector->tracees[i], i);
+    }
+
+    return NULL;
+}
+
+//
+// Collector functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_collector_create
+// Description  : Create a collector, not started yet.
+//
+// Inputs       : unsigned int interval_us : sleep between two drains (0 to
+//                                           drain continuously)
+// Outputs      : struct iht_collector* : the collector, NULL on failure
+
+struct iht_collector *iht_collector_create(unsigned int interval_us) {
+    struct iht_collector *collector;
+
+    collector = calloc(1, sizeof(struct iht_collector));
+    if (collector == NULL) {
+        return NULL;
+    }
+    collector->interval_us = interval_us;
+    atomic_init(&collector->running, 0);
+
+    return collector;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_collector_add_ring
+// Description  : Add the ring of a consumer to a collector, before it is
+//                started. The slots hold the records of the largest dump of
+//                the ring tracees, they are allocated by the start.
+//
+// Inputs       : struct iht_collector *collector : the collector
+//                unsigned int slots : number of batches of the ring
+//                enum IHT_RING_POLICY policy : what to do when it is full
+//                unsigned int wait_us : longest wait of the wait policy
+//                                       (0 to wait for the consumer)
+// Outputs      : struct iht_ring* : the ring, NULL on failure
+
+struct iht_ring *iht_collector_add_ring(struct iht_collector *collector,
+                                        unsigned int slots,
+                                        enum IHT_RING_POLICY policy,
+                                        unsigned int wait_us) {
+    struct iht_ring **rings;
+    struct iht_ring *ring;
+    unsigned int count = 2;
+
+    if (collector->started) {
+        return NULL;
+    }
+    while (count < slots) {
+        count <<= 1;
+    }
+
+    rings = realloc(collector->rings, (collector->ring_count + 1) * sizeof(*rings));
+    if (rings == NULL) {
+        return NULL;
+    }
+    collector->rings = rings;
+
+    ring = aligned_alloc(IHT_CACHE_LINE, sizeof(struct iht_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(struct iht_ring));
+    ring->slots = calloc(count, sizeof(struct iht_batch));
+    if (ring->slots == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->slot_count = count;
+    ring->policy = policy;
+    ring->wait_us = wait_us;
+
+    collector->rings[collector->ring_count++] = ring;
+    return ring;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_collector_add
+// Description  : Add a tracee to a collector, before it is started. From the
+//                start, only the collector thread may use the tracee until
+//                the collector is stopped.
+//
+// Inputs       : struct iht_collector *collector : the collector
+//                struct iht_tracee *tracee : the tracee
+//                struct iht_ring *ring : the ring of the tracee consumer
+//                unsigned int threads : dump buffers of a process scope
+//                                       tracee (one per thread)
+// Outputs      : int : the tracee id in the batches, -1 on failure
+
+int iht_collector_add(struct iht_collector *collector, struct iht_tracee *tracee,
+                        struct iht_ring *ring, unsigned int threads) {
+    struct collector_tracee *tracees, *ct;
+    unsigned long long data_size = 0;
+    unsigned int i;
+
+    if (collector->started) {
+        return -1;
+    }
+
+    tracees = realloc(collector->tracees,
+                        (collector->tracee_count + 1) * sizeof(*tracees));
+    if (tracees == NULL) {
+        return -1;
+    }
+    collector->tracees = tracees;
+
+    ct = &collector->tracees[collector->tracee_count];
+    memset(ct, 0, sizeof(*ct));
+    ct->tracee = tracee;
+    ct->ring = ring;
+    ct->count = threads ? threads : 1;
+    ct->capacity = iht_buffer_size(tracee);
+    switch (tracee->feature) {
+    case IHT_FEATURE_LBR:
+        ct->elem_size = sizeof(struct lbr_stack_entry);
+        data_size = sizeof(struct lbr_data);
+        break;
+    case IHT_FEATURE_BTS:
+        ct->elem_size = sizeof(struct bts_record);
+        data_size = sizeof(struct bts_data);
+        break;
+    case IHT_FEATURE_PT:
+        ct->elem_size = 1;
+        data_size = sizeof(struct pt_data);
+        break;
+    default:
+        return -1;
+    }
+
+    ct->data = calloc(ct->count, data_size);
+    ct->storage = malloc(ct->count * ct->capacity * ct->elem_size);
+    if (ct->data == NULL || ct->storage == NULL) {
+        free(ct->data);
+        free(ct->storage);
+        return -1;
+    }
+
+    for (i = 0; i < ct->count; i++) {
+        switch (tracee->feature) {
+        case IHT_FEATURE_LBR:
+            ((struct lbr_data *)ct->data)[i].entries =
+                (struct lbr_stack_entry *)(ct->storage + i * ct->capacity * ct->elem_size);
+            break;
+        case IHT_FEATURE_BTS:
+            ((struct bts_data *)ct->data)[i].bts_buffer_base =
+                (struct bts_record *)(ct->storage + i * ct->capacity * ct->elem_size);
+            break;
+        case IHT_FEATURE_PT:
+            ((struct pt_data *)ct->data)[i].buffer = ct->storage + i * ct->capacity;
+            break;
+        }
+    }
+
+    return (int)collector->tracee_count++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_collector_start
+// Description  : Allocate the ring slots and start the collector thread.
+//
+// Inputs       : struct iht_collector *collector : the collector
+// Outputs      : int : 0 on success, -1 on failure
+
+int iht_collector_start(struct iht_collector *collector) {
+    struct iht_ring *ring;
+    unsigned long long size;
+    unsigned int i, j;
+
+    if (collector->started) {
+        return -1;
+    }
+
+    for (i = 0; i < collector->ring_count; i++) {
+        ring = collector->rings[i];
+        if (ring->storage) {
+            continue;
+        }
+
+        ring->slot_size = 0;
+        for (j = 0; j < collector->tracee_count; j++) {
+            size = collector->tracees[j].capacity * collector->tracees[j].elem_size;
+            if (collector->tracees[j].ring == ring && size > ring->slot_size) {
+                ring->slot_size = size;
+            }
+        }
+        ring->slot_size = (ring->slot_size + IHT_CACHE_LINE - 1) & ~(IHT_CACHE_LINE - 1ULL);
+        if (ring->slot_size == 0) {
+            continue;
+        }
+
+        ring->storage = aligned_alloc(IHT_CACHE_LINE, ring->slot_count * ring->slot_size);
+        if (ring->storage == NULL) {
+            return -1;
+        }
+        for (j = 0; j < ring->slot_count; j++) {
+            ring->slots[j].records = ring->storage + j * ring->slot_size;
+        }
+    }
+
+    atomic_store_explicit(&collector->running, 1, memory_order_release);
+    if (pthread_create(&collector->thread, NULL, collector_thread, collector) != 0) {
+        atomic_store_explicit(&collector->running, 0, memory_order_release);
+        return -1;
+    }
+    collector->started = 1;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_collector_stop
+// Description  : Stop the collector thread after a last drain. The tracees
+//                can be used by the caller again.
+//
+// Inputs       : struct iht_collector *collector : the collector
+// Outputs      : None
+
+void iht_collector_stop(struct iht_collector *collector) {
+    if (!collector->started) {
+        return;
+    }
+
+    atomic_store_explicit(&collector->running, 0, memory_order_release);
+    pthread_join(collector->thread, NULL);
+    collector->started = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_collector_free
+// Description  : Stop and free a collector with its rings. The tracees are
+//                left to the caller.
+//
+// Inputs       : struct iht_collector *collector : the collector
+// Outputs      : None
+
+void iht_collector_free(struct iht_collector *collector) {
+    unsigned int i;
+
+    iht_collector_stop(collector);
+
+    for (i = 0; i < collector->tracee_count; i++) {
+        free(collector->tracees[i].data);
+        free(collector->tracees[i].storage);
+    }
+    for (i = 0; i < collector->ring_count; i++) {
+        free(collector->rings[i]->slots);
+        free(collector->rings[i]->storage);
+        free(collector->rings[i]);
+    }
+    free(collector->tracees);
+    free(collector->rings);
+    free(collector);
+}
+
+//
+// Consumer functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_ring_peek
+// Description  : Get the oldest published batch of a ring, from its consumer
+//                thread. It stays valid until it is released.
+//
+// Inputs       : struct iht_ring *ring : the ring
+// Outputs      : struct iht_batch* : the batch, NULL if the ring is empty
+
+struct iht_batch *iht_ring_peek(struct iht_ring *ring) {
+    unsigned long long tail;
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail == ring->head_cache) {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == ring->head_cache) {
+            return NULL;
+        }
+    }
+
+    return &ring->slots[tail & (ring->slot_count - 1)];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_ring_release
+// Description  : Give the batch returned by iht_ring_peek back to the
+//                collector.
+//
+// Inputs       : struct iht_ring *ring : the ring
+// Outputs      : None
+
+void iht_ring_release(struct iht_ring *ring) {
+    unsigned long long tail;
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iht_ring_stats
+// Description  : Get the batch and drop counters of a ring.
+//
+// Inputs       : struct iht_ring *ring : the ring
+//                struct iht_ring_stats *stats : the output counters
+// Outputs      : None
+
+void iht_ring_stats(struct iht_ring *ring, struct iht_ring_stats *stats) {
+    stats->published = atomic_load_explicit(&ring->published, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    stats->dropped_records = atomic_load_explicit(&ring->dropped_records, memory_order_relaxed);
+    stats->waits = atomic_load_explicit(&ring->waits, memory_order_relaxed);
+    stats->errors = atomic_load_explicit(&ring->errors, memory_order_relaxed);
+}
@@ -13,6 +13,10 @@ import os
 import gdb
 import ctypes
 
+# buffer sizes of the requests allocated by the library
+LBR_BUFFER_ENTRIES = 0x20
+DEFAULT_BTS_BUFFER_SIZE = 0x3000 << 1
+
 # quote the ctypes
 
 class Clbr_stack_entry(ctypes.Structure):
@@ -24,10 +28,17 @@ class Clbr_stack_entry(ctypes.Structure):
         self.from_ = from_
         self.to = to
 
+LIBIHT_SYSCALL_MASK_WORDS = 8
+LIBIHT_LBR_MAX_ENTRIES = 32
+
 class Clbr_config(ctypes.Structure):
     _fields_ = [
         ('pid', ctypes.c_uint),
-        ('lbr_select', ctypes.c_ulonglong)
+        ('scope', ctypes.c_uint),
+        ('lbr_select', ctypes.c_ulonglong),
+        ('offcpu_records', ctypes.c_uint),
+        ('syscall_records', ctypes.c_uint),
+        ('syscall_mask', ctypes.c_ulonglong * LIBIHT_SYSCALL_MASK_WORDS)
     ]
     def __init__(self, pid, lbr_select):
         self.pid = pid
@@ -36,16 +47,45 @@ class Clbr_config(ctypes.Structure):
 class Clbr_data(ctypes.Structure):
     _fields_ = [
         ('lbr_tos', ctypes.c_ulonglong),
-        ('entries', ctypes.POINTER(Clbr_stack_entry))
+        ('entries', ctypes.POINTER(Clbr_stack_entry)),
+        ('tid', ctypes.c_uint),
+        ('entry_count', ctypes.c_uint)
     ]
     def __init__(self, lbr_tos, entries):
         self.lbr_tos = lbr_tos
         self.entries = entries
 
+class Clbr_offcpu_record(ctypes.Structure):
+    _fields_ = [
+        ('timestamp', ctypes.c_ulonglong),
+        ('pid', ctypes.c_uint),
+        ('prev_state', ctypes.c_uint),
+        ('next_pid', ctypes.c_uint),
+        ('cpu', ctypes.c_uint),
+        ('lbr_tos', ctypes.c_ulonglong),
+        ('entries', Clbr_stack_entry * LIBIHT_LBR_MAX_ENTRIES)
+    ]
+
+class Clbr_syscall_record(ctypes.Structure):
+    _fields_ = [
+        ('timestamp', ctypes.c_ulonglong),
+        ('pid', ctypes.c_uint),
+        ('syscall', ctypes.c_uint),
+        ('cpu', ctypes.c_uint),
+        ('reserved', ctypes.c_uint),
+        ('lbr_tos', ctypes.c_ulonglong),
+        ('entries', Clbr_stack_entry * LIBIHT_LBR_MAX_ENTRIES)
+    ]
+
 class Clbr_ioctl_request(ctypes.Structure):
     _fields_ = [
         ('lbr_config', Clbr_config),
-        ('buffer', ctypes.POINTER(Clbr_data))
+        ('buffer', ctypes.POINTER(Clbr_data)),
+        ('buffer_count', ctypes.c_uint),
+        ('offcpu', ctypes.POINTER(Clbr_offcpu_record)),
+        ('offcpu_count', ctypes.c_uint),
+        ('syscall', ctypes.POINTER(Clbr_syscall_record)),
+        ('syscall_count', ctypes.c_uint)
     ]
     def __init__(self, lbr_config, buffer):
         self.lbr_config = lbr_config
@@ -54,8 +94,14 @@ class Clbr_ioctl_request(ctypes.Structure):
 class Cbts_config(ctypes.Structure):
     _fields_ = [
         ('pid', ctypes.c_uint),
+        ('scope', ctypes.c_uint),
         ('bts_config', ctypes.c_ulonglong),
-        ('bts_buffer_size', ctypes.c_ulonglong)
+        ('bts_buffer_size', ctypes.c_ulonglong),
+        ('pebs_event', ctypes.c_ulonglong),
+        ('pebs_period', ctypes.c_ulonglong),
+        ('pebs_buffer_size', ctypes.c_ulonglong),
+        ('pebs_latency', ctypes.c_uint),
+        ('reserved', ctypes.c_uint)
     ]
     def __init__(self, pid, bts_config, bts_buffer):
         self.pid = pid
@@ -77,17 +123,47 @@ class Cbts_data(ctypes.Structure):
     _fields_ = [
         ('bts_buffer_base', ctypes.POINTER(Cbts_record)),
         ('bts_index', ctypes.POINTER(Cbts_record)),
-        ('bts_interrupt_threshold', ctypes.c_ulonglong)
+        ('bts_interrupt_threshold', ctypes.c_ulonglong),
+        ('tid', ctypes.c_uint),
+        ('record_count', ctypes.c_uint)
     ]
     def __init__(self, bts_buffer_base, bts_index, bts_interrupt_threshold):
         self.bts_buffer_base = bts_buffer_base
         self.bts_index = bts_index
         self.bts_interrupt_threshold = bts_interrupt_threshold
 
+class Csymbol_info(ctypes.Structure):
+    _fields_ = [
+        ('name', ctypes.c_char_p),
+        ('module', ctypes.c_char_p),
+        ('offset', ctypes.c_ulonglong),
+        ('module_offset', ctypes.c_ulonglong)
+    ]
+
+class Cline_info(ctypes.Structure):
+    _fields_ = [
+        ('file', ctypes.c_char_p),
+        ('line', ctypes.c_uint)
+    ]
+
+class Cpebs_record(ctypes.Structure):
+    _fields_ = [
+        ('ip', ctypes.c_ulonglong),
+        ('data_addr', ctypes.c_ulonglong),
+        ('latency', ctypes.c_ulonglong),
+        ('data_source', ctypes.c_ulonglong),
+        ('tsc', ctypes.c_ulonglong),
+        ('tid', ctypes.c_uint),
+        ('reserved', ctypes.c_uint)
+    ]
+
 class Cbts_ioctl_request(ctypes.Structure):
     _fields_ = [
         ('bts_config', Cbts_config),
-        ('bts_data', ctypes.POINTER(Cbts_data))
+        ('bts_data', ctypes.POINTER(Cbts_data)),
+        ('buffer_count', ctypes.c_uint),
+        ('pebs', ctypes.POINTER(Cpebs_record)),
+        ('pebs_count', ctypes.c_uint)
     ]
     def __init__(self, bts_config, bts_data):
         self.bts_config = bts_config
@@ -134,19 +210,61 @@ disable_bts.argtypes = [Cbts_ioctl_request]
 dump_bts.argtypes = [Cbts_ioctl_request]
 config_bts.argtypes = [Cbts_ioctl_request]
 
+symbolizer_alloc = my_lib.symbolizer_alloc
+symbolizer_free = my_lib.symbolizer_free
+symbolizer_load_process = my_lib.symbolizer_load_process
+symbolizer_lookup_batch = my_lib.symbolizer_lookup_batch
+symbolizer_lookup_line_batch = my_lib.symbolizer_lookup_line_batch
+
+symbolizer_alloc.restype = ctypes.c_void_p
+symbolizer_load_process.restype = ctypes.c_int
+symbolizer_lookup_batch.restype = ctypes.c_ulonglong
+symbolizer_lookup_line_batch.restype = ctypes.c_ulonglong
+
+symbolizer_free.argtypes = [ctypes.c_void_p]
+symbolizer_load_process.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+symbolizer_lookup_batch.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_ulonglong),
+                                    ctypes.c_ulonglong, ctypes.POINTER(Csymbol_info)]
+symbolizer_lookup_line_batch.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_ulonglong),
+                                         ctypes.c_ulonglong, ctypes.POINTER(Cline_info)]
+
 lbr_req = None
 lbr_enable = False
 bts_req = None
 bts_enable = False
 
-def get_function_name(address):
-    symbol_output = gdb.execute("info symbol " + str(address), to_string=True)
-    lines = symbol_output.splitlines()
-    if len(lines) > 1:
-        function_name = lines[1]
-        function_name = function_name.split(' ', 1)[1]
-        return function_name
-    return address
+# symbols of the inferior, loaded once per pid
+symbolizer = None
+symbolizer_pid = None
+
+def get_function_names(addresses):
+    global symbolizer, symbolizer_pid
+    pid = get_gdb_pid()
+    if symbolizer is None or symbolizer_pid != pid:
+        if symbolizer is not None:
+            symbolizer_free(symbolizer)
+        symbolizer = symbolizer_alloc()
+        symbolizer_pid = pid
+        symbolizer_load_process(symbolizer, pid)
+
+    # resolve all addresses in a single call
+    count = len(addresses)
+    addrs = (ctypes.c_ulonglong * count)(*addresses)
+    infos = (Csymbol_info * count)()
+    lines = (Cline_info * count)()
+    symbolizer_lookup_batch(symbolizer, addrs, count, infos)
+    symbolizer_lookup_line_batch(symbolizer, addrs, count, lines)
+
+    names = []
+    for i in range(count):
+        if infos[i].name is not None:
+            name = "%s + %s" % (infos[i].name.decode(), hex(infos[i].offset))
+        else:
+            name = hex(addresses[i])
+        if lines[i].file is not None:
+            name += " at %s:%d" % (lines[i].file.decode(), lines[i].line)
+        names.append(name)
+    return names
 
 def get_gdb_pid():
     inferior = gdb.selected_inferior()
@@ -182,12 +300,15 @@ class DumpLBR(gdb.Command):
     def invoke(self, args, from_tty):
         global lbr_req
         print("LIBIHT-GDB: dump lbr for pid :", lbr_req.lbr_config.pid)
+        # the dump replaces the buffer size with the number of valid entries
+        lbr_req.buffer.contents.entry_count = LBR_BUFFER_ENTRIES
         dump_lbr(lbr_req)
-        lbr_tos = lbr_req.buffer.contents.lbr_tos
+        entry_count = lbr_req.buffer.contents.entry_count
+        lbr_tos = lbr_req.buffer.contents.lbr_tos % entry_count
         data_pointer = ctypes.cast(lbr_req.buffer.contents.entries, ctypes.POINTER(Clbr_stack_entry))
 
         lbr_content = []
-        for i in range(lbr_tos + 1, 32):
+        for i in range(lbr_tos + 1, entry_count):
             lbr_content.append(LBRContent(data_pointer[i].from_, data_pointer[i].to))
         for i in range(lbr_tos + 1):
             lbr_content.append(LBRContent(data_pointer[i].from_, data_pointer[i].to))
@@ -196,10 +317,11 @@ class DumpLBR(gdb.Command):
         # PS: (not the order in the LBR stack)
         print(lbr_tos)
         lbr_content = lbr_content[::-1]
+        names = get_function_names([c.from_ for c in lbr_content] + [c.to for c in lbr_content])
         for i in reversed(range(len(lbr_content))):
             print("Last [", i, "] branch record:")
-            print("\t From: ", get_function_name(hex(lbr_content[i].from_)))
-            print("\t To  : ", get_function_name(hex(lbr_content[i].to)))
+            print("\t From: ", names[i])
+            print("\t To  : ", names[len(lbr_content) + i])
         return lbr_content
 
 class EnableBTS(gdb.Command):
@@ -230,21 +352,34 @@ class DumpBTS(gdb.Command):
     def invoke(self, args, from_tty):
         global bts_req
         print("LIBIHT-GDB: dump bts for pid :", bts_req.bts_config.pid)
+        # the dump replaces the buffer size with the number of valid records
+        buffer_size = bts_req.bts_config.bts_buffer_size or DEFAULT_BTS_BUFFER_SIZE
+        capacity = buffer_size // ctypes.sizeof(Cbts_record)
+        bts_req.bts_data.contents.record_count = capacity
         dump_bts(bts_req)
+        record_count = bts_req.bts_data.contents.record_count
         data_pointer = ctypes.cast(bts_req.bts_data.contents.bts_buffer_base, ctypes.POINTER(Cbts_record))
 
+        # a full buffer has wrapped, its oldest record is at bts_index
+        start = 0
+        if record_count == capacity and bts_req.bts_data.contents.bts_index:
+            base = ctypes.cast(bts_req.bts_data.contents.bts_buffer_base, ctypes.c_void_p).value
+            index = ctypes.cast(bts_req.bts_data.contents.bts_index, ctypes.c_void_p).value
+            start = (index - base) // ctypes.sizeof(Cbts_record) % capacity
+
         bts_content = []
-        for i in range(1024):
-            if data_pointer[i].from_ !=0 or data_pointer[i].to != 0:
-                bts_content.append(BTSContent(data_pointer[i].from_, data_pointer[i].to, data_pointer[i].misc))
+        for i in range(record_count):
+            record = data_pointer[(start + i) % capacity]
+            bts_content.append(BTSContent(record.from_, record.to, record.misc))
 
         bts_tos=len(bts_content)
         print (bts_tos)
         print ("BTS Information:")
+        names = get_function_names([c.from_ for c in bts_content] + [c.to for c in bts_content])
         for i in range(bts_tos):
             print("Last [", i, "] branch record:")
-            print("\t From: ", get_function_name(hex(bts_content[i].from_)))
-            print("\t To  : ", get_function_name(hex(bts_content[i].to)))
+            print("\t From: ", names[i])
+            print("\t To  : ", names[bts_tos + i])
             print("\t Misc: ", hex(bts_content[i].misc))
         return bts_content
 
@@ -0,0 +1,209 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/tests/line_table_test.c
+//  Description    : This is the test of the DWARF line tables. The test is
+//                   built with debug info, records the source lines of a few
+//                   of its own call sites with __LINE__, and resolves their
+//                   return addresses from its own line table, directly and
+//                   through the symbolizer. It is built once per DWARF
+//                   version of the line programs.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#define _GNU_SOURCE
+#include "../commons/line_table.h"
+#include "../commons/symbolizer.h"
+#include <link.h>
+#include <stdio.h>
+#include <string.h>
+
+//
+// Library constants
+
+// Number of recorded call sites
+#define TEST_SITES          3
+
+//
+// Global variables
+
+// Number of failed checks
+static int failures;
+
+// Call site addresses and their source lines
+static unsigned long long site_addrs[TEST_SITES];
+static unsigned int site_lines[TEST_SITES];
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+//
+// Helper functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : call_site
+// Description  : Get an address in the call instruction of the caller
+//
+// Inputs       : None
+// Outputs      : unsigned long long : the call site address
+
+__attribute__((noinline))
+static unsigned long long call_site(void) {
+    return (unsigned long long)__builtin_return_address(0) - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : record_sites
+// Description  : Record the call sites, each call on the line of its
+//                __LINE__
+//
+// Inputs       : None
+// Outputs      : None
+
+__attribute__((noinline))
+static void record_sites(void) {
+    site_addrs[0] = call_site(); site_lines[0] = __LINE__;
+
+    site_addrs[1] = call_site(); site_lines[1] = __LINE__;
+    if (site_addrs[1] != 0) {
+        site_addrs[2] = call_site(); site_lines[2] = __LINE__;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main_bias
+// Description  : Get the load bias of the main executable, the first object
+//                of dl_iterate_phdr
+//
+// Inputs       : struct dl_phdr_info *info : the object
+//                size_t size : the info size
+//                void *data : the output bias
+// Outputs      : int : 1 to stop at the first object
+
+static int main_bias(struct dl_phdr_info *info, size_t size, void *data) {
+    *(unsigned long long *)data = info->dlpi_addr;
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : is_test_file
+// Description  : Check that a resolved file is this source file
+//
+// Inputs       : const char *file : the resolved file
+// Outputs      : int : 1 if it is, 0 otherwise
+
+static int is_test_file(const char *file) {
+    const char *base;
+
+    if (file == NULL) {
+        return 0;
+    }
+    base = strrchr(file, '/');
+    return strcmp(base ? base + 1 : file, "line_table_test.c") == 0;
+}
+
+//
+// Test functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_line_table
+// Description  : Resolve the call sites from the line table of the test
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_line_table(void) {
+    struct line_table *table;
+    unsigned long long bias = 0;
+    const char *file;
+    unsigned int i, line;
+
+    CHECK(line_table_open("/nonexistent/libiht-test") == NULL);
+
+    table = line_table_open("/proc/self/exe");
+    CHECK(table != NULL);
+    if (table == NULL) {
+        return;
+    }
+    dl_iterate_phdr(main_bias, &bias);
+
+    for (i = 0; i < TEST_SITES; i++) {
+        file = NULL;
+        line = 0;
+        CHECK(line_table_lookup(table, site_addrs[i] - bias, &file, &line) == 0);
+        CHECK(is_test_file(file));
+        if (line != site_lines[i]) {
+            fprintf(stderr, "site %u: line %u, expected %u\n", i, line, site_lines[i]);
+            CHECK(line == site_lines[i]);
+        }
+
+        // Decoded units are kept for later lookups
+        CHECK(line_table_lookup(table, site_addrs[i] - bias, &file, &line) == 0);
+        CHECK(line == site_lines[i]);
+    }
+
+    // Address 0 is never code
+    CHECK(line_table_lookup(table, 0, &file, &line) == -1);
+
+    line_table_close(table);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_symbolizer_lines
+// Description  : Resolve the call sites at their runtime addresses through
+//                the symbolizer
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_symbolizer_lines(void) {
+    struct symbolizer *symbolizer;
+    struct line_info infos[TEST_SITES];
+    unsigned int i;
+
+    symbolizer = symbolizer_alloc();
+    CHECK(symbolizer != NULL);
+    if (symbolizer == NULL) {
+        return;
+    }
+    symbolizer_set_cache_dir(symbolizer, NULL);
+    CHECK(symbolizer_load_process(symbolizer, 0) > 0);
+
+    CHECK(symbolizer_lookup_line_batch(symbolizer, site_addrs, TEST_SITES, infos) ==
+            TEST_SITES);
+    for (i = 0; i < TEST_SITES; i++) {
+        CHECK(is_test_file(infos[i].file));
+        CHECK(infos[i].line == site_lines[i]);
+    }
+
+    CHECK(symbolizer_lookup_line(symbolizer, 0x1000, &infos[0]) == -1);
+    CHECK(infos[0].file == NULL && infos[0].line == 0);
+
+    symbolizer_free(symbolizer);
+}
+
+int main(void) {
+    record_sites();
+
+    test_line_table();
+    test_symbolizer_lines();
+
+    if (failures) {
+        fprintf(stderr, "line_table_test: %d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("line_table_test: all checks passed\n");
+    return 0;
+}
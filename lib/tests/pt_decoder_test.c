@@ -0,0 +1,326 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/tests/pt_decoder_test.c
+//  Description    : This is the test of the Intel PT decoder on hand built
+//                   packet streams. The streams are walked over a small code
+//                   section, and the decoded branches are compared with the
+//                   ones the packets describe. Packet decoding and the
+//                   synchronization on PSB packets are checked as well.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#include "../commons/pt_decoder.h"
+#include <stdio.h>
+#include <string.h>
+
+//
+// Library constants
+
+// Address of the test code when traced
+#define TEST_CODE_BASE      0x401000ULL
+
+// Size of the records buffer
+#define TEST_MAX_RECORDS    16
+
+//
+// Global variables
+
+// Number of failed checks
+static int failures;
+
+// Test code, a loop ending with an indirect jump
+//   401000: jz 401004
+//   401002: nop
+//   401003: nop
+//   401004: jmp rax
+static const unsigned char test_code[] = {
+    0x74, 0x02, 0x90, 0x90, 0xff, 0xe0,
+};
+
+// Packet stream builder
+static unsigned char stream[0x100];
+static unsigned long long stream_size;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+//
+// Packet building functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_bytes
+// Description  : Append raw bytes to the packet stream
+//
+// Inputs       : const unsigned char *bytes : the bytes
+//                unsigned long long size : the number of bytes
+// Outputs      : None
+
+static void put_bytes(const unsigned char *bytes, unsigned long long size) {
+    memcpy(stream + stream_size, bytes, size);
+    stream_size += size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_psb
+// Description  : Append a PSB packet, starting a PSB+ header
+//
+// Inputs       : None
+// Outputs      : None
+
+static void put_psb(void) {
+    static const unsigned char psb[16] = {
+        0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+        0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+    };
+
+    put_bytes(psb, sizeof(psb));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_psbend
+// Description  : Append a PSBEND packet, ending a PSB+ header
+//
+// Inputs       : None
+// Outputs      : None
+
+static void put_psbend(void) {
+    static const unsigned char psbend[2] = { 0x02, 0x23 };
+
+    put_bytes(psbend, sizeof(psbend));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_mode_exec
+// Description  : Append a MODE.Exec packet for 64-bit code
+//
+// Inputs       : None
+// Outputs      : None
+
+static void put_mode_exec(void) {
+    static const unsigned char mode[2] = { 0x99, 0x01 };
+
+    put_bytes(mode, sizeof(mode));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_tnt
+// Description  : Append a short TNT packet with a single bit
+//
+// Inputs       : int taken : 1 if the branch was taken
+// Outputs      : None
+
+static void put_tnt(int taken) {
+    unsigned char tnt = (unsigned char)(0x04 | (taken ? 0x02 : 0x00));
+
+    put_bytes(&tnt, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_ip
+// Description  : Append an IP packet (TIP, TIP.PGE, TIP.PGD or FUP), with the
+//                full 64-bit address, or with the address suppressed
+//
+// Inputs       : unsigned char opcode : the low 5 bits of the header
+//                unsigned long long ip : the address, 0 to suppress it
+// Outputs      : None
+
+static void put_ip(unsigned char opcode, unsigned long long ip) {
+    unsigned char packet[9];
+    unsigned int i;
+
+    if (ip == 0) {
+        put_bytes(&opcode, 1);
+        return;
+    }
+
+    packet[0] = (unsigned char)(0xc0 | opcode);
+    for (i = 0; i < 8; i++) {
+        packet[1 + i] = (unsigned char)(ip >> (8 * i));
+    }
+    put_bytes(packet, sizeof(packet));
+}
+
+//
+// Test functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : decode_stream
+// Description  : Decode the packet stream over the test code
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+//                struct bts_record *records : the records buffer
+// Outputs      : long long : number of records, -1 on failure
+
+static long long decode_stream(struct pt_decoder *decoder,
+                                struct bts_record *records) {
+    long long n, total = 0;
+
+    pt_decoder_reset(decoder, stream, stream_size);
+    while ((n = pt_decode(decoder, records + total,
+                            TEST_MAX_RECORDS - total)) > 0) {
+        total += n;
+        if (total == TEST_MAX_RECORDS) {
+            break;
+        }
+    }
+
+    return n < 0 ? -1 : total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_packets
+// Description  : Check the decoding of single packets
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_packets(void) {
+    struct pt_packet packet;
+
+    stream_size = 0;
+    put_tnt(1);
+    CHECK(pt_packet_decode(stream, stream_size, &packet) == 1);
+    CHECK(packet.type == PT_PACKET_TNT);
+    CHECK(packet.count == 1 && packet.payload == 1);
+
+    stream_size = 0;
+    put_ip(0x1d, TEST_CODE_BASE);
+    CHECK(pt_packet_decode(stream, stream_size, &packet) == 9);
+    CHECK(packet.type == PT_PACKET_FUP);
+    CHECK(packet.payload == TEST_CODE_BASE);
+
+    // Truncated packets wait for more bytes
+    CHECK(pt_packet_decode(stream, 4, &packet) == 0);
+
+    stream_size = 0;
+    put_ip(0x01, 0);
+    CHECK(pt_packet_decode(stream, stream_size, &packet) == 1);
+    CHECK(packet.type == PT_PACKET_TIP_PGD && packet.count == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_sync
+// Description  : Check that decoding starts at the first PSB packet, after
+//                bytes of a partial packet
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_sync(void) {
+    static const unsigned char junk[5] = { 0x82, 0x02, 0x82, 0x02, 0x00 };
+
+    stream_size = 0;
+    put_bytes(junk, sizeof(junk));
+    put_psb();
+    put_psbend();
+    CHECK(pt_sync_forward(stream, stream_size, 0) == sizeof(junk));
+    CHECK(pt_sync_forward(stream, stream_size, sizeof(junk) + 1) ==
+            stream_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_psb_fup
+// Description  : Check that the FUP of a PSB+ header starts the walk, the
+//                branches following it are decoded without a TIP
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+// Outputs      : None
+
+static void test_psb_fup(struct pt_decoder *decoder) {
+    struct bts_record records[TEST_MAX_RECORDS];
+    long long n;
+
+    stream_size = 0;
+    put_psb();
+    put_mode_exec();
+    put_ip(0x1d, TEST_CODE_BASE);
+    put_psbend();
+    put_tnt(1);
+    put_ip(0x01, 0);
+
+    n = decode_stream(decoder, records);
+    CHECK(n == 1);
+    if (n == 1) {
+        CHECK(records[0].from == TEST_CODE_BASE);
+        CHECK(records[0].to == TEST_CODE_BASE + 4);
+        CHECK(records[0].misc == PT_BRANCH_COND);
+    }
+    CHECK(decoder->stats.desyncs == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_tip_pge
+// Description  : Check a walk started by a TIP.PGE, with a conditional branch
+//                both ways and an indirect jump resolved by a TIP
+//
+// Inputs       : struct pt_decoder *decoder : the PT decoder
+// Outputs      : None
+
+static void test_tip_pge(struct pt_decoder *decoder) {
+    struct bts_record records[TEST_MAX_RECORDS];
+    long long n;
+
+    stream_size = 0;
+    put_psb();
+    put_psbend();
+    put_ip(0x11, TEST_CODE_BASE);
+    put_tnt(0);
+    put_ip(0x0d, TEST_CODE_BASE);
+    put_tnt(1);
+    put_ip(0x01, 0);
+
+    n = decode_stream(decoder, records);
+    CHECK(n == 2);
+    if (n == 2) {
+        CHECK(records[0].from == TEST_CODE_BASE + 4);
+        CHECK(records[0].to == TEST_CODE_BASE);
+        CHECK(records[0].misc == PT_BRANCH_IND_JUMP);
+        CHECK(records[1].from == TEST_CODE_BASE);
+        CHECK(records[1].to == TEST_CODE_BASE + 4);
+        CHECK(records[1].misc == PT_BRANCH_COND);
+    }
+    CHECK(decoder->stats.desyncs == 0);
+}
+
+int main(void) {
+    struct pt_decoder *decoder;
+
+    decoder = pt_decoder_alloc();
+    if (decoder == NULL ||
+        pt_decoder_add_section(decoder, TEST_CODE_BASE, test_code,
+                                sizeof(test_code))) {
+        fprintf(stderr, "pt_decoder_test: decoder setup failed\n");
+        return 1;
+    }
+
+    test_packets();
+    test_sync();
+    test_psb_fup(decoder);
+    test_tip_pge(decoder);
+
+    pt_decoder_free(decoder);
+    if (failures) {
+        fprintf(stderr, "pt_decoder_test: %d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("pt_decoder_test: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,461 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/tests/record_batch_test.c
+//  Description    : This is the test of the columnar record batches. Random
+//                   records are transposed into batches, by the scalar and
+//                   the AVX2 kernels and through the append functions, and
+//                   the columns are compared with the records one by one.
+//                   The range filter and its edge classes are compared with
+//                   a brute force filter. The batch source is included so
+//                   its static kernels can be called.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#include "../commons/record_batch.c"
+#include <stdio.h>
+
+//
+// Library constants
+
+// Most records transposed at once, not a multiple of four
+#define TEST_RECORDS        1027
+
+// Capacity of the test batches, rounded up by the allocation
+#define TEST_CAPACITY       2000
+
+// Most ranges of the filter tests, past the AVX2 filter limit
+#define TEST_MAX_RANGES     (FILTER_AVX2_MAX_RANGES + 1)
+
+//
+// Global variables
+
+// Number of failed checks
+static int failures;
+
+// Input records
+static struct bts_record bts_records[TEST_RECORDS];
+static struct lbr_stack_entry lbr_entries[TEST_RECORDS];
+
+// Filter ranges, some overlapping
+static struct record_range ranges[TEST_MAX_RANGES];
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+//
+// Helper functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : next_random
+// Description  : Get the next value of a fixed seed generator
+//
+// Inputs       : None
+// Outputs      : unsigned long long : the next value
+
+static unsigned long long next_random(void) {
+    static unsigned long long state = 0x9e3779b97f4a7c15ULL;
+
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fill_records
+// Description  : Fill the input records with random values, so that any
+//                misplaced lane shows up
+//
+// Inputs       : None
+// Outputs      : None
+
+static void fill_records(void) {
+    unsigned int i;
+
+    for (i = 0; i < TEST_RECORDS; i++) {
+        bts_records[i].from = next_random();
+        bts_records[i].to = next_random();
+        bts_records[i].misc = next_random();
+        lbr_entries[i].from = next_random();
+        lbr_entries[i].to = next_random();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_bts_columns
+// Description  : Compare the columns of a batch with BTS records
+//
+// Inputs       : const unsigned long long *from : the from column
+//                const unsigned long long *to : the to column
+//                const unsigned long long *flags : the flags column
+//                const struct bts_record *records : the expected records
+//                unsigned long long count : number of records
+// Outputs      : int : 1 if they match, 0 otherwise
+
+static int check_bts_columns(const unsigned long long *from,
+                                const unsigned long long *to,
+                                const unsigned long long *flags,
+                                const struct bts_record *records,
+                                unsigned long long count) {
+    unsigned long long i;
+
+    for (i = 0; i < count; i++) {
+        if (from[i] != records[i].from || to[i] != records[i].to ||
+            flags[i] != records[i].misc) {
+            fprintf(stderr, "record %llu misplaced\n", i);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fill_ranges
+// Description  : Fill the filter ranges, 4 KiB apart with random sizes, so
+//                they overlap now and then
+//
+// Inputs       : None
+// Outputs      : None
+
+static void fill_ranges(void) {
+    unsigned int r;
+
+    for (r = 0; r < TEST_MAX_RANGES; r++) {
+        ranges[r].start = 0x400000ULL + r * 0x1000ULL;
+        ranges[r].end = ranges[r].start + 0x100 + next_random() % 0x1400;
+    }
+
+    // An empty range holds no address
+    ranges[1].end = ranges[1].start;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fill_filter_batch
+// Description  : Fill a batch with branches around the filter ranges
+//
+// Inputs       : struct record_batch *batch : the batch
+//                unsigned long long count : number of records
+// Outputs      : None
+
+static void fill_filter_batch(struct record_batch *batch, unsigned long long count) {
+    unsigned long long i;
+
+    for (i = 0; i < count; i++) {
+        batch->from[i] = 0x3ff000ULL + next_random() % (0x1000ULL * (TEST_MAX_RANGES + 2));
+        batch->to[i] = 0x3ff000ULL + next_random() % (0x1000ULL * (TEST_MAX_RANGES + 2));
+        batch->flags[i] = next_random();
+        batch->tid[i] = (unsigned int)i;
+    }
+
+    // Addresses far from any range, and on the range bounds
+    batch->from[0] = 0;
+    batch->to[1] = ~0ULL;
+    batch->from[2] = ranges[0].start;
+    batch->to[2] = ranges[0].end;
+    batch->from[3] = ranges[0].end - 1;
+    batch->to[3] = ranges[2].start;
+    batch->count = count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : brute_range
+// Description  : Find the first range holding an address, one compare at a
+//                time
+//
+// Inputs       : unsigned long long addr : the address
+//                unsigned int range_count : number of ranges
+// Outputs      : int : the range index, -1 if none holds it
+
+static int brute_range(unsigned long long addr, unsigned int range_count) {
+    unsigned int r;
+
+    for (r = 0; r < range_count; r++) {
+        if (addr >= ranges[r].start && addr < ranges[r].end) {
+            return (int)r;
+        }
+    }
+
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_filter
+// Description  : Filter a batch and compare the output with the brute force
+//                filter, the output is a prefix of it when it runs out of
+//                room
+//
+// Inputs       : const struct record_batch *in : the input batch
+//                unsigned int range_count : number of ranges
+//                unsigned int mode : the filter mode
+//                unsigned long long room : records left in the output
+// Outputs      : int : 1 if they match, 0 otherwise
+
+static int check_filter(const struct record_batch *in, unsigned int range_count,
+                        unsigned int mode, unsigned long long room) {
+    static unsigned char edges[TEST_CAPACITY + 16];
+    struct record_batch *out;
+    unsigned long long i, o = 0, n, base = 5;
+    unsigned char edge;
+    int f, t, ok = 1;
+
+    out = record_batch_alloc(TEST_CAPACITY);
+    if (out == NULL) {
+        return 0;
+    }
+
+    // Filtered records go after the ones already in the output, the edge
+    // classes are indexed like the output records
+    out->count = base;
+    if (room > out->capacity - base) {
+        room = out->capacity - base;
+    }
+    out->capacity = base + room;
+    memset(edges, 0xff, sizeof(edges));
+    n = record_batch_filter(in, ranges, range_count, mode, out, edges);
+
+    for (i = 0; i < in->count && o < room; i++) {
+        f = brute_range(in->from[i], range_count);
+        t = brute_range(in->to[i], range_count);
+        if (!(((mode & RECORD_FILTER_FROM) && f >= 0) ||
+                ((mode & RECORD_FILTER_TO) && t >= 0))) {
+            continue;
+        }
+
+        if (f >= 0 && t >= 0) {
+            edge = f == t ? RECORD_EDGE_INTRA : RECORD_EDGE_INTER;
+        }
+        else {
+            edge = f >= 0 ? RECORD_EDGE_OUT : RECORD_EDGE_IN;
+        }
+
+        if (o >= n || out->from[base + o] != in->from[i] ||
+            out->to[base + o] != in->to[i] || out->flags[base + o] != in->flags[i] ||
+            out->tid[base + o] != in->tid[i] || edges[base + o] != edge) {
+            fprintf(stderr, "%u ranges, mode %u: record %llu mismatch\n",
+                    range_count, mode, i);
+            ok = 0;
+            break;
+        }
+        o++;
+    }
+
+    if (ok && (n != o || out->count != base + n)) {
+        fprintf(stderr, "%u ranges, mode %u: %llu records, %llu expected\n",
+                range_count, mode, n, o);
+        ok = 0;
+    }
+
+    record_batch_free(out);
+    return ok;
+}
+
+//
+// Test functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_transpose_kernels
+// Description  : Check the scalar and AVX2 transposition kernels for every
+//                record count around the four record step
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_transpose_kernels(void) {
+    struct record_batch *batch;
+    unsigned long long count;
+
+    batch = record_batch_alloc(TEST_CAPACITY);
+    CHECK(batch != NULL);
+    if (batch == NULL) {
+        return;
+    }
+
+    for (count = 0; count <= 16; count++) {
+        transpose_bts_scalar(bts_records, count, batch->from, batch->to, batch->flags);
+        CHECK(check_bts_columns(batch->from, batch->to, batch->flags,
+                                bts_records, count));
+    }
+
+#ifdef RECORD_BATCH_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        for (count = 0; count <= 16; count++) {
+            transpose_bts_avx2(bts_records, count, batch->from, batch->to,
+                                batch->flags);
+            CHECK(check_bts_columns(batch->from, batch->to, batch->flags,
+                                    bts_records, count));
+        }
+
+        // Unaligned records and columns
+        transpose_bts_avx2(bts_records + 1, TEST_RECORDS - 1, batch->from + 3,
+                            batch->to + 3, batch->flags + 3);
+        CHECK(check_bts_columns(batch->from + 3, batch->to + 3, batch->flags + 3,
+                                bts_records + 1, TEST_RECORDS - 1));
+    }
+    else {
+        printf("record_batch_test: no AVX2, only the scalar kernel is checked\n");
+    }
+#endif
+
+    record_batch_free(batch);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_append_bts
+// Description  : Check BTS appends at the end of a batch, their thread IDs,
+//                and the clipping to the batch capacity
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_append_bts(void) {
+    struct record_batch *batch;
+    unsigned long long i, n;
+
+    batch = record_batch_alloc(TEST_CAPACITY);
+    CHECK(batch != NULL);
+    if (batch == NULL) {
+        return;
+    }
+    CHECK(batch->capacity >= TEST_CAPACITY && batch->capacity % 16 == 0);
+    CHECK((unsigned long long)batch->from % RECORD_BATCH_ALIGN == 0);
+    CHECK((unsigned long long)batch->tid % RECORD_BATCH_ALIGN == 0);
+
+    CHECK(record_batch_append_bts(batch, bts_records, 7, 11) == 7);
+    CHECK(record_batch_append_bts(batch, bts_records + 7, TEST_RECORDS - 7, 12) ==
+            TEST_RECORDS - 7);
+    CHECK(batch->count == TEST_RECORDS);
+    CHECK(check_bts_columns(batch->from, batch->to, batch->flags, bts_records,
+                            TEST_RECORDS));
+    for (i = 0; i < TEST_RECORDS; i++) {
+        if (batch->tid[i] != (i < 7 ? 11U : 12U)) {
+            CHECK(batch->tid[i] == (i < 7 ? 11U : 12U));
+            break;
+        }
+    }
+
+    // Only the room left is appended
+    n = batch->capacity - batch->count;
+    CHECK(record_batch_append_bts(batch, bts_records, TEST_RECORDS, 13) == n);
+    CHECK(batch->count == batch->capacity);
+    CHECK(check_bts_columns(batch->from + TEST_RECORDS, batch->to + TEST_RECORDS,
+                            batch->flags + TEST_RECORDS, bts_records, n));
+    CHECK(record_batch_append_bts(batch, bts_records, 1, 13) == 0);
+
+    record_batch_clear(batch);
+    CHECK(batch->count == 0);
+    CHECK(record_batch_append_bts(batch, bts_records + 5, 3, 14) == 3);
+    CHECK(check_bts_columns(batch->from, batch->to, batch->flags,
+                            bts_records + 5, 3));
+
+    record_batch_free(batch);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_append_lbr
+// Description  : Check LBR appends, which have no flags
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_append_lbr(void) {
+    struct record_batch *batch;
+    unsigned long long i;
+
+    batch = record_batch_alloc(TEST_CAPACITY);
+    CHECK(batch != NULL);
+    if (batch == NULL) {
+        return;
+    }
+
+    CHECK(record_batch_append_bts(batch, bts_records, 5, 21) == 5);
+    CHECK(record_batch_append_lbr(batch, lbr_entries, 32, 22) == 32);
+    CHECK(batch->count == 37);
+    for (i = 0; i < 32; i++) {
+        if (batch->from[5 + i] != lbr_entries[i].from ||
+            batch->to[5 + i] != lbr_entries[i].to ||
+            batch->flags[5 + i] != 0 || batch->tid[5 + i] != 22) {
+            CHECK(!"LBR entry misplaced");
+            break;
+        }
+    }
+
+    record_batch_free(batch);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_filter
+// Description  : Check the range filter against the brute force filter,
+//                for each mode, with range counts below and above the AVX2
+//                limit, and with an output running out of room
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_filter(void) {
+    static const unsigned int range_counts[] = {
+        0, 1, 2, 3, 16, FILTER_AVX2_MAX_RANGES, TEST_MAX_RANGES,
+    };
+    static const unsigned int modes[] = {
+        RECORD_FILTER_FROM, RECORD_FILTER_TO, RECORD_FILTER_FROM | RECORD_FILTER_TO,
+    };
+    struct record_batch *in;
+    unsigned int r, m;
+
+    in = record_batch_alloc(TEST_CAPACITY);
+    CHECK(in != NULL);
+    if (in == NULL) {
+        return;
+    }
+
+    fill_ranges();
+    fill_filter_batch(in, TEST_RECORDS);
+    for (r = 0; r < sizeof(range_counts) / sizeof(range_counts[0]); r++) {
+        for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            CHECK(check_filter(in, range_counts[r], modes[m], TEST_CAPACITY));
+            CHECK(check_filter(in, range_counts[r], modes[m], 0));
+            CHECK(check_filter(in, range_counts[r], modes[m], 6));
+            CHECK(check_filter(in, range_counts[r], modes[m], 101));
+        }
+    }
+
+    // Tail records after the last group of four
+    in->count = 7;
+    CHECK(check_filter(in, 3, RECORD_FILTER_FROM | RECORD_FILTER_TO, TEST_CAPACITY));
+
+    record_batch_free(in);
+}
+
+int main(void) {
+    fill_records();
+
+    test_transpose_kernels();
+    test_append_bts();
+    test_append_lbr();
+    test_filter();
+
+    if (failures) {
+        fprintf(stderr, "record_batch_test: %d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("record_batch_test: all checks passed\n");
+    return 0;
+}
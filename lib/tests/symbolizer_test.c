@@ -0,0 +1,260 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/tests/symbolizer_test.c
+//  Description    : This is the test of the native symbolizer. The test loads
+//                   its own process, resolves its own functions, and compares
+//                   the lookups around every symbol of the index with a
+//                   linear search, with a cold and a warm thread cache. The
+//                   symbolizer source is included so its index can be read.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#include "../commons/symbolizer.c"
+
+//
+// Library constants
+
+// Addresses checked around each symbol
+#define TEST_PROBES         4
+
+//
+// Global variables
+
+// Number of failed checks
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+//
+// Lookup targets
+
+__attribute__((noinline, noclone))
+int symbolizer_test_alpha(int x) {
+    return x * 3 + 1;
+}
+
+__attribute__((noinline, noclone))
+int symbolizer_test_beta(int x) {
+    return symbolizer_test_alpha(x) ^ 0x55;
+}
+
+//
+// Helper functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : brute_entry
+// Description  : Find the symbol holding an address with a linear search of
+//                the last start at or before it
+//
+// Inputs       : const struct symbolizer *symbolizer : the symbolizer
+//                unsigned long long addr : the address
+// Outputs      : int : the symbol index, -1 if none holds it
+
+static int brute_entry(const struct symbolizer *symbolizer, unsigned long long addr) {
+    unsigned long long i;
+
+    for (i = symbolizer->entry_count; i-- > 0;) {
+        if (symbolizer->entries[i].start <= addr) {
+            return addr < symbolizer->entries[i].end ? (int)i : -1;
+        }
+    }
+
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_lookup
+// Description  : Compare the lookup of an address with the linear search
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+//                unsigned long long addr : the address
+// Outputs      : int : 1 if they match, 0 otherwise
+
+static int check_lookup(struct symbolizer *symbolizer, unsigned long long addr) {
+    struct symbol_info info;
+    int entry, res;
+
+    entry = brute_entry(symbolizer, addr);
+    res = symbolizer_lookup(symbolizer, addr, &info);
+    if (entry < 0) {
+        if (res == 0 || info.name != NULL) {
+            fprintf(stderr, "0x%llx resolved to %s\n", addr, info.name);
+            return 0;
+        }
+        return 1;
+    }
+
+    if (res != 0 || info.name != symbolizer->entries[entry].name ||
+        info.offset != addr - symbolizer->entries[entry].start ||
+        info.module != symbolizer->modules[symbolizer->entries[entry].module].path) {
+        fprintf(stderr, "0x%llx not resolved to %s\n", addr,
+                symbolizer->entries[entry].name);
+        return 0;
+    }
+
+    return 1;
+}
+
+//
+// Test functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_own_functions
+// Description  : Check the lookups of the test functions
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+// Outputs      : None
+
+static void test_own_functions(struct symbolizer *symbolizer) {
+    unsigned long long alpha = (unsigned long long)symbolizer_test_alpha;
+    unsigned long long beta = (unsigned long long)symbolizer_test_beta;
+    struct symbol_info info;
+    const char *base;
+
+    CHECK(symbolizer_lookup(symbolizer, alpha, &info) == 0);
+    CHECK(info.name && strcmp(info.name, "symbolizer_test_alpha") == 0);
+    CHECK(info.offset == 0);
+    base = info.module ? strrchr(info.module, '/') : NULL;
+    CHECK(base && strcmp(base, "/symbolizer_test") == 0);
+
+    CHECK(symbolizer_lookup(symbolizer, beta + 1, &info) == 0);
+    CHECK(info.name && strcmp(info.name, "symbolizer_test_beta") == 0);
+    CHECK(info.offset == 1);
+
+    // Not mapped by any module
+    CHECK(symbolizer_lookup(symbolizer, 0x1000, &info) == -1);
+    CHECK(info.name == NULL && info.module == NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_index
+// Description  : Check the lookups at, before and past every symbol against
+//                the linear search, twice so the second round hits the
+//                thread cache, and the batch lookup against single ones
+//
+// Inputs       : struct symbolizer *symbolizer : the symbolizer
+// Outputs      : None
+
+static void test_index(struct symbolizer *symbolizer) {
+    unsigned long long i, n, count, *addrs;
+    struct symbol_info *infos, info;
+    const struct sym_entry *entry;
+    unsigned int round;
+    int ok;
+
+    CHECK(symbolizer->entry_count > 0);
+    for (i = 1; i < symbolizer->entry_count; i++) {
+        if (symbolizer->starts[i - 1] > symbolizer->starts[i]) {
+            CHECK(!"symbol index not sorted");
+            break;
+        }
+    }
+
+    count = symbolizer->entry_count * TEST_PROBES;
+    addrs = malloc(count * sizeof(*addrs));
+    infos = malloc(count * sizeof(*infos));
+    CHECK(addrs != NULL && infos != NULL);
+    if (addrs == NULL || infos == NULL) {
+        free(addrs);
+        free(infos);
+        return;
+    }
+
+    for (i = 0; i < symbolizer->entry_count; i++) {
+        entry = &symbolizer->entries[i];
+        addrs[i * TEST_PROBES] = entry->start;
+        addrs[i * TEST_PROBES + 1] = entry->start - 1;
+        addrs[i * TEST_PROBES + 2] = entry->end;
+        addrs[i * TEST_PROBES + 3] = entry->start + (entry->end - entry->start) / 2;
+    }
+
+    for (round = 0; round < 2; round++) {
+        ok = 1;
+        for (i = 0; i < count && ok; i++) {
+            ok = check_lookup(symbolizer, addrs[i]);
+        }
+        CHECK(ok);
+    }
+
+    n = symbolizer_lookup_batch(symbolizer, addrs, count, infos);
+    ok = 1;
+    for (i = 0; i < count && ok; i++) {
+        if (symbolizer_lookup(symbolizer, addrs[i], &info) == 0) {
+            n--;
+        }
+        ok = info.name == infos[i].name && info.offset == infos[i].offset &&
+                info.module == infos[i].module;
+    }
+    CHECK(ok);
+    CHECK(n == 0);
+
+    free(addrs);
+    free(infos);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_cache_owner
+// Description  : Check that the thread cache of a symbolizer is not used by
+//                another one
+//
+// Inputs       : struct symbolizer *symbolizer : the loaded symbolizer
+// Outputs      : None
+
+static void test_cache_owner(struct symbolizer *symbolizer) {
+    unsigned long long alpha = (unsigned long long)symbolizer_test_alpha;
+    struct symbolizer *empty;
+    struct symbol_info info;
+
+    empty = symbolizer_alloc();
+    CHECK(empty != NULL);
+    if (empty == NULL) {
+        return;
+    }
+    symbolizer_set_cache_dir(empty, NULL);
+
+    CHECK(symbolizer_lookup(symbolizer, alpha, &info) == 0);
+    CHECK(symbolizer_lookup(empty, alpha, &info) == -1);
+    CHECK(symbolizer_lookup(symbolizer, alpha, &info) == 0);
+    CHECK(symbolizer_add_module(empty, "/nonexistent/libiht-test.so",
+                                0x1000, 0x2000, 0) == -1);
+
+    symbolizer_free(empty);
+}
+
+int main(void) {
+    struct symbolizer *symbolizer;
+
+    // Keep the user symbol cache out of the test
+    symbolizer = symbolizer_alloc();
+    if (symbolizer == NULL || symbolizer_set_cache_dir(symbolizer, NULL)) {
+        fprintf(stderr, "symbolizer_test: symbolizer setup failed\n");
+        return 1;
+    }
+    CHECK(symbolizer_load_process(symbolizer, 0) > 0);
+    CHECK(symbolizer_test_beta(1) == (4 ^ 0x55));
+
+    test_own_functions(symbolizer);
+    test_index(symbolizer);
+    test_cache_owner(symbolizer);
+
+    symbolizer_free(symbolizer);
+    if (failures) {
+        fprintf(stderr, "symbolizer_test: %d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("symbolizer_test: all checks passed\n");
+    return 0;
+}
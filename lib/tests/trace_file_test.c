@@ -0,0 +1,675 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/tests/trace_file_test.c
+//  Description    : This is the round trip test of the on-disk trace format.
+//                   LBR snapshots and BTS records are written with the trace
+//                   writer, read back with the trace reader and decoded, and
+//                   compared with what was written. Seeking, unclosed files
+//                   and truncated files are checked as well.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : October 17, 2026
+//
+
+#include "../commons/trace_file.h"
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//
+// Library constants
+
+// Smallest chunk size of the format, so the records span many chunks
+#define TEST_CHUNK_SIZE     0x1000
+
+// Number of written LBR snapshots and BTS records
+#define TEST_LBR_SNAPSHOTS  2000
+#define TEST_BTS_RECORDS    40000
+
+// BTS records per write call
+#define TEST_BTS_BATCH      37
+
+//
+// Global variables
+
+// Number of failed checks
+static int failures;
+
+// Directory of the test files
+static char test_dir[] = "/tmp/libiht-trace-XXXXXX";
+
+// Expected LBR snapshots
+static struct trace_lbr_snapshot lbr_expected[TEST_LBR_SNAPSHOTS];
+
+// Expected BTS records and their timestamps
+static struct bts_record bts_expected[TEST_BTS_RECORDS];
+static unsigned long long bts_times[TEST_BTS_RECORDS];
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+//
+// Helper functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : next_random
+// Description  : Get the next value of a fixed seed generator
+//
+// Inputs       : None
+// Outputs      : unsigned long long : the next value
+
+static unsigned long long next_random(void) {
+    static unsigned long long state = 0x9e3779b97f4a7c15ULL;
+
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : next_branch
+// Description  : Get a branch address, mostly near the previous one like in
+//                a real trace, sometimes in another module or in the kernel
+//
+// Inputs       : unsigned long long prev : the previous address
+// Outputs      : unsigned long long : the address
+
+static unsigned long long next_branch(unsigned long long prev) {
+    unsigned long long r = next_random();
+
+    switch (r % 16) {
+        case 0:
+            return 0x7f0000000000ULL + (r >> 20 & 0xffffffffULL);
+        case 1:
+            return 0xffffffff81000000ULL + (r >> 40);
+        default:
+            return prev + (r >> 32 & 0x3ff) - 0x200;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_path
+// Description  : Build the path of a test file
+//
+// Inputs       : char *path : the output path, 4096 bytes
+//                const char *name : the file name
+// Outputs      : const char* : the path
+
+static const char *test_path(char *path, const char *name) {
+    snprintf(path, 4096, "%s/%s", test_dir, name);
+    return path;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_info
+// Description  : Fill the trace info and module of the test files
+//
+// Inputs       : struct trace_info *info : the trace info
+//                struct trace_module *module : the module
+// Outputs      : None
+
+static void test_info(struct trace_info *info, struct trace_module *module) {
+    memset(info, 0, sizeof(*info));
+    info->cpu_family = 6;
+    info->cpu_model = 0x8f;
+    info->cpu_stepping = 8;
+    info->lbr_depth = TRACE_LBR_MAX_ENTRIES;
+    info->chunk_size = TEST_CHUNK_SIZE;
+
+    memset(module, 0, sizeof(*module));
+    module->start = 0x400000;
+    module->end = 0x4a0000;
+    module->offset = 0x1000;
+    strcpy(module->path, "/usr/bin/traced");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : copy_prefix
+// Description  : Copy the first bytes of a file, as left by a writer killed
+//                while writing
+//
+// Inputs       : const char *src : the source file
+//                const char *dst : the destination file
+//                long size : the number of bytes to keep
+// Outputs      : int : 0 on success, -1 on failure
+
+static int copy_prefix(const char *src, const char *dst, long size) {
+    FILE *in, *out;
+    char *data;
+    int res = -1;
+
+    data = malloc(size);
+    in = fopen(src, "rb");
+    out = fopen(dst, "wb");
+    if (data && in && out && fread(data, 1, size, in) == (size_t)size &&
+        fwrite(data, 1, size, out) == (size_t)size) {
+        res = 0;
+    }
+
+    if (in) {
+        fclose(in);
+    }
+    if (out && fclose(out)) {
+        res = -1;
+    }
+    free(data);
+    return res;
+}
+
+//
+// Writer functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_lbr
+// Description  : Generate the expected LBR snapshots and write them, the
+//                first half by one thread and the second half by two threads
+//                in turn, so chunks also end on a thread switch
+//
+// Inputs       : const char *path : the file path
+//                int close : whether to close the writer
+// Outputs      : int : 0 on success, -1 on failure
+
+static int write_lbr(const char *path, int close) {
+    struct trace_info info;
+    struct trace_module module;
+    struct trace_writer *writer;
+    unsigned long long time = 1000, addr = 0x401000;
+    unsigned int i, j, tid;
+
+    test_info(&info, &module);
+    writer = trace_writer_create(path, &info, &module, 1);
+    if (writer == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < TEST_LBR_SNAPSHOTS; i++) {
+        struct trace_lbr_snapshot *snapshot = &lbr_expected[i];
+
+        // Some snapshots share their timestamp
+        time += next_random() % 3;
+        snapshot->timestamp = time;
+        snapshot->count = (unsigned int)(next_random() % (TRACE_LBR_MAX_ENTRIES + 1));
+        snapshot->reserved = 0;
+        for (j = 0; j < snapshot->count; j++) {
+            snapshot->entries[j].from = addr = next_branch(addr);
+            snapshot->entries[j].to = addr = next_branch(addr);
+        }
+
+        tid = i < TEST_LBR_SNAPSHOTS / 2 ? 100 : 100 + (i & 1);
+        if (trace_writer_write_lbr(writer, time, 100, tid, snapshot->entries,
+                                    snapshot->count)) {
+            return -1;
+        }
+    }
+
+    if (close) {
+        return trace_writer_close(writer);
+    }
+
+    // Leave the last chunk and the header unfinished, as a killed writer
+    fflush(NULL);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_bts
+// Description  : Generate the expected BTS records and write them in batches
+//                of one timestamp each, by a single thread
+//
+// Inputs       : const char *path : the file path
+//                int close : whether to close the writer
+// Outputs      : int : 0 on success, -1 on failure
+
+static int write_bts(const char *path, int close) {
+    struct trace_info info;
+    struct trace_module module;
+    struct trace_writer *writer;
+    unsigned long long time = 5000, addr = 0x401000, i, j, n;
+
+    test_info(&info, &module);
+    writer = trace_writer_create(path, &info, &module, 1);
+    if (writer == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < TEST_BTS_RECORDS; i += n) {
+        n = TEST_BTS_RECORDS - i < TEST_BTS_BATCH ? TEST_BTS_RECORDS - i : TEST_BTS_BATCH;
+        time += 1 + next_random() % 50;
+        for (j = i; j < i + n; j++) {
+            bts_expected[j].from = addr = next_branch(addr);
+            bts_expected[j].to = addr = next_branch(addr);
+            bts_expected[j].misc = next_random() % 4 ? 0 : 0x10;
+            bts_times[j] = time;
+        }
+
+        if (trace_writer_write_bts(writer, time, 200, 201, &bts_expected[i], n)) {
+            return -1;
+        }
+    }
+
+    if (close) {
+        return trace_writer_close(writer);
+    }
+
+    fflush(NULL);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_unclosed
+// Description  : Write a trace file from a child process that exits without
+//                closing the writer
+//
+// Inputs       : int (*write_trace)(const char *, int) : the writer function
+//                const char *path : the file path
+// Outputs      : int : 0 on success, -1 on failure
+
+static int write_unclosed(int (*write_trace)(const char *, int), const char *path) {
+    char scratch[4096];
+    int status;
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        _exit(write_trace(path, 0) ? 1 : 0);
+    }
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status)) {
+        return -1;
+    }
+
+    // The child had the same generator state, regenerate its records here
+    return write_trace(test_path(scratch, "scratch.trace"), 1);
+}
+
+//
+// Reader functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_header
+// Description  : Check the header and module of an opened test file
+//
+// Inputs       : const struct trace_reader *reader : the reader
+// Outputs      : None
+
+static void check_header(const struct trace_reader *reader) {
+    CHECK(reader->header->info.cpu_family == 6);
+    CHECK(reader->header->info.cpu_model == 0x8f);
+    CHECK(reader->header->info.lbr_depth == TRACE_LBR_MAX_ENTRIES);
+    CHECK(reader->header->info.chunk_size == TEST_CHUNK_SIZE);
+    CHECK(reader->header->module_count == 1);
+    CHECK(reader->modules[0].start == 0x400000);
+    CHECK(reader->modules[0].end == 0x4a0000);
+    CHECK(reader->modules[0].offset == 0x1000);
+    CHECK(strcmp(reader->modules[0].path, "/usr/bin/traced") == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_lbr
+// Description  : Decode the LBR snapshots of a trace file and compare them
+//                with the expected ones, in order
+//
+// Inputs       : const char *path : the file path
+//                unsigned long long *chunks : the chunks of the file
+// Outputs      : long long : the number of matching snapshots, -1 if the
+//                file cannot be opened
+
+static long long check_lbr(const char *path, unsigned long long *chunks) {
+    static struct trace_lbr_snapshot snapshots[TEST_CHUNK_SIZE];
+    const struct trace_chunk_header *chunk;
+    struct trace_reader reader;
+    unsigned long long index, done = 0;
+    long long n, i;
+
+    if (trace_reader_open(&reader, path)) {
+        return -1;
+    }
+    check_header(&reader);
+
+    for (index = 0; index < reader.chunk_count; index++) {
+        chunk = trace_reader_chunk(&reader, index);
+        CHECK(chunk != NULL);
+        if (chunk == NULL) {
+            break;
+        }
+        CHECK(chunk->type == TRACE_RECORD_LBR);
+        CHECK(chunk->pid == 100);
+
+        n = trace_chunk_decode_lbr(chunk, snapshots, chunk->record_count);
+        CHECK(n == chunk->record_count);
+        CHECK(done + n <= TEST_LBR_SNAPSHOTS);
+        if (n < 0 || done + n > TEST_LBR_SNAPSHOTS) {
+            break;
+        }
+        CHECK(chunk->time_start == lbr_expected[done].timestamp);
+        CHECK(chunk->time_end == lbr_expected[done + n - 1].timestamp);
+
+        for (i = 0; i < n; i++, done++) {
+            CHECK(chunk->tid == (done < TEST_LBR_SNAPSHOTS / 2 ? 100 : 100 + (done & 1)));
+            CHECK(snapshots[i].timestamp == lbr_expected[done].timestamp);
+            CHECK(snapshots[i].count == lbr_expected[done].count);
+            CHECK(memcmp(snapshots[i].entries, lbr_expected[done].entries,
+                            lbr_expected[done].count * sizeof(struct lbr_stack_entry)) == 0);
+        }
+    }
+
+    *chunks = reader.chunk_count;
+    trace_reader_close(&reader);
+    return (long long)done;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_bts
+// Description  : Decode the BTS records of a trace file and compare them
+//                with the expected ones, in order
+//
+// Inputs       : const char *path : the file path
+//                unsigned long long *chunks : the chunks of the file
+// Outputs      : long long : the number of matching records, -1 if the file
+//                cannot be opened
+
+static long long check_bts(const char *path, unsigned long long *chunks) {
+    static struct bts_record records[TEST_CHUNK_SIZE];
+    static unsigned long long times[TEST_CHUNK_SIZE];
+    const struct trace_chunk_header *chunk;
+    struct trace_reader reader;
+    unsigned long long index, done = 0;
+    long long n;
+
+    if (trace_reader_open(&reader, path)) {
+        return -1;
+    }
+    check_header(&reader);
+
+    for (index = 0; index < reader.chunk_count; index++) {
+        chunk = trace_reader_chunk(&reader, index);
+        CHECK(chunk != NULL);
+        if (chunk == NULL) {
+            break;
+        }
+        CHECK(chunk->type == TRACE_RECORD_BTS);
+        CHECK(chunk->pid == 200 && chunk->tid == 201);
+
+        n = trace_chunk_decode_bts(chunk, records, times, chunk->record_count);
+        CHECK(n == chunk->record_count);
+        CHECK(done + n <= TEST_BTS_RECORDS);
+        if (n <= 0 || done + n > TEST_BTS_RECORDS) {
+            break;
+        }
+        CHECK(chunk->time_start == bts_times[done]);
+        CHECK(chunk->time_end == bts_times[done + n - 1]);
+        CHECK(memcmp(records, &bts_expected[done], n * sizeof(struct bts_record)) == 0);
+        CHECK(memcmp(times, &bts_times[done], n * sizeof(unsigned long long)) == 0);
+        done += n;
+    }
+
+    *chunks = reader.chunk_count;
+    trace_reader_close(&reader);
+    return (long long)done;
+}
+
+//
+// Test functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_lbr_round_trip
+// Description  : Write, read and decode LBR snapshots
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_lbr_round_trip(void) {
+    char path[4096];
+    unsigned long long chunks;
+
+    CHECK(write_lbr(test_path(path, "lbr.trace"), 1) == 0);
+    CHECK(check_lbr(path, &chunks) == TEST_LBR_SNAPSHOTS);
+    CHECK(chunks > 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_bts_round_trip
+// Description  : Write, read and decode BTS records
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_bts_round_trip(void) {
+    char path[4096];
+    unsigned long long chunks;
+
+    CHECK(write_bts(test_path(path, "bts.trace"), 1) == 0);
+    CHECK(check_bts(path, &chunks) == TEST_BTS_RECORDS);
+    CHECK(chunks > 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_seek
+// Description  : Seek a timestamp and check the found chunk is the first one
+//                ending at or after it, and that it holds the first record
+//                at or after the timestamp
+//
+// Inputs       : const struct trace_reader *reader : the reader
+//                unsigned long long timestamp : the timestamp
+// Outputs      : unsigned long long : the found chunk
+
+static unsigned long long check_seek(const struct trace_reader *reader,
+                                        unsigned long long timestamp) {
+    static struct bts_record records[TEST_CHUNK_SIZE];
+    static unsigned long long times[TEST_CHUNK_SIZE];
+    const struct trace_chunk_header *chunk;
+    unsigned long long index, first;
+    long long n, i;
+
+    index = trace_reader_seek(reader, timestamp);
+    CHECK(index <= reader->chunk_count);
+    if (index > 0) {
+        CHECK(trace_reader_chunk(reader, index - 1)->time_end < timestamp);
+    }
+    if (index == reader->chunk_count) {
+        CHECK(bts_times[TEST_BTS_RECORDS - 1] < timestamp);
+        return index;
+    }
+
+    chunk = trace_reader_chunk(reader, index);
+    CHECK(chunk->time_end >= timestamp);
+
+    for (first = 0; bts_times[first] < timestamp; first++);
+    n = trace_chunk_decode_bts(chunk, records, times, chunk->record_count);
+    for (i = 0; i < n && times[i] < timestamp; i++);
+    CHECK(i < n);
+    CHECK(times[i] == bts_times[first]);
+    CHECK(memcmp(&records[i], &bts_expected[first], sizeof(struct bts_record)) == 0);
+
+    return index;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_seek
+// Description  : Seek the start, the middle and the end of a BTS trace
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_seek(void) {
+    const struct trace_chunk_header *chunk;
+    struct trace_reader reader;
+    unsigned long long middle;
+    char path[4096];
+
+    CHECK(write_bts(test_path(path, "seek.trace"), 1) == 0);
+    CHECK(trace_reader_open(&reader, path) == 0);
+    if (reader.map == NULL) {
+        return;
+    }
+
+    // Start: before and at the first record
+    CHECK(check_seek(&reader, 0) == 0);
+    CHECK(check_seek(&reader, bts_times[0]) == 0);
+
+    // Middle: a record timestamp, the time between two records, and the
+    // boundaries of a chunk
+    middle = reader.chunk_count / 2;
+    chunk = trace_reader_chunk(&reader, middle);
+    check_seek(&reader, bts_times[TEST_BTS_RECORDS / 2]);
+    check_seek(&reader, bts_times[TEST_BTS_RECORDS / 2] + 1);
+    CHECK(check_seek(&reader, chunk->time_end) <= middle);
+    CHECK(check_seek(&reader, chunk->time_end + 1) > middle);
+    CHECK(check_seek(&reader, chunk->time_start) <= middle);
+
+    // End: at and past the last record
+    CHECK(check_seek(&reader, bts_times[TEST_BTS_RECORDS - 1]) < reader.chunk_count);
+    CHECK(check_seek(&reader, bts_times[TEST_BTS_RECORDS - 1] + 1) == reader.chunk_count);
+    CHECK(trace_reader_seek(&reader, ~0ULL) == reader.chunk_count);
+
+    trace_reader_close(&reader);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_unclosed
+// Description  : Read trace files whose writer exited without closing, the
+//                complete chunks are read and match what was written
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_unclosed(void) {
+    struct trace_reader reader;
+    char path[4096];
+    unsigned long long chunks;
+    long long n;
+
+    CHECK(write_unclosed(write_lbr, test_path(path, "lbr-unclosed.trace")) == 0);
+    CHECK(trace_reader_open(&reader, path) == 0);
+    CHECK(reader.header != NULL && reader.header->chunk_count == 0);
+    trace_reader_close(&reader);
+    n = check_lbr(path, &chunks);
+    CHECK(n > 0 && n < TEST_LBR_SNAPSHOTS);
+    CHECK(chunks > 0);
+
+    CHECK(write_unclosed(write_bts, test_path(path, "bts-unclosed.trace")) == 0);
+    n = check_bts(path, &chunks);
+    CHECK(n > 0 && n < TEST_BTS_RECORDS);
+    CHECK(chunks > 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_truncated
+// Description  : Read trace files cut inside a chunk, inside the modules and
+//                inside the header. Only the complete chunks are read from a
+//                file cut inside a chunk, and the others are refused.
+//
+// Inputs       : None
+// Outputs      : None
+
+static void test_truncated(void) {
+    struct trace_reader reader;
+    char path[4096], cut[4096];
+    unsigned long long chunks, data_offset;
+    long long n;
+
+    data_offset = sizeof(struct trace_file_header) + sizeof(struct trace_module);
+
+    // Closed file cut in its third chunk: the header chunk count is capped
+    CHECK(write_bts(test_path(path, "bts.trace"), 1) == 0);
+    CHECK(copy_prefix(path, test_path(cut, "bts-cut.trace"),
+                        data_offset + TEST_CHUNK_SIZE * 5 / 2) == 0);
+    n = check_bts(cut, &chunks);
+    CHECK(chunks == 2);
+    CHECK(n > 0 && n < TEST_BTS_RECORDS);
+
+    // Unclosed file cut in its second chunk
+    CHECK(write_unclosed(write_lbr, test_path(path, "lbr-unclosed.trace")) == 0);
+    CHECK(copy_prefix(path, test_path(cut, "lbr-cut.trace"),
+                        data_offset + TEST_CHUNK_SIZE + 100) == 0);
+    n = check_lbr(cut, &chunks);
+    CHECK(chunks == 1);
+    CHECK(n > 0);
+
+    // File cut right after the modules has no chunk
+    CHECK(copy_prefix(path, cut, data_offset) == 0);
+    CHECK(check_lbr(cut, &chunks) == 0);
+    CHECK(chunks == 0);
+    CHECK(trace_reader_open(&reader, cut) == 0);
+    CHECK(trace_reader_chunk(&reader, 0) == NULL);
+    CHECK(trace_reader_seek(&reader, 0) == 0);
+    trace_reader_close(&reader);
+
+    // File cut inside the modules or the header is refused
+    CHECK(copy_prefix(path, cut, data_offset - 1) == 0);
+    CHECK(trace_reader_open(&reader, cut) == -1);
+    CHECK(copy_prefix(path, cut, sizeof(struct trace_file_header) - 1) == 0);
+    CHECK(trace_reader_open(&reader, cut) == -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_test_dir
+// Description  : Remove the test files and their directory
+//
+// Inputs       : None
+// Outputs      : None
+
+static void remove_test_dir(void) {
+    static const char *names[] = {
+        "lbr.trace", "bts.trace", "seek.trace", "scratch.trace",
+        "lbr-unclosed.trace", "bts-unclosed.trace", "bts-cut.trace",
+        "lbr-cut.trace",
+    };
+    char path[4096];
+    unsigned int i;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        unlink(test_path(path, names[i]));
+    }
+    rmdir(test_dir);
+}
+
+int main(void) {
+    if (mkdtemp(test_dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    test_lbr_round_trip();
+    test_bts_round_trip();
+    test_seek();
+    test_unclosed();
+    test_truncated();
+
+    remove_test_dir();
+    if (failures) {
+        fprintf(stderr, "trace_file_test: %d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("trace_file_test: all checks passed\n");
+    return 0;
+}